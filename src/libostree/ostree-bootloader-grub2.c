@@ -239,6 +239,267 @@ _ostree_bootloader_grub2_generate_config (OstreeSysroot                 *sysroot
   return ret;
 }
 
+/* Optional files in the sysroot which the native generator will use in
+ * place of its hardcoded header and menu entry; see
+ * ostree.repo-config(5).
+ */
+#define GRUB2_NATIVE_HEADER_TEMPLATE "boot/grub2/ostree-header.cfg"
+#define GRUB2_NATIVE_ENTRY_TEMPLATE "boot/grub2/ostree-entry.cfg"
+
+static gboolean
+read_template_at (int            dfd,
+                  const char    *path,
+                  char         **out_contents,
+                  GCancellable  *cancellable,
+                  GError       **error)
+{
+  glnx_fd_close int fd = -1;
+  g_autofree char *contents = NULL;
+
+  if (!ot_openat_ignore_enoent (dfd, path, &fd, error))
+    return FALSE;
+
+  if (fd != -1)
+    {
+      contents = glnx_fd_readall_utf8 (fd, NULL, cancellable, error);
+      if (!contents)
+        {
+          g_prefix_error (error, "Reading %s: ", path);
+          return FALSE;
+        }
+    }
+
+  *out_contents = g_steal_pointer (&contents);
+  return TRUE;
+}
+
+/* GRUB's root is the partition holding /boot; if that isn't a separate
+ * filesystem, the kernel paths need a /boot prefix.  Like
+ * ostree-grub-generator, allow OSTREE_BOOT_PARTITION to override this.
+ */
+static gboolean
+get_boot_prefix (OstreeSysroot  *sysroot,
+                 const char    **out_prefix,
+                 GError        **error)
+{
+  const char *prefix = g_getenv ("OSTREE_BOOT_PARTITION");
+  struct stat sysroot_stbuf;
+  struct stat boot_stbuf;
+
+  if (prefix == NULL)
+    {
+      if (fstat (sysroot->sysroot_fd, &sysroot_stbuf) != 0 ||
+          fstatat (sysroot->sysroot_fd, "boot", &boot_stbuf, 0) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      prefix = sysroot_stbuf.st_dev == boot_stbuf.st_dev ? "/boot" : "";
+    }
+
+  *out_prefix = prefix;
+  return TRUE;
+}
+
+static void
+append_entry_template (GString    *output,
+                       const char *template,
+                       const char *quoted_title,
+                       guint       index,
+                       const char *kernel,
+                       const char *initrd,
+                       const char *options)
+{
+  g_auto(GStrv) lines = g_strsplit (template, "\n", -1);
+  g_autofree char *index_str = g_strdup_printf ("%u", index);
+  const char *keys[] = { "@TITLE@", "@INDEX@", "@LINUX@", "@INITRD@", "@OPTIONS@" };
+  const char *values[] = { quoted_title, index_str, kernel, initrd, options };
+  char **iter;
+
+  for (iter = lines; *iter; iter++)
+    {
+      const char *p = *iter;
+
+      /* Drop the last empty element after a trailing newline */
+      if (*p == '\0' && iter[1] == NULL)
+        break;
+
+      /* Lines referring to a missing initramfs are omitted entirely */
+      if (initrd == NULL && strstr (p, "@INITRD@") != NULL)
+        continue;
+
+      while (*p)
+        {
+          guint i;
+          gboolean matched = FALSE;
+
+          for (i = 0; i < G_N_ELEMENTS (keys); i++)
+            {
+              gsize len = strlen (keys[i]);
+
+              if (strncmp (p, keys[i], len) == 0)
+                {
+                  g_string_append (output, values[i] ? values[i] : "");
+                  p += len;
+                  matched = TRUE;
+                  break;
+                }
+            }
+
+          if (!matched)
+            g_string_append_c (output, *p++);
+        }
+      g_string_append_c (output, '\n');
+    }
+}
+
+/* Render a complete grub.cfg directly from the loader entries for
+ * @bootversion, without running grub2-mkconfig or any script.  The
+ * menu entries are delimited by ### BEGIN/END ostree ### markers so
+ * that tooling (and tests/grub2-entries-crosscheck.py) can find them.
+ */
+static gboolean
+generate_native_config (OstreeBootloaderGrub2  *self,
+                        int                     bootversion,
+                        GString                *output,
+                        GCancellable           *cancellable,
+                        GError                **error)
+{
+  g_autoptr(GPtrArray) loader_configs = NULL;
+  g_autofree char *header_template = NULL;
+  g_autofree char *entry_template = NULL;
+  const char *boot_prefix;
+  guint i;
+
+  if (!_ostree_sysroot_read_boot_loader_configs (self->sysroot, bootversion,
+                                                 &loader_configs,
+                                                 cancellable, error))
+    return FALSE;
+
+  if (!get_boot_prefix (self->sysroot, &boot_prefix, error))
+    return FALSE;
+
+  if (!read_template_at (self->sysroot->sysroot_fd, GRUB2_NATIVE_HEADER_TEMPLATE,
+                         &header_template, cancellable, error))
+    return FALSE;
+  if (!read_template_at (self->sysroot->sysroot_fd, GRUB2_NATIVE_ENTRY_TEMPLATE,
+                         &entry_template, cancellable, error))
+    return FALSE;
+
+  g_string_append (output,
+                   "# This file was generated by ostree.  Do not modify the generated file - all\n"
+                   "# changes will be lost the next time it is regenerated.\n");
+  if (header_template)
+    {
+      g_string_append (output, header_template);
+      if (output->str[output->len - 1] != '\n')
+        g_string_append_c (output, '\n');
+    }
+  else
+    g_string_append (output,
+                     "set default=0\n"
+                     "set timeout=5\n");
+
+  g_string_append (output, "\n### BEGIN ostree ###\n");
+
+  for (i = 0; i < loader_configs->len; i++)
+    {
+      OstreeBootconfigParser *config = loader_configs->pdata[i];
+      const char *title;
+      const char *kernel;
+      const char *initrd;
+      const char *options;
+      g_autofree char *quoted_title = NULL;
+      g_autofree char *kernel_path = NULL;
+      g_autofree char *initrd_path = NULL;
+
+      title = ostree_bootconfig_parser_get (config, "title");
+      if (!title)
+        title = "(Untitled)";
+      quoted_title = g_shell_quote (title);
+
+      kernel = ostree_bootconfig_parser_get (config, "linux");
+      if (!kernel)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "No \"linux\" key in bootloader config");
+          return FALSE;
+        }
+      kernel_path = g_strconcat (boot_prefix, kernel, NULL);
+
+      initrd = ostree_bootconfig_parser_get (config, "initrd");
+      if (initrd)
+        initrd_path = g_strconcat (boot_prefix, initrd, NULL);
+
+      options = ostree_bootconfig_parser_get (config, "options");
+
+      if (entry_template)
+        {
+          append_entry_template (output, entry_template, quoted_title, i,
+                                 kernel_path, initrd_path, options);
+          continue;
+        }
+
+      g_string_append_printf (output, "menuentry %s --class gnu-linux --class gnu --class os --unrestricted --id 'ostree-%u' {\n",
+                              quoted_title, i);
+      g_string_append (output, "insmod gzio\n");
+      g_string_append_printf (output, "%s %s", self->is_efi ? "linuxefi" : "linux",
+                              kernel_path);
+      if (options)
+        g_string_append_printf (output, " %s", options);
+      g_string_append_c (output, '\n');
+      if (initrd_path)
+        g_string_append_printf (output, "%s %s\n", self->is_efi ? "initrdefi" : "initrd",
+                                initrd_path);
+      g_string_append (output, "}\n");
+    }
+
+  g_string_append (output, "### END ostree ###\n");
+
+  return TRUE;
+}
+
+/* The native generator is the default when ostree was built with
+ * --with-builtin-grub2-mkconfig and OSTREE_GRUB2_EXEC isn't set;
+ * sysroot.grub2-generator in the repo config overrides both.
+ */
+static gboolean
+use_native_generator (OstreeBootloaderGrub2  *self,
+                      gboolean               *out_native,
+                      GCancellable           *cancellable,
+                      GError                **error)
+{
+  glnx_unref_object OstreeRepo *repo = NULL;
+  g_autofree char *generator = NULL;
+  const char *default_generator = "external";
+
+#ifdef USE_BUILTIN_GRUB2_MKCONFIG
+  if (g_getenv ("OSTREE_GRUB2_EXEC") == NULL)
+    default_generator = "native";
+#endif
+
+  if (!ostree_sysroot_get_repo (self->sysroot, &repo, cancellable, error))
+    return FALSE;
+
+  if (!ot_keyfile_get_value_with_default (ostree_repo_get_config (repo), "sysroot", "grub2-generator",
+                                          default_generator, &generator, error))
+    return FALSE;
+
+  if (strcmp (generator, "native") == 0)
+    *out_native = TRUE;
+  else if (strcmp (generator, "external") == 0)
+    *out_native = FALSE;
+  else
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid sysroot.grub2-generator '%s'", generator);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 static void
 grub2_child_setup (gpointer user_data)
 {
@@ -281,20 +542,19 @@ grub2_child_setup (gpointer user_data)
     }
 }
 
+/* Run grub2-mkconfig (or OSTREE_GRUB2_EXEC) to write @new_config_path */
 static gboolean
-_ostree_bootloader_grub2_write_config (OstreeBootloader      *bootloader,
-                                       int                    bootversion,
-                                       GCancellable          *cancellable,
-                                       GError               **error)
+run_external_generator (OstreeBootloaderGrub2  *self,
+                        int                     bootversion,
+                        GFile                  *new_config_path,
+                        GCancellable           *cancellable,
+                        GError                **error)
 {
-  OstreeBootloaderGrub2 *self = OSTREE_BOOTLOADER_GRUB2 (bootloader);
   gboolean ret = FALSE;
-  g_autoptr(GFile) new_config_path = NULL;
   GSubprocessFlags subp_flags = 0;
   glnx_unref_object GSubprocessLauncher *launcher = NULL;
   glnx_unref_object GSubprocess *proc = NULL;
   g_autofree char *bootversion_str = g_strdup_printf ("%u", (guint)bootversion);
-  g_autoptr(GFile) config_path_efi_dir = NULL;
   g_autofree char *grub2_mkconfig_chroot = NULL;
   gboolean use_system_grub2_mkconfig = TRUE;
   const gchar *grub_exec = NULL;
@@ -340,20 +600,6 @@ _ostree_bootloader_grub2_write_config (OstreeBootloader      *bootloader,
       grub2_mkconfig_chroot = g_file_get_path (tool_deployment_root);
     }
 
-  if (self->is_efi)
-    {
-      config_path_efi_dir = g_file_get_parent (self->config_path_efi);
-      new_config_path = g_file_get_child (config_path_efi_dir, "grub.cfg.new");
-      /* We use grub2-mkconfig to write to a temporary file first */
-      if (!ot_gfile_ensure_unlinked (new_config_path, cancellable, error))
-        goto out;
-    }
-  else
-    {
-      new_config_path = ot_gfile_resolve_path_printf (self->sysroot->path, "boot/loader.%d/grub.cfg",
-                                                      bootversion);
-    }
-
   if (!g_getenv ("OSTREE_DEBUG_GRUB2"))
     subp_flags |= (G_SUBPROCESS_FLAGS_STDOUT_SILENCE | G_SUBPROCESS_FLAGS_STDERR_SILENCE);
   
@@ -399,6 +645,63 @@ _ostree_bootloader_grub2_write_config (OstreeBootloader      *bootloader,
       }
   }
 
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+_ostree_bootloader_grub2_write_config (OstreeBootloader      *bootloader,
+                                       int                    bootversion,
+                                       GCancellable          *cancellable,
+                                       GError               **error)
+{
+  OstreeBootloaderGrub2 *self = OSTREE_BOOTLOADER_GRUB2 (bootloader);
+  gboolean ret = FALSE;
+  g_autoptr(GFile) new_config_path = NULL;
+  g_autoptr(GFile) config_path_efi_dir = NULL;
+  gboolean use_native = FALSE;
+
+  if (!use_native_generator (self, &use_native, cancellable, error))
+    goto out;
+
+  if (self->is_efi)
+    {
+      config_path_efi_dir = g_file_get_parent (self->config_path_efi);
+      new_config_path = g_file_get_child (config_path_efi_dir, "grub.cfg.new");
+      /* We use grub2-mkconfig to write to a temporary file first */
+      if (!ot_gfile_ensure_unlinked (new_config_path, cancellable, error))
+        goto out;
+    }
+  else
+    {
+      new_config_path = ot_gfile_resolve_path_printf (self->sysroot->path, "boot/loader.%d/grub.cfg",
+                                                      bootversion);
+    }
+
+  if (use_native)
+    {
+      g_autoptr(GString) output = g_string_new ("");
+
+      if (!generate_native_config (self, bootversion, output, cancellable, error))
+        goto out;
+
+      /* This writes a temporary file, fdatasync()s it and renames it
+       * into place, so unlike grub2-mkconfig it's always atomic.
+       */
+      if (!glnx_file_replace_contents_at (AT_FDCWD, gs_file_get_path_cached (new_config_path),
+                                          (guint8*)output->str, output->len,
+                                          GLNX_FILE_REPLACE_DATASYNC_NEW,
+                                          cancellable, error))
+        goto out;
+    }
+  else
+    {
+      if (!run_external_generator (self, bootversion, new_config_path,
+                                   cancellable, error))
+        goto out;
+    }
+
   if (self->is_efi)
     {
       g_autoptr(GFile) config_path_efi_old = g_file_get_child (config_path_efi_dir, "grub.cfg.old");
@@ -24,7 +24,7 @@
 #include "ostree-repo-private.h"
 #include "ostree-core-private.h"
 #include "ostree-repo-static-delta-private.h"
-#include "ostree-sysroot.h"
+#include "ostree-sysroot-private.h"
 #include "ostree-bootloader-grub2.h"
 
 #include "otutil.h"
@@ -35,6 +35,16 @@ impl_ostree_generate_grub2_config (OstreeSysroot *sysroot, int bootversion, int
   return _ostree_bootloader_grub2_generate_config (sysroot, bootversion, target_fd, cancellable, error);
 }
 
+/* Everything ostree_sysroot_cleanup() does, except deleting the
+ * deployments which were moved to the trash.
+ */
+static gboolean
+impl_ostree_sysroot_cleanup_without_trash (OstreeSysroot *sysroot, GCancellable *cancellable, GError **error)
+{
+  return _ostree_sysroot_piecemeal_cleanup (sysroot, OSTREE_SYSROOT_CLEANUP_ALL & ~OSTREE_SYSROOT_CLEANUP_TRASH,
+                                            cancellable, error);
+}
+
 /**
  * ostree_cmdprivate: (skip)
  *
@@ -48,7 +58,12 @@ ostree_cmd__private__ (void)
     impl_ostree_generate_grub2_config,
     _ostree_repo_static_delta_dump,
     _ostree_repo_static_delta_query_exists,
-    _ostree_repo_static_delta_delete
+    _ostree_repo_static_delta_delete,
+    _ostree_repo_get_commit_object_sizes,
+    _ostree_sepolicy_relabel_dir_at,
+    impl_ostree_sysroot_cleanup_without_trash,
+    _ostree_sysroot_empty_trash,
+    _ostree_repo_get_commit_index
   };
 
   return &table;
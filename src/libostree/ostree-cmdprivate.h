@@ -21,6 +21,7 @@
 #pragma once
 
 #include "ostree-types.h"
+#include "ostree-sepolicy-private.h"
 
 G_BEGIN_DECLS
 
@@ -29,6 +30,11 @@ typedef struct {
   gboolean (* ostree_static_delta_dump) (OstreeRepo *repo, const char *delta_id, GCancellable *cancellable, GError **error);
   gboolean (* ostree_static_delta_query_exists) (OstreeRepo *repo, const char *delta_id, gboolean *out_exists, GCancellable *cancellable, GError **error);
   gboolean (* ostree_static_delta_delete) (OstreeRepo *repo, const char *delta_id, GCancellable *cancellable, GError **error);
+  gboolean (* ostree_repo_get_commit_object_sizes) (OstreeRepo *repo, const char *commit_checksum, GVariant **out_sizes, GCancellable *cancellable, GError **error);
+  gboolean (* ostree_sepolicy_relabel_dir_at) (OstreeSePolicy *sepolicy, int dfd, const char *path, const char *prefix, OstreeSePolicyRestoreconFlags flags, OstreeSePolicyRelabelFunc func, gpointer user_data, GCancellable *cancellable, GError **error);
+  gboolean (* ostree_sysroot_cleanup_without_trash) (OstreeSysroot *sysroot, GCancellable *cancellable, GError **error);
+  gboolean (* ostree_sysroot_empty_trash) (OstreeSysroot *sysroot, GCancellable *cancellable, GError **error);
+  gboolean (* ostree_repo_get_commit_index) (OstreeRepo *repo, GVariant **out_index, GCancellable *cancellable, GError **error);
 } OstreeCmdPrivateVTable;
 
 /* Note this not really "public", we just export the symbol, but not the header */
@@ -21,6 +21,7 @@
 #pragma once
 
 #include "ostree-core.h"
+#include "otutil.h"
 
 G_BEGIN_DECLS
 
@@ -74,7 +75,7 @@ gboolean _ostree_write_variant_with_size (GOutputStream      *output,
                                           GVariant           *variant,
                                           guint64             alignment_offset,
                                           gsize              *out_bytes_written,
-                                          GChecksum          *checksum,
+                                          OtChecksum         *checksum,
                                           GCancellable       *cancellable,
                                           GError            **error);
 
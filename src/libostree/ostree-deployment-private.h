@@ -55,4 +55,6 @@ struct _OstreeDeployment
 
 void _ostree_deployment_set_bootcsum (OstreeDeployment *self, const char *bootcsum);
 
+char *_ostree_deployment_get_etc_cache_relpath (OstreeDeployment *self);
+
 G_END_DECLS
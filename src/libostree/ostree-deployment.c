@@ -267,6 +267,25 @@ ostree_deployment_get_origin_relpath (OstreeDeployment *self)
                           ostree_deployment_get_deployserial (self));
 }
 
+/*
+ * _ostree_deployment_get_etc_cache_relpath:
+ * @self: A deployment
+ *
+ * Like ostree_deployment_get_origin_relpath(), but for the cache of
+ * /etc files known to be unmodified relative to /usr/etc, which is
+ * used to speed up the configuration merge.
+ *
+ * Returns: (transfer full): Path relative to sysroot
+ */
+char *
+_ostree_deployment_get_etc_cache_relpath (OstreeDeployment *self)
+{
+  return g_strdup_printf ("ostree/deploy/%s/deploy/%s.%d.etc-cache",
+                          ostree_deployment_get_osname (self),
+                          ostree_deployment_get_csum (self),
+                          ostree_deployment_get_deployserial (self));
+}
+
 const char *
 ostree_deployment_unlocked_state_to_string (OstreeDeploymentUnlockedState state)
 {
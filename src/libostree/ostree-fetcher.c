@@ -70,6 +70,7 @@ typedef struct {
 
   /* Also protected by output_stream_set_lock. */
   guint64 total_downloaded;
+  guint64 total_spooled;   /* Subset of the above written to tmpfiles */
 
   GError *oob_error;
 
@@ -98,6 +99,17 @@ typedef struct {
   guint64 max_size;
   guint64 current_size;
   guint64 content_length;
+
+  /* Bodies up to this size are kept in memory rather than spooled
+   * to out_tmpfile; see _ostree_fetcher_mirrored_request_buffered_async(). */
+  guint64 buffer_max;
+  gboolean buffered;
+
+  /* If range_length is nonzero, only that part of the file is
+   * requested; see _ostree_fetcher_mirrored_request_range_to_membuf(). */
+  guint64 range_start;
+  guint64 range_length;
+  gboolean range_satisfied;
 } OstreeFetcherPendingURI;
 
 /* Used by session_thread_idle_add() */
@@ -436,6 +448,14 @@ create_pending_soup_request (OstreeFetcherPendingURI  *pending,
 
   pending->request = soup_session_request_uri (pending->thread_closure->session,
                                                (SoupURI*)(uri ? uri : next_mirror), error);
+
+  if (pending->request && pending->range_length > 0 &&
+      SOUP_IS_REQUEST_HTTP (pending->request))
+    {
+      glnx_unref_object SoupMessage *msg = soup_request_http_get_message ((SoupRequestHTTP*) pending->request);
+      soup_message_headers_set_range (msg->request_headers, pending->range_start,
+                                      pending->range_start + pending->range_length - 1);
+    }
 }
 
 static void
@@ -887,6 +907,7 @@ finish_stream (OstreeFetcherPendingURI *pending,
     {
       g_mutex_lock (&pending->thread_closure->output_stream_set_lock);
       pending->thread_closure->total_downloaded += stbuf.st_size;
+      pending->thread_closure->total_spooled += pending->current_size;
       g_mutex_unlock (&pending->thread_closure->output_stream_set_lock);
     }
 
@@ -1021,12 +1042,61 @@ on_stream_read (GObject        *object,
   g_object_unref (task);
 }
 
+/* The counterpart of finish_stream() for responses received into
+ * memory.  A truncated body is saved to out_tmpfile so that the next
+ * attempt can resume from it with a range request.
+ */
+static gboolean
+finish_buffered (OstreeFetcherPendingURI *pending,
+                 GMemoryOutputStream     *membuf,
+                 GError                 **error)
+{
+  gsize size = g_memory_output_stream_get_data_size (membuf);
+
+  if (pending->max_size > 0 && size > pending->max_size)
+    {
+      g_autofree char *uristr =
+        soup_uri_to_string (soup_request_get_uri (pending->request), FALSE);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "URI %s exceeded maximum size of %" G_GUINT64_FORMAT " bytes",
+                   uristr, pending->max_size);
+      return FALSE;
+    }
+
+  g_mutex_lock (&pending->thread_closure->output_stream_set_lock);
+  pending->thread_closure->total_downloaded += size;
+  g_mutex_unlock (&pending->thread_closure->output_stream_set_lock);
+
+  if (size < pending->content_length)
+    {
+      if (size > 0)
+        {
+          if (!glnx_file_replace_contents_at (pending->thread_closure->tmpdir_dfd,
+                                              pending->out_tmpfile,
+                                              g_memory_output_stream_get_data (membuf),
+                                              size, GLNX_FILE_REPLACE_NODATASYNC,
+                                              NULL, error))
+            return FALSE;
+
+          g_mutex_lock (&pending->thread_closure->output_stream_set_lock);
+          pending->thread_closure->total_spooled += size;
+          g_mutex_unlock (&pending->thread_closure->output_stream_set_lock);
+        }
+
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Download incomplete");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 static void
 request_body_spliced (GObject      *object,
                       GAsyncResult *result,
                       gpointer      user_data)
 {
   g_autoptr(GTask) task = G_TASK (user_data);
+  OstreeFetcherPendingURI *pending = g_task_get_task_data (task);
   GError *local_error = NULL;
   GMemoryOutputStream *membuf = G_MEMORY_OUTPUT_STREAM (object);
 
@@ -1036,8 +1106,18 @@ request_body_spliced (GObject      *object,
     {
       g_task_return_error (task, local_error);
     }
+  else if (pending->buffered && !finish_buffered (pending, membuf, &local_error))
+    {
+      g_task_return_error (task, local_error);
+    }
   else
     {
+      if (pending->range_length > 0)
+        {
+          g_mutex_lock (&pending->thread_closure->output_stream_set_lock);
+          pending->thread_closure->total_downloaded += g_memory_output_stream_get_data_size (membuf);
+          g_mutex_unlock (&pending->thread_closure->output_stream_set_lock);
+        }
       g_task_return_pointer (task, g_object_ref (membuf), g_object_unref);
     }
 }
@@ -1081,7 +1161,8 @@ on_request_sent (GObject        *object,
   if (SOUP_IS_REQUEST_HTTP (object))
     {
       msg = soup_request_http_get_message ((SoupRequestHTTP*) object);
-      if (msg->status_code == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE)
+      if (msg->status_code == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE &&
+          pending->range_length == 0)
         {
           // We already have the whole file, so just use it.
           pending->state = OSTREE_FETCHER_STATE_COMPLETE;
@@ -1159,8 +1240,34 @@ on_request_sent (GObject        *object,
   pending->state = OSTREE_FETCHER_STATE_DOWNLOADING;
   
   pending->content_length = soup_request_get_content_length (pending->request);
+  pending->range_satisfied = msg && msg->status_code == SOUP_STATUS_PARTIAL_CONTENT;
 
-  if (!pending->is_stream)
+  /* Don't download the whole file for each part of it; the caller
+   * will rather fetch it once.
+   */
+  if (pending->range_length > 0 && !pending->range_satisfied)
+    {
+      g_set_error (&local_error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Server does not support range requests for %s", pending->filename);
+      goto out;
+    }
+
+  /* Small enough to keep in memory, and not a resumed download; the
+   * caller can then write it straight to its final destination
+   * without a round trip through the fetcher tmpdir.
+   */
+  if (!pending->is_stream && pending->buffer_max > 0 &&
+      pending->content_length > 0 &&
+      pending->content_length <= pending->buffer_max &&
+      !(msg && msg->status_code == SOUP_STATUS_PARTIAL_CONTENT))
+    {
+      pending->buffered = TRUE;
+      /* Drop any stale partial file from an earlier run */
+      (void) unlinkat (pending->thread_closure->tmpdir_dfd, pending->out_tmpfile, 0);
+      splice_request_body_to_membuf (task, pending->request_body);
+      remove_pending_rerun_queue (pending);
+    }
+  else if (!pending->is_stream)
     {
       int oflags = O_CREAT | O_WRONLY | O_CLOEXEC;
       int fd;
@@ -1217,6 +1324,9 @@ ostree_fetcher_mirrored_request_internal (OstreeFetcher         *self,
                                           const char            *filename,
                                           gboolean               is_stream,
                                           guint64                max_size,
+                                          guint64                buffer_max,
+                                          guint64                range_start,
+                                          guint64                range_length,
                                           int                    priority,
                                           GCancellable          *cancellable,
                                           GAsyncReadyCallback    callback,
@@ -1237,6 +1347,9 @@ ostree_fetcher_mirrored_request_internal (OstreeFetcher         *self,
   pending->mirrorlist = g_ptr_array_ref (mirrorlist);
   pending->filename = g_strdup (filename);
   pending->max_size = max_size;
+  pending->buffer_max = buffer_max;
+  pending->range_start = range_start;
+  pending->range_length = range_length;
   pending->is_stream = is_stream;
 
   task = g_task_new (self, cancellable, callback, user_data);
@@ -1263,7 +1376,7 @@ _ostree_fetcher_mirrored_request_with_partial_async (OstreeFetcher         *self
                                                      gpointer               user_data)
 {
   ostree_fetcher_mirrored_request_internal (self, mirrorlist, filename, FALSE,
-                                            max_size, priority, cancellable,
+                                            max_size, 0, 0, 0, priority, cancellable,
                                             callback, user_data,
                                             _ostree_fetcher_mirrored_request_with_partial_async);
 }
@@ -1280,18 +1393,84 @@ _ostree_fetcher_mirrored_request_with_partial_finish (OstreeFetcher         *sel
   return g_task_propagate_pointer (G_TASK (result), error);
 }
 
+/* Like _ostree_fetcher_mirrored_request_with_partial_async(), but
+ * a response body of known length no larger than @buffer_max is
+ * kept in memory instead of being written to the fetcher tmpdir.
+ * Large bodies, and downloads resuming a partial file, still go
+ * through a tmpfile.
+ */
+void
+_ostree_fetcher_mirrored_request_buffered_async (OstreeFetcher         *self,
+                                                 GPtrArray             *mirrorlist,
+                                                 const char            *filename,
+                                                 guint64                max_size,
+                                                 guint64                buffer_max,
+                                                 int                    priority,
+                                                 GCancellable          *cancellable,
+                                                 GAsyncReadyCallback    callback,
+                                                 gpointer               user_data)
+{
+  ostree_fetcher_mirrored_request_internal (self, mirrorlist, filename, FALSE,
+                                            max_size, buffer_max, 0, 0, priority, cancellable,
+                                            callback, user_data,
+                                            _ostree_fetcher_mirrored_request_buffered_async);
+}
+
+/* Exactly one of @out_tmpfile (relative to _ostree_fetcher_get_dfd())
+ * and @out_contents is set on success.
+ */
+gboolean
+_ostree_fetcher_mirrored_request_buffered_finish (OstreeFetcher         *self,
+                                                  GAsyncResult          *result,
+                                                  char                 **out_tmpfile,
+                                                  GBytes               **out_contents,
+                                                  GError               **error)
+{
+  OstreeFetcherPendingURI *pending;
+  gpointer ret;
+
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  g_return_val_if_fail (g_async_result_is_tagged (result,
+                        _ostree_fetcher_mirrored_request_buffered_async), FALSE);
+
+  pending = g_task_get_task_data (G_TASK (result));
+  ret = g_task_propagate_pointer (G_TASK (result), error);
+  if (!ret)
+    return FALSE;
+
+  if (pending->buffered)
+    {
+      g_autoptr(GMemoryOutputStream) membuf = ret;
+
+      if (!g_output_stream_close (G_OUTPUT_STREAM (membuf), NULL, error))
+        return FALSE;
+      *out_tmpfile = NULL;
+      *out_contents = g_memory_output_stream_steal_as_bytes (membuf);
+    }
+  else
+    {
+      *out_tmpfile = ret;
+      *out_contents = NULL;
+    }
+
+  return TRUE;
+}
+
 static void
 ostree_fetcher_stream_mirrored_uri_async (OstreeFetcher         *self,
                                           GPtrArray             *mirrorlist,
                                           const char            *filename,
                                           guint64                max_size,
+                                          guint64                range_start,
+                                          guint64                range_length,
                                           int                    priority,
                                           GCancellable          *cancellable,
                                           GAsyncReadyCallback    callback,
                                           gpointer               user_data)
 {
   ostree_fetcher_mirrored_request_internal (self, mirrorlist, filename, TRUE,
-                                            max_size, priority, cancellable,
+                                            max_size, 0, range_start, range_length,
+                                            priority, cancellable,
                                             callback, user_data,
                                             ostree_fetcher_stream_mirrored_uri_async);
 }
@@ -1339,9 +1518,27 @@ _ostree_fetcher_bytes_transferred (OstreeFetcher       *self)
   return ret;
 }
 
+/* Bytes of response bodies that were written out to the fetcher tmpdir,
+ * as opposed to those handed back in memory.
+ */
+guint64
+_ostree_fetcher_bytes_spooled (OstreeFetcher       *self)
+{
+  guint64 ret;
+
+  g_return_val_if_fail (OSTREE_IS_FETCHER (self), 0);
+
+  g_mutex_lock (&self->thread_closure->output_stream_set_lock);
+  ret = self->thread_closure->total_spooled;
+  g_mutex_unlock (&self->thread_closure->output_stream_set_lock);
+
+  return ret;
+}
+
 typedef struct
 {
   GMemoryOutputStream   *membuf;
+  gboolean               range_satisfied;
   gboolean               done;
   GError               **error;
 }
@@ -1353,9 +1550,11 @@ fetch_uri_sync_on_complete (GObject        *object,
                             gpointer        user_data)
 {
   FetchUriSyncData *data = user_data;
+  OstreeFetcherPendingURI *pending = g_task_get_task_data (G_TASK (result));
 
   data->membuf = ostree_fetcher_stream_mirrored_uri_finish ((OstreeFetcher*)object,
                                                             result, data->error);
+  data->range_satisfied = pending->range_satisfied;
   data->done = TRUE;
 }
 
@@ -1386,7 +1585,7 @@ _ostree_fetcher_mirrored_request_to_membuf (OstreeFetcher  *fetcher,
   data.done = FALSE;
   data.error = error;
 
-  ostree_fetcher_stream_mirrored_uri_async (fetcher, mirrorlist, filename, max_size,
+  ostree_fetcher_stream_mirrored_uri_async (fetcher, mirrorlist, filename, max_size, 0, 0,
                                    OSTREE_FETCHER_DEFAULT_PRIORITY, cancellable,
                                    fetch_uri_sync_on_complete, &data);
   while (!data.done)
@@ -1425,6 +1624,74 @@ _ostree_fetcher_mirrored_request_to_membuf (OstreeFetcher  *fetcher,
   return ret;
 }
 
+/* Fetch @length bytes of @filename from @offset, with a range request.
+ * Fails with %G_IO_ERROR_NOT_SUPPORTED, without downloading the body,
+ * if the server (or a file: URI) ignores the range.  May be called
+ * from any thread.
+ */
+gboolean
+_ostree_fetcher_mirrored_request_range_to_membuf (OstreeFetcher  *fetcher,
+                                                  GPtrArray      *mirrorlist,
+                                                  const char     *filename,
+                                                  guint64         offset,
+                                                  guint64         length,
+                                                  GBytes        **out_contents,
+                                                  GCancellable   *cancellable,
+                                                  GError        **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GMainContext) mainctx = NULL;
+  g_autoptr(GBytes) contents = NULL;
+  FetchUriSyncData data;
+  gsize size;
+  g_assert (error != NULL);
+
+  g_return_val_if_fail (length > 0, FALSE);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  mainctx = g_main_context_new ();
+  g_main_context_push_thread_default (mainctx);
+
+  data.membuf = NULL;
+  data.range_satisfied = FALSE;
+  data.done = FALSE;
+  data.error = error;
+
+  ostree_fetcher_stream_mirrored_uri_async (fetcher, mirrorlist, filename, 0,
+                                            offset, length,
+                                            OSTREE_FETCHER_DEFAULT_PRIORITY, cancellable,
+                                            fetch_uri_sync_on_complete, &data);
+  while (!data.done)
+    g_main_context_iteration (mainctx, TRUE);
+
+  if (!data.membuf)
+    goto out;
+
+  if (!g_output_stream_close ((GOutputStream*)data.membuf, cancellable, error))
+    goto out;
+
+  contents = g_memory_output_stream_steal_as_bytes (data.membuf);
+  size = g_bytes_get_size (contents);
+
+  g_assert (data.range_satisfied);
+  if (size != length)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Requested %" G_GUINT64_FORMAT " bytes of %s, got %" G_GSIZE_FORMAT,
+                   length, filename, size);
+      goto out;
+    }
+  *out_contents = g_steal_pointer (&contents);
+
+  ret = TRUE;
+ out:
+  g_main_context_pop_thread_default (mainctx);
+  g_clear_object (&(data.membuf));
+  return ret;
+}
+
 /* Helper for callers who just want to fetch single one-off URIs */
 gboolean
 _ostree_fetcher_request_uri_to_membuf (OstreeFetcher  *fetcher,
@@ -103,6 +103,8 @@ void _ostree_fetcher_set_extra_headers (OstreeFetcher *self,
 
 guint64 _ostree_fetcher_bytes_transferred (OstreeFetcher       *self);
 
+guint64 _ostree_fetcher_bytes_spooled (OstreeFetcher       *self);
+
 void _ostree_fetcher_mirrored_request_with_partial_async (OstreeFetcher         *self,
                                                           GPtrArray             *mirrorlist,
                                                           const char            *filename,
@@ -116,6 +118,22 @@ char *_ostree_fetcher_mirrored_request_with_partial_finish (OstreeFetcher *self,
                                                             GAsyncResult  *result,
                                                             GError       **error);
 
+void _ostree_fetcher_mirrored_request_buffered_async (OstreeFetcher         *self,
+                                                      GPtrArray             *mirrorlist,
+                                                      const char            *filename,
+                                                      guint64                max_size,
+                                                      guint64                buffer_max,
+                                                      int                    priority,
+                                                      GCancellable          *cancellable,
+                                                      GAsyncReadyCallback    callback,
+                                                      gpointer               user_data);
+
+gboolean _ostree_fetcher_mirrored_request_buffered_finish (OstreeFetcher *self,
+                                                           GAsyncResult  *result,
+                                                           char         **out_tmpfile,
+                                                           GBytes       **out_contents,
+                                                           GError       **error);
+
 gboolean _ostree_fetcher_mirrored_request_to_membuf (OstreeFetcher *fetcher,
                                                      GPtrArray     *mirrorlist,
                                                      const char    *filename,
@@ -126,6 +144,15 @@ gboolean _ostree_fetcher_mirrored_request_to_membuf (OstreeFetcher *fetcher,
                                                      GCancellable   *cancellable,
                                                      GError         **error);
 
+gboolean _ostree_fetcher_mirrored_request_range_to_membuf (OstreeFetcher  *fetcher,
+                                                           GPtrArray      *mirrorlist,
+                                                           const char     *filename,
+                                                           guint64         offset,
+                                                           guint64         length,
+                                                           GBytes        **out_contents,
+                                                           GCancellable   *cancellable,
+                                                           GError        **error);
+
 gboolean _ostree_fetcher_request_uri_to_membuf (OstreeFetcher *fetcher,
                                                 OstreeFetcherURI *uri,
                                                 gboolean       add_nul,
@@ -26,6 +26,7 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <ext2fs/ext2_fs.h>
+#include <linux/fs.h>
 
 /**
  * _ostree_linuxfs_fd_alter_immutable_flag:
@@ -131,3 +132,60 @@ _ostree_linuxfs_alter_immutable_flag (GFile         *path,
  out:
   return ret;
 }
+
+/**
+ * _ostree_linuxfs_filesystem_freeze_thaw:
+ * @dfd: A directory file descriptor on the filesystem
+ * @cancellable: Cancellable
+ * @error: GError
+ *
+ * Freeze and immediately thaw the filesystem containing @dfd.  A
+ * freeze writes back all dirty data and checkpoints the journal, so
+ * the on-disk state is consistent even for readers which don't replay
+ * the journal (notably bootloaders reading /boot).
+ *
+ * If the operation is not supported by the underlying filesystem,
+ * this function will silently do nothing.  Lacking CAP_SYS_ADMIN is an
+ * error.
+ */
+gboolean
+_ostree_linuxfs_filesystem_freeze_thaw (int            dfd,
+                                        GCancellable  *cancellable,
+                                        GError       **error)
+{
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  if (ioctl (dfd, FIFREEZE, 0) != 0)
+    {
+      int errsv = errno;
+      /* EBUSY: someone else already froze it, nothing to do */
+      if (errsv == EOPNOTSUPP || errsv == ENOTTY
+          || errsv == EBUSY || errsv == EINVAL)
+        return TRUE;
+      /* Unlike the immutable flag, don't silently skip this without
+       * CAP_SYS_ADMIN: the caller asked for the journal checkpoint, and
+       * would otherwise believe /boot is consistent when it isn't.
+       */
+      if (errsv == EPERM)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED,
+                       "ioctl(FIFREEZE): %s (freezing requires CAP_SYS_ADMIN)",
+                       g_strerror (errsv));
+          return FALSE;
+        }
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "ioctl(FIFREEZE): %s", g_strerror (errsv));
+      return FALSE;
+    }
+
+  if (ioctl (dfd, FITHAW, 0) != 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "ioctl(FITHAW): %s", g_strerror (errsv));
+      return FALSE;
+    }
+
+  return TRUE;
+}
@@ -36,4 +36,9 @@ _ostree_linuxfs_alter_immutable_flag (GFile         *path,
                                       GCancellable  *cancellable,
                                       GError       **error);
 
+gboolean
+_ostree_linuxfs_filesystem_freeze_thaw (int            dfd,
+                                        GCancellable  *cancellable,
+                                        GError       **error);
+
 G_END_DECLS
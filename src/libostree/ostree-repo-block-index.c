@@ -0,0 +1,600 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2017 The OSTree Authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <zlib.h>
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+#include "otutil.h"
+
+/*
+ * A block index lets a client which has an older version of a large
+ * file build the new one from it, fetching only the blocks it lacks
+ * from the archive-z2 object with HTTP range requests.  It is the
+ * rsync-style block signatures of the file (see ostree-rollsum.c),
+ * which the client searches for in its own copy, and where each
+ * block's compressed data is in the object.
+ *
+ * A deflate stream can't normally be decompressed from the middle, so
+ * when an index is generated the object is recompressed with a full
+ * flush at each block boundary, which makes every block independently
+ * decompressible.  The object's checksum, being of the uncompressed
+ * content, doesn't change, and it is still a single deflate stream for
+ * clients which fetch it whole.
+ *
+ * Indexes are stored in block-index/XX/YYYY..., one per content object,
+ * as a GVariant of type OSTREE_BLOCK_INDEX_GVARIANT_FORMAT:
+ *
+ *   u       - block size, big endian
+ *   t       - uncompressed size, big endian
+ *   ay      - the start of the object up to its compressed content,
+ *             i.e. the size prefixed file header
+ *   a(uayt) - for each block, the weak checksum (big endian), the
+ *             strong checksum, and the offset in the object of the
+ *             end of its compressed data (big endian)
+ *
+ * They are maintained by ostree_repo_regenerate_summary() when
+ * core.block-index-min-size is set, for the objects of at least that
+ * size in the commits the summary references.
+ */
+
+char *
+_ostree_get_relative_block_index_path (const char *checksum)
+{
+  g_assert (strlen (checksum) == OSTREE_SHA256_STRING_LEN);
+
+  return g_strdup_printf (_OSTREE_BLOCK_INDEX_DIR "/%c%c/%s",
+                          checksum[0], checksum[1], checksum + 2);
+}
+
+void
+_ostree_block_index_free (OstreeBlockIndex *index)
+{
+  g_clear_pointer (&index->sigs, (GDestroyNotify) _ostree_block_signatures_free);
+  g_clear_pointer (&index->header, g_bytes_unref);
+  g_clear_pointer (&index->block_ends, g_array_unref);
+  g_free (index);
+}
+
+/*
+ * _ostree_block_index_parse:
+ * @data: Serialized index, untrusted
+ * @out_index: (out): The parsed index
+ *
+ * Parse and validate a block index.
+ */
+gboolean
+_ostree_block_index_parse (GBytes            *data,
+                           OstreeBlockIndex **out_index,
+                           GError           **error)
+{
+  g_autoptr(GVariant) variant = NULL;
+  g_autoptr(GVariant) header_v = NULL;
+  g_autoptr(GVariant) blocks_v = NULL;
+  g_autoptr(GArray) sigs = NULL;
+  g_autoptr(GArray) ends = NULL;
+  OstreeBlockIndex *ret_index;
+  guint32 block_size;
+  guint64 size;
+  guint64 prev_end;
+  gsize n_blocks;
+  gsize i;
+
+  variant = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_BLOCK_INDEX_GVARIANT_FORMAT,
+                                                          data, FALSE));
+  g_variant_get (variant, "(ut@ay@a(uayt))", &block_size, &size, &header_v, &blocks_v);
+  block_size = GUINT32_FROM_BE (block_size);
+  size = GUINT64_FROM_BE (size);
+  n_blocks = g_variant_n_children (blocks_v);
+
+  if (block_size == 0 || block_size > OSTREE_MAX_METADATA_SIZE ||
+      n_blocks != (size + block_size - 1) / block_size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid block index: %" G_GSIZE_FORMAT " blocks of %u bytes for %" G_GUINT64_FORMAT " bytes",
+                   n_blocks, block_size, size);
+      return FALSE;
+    }
+
+  if (g_variant_get_size (header_v) < 8)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid block index: truncated file header");
+      return FALSE;
+    }
+
+  sigs = g_array_sized_new (FALSE, FALSE, sizeof (OstreeBlockSignature), n_blocks);
+  ends = g_array_sized_new (FALSE, FALSE, sizeof (guint64), n_blocks);
+  prev_end = g_variant_get_size (header_v);
+
+  for (i = 0; i < n_blocks; i++)
+    {
+      g_autoptr(GVariant) strong_v = NULL;
+      OstreeBlockSignature sig;
+      guint64 end;
+
+      g_variant_get_child (blocks_v, i, "(u@ayt)", &sig.weak, &strong_v, &end);
+      sig.weak = GUINT32_FROM_BE (sig.weak);
+      end = GUINT64_FROM_BE (end);
+
+      if (g_variant_get_size (strong_v) != OSTREE_BLOCK_SIGNATURE_STRONG_LEN || end <= prev_end)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Invalid block index: bad entry for block %" G_GSIZE_FORMAT, i);
+          return FALSE;
+        }
+      memcpy (sig.strong, g_variant_get_data (strong_v), OSTREE_BLOCK_SIGNATURE_STRONG_LEN);
+
+      g_array_append_val (sigs, sig);
+      g_array_append_val (ends, end);
+      prev_end = end;
+    }
+
+  ret_index = g_new0 (OstreeBlockIndex, 1);
+  ret_index->sigs = _ostree_block_signatures_new_from_blocks (block_size, size,
+                                                              g_steal_pointer (&sigs));
+  ret_index->header = g_variant_get_data_as_bytes (header_v);
+  ret_index->block_ends = g_steal_pointer (&ends);
+  *out_index = ret_index;
+  return TRUE;
+}
+
+/*
+ * _ostree_block_index_get_block_range:
+ *
+ * Find where the compressed data of @block is in the object.
+ */
+void
+_ostree_block_index_get_block_range (OstreeBlockIndex *index,
+                                     guint             block,
+                                     guint64          *out_start,
+                                     guint64          *out_end)
+{
+  g_assert_cmpuint (block, <, index->block_ends->len);
+
+  if (block == 0)
+    *out_start = g_bytes_get_size (index->header);
+  else
+    *out_start = g_array_index (index->block_ends, guint64, block - 1);
+  *out_end = g_array_index (index->block_ends, guint64, block);
+}
+
+/*
+ * _ostree_block_index_inflate_block:
+ * @index: Index
+ * @checksum: An initialized checksum context, reused across blocks
+ * @block: Block number
+ * @compressed: The compressed data of @block
+ * @compressed_len: Length of @compressed
+ * @out_buf: Return location for the block, of the block size
+ * @out_len: (out): Length of the block
+ *
+ * Decompress one block of the object and check it against its
+ * signature.
+ */
+gboolean
+_ostree_block_index_inflate_block (OstreeBlockIndex  *index,
+                                   OtChecksum        *checksum,
+                                   guint              block,
+                                   const guint8      *compressed,
+                                   gsize              compressed_len,
+                                   guint8            *out_buf,
+                                   gsize             *out_len,
+                                   GError           **error)
+{
+  OstreeBlockSignatures *sigs = index->sigs;
+  const OstreeBlockSignature *expected = &g_array_index (sigs->blocks, OstreeBlockSignature, block);
+  OstreeBlockSignature actual;
+  z_stream zs = { 0, };
+  gsize len;
+  int res;
+
+  len = MIN ((guint64) sigs->block_size, sigs->size - (guint64) block * sigs->block_size);
+
+  if (inflateInit2 (&zs, -MAX_WBITS) != Z_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to initialize zlib");
+      return FALSE;
+    }
+
+  zs.next_in = (guint8 *) compressed;
+  zs.avail_in = compressed_len;
+  zs.next_out = out_buf;
+  zs.avail_out = len;
+  res = inflate (&zs, Z_SYNC_FLUSH);
+  (void) inflateEnd (&zs);
+
+  if (!(res == Z_OK || res == Z_STREAM_END || res == Z_BUF_ERROR) || zs.avail_out != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Failed to decompress block %u", block);
+      return FALSE;
+    }
+
+  _ostree_block_signature_compute (checksum, out_buf, len, &actual);
+  if (actual.weak != expected->weak ||
+      memcmp (actual.strong, expected->strong, OSTREE_BLOCK_SIGNATURE_STRONG_LEN) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Block %u doesn't match its signature", block);
+      return FALSE;
+    }
+
+  *out_len = len;
+  return TRUE;
+}
+
+/* Compress @len bytes of @buf to @fd, advancing @inout_offset */
+static gboolean
+deflate_to_fd (z_stream     *zs,
+               const guint8 *buf,
+               gsize         len,
+               int           flush,
+               guint8       *outbuf,
+               gsize         outbuf_len,
+               int           fd,
+               guint64      *inout_offset,
+               GError      **error)
+{
+  zs->next_in = (guint8 *) buf;
+  zs->avail_in = len;
+
+  do
+    {
+      gsize n;
+      int res;
+
+      zs->next_out = outbuf;
+      zs->avail_out = outbuf_len;
+      res = deflate (zs, flush);
+      if (res == Z_STREAM_ERROR)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to compress");
+          return FALSE;
+        }
+
+      n = outbuf_len - zs->avail_out;
+      if (n > 0 && glnx_loop_write (fd, outbuf, n) < 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+      *inout_offset += n;
+    }
+  while (zs->avail_out == 0);
+
+  g_assert_cmpuint (zs->avail_in, ==, 0);
+  return TRUE;
+}
+
+/* Recompress the object @checksum with a full flush after each block,
+ * replacing it, and write its index.  The content is checksummed as it
+ * is read, so a corrupted object is never republished.
+ */
+static gboolean
+write_block_index (OstreeRepo    *self,
+                   const char    *checksum,
+                   guint64        size,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  char loose_path[_OSTREE_LOOSE_PATH_MAX];
+  g_autofree char *index_path = _ostree_get_relative_block_index_path (checksum);
+  g_autofree char *index_dir = g_path_get_dirname (index_path);
+  g_autofree char *tmpname = NULL;
+  glnx_fd_close int tmp_fd = -1;
+  g_autoptr(GInputStream) object_in = NULL;
+  g_autoptr(GInputStream) content_in = NULL;
+  g_autoptr(GConverter) decompressor = NULL;
+  g_autofree guint8 *header = NULL;
+  g_autoptr(GInputStream) header_in = NULL;
+  g_autoptr(GFileInfo) file_info = NULL;
+  g_autoptr(GVariant) xattrs = NULL;
+  g_autoptr(GVariant) file_header = NULL;
+  g_auto(OtChecksum) content_checksum = { 0, };
+  g_auto(OtChecksum) block_checksum = { 0, };
+  char actual_checksum[OSTREE_SHA256_STRING_LEN+1];
+  g_autofree guint8 *block_buf = NULL;
+  g_autofree guint8 *outbuf = NULL;
+  const gsize outbuf_len = 64 * 1024;
+  guint32 header_size_be;
+  guint32 header_size;
+  gsize header_len;
+  gsize bytes_read;
+  guint32 block_size;
+  guint64 offset;
+  guint64 total = 0;
+  z_stream zs = { 0, };
+  gboolean zs_inited = FALSE;
+  g_autoptr(GVariantBuilder) blocks_builder = NULL;
+  g_autoptr(GVariant) index = NULL;
+  gboolean ret = FALSE;
+
+  _ostree_loose_path (loose_path, checksum, OSTREE_OBJECT_TYPE_FILE, self->mode);
+
+  if (!ot_openat_read_stream (self->objects_dir_fd, loose_path, TRUE, &object_in,
+                              cancellable, error))
+    goto out;
+
+  /* Copy the header as is; see ostree_content_stream_parse() */
+  if (!g_input_stream_read_all (object_in, &header_size_be, 4, &bytes_read,
+                                cancellable, error))
+    goto out;
+  header_size = GUINT32_FROM_BE (header_size_be);
+  if (bytes_read != 4 || header_size == 0 || header_size > OSTREE_MAX_METADATA_SIZE)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted file object %s: invalid header", checksum);
+      goto out;
+    }
+  header_len = 8 + header_size;
+  header = g_malloc (header_len);
+  memcpy (header, &header_size_be, 4);
+  if (!g_input_stream_read_all (object_in, header + 4, header_len - 4, &bytes_read,
+                                cancellable, error))
+    goto out;
+  if (bytes_read != header_len - 4)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted file object %s: truncated header", checksum);
+      goto out;
+    }
+
+  /* The checksum covers the uncompressed form of the header */
+  header_in = g_memory_input_stream_new_from_data (header, header_len, NULL);
+  if (!ostree_content_stream_parse (TRUE, header_in, header_len, FALSE,
+                                    NULL, &file_info, &xattrs,
+                                    cancellable, error))
+    goto out;
+  file_header = _ostree_file_header_new (file_info, xattrs);
+  ot_checksum_init (&content_checksum);
+  ot_checksum_init (&block_checksum);
+  if (!_ostree_write_variant_with_size (NULL, file_header, 0, NULL, &content_checksum,
+                                        cancellable, error))
+    goto out;
+
+  decompressor = (GConverter*)g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW);
+  content_in = g_converter_input_stream_new (object_in, decompressor);
+
+  if (!glnx_open_tmpfile_linkable_at (self->tmp_dir_fd, ".", O_WRONLY | O_CLOEXEC,
+                                      &tmp_fd, &tmpname, error))
+    goto out;
+
+  if (glnx_loop_write (tmp_fd, header, header_len) < 0)
+    {
+      glnx_set_error_from_errno (error);
+      goto out;
+    }
+  offset = header_len;
+
+  /* Same as ostree_raw_file_to_archive_z2_stream() */
+  if (deflateInit2 (&zs, 9, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to initialize zlib");
+      goto out;
+    }
+  zs_inited = TRUE;
+
+  block_size = _ostree_block_signatures_default_block_size (size);
+  block_buf = g_malloc (block_size);
+  outbuf = g_malloc (outbuf_len);
+  blocks_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(uayt)"));
+
+  while (total < size)
+    {
+      gsize len = MIN ((guint64) block_size, size - total);
+      OstreeBlockSignature sig;
+
+      if (!g_input_stream_read_all (content_in, block_buf, len, &bytes_read,
+                                    cancellable, error))
+        goto out;
+      if (bytes_read != len)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Corrupted file object %s: truncated content", checksum);
+          goto out;
+        }
+      total += len;
+      ot_checksum_update (&content_checksum, block_buf, len);
+
+      if (!deflate_to_fd (&zs, block_buf, len, total < size ? Z_FULL_FLUSH : Z_FINISH,
+                          outbuf, outbuf_len, tmp_fd, &offset, error))
+        goto out;
+
+      _ostree_block_signature_compute (&block_checksum, block_buf, len, &sig);
+      g_variant_builder_add (blocks_builder, "(u@ayt)",
+                             GUINT32_TO_BE (sig.weak),
+                             ot_gvariant_new_bytearray (sig.strong, OSTREE_BLOCK_SIGNATURE_STRONG_LEN),
+                             GUINT64_TO_BE (offset));
+    }
+
+  ot_checksum_get_hexdigest (&content_checksum, actual_checksum, sizeof (actual_checksum));
+  if (strcmp (actual_checksum, checksum) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted file object %s: actual checksum is %s",
+                   checksum, actual_checksum);
+      goto out;
+    }
+
+  if (fchmod (tmp_fd, 0644) < 0)
+    {
+      glnx_set_error_from_errno (error);
+      goto out;
+    }
+
+  if (!glnx_link_tmpfile_at (self->tmp_dir_fd, GLNX_LINK_TMPFILE_REPLACE, tmp_fd, tmpname,
+                             self->objects_dir_fd, loose_path, error))
+    goto out;
+
+  _ostree_repo_store_size_entry (self, OSTREE_OBJECT_TYPE_FILE, checksum, size, offset);
+
+  index = g_variant_ref_sink (g_variant_new ("(ut@ay@a(uayt))",
+                                             GUINT32_TO_BE (block_size),
+                                             GUINT64_TO_BE (size),
+                                             ot_gvariant_new_bytearray (header, header_len),
+                                             g_variant_builder_end (blocks_builder)));
+
+  if (!glnx_shutil_mkdir_p_at (self->repo_dir_fd, index_dir, 0755, cancellable, error))
+    goto out;
+
+  if (!_ostree_repo_file_replace_contents (self, self->repo_dir_fd, index_path,
+                                           g_variant_get_data (index),
+                                           g_variant_get_size (index),
+                                           cancellable, error))
+    goto out;
+
+  g_debug ("wrote block index for %s: %" G_GUINT64_FORMAT " blocks",
+           checksum, (size + block_size - 1) / block_size);
+
+  ret = TRUE;
+ out:
+  if (zs_inited)
+    (void) deflateEnd (&zs);
+  if (tmpname)
+    (void) unlinkat (self->tmp_dir_fd, tmpname, 0);
+  return ret;
+}
+
+/* An index is current if it was written after its object, which is
+ * replaced when the index is generated.
+ */
+static gboolean
+block_index_is_current (OstreeRepo  *self,
+                        const char  *checksum,
+                        gboolean    *out_current,
+                        GError     **error)
+{
+  char loose_path[_OSTREE_LOOSE_PATH_MAX];
+  g_autofree char *index_path = _ostree_get_relative_block_index_path (checksum);
+  struct stat object_stbuf;
+  struct stat index_stbuf;
+
+  if (fstatat (self->repo_dir_fd, index_path, &index_stbuf, 0) < 0)
+    {
+      if (errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+      *out_current = FALSE;
+      return TRUE;
+    }
+
+  _ostree_loose_path (loose_path, checksum, OSTREE_OBJECT_TYPE_FILE, self->mode);
+  if (fstatat (self->objects_dir_fd, loose_path, &object_stbuf, 0) < 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  *out_current =
+    index_stbuf.st_mtim.tv_sec > object_stbuf.st_mtim.tv_sec ||
+    (index_stbuf.st_mtim.tv_sec == object_stbuf.st_mtim.tv_sec &&
+     index_stbuf.st_mtim.tv_nsec >= object_stbuf.st_mtim.tv_nsec);
+  return TRUE;
+}
+
+/*
+ * _ostree_repo_regenerate_block_index:
+ * @self: Repo
+ * @commits: Checksums of the commits whose objects should be indexed
+ * @min_size: Smallest content size to index, or 0 for none
+ *
+ * Ensure each regular file of at least @min_size bytes in @commits has
+ * a current block index, and delete all other indexes.
+ */
+gboolean
+_ostree_repo_regenerate_block_index (OstreeRepo    *self,
+                                     GPtrArray     *commits,
+                                     guint64        min_size,
+                                     GCancellable  *cancellable,
+                                     GError       **error)
+{
+  g_autoptr(GHashTable) indexed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  guint n_written = 0;
+  guint i;
+
+  if (min_size > 0 && self->mode != OSTREE_REPO_MODE_ARCHIVE_Z2)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Block indexes require an archive-z2 repository");
+      return FALSE;
+    }
+
+  for (i = 0; min_size > 0 && i < commits->len; i++)
+    {
+      const char *commit = commits->pdata[i];
+      g_autoptr(GHashTable) reachable = NULL;
+      GHashTableIter hashiter;
+      gpointer key, value;
+
+      if (!ostree_repo_traverse_commit (self, commit, 0, &reachable,
+                                        cancellable, error))
+        return FALSE;
+
+      g_hash_table_iter_init (&hashiter, reachable);
+      while (g_hash_table_iter_next (&hashiter, &key, &value))
+        {
+          const char *checksum;
+          OstreeObjectType objtype;
+          OstreeContentSizeCacheEntry entry;
+          gboolean current;
+
+          ostree_object_name_deserialize (key, &checksum, &objtype);
+          if (objtype != OSTREE_OBJECT_TYPE_FILE ||
+              g_hash_table_contains (indexed, checksum))
+            continue;
+
+          /* Non-regular files have an unpacked size of zero */
+          if (!_ostree_repo_get_object_size_entry (self, objtype, checksum, &entry,
+                                                   cancellable, error))
+            return FALSE;
+          if (entry.unpacked < min_size)
+            continue;
+
+          if (!block_index_is_current (self, checksum, &current, error))
+            return FALSE;
+          if (!current)
+            {
+              if (!write_block_index (self, checksum, entry.unpacked, cancellable, error))
+                {
+                  g_prefix_error (error, "Writing block index for %s: ", checksum);
+                  return FALSE;
+                }
+              n_written++;
+            }
+
+          g_hash_table_add (indexed, g_strdup (checksum));
+        }
+    }
+
+  if (!_ostree_repo_prune_checksum_dir (self, _OSTREE_BLOCK_INDEX_DIR, indexed,
+                                        cancellable, error))
+    return FALSE;
+
+  if (!_ostree_repo_flush_size_index (self, cancellable, error))
+    return FALSE;
+
+  g_debug ("block index: %u objects, %u updated", g_hash_table_size (indexed), n_written);
+  return TRUE;
+}
@@ -124,14 +124,27 @@ write_regular_file_content (OstreeRepo            *self,
   int fd;
   int res;
 
-  if (g_output_stream_splice (output, input, 0,
-                              cancellable, error) < 0)
-    goto out;
+  fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)output);
 
-  if (!g_output_stream_flush (output, cancellable, error))
-    goto out;
+  /* Content from bare repos is a plain file, which we can reflink or at
+   * least copy in the kernel.
+   */
+  if (G_IS_FILE_DESCRIPTOR_BASED (input))
+    {
+      if (!ot_regfile_copy_bytes (g_file_descriptor_based_get_fd ((GFileDescriptorBased*)input), fd,
+                                  g_file_info_get_size (file_info),
+                                  cancellable, error))
+        goto out;
+    }
+  else
+    {
+      if (g_output_stream_splice (output, input, 0,
+                                  cancellable, error) < 0)
+        goto out;
 
-  fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)output);
+      if (!g_output_stream_flush (output, cancellable, error))
+        goto out;
+    }
 
   if (mode != OSTREE_REPO_CHECKOUT_MODE_USER)
     {
@@ -459,6 +472,13 @@ checkout_one_file_at (OstreeRepo                        *repo,
                                                && options->mode == OSTREE_REPO_CHECKOUT_MODE_USER
                                                && current_can_cache);
 
+          /* With prefer_reflinks, copy (reflinking where the filesystem
+           * supports it) rather than hardlink, so the checkout shares no
+           * inodes with the repo and can be safely modified.
+           */
+          if (is_bare && options->prefer_reflinks)
+            break;
+
           /* But only under these conditions */
           if (is_bare || is_archive_z2_with_cache)
             {
@@ -907,6 +927,7 @@ ostree_repo_checkout_at (OstreeRepo                        *self,
   g_autoptr(GFile) target_dir = NULL;
   g_autoptr(GFileInfo) target_info = NULL;
   OstreeRepoCheckoutAtOptions default_options = { 0, };
+  OtCopyStats stats_before, stats_after;
 
   if (!options)
     {
@@ -931,6 +952,8 @@ ostree_repo_checkout_at (OstreeRepo                        *self,
   if (!target_info)
     goto out;
 
+  ot_get_copy_stats (&stats_before);
+
   if (!checkout_tree_at (self, options,
                          destination_dfd,
                          destination_path,
@@ -938,6 +961,13 @@ ostree_repo_checkout_at (OstreeRepo                        *self,
                          cancellable, error))
     goto out;
 
+  ot_get_copy_stats (&stats_after);
+  g_debug ("Checkout of %s: %" G_GUINT64_FORMAT " bytes reflinked, %" G_GUINT64_FORMAT
+           " copied in kernel, %" G_GUINT64_FORMAT " copied",
+           commit, stats_after.bytes_reflinked - stats_before.bytes_reflinked,
+           stats_after.bytes_copied_in_kernel - stats_before.bytes_copied_in_kernel,
+           stats_after.bytes_copied - stats_before.bytes_copied);
+
   ret = TRUE;
  out:
   return ret;
@@ -0,0 +1,700 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2017 The OSTree Authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+#include "otutil.h"
+
+/*
+ * The commit index caches, for every commit object in the repository
+ * (not its parents), the commit's parent, timestamp and root dirtree,
+ * so that commits can be found by checksum prefix and listed without
+ * reading the objects directories or loading each commit.
+ *
+ * On disk it is:
+ *
+ *   8 bytes   - magic, "OSTCIDX1"
+ *   8 bytes   - number of records, big endian
+ *   256 * 16  - for each objects/XX directory, the mtime (seconds and
+ *               nanoseconds, big endian) its records were taken at;
+ *               nanoseconds of G_MAXUINT64 means unknown
+ *   n * 104   - records, sorted by checksum:
+ *                 32 bytes - commit checksum
+ *                 32 bytes - parent checksum, zero if none
+ *                 32 bytes - root dirtree checksum
+ *                 8 bytes  - timestamp, big endian
+ *
+ * The directory mtimes make the index self-validating: records for a
+ * directory which has changed since are rebuilt when it is queried, so
+ * commits written or deleted by anything which doesn't maintain the
+ * index are still found.  A directory modified within
+ * COMMIT_INDEX_RACY_SECS of being scanned is stored with an unknown
+ * mtime, since a later change in the same timestamp tick would go
+ * unnoticed.
+ *
+ * The index is only saved under _OSTREE_COMMIT_INDEX_LOCK: by
+ * ostree_repo_commit_transaction(), which adds the commits it moved
+ * into place, by prune, which rescans everything, and by queries,
+ * which merge in the directories they had to rescan if the lock is
+ * free.  Each query loads it afresh, so it is never older than what
+ * another process last saved.
+ */
+#define COMMIT_INDEX_MAGIC "OSTCIDX1"
+#define COMMIT_INDEX_N_DIRS 256
+#define COMMIT_INDEX_HEADER_LEN (16 + COMMIT_INDEX_N_DIRS * 16)
+#define COMMIT_INDEX_RECORD_LEN 104
+#define COMMIT_INDEX_RACY_SECS 2
+
+typedef struct {
+  guint8 checksum[OSTREE_SHA256_DIGEST_LEN];
+  guint8 parent[OSTREE_SHA256_DIGEST_LEN];
+  guint8 root_tree[OSTREE_SHA256_DIGEST_LEN];
+  guint64 timestamp;
+} CommitIndexRecord;
+
+typedef struct {
+  guint64 sec;
+  guint64 nsec;
+} CommitIndexMtime;
+
+#define MTIME_UNKNOWN_NSEC G_MAXUINT64
+
+typedef struct {
+  GArray *records; /* CommitIndexRecord, sorted by checksum */
+  CommitIndexMtime dir_mtimes[COMMIT_INDEX_N_DIRS];
+} CommitIndex;
+
+static const guint8 zero_checksum[OSTREE_SHA256_DIGEST_LEN];
+
+static void
+commit_index_free (CommitIndex *index)
+{
+  g_array_unref (index->records);
+  g_free (index);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (CommitIndex, commit_index_free)
+
+static CommitIndex *
+commit_index_new (void)
+{
+  CommitIndex *index = g_new0 (CommitIndex, 1);
+  guint i;
+
+  index->records = g_array_new (FALSE, FALSE, sizeof (CommitIndexRecord));
+  for (i = 0; i < COMMIT_INDEX_N_DIRS; i++)
+    index->dir_mtimes[i].nsec = MTIME_UNKNOWN_NSEC;
+
+  return index;
+}
+
+static int
+compare_records (gconstpointer a,
+                 gconstpointer b)
+{
+  return memcmp (((CommitIndexRecord*)a)->checksum,
+                 ((CommitIndexRecord*)b)->checksum,
+                 OSTREE_SHA256_DIGEST_LEN);
+}
+
+/* Find the range of records whose checksum starts with byte @c */
+static void
+prefix_range (CommitIndex *index,
+              guint              c,
+              guint             *out_start,
+              guint             *out_end)
+{
+  guint lo = 0, hi = index->records->len;
+
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+      if (g_array_index (index->records, CommitIndexRecord, mid).checksum[0] < c)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  *out_start = lo;
+
+  hi = index->records->len;
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+      if (g_array_index (index->records, CommitIndexRecord, mid).checksum[0] <= c)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  *out_end = lo;
+}
+
+static CommitIndexRecord *
+lookup_record (CommitIndex *index,
+               const guint8      *csum)
+{
+  guint lo = 0, hi = index->records->len;
+
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+      CommitIndexRecord *rec = &g_array_index (index->records, CommitIndexRecord, mid);
+      int cmp = memcmp (rec->checksum, csum, OSTREE_SHA256_DIGEST_LEN);
+
+      if (cmp == 0)
+        return rec;
+      else if (cmp < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return NULL;
+}
+
+static gboolean
+load_record (OstreeRepo        *self,
+             const char        *checksum,
+             CommitIndexRecord *out_rec,
+             GError           **error)
+{
+  g_autoptr(GVariant) commit = NULL;
+  g_autoptr(GVariant) root_tree = NULL;
+  g_autofree char *parent = NULL;
+  const guchar *root_tree_csum;
+
+  if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_COMMIT, checksum,
+                                 &commit, error))
+    return FALSE;
+
+  memset (out_rec, 0, sizeof (*out_rec));
+  ostree_checksum_inplace_to_bytes (checksum, out_rec->checksum);
+
+  parent = ostree_commit_get_parent (commit);
+  if (parent)
+    ostree_checksum_inplace_to_bytes (parent, out_rec->parent);
+
+  root_tree = g_variant_get_child_value (commit, 6);
+  root_tree_csum = ostree_checksum_bytes_peek_validate (root_tree, error);
+  if (!root_tree_csum)
+    return FALSE;
+  memcpy (out_rec->root_tree, root_tree_csum, OSTREE_SHA256_DIGEST_LEN);
+
+  out_rec->timestamp = ostree_commit_get_timestamp (commit);
+  return TRUE;
+}
+
+/* Insert or replace a record, keeping the array sorted */
+static void
+insert_record (CommitIndex             *index,
+               const CommitIndexRecord *rec)
+{
+  guint lo = 0, hi = index->records->len;
+
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+      int cmp = memcmp (g_array_index (index->records, CommitIndexRecord, mid).checksum,
+                        rec->checksum, OSTREE_SHA256_DIGEST_LEN);
+      if (cmp == 0)
+        {
+          g_array_index (index->records, CommitIndexRecord, mid) = *rec;
+          return;
+        }
+      else if (cmp < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  g_array_insert_val (index->records, lo, *rec);
+}
+
+static gboolean
+get_dir_mtime (OstreeRepo        *self,
+               guint              c,
+               CommitIndexMtime  *out_mtime,
+               GError           **error)
+{
+  char name[3];
+  struct stat stbuf;
+
+  g_snprintf (name, sizeof (name), "%02x", c);
+  if (fstatat (self->objects_dir_fd, name, &stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+    {
+      if (errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+      /* Stands for a missing directory */
+      out_mtime->sec = 0;
+      out_mtime->nsec = 0;
+      return TRUE;
+    }
+
+  out_mtime->sec = stbuf.st_mtim.tv_sec;
+  out_mtime->nsec = stbuf.st_mtim.tv_nsec;
+  return TRUE;
+}
+
+/* Read the index from disk; an empty one if it is missing or in an
+ * unknown format.
+ */
+static gboolean
+load_index (OstreeRepo    *self,
+            CommitIndex  **out_index,
+            GCancellable  *cancellable,
+            GError       **error)
+{
+  glnx_fd_close int fd = -1;
+  g_autoptr(GBytes) contents = NULL;
+  g_autoptr(CommitIndex) index = commit_index_new ();
+  const guint8 *buf;
+  gsize len;
+  guint64 n_records;
+  guint i;
+
+  if (!ot_openat_ignore_enoent (self->repo_dir_fd, _OSTREE_COMMIT_INDEX_PATH, &fd, error))
+    return FALSE;
+
+  if (fd == -1)
+    goto done;
+
+  contents = glnx_fd_readall_bytes (fd, cancellable, error);
+  if (!contents)
+    return FALSE;
+
+  buf = g_bytes_get_data (contents, &len);
+  if (len < COMMIT_INDEX_HEADER_LEN || memcmp (buf, COMMIT_INDEX_MAGIC, 8) != 0)
+    goto done;  /* Unknown format; start over */
+  memcpy (&n_records, buf + 8, sizeof (n_records));
+  n_records = GUINT64_FROM_BE (n_records);
+  if (len != COMMIT_INDEX_HEADER_LEN + n_records * COMMIT_INDEX_RECORD_LEN)
+    goto done;
+
+  for (i = 0; i < COMMIT_INDEX_N_DIRS; i++)
+    {
+      const guint8 *p = buf + 16 + i * 16;
+      guint64 sec, nsec;
+
+      memcpy (&sec, p, sizeof (sec));
+      memcpy (&nsec, p + 8, sizeof (nsec));
+      index->dir_mtimes[i].sec = GUINT64_FROM_BE (sec);
+      index->dir_mtimes[i].nsec = GUINT64_FROM_BE (nsec);
+    }
+
+  g_array_set_size (index->records, n_records);
+  for (i = 0; i < n_records; i++)
+    {
+      const guint8 *p = buf + COMMIT_INDEX_HEADER_LEN + i * COMMIT_INDEX_RECORD_LEN;
+      CommitIndexRecord *rec = &g_array_index (index->records, CommitIndexRecord, i);
+      guint64 timestamp;
+
+      memcpy (rec->checksum, p, OSTREE_SHA256_DIGEST_LEN);
+      memcpy (rec->parent, p + 32, OSTREE_SHA256_DIGEST_LEN);
+      memcpy (rec->root_tree, p + 64, OSTREE_SHA256_DIGEST_LEN);
+      memcpy (&timestamp, p + 96, sizeof (timestamp));
+      rec->timestamp = GUINT64_FROM_BE (timestamp);
+    }
+
+ done:
+  *out_index = g_steal_pointer (&index);
+  return TRUE;
+}
+
+/* Must hold _OSTREE_COMMIT_INDEX_LOCK */
+static gboolean
+save_index (OstreeRepo    *self,
+            CommitIndex   *index,
+            GCancellable  *cancellable,
+            GError       **error)
+{
+  g_autofree guint8 *buf = NULL;
+  gsize len;
+  guint64 n_records_be;
+  guint i;
+
+  len = COMMIT_INDEX_HEADER_LEN + index->records->len * COMMIT_INDEX_RECORD_LEN;
+  buf = g_malloc0 (len);
+
+  memcpy (buf, COMMIT_INDEX_MAGIC, 8);
+  n_records_be = GUINT64_TO_BE ((guint64) index->records->len);
+  memcpy (buf + 8, &n_records_be, sizeof (n_records_be));
+  for (i = 0; i < COMMIT_INDEX_N_DIRS; i++)
+    {
+      guint64 sec = GUINT64_TO_BE (index->dir_mtimes[i].sec);
+      guint64 nsec = GUINT64_TO_BE (index->dir_mtimes[i].nsec);
+
+      memcpy (buf + 16 + i * 16, &sec, sizeof (sec));
+      memcpy (buf + 16 + i * 16 + 8, &nsec, sizeof (nsec));
+    }
+  for (i = 0; i < index->records->len; i++)
+    {
+      guint8 *p = buf + COMMIT_INDEX_HEADER_LEN + i * COMMIT_INDEX_RECORD_LEN;
+      CommitIndexRecord *rec = &g_array_index (index->records, CommitIndexRecord, i);
+      guint64 timestamp = GUINT64_TO_BE (rec->timestamp);
+
+      memcpy (p, rec->checksum, OSTREE_SHA256_DIGEST_LEN);
+      memcpy (p + 32, rec->parent, OSTREE_SHA256_DIGEST_LEN);
+      memcpy (p + 64, rec->root_tree, OSTREE_SHA256_DIGEST_LEN);
+      memcpy (p + 96, &timestamp, sizeof (timestamp));
+    }
+
+  return glnx_file_replace_contents_at (self->repo_dir_fd, _OSTREE_COMMIT_INDEX_PATH,
+                                        buf, len, GLNX_FILE_REPLACE_NODATASYNC,
+                                        cancellable, error);
+}
+
+static gboolean
+lock_index (OstreeRepo    *self,
+            int            operation,
+            GLnxLockFile  *lock,
+            GCancellable  *cancellable,
+            GError       **error)
+{
+  if (!glnx_shutil_mkdir_p_at (self->repo_dir_fd, "state", 0777, cancellable, error))
+    return FALSE;
+
+  return glnx_make_lock_file (self->repo_dir_fd, _OSTREE_COMMIT_INDEX_LOCK,
+                              operation, lock, error);
+}
+
+static gboolean
+mtime_equal (const CommitIndexMtime *a,
+             const CommitIndexMtime *b)
+{
+  return a->sec == b->sec && a->nsec == b->nsec;
+}
+
+/* Bring the records for objects/XX up to date if it has changed */
+static gboolean
+refresh_dir (OstreeRepo    *self,
+             CommitIndex   *index,
+             guint          c,
+             GCancellable  *cancellable,
+             GError       **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  g_autoptr(GArray) new_records = NULL;
+  CommitIndexMtime mtime;
+  char prefix[3];
+  guint start, end;
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+
+  /* Stat before reading, so a change while we read is seen next time */
+  if (!get_dir_mtime (self, c, &mtime, error))
+    return FALSE;
+
+  if (mtime_equal (&mtime, &index->dir_mtimes[c]))
+    return TRUE;
+
+  new_records = g_array_new (FALSE, FALSE, sizeof (CommitIndexRecord));
+  g_snprintf (prefix, sizeof (prefix), "%02x", c);
+
+  if (mtime.sec != 0 || mtime.nsec != 0)
+    {
+      if (!glnx_dirfd_iterator_init_at (self->objects_dir_fd, prefix, FALSE,
+                                        &dfd_iter, error))
+        return FALSE;
+
+      while (TRUE)
+        {
+          struct dirent *dent;
+          const char *dot;
+          char checksum[OSTREE_SHA256_STRING_LEN+1];
+          guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+          CommitIndexRecord *existing;
+          CommitIndexRecord rec;
+
+          if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+            return FALSE;
+          if (dent == NULL)
+            break;
+
+          dot = strrchr (dent->d_name, '.');
+          if (!dot || (dot - dent->d_name) != 62 || strcmp (dot, ".commit") != 0)
+            continue;
+
+          memcpy (checksum, prefix, 2);
+          memcpy (checksum + 2, dent->d_name, 62);
+          checksum[OSTREE_SHA256_STRING_LEN] = '\0';
+          if (!ostree_validate_checksum_string (checksum, NULL))
+            continue;
+
+          ostree_checksum_inplace_to_bytes (checksum, csum);
+          existing = lookup_record (index, csum);
+          if (existing)
+            rec = *existing;
+          else if (!load_record (self, checksum, &rec, error))
+            return FALSE;
+
+          g_array_append_val (new_records, rec);
+        }
+    }
+
+  g_array_sort (new_records, compare_records);
+
+  prefix_range (index, c, &start, &end);
+  if (end > start)
+    g_array_remove_range (index->records, start, end - start);
+  if (new_records->len > 0)
+    g_array_insert_vals (index->records, start, new_records->data, new_records->len);
+
+  index->dir_mtimes[c] = mtime;
+  if ((mtime.sec != 0 || mtime.nsec != 0) &&
+      (gint64) mtime.sec + COMMIT_INDEX_RACY_SECS >= now)
+    index->dir_mtimes[c].nsec = MTIME_UNKNOWN_NSEC;
+  return TRUE;
+}
+
+/* Merge the directories a query rescanned into the saved index, so the
+ * next query doesn't have to rescan them too.  @loaded_mtimes are the
+ * directory mtimes @index was loaded with.  A directory is only taken
+ * over if the saved index still has the mtime we started from, so
+ * anything saved meanwhile by another process wins.  This is only an
+ * optimization: it is skipped if the lock is held or the repository
+ * isn't writable.
+ */
+static void
+save_refreshed (OstreeRepo             *self,
+                CommitIndex            *index,
+                const CommitIndexMtime *loaded_mtimes,
+                GCancellable           *cancellable)
+{
+  g_auto(GLnxLockFile) lock = GLNX_LOCK_FILE_INIT;
+  g_autoptr(CommitIndex) saved = NULL;
+  g_autoptr(GError) local_error = NULL;
+  gboolean changed = FALSE;
+  guint c;
+
+  for (c = 0; c < COMMIT_INDEX_N_DIRS; c++)
+    {
+      if (!mtime_equal (&index->dir_mtimes[c], &loaded_mtimes[c]))
+        break;
+    }
+  if (c == COMMIT_INDEX_N_DIRS || !self->writable)
+    return;
+
+  if (!lock_index (self, LOCK_EX | LOCK_NB, &lock, cancellable, &local_error))
+    return;
+
+  if (!load_index (self, &saved, cancellable, &local_error))
+    return;
+
+  for (c = 0; c < COMMIT_INDEX_N_DIRS; c++)
+    {
+      guint start, end, new_start, new_end;
+
+      if (mtime_equal (&index->dir_mtimes[c], &loaded_mtimes[c]) ||
+          !mtime_equal (&saved->dir_mtimes[c], &loaded_mtimes[c]))
+        continue;
+
+      prefix_range (saved, c, &start, &end);
+      if (end > start)
+        g_array_remove_range (saved->records, start, end - start);
+      prefix_range (index, c, &new_start, &new_end);
+      if (new_end > new_start)
+        g_array_insert_vals (saved->records, start,
+                             &g_array_index (index->records, CommitIndexRecord, new_start),
+                             new_end - new_start);
+      saved->dir_mtimes[c] = index->dir_mtimes[c];
+      changed = TRUE;
+    }
+
+  if (changed)
+    (void) save_index (self, saved, cancellable, NULL);
+}
+
+/*
+ * _ostree_repo_commit_index_add:
+ * @commits: Checksums of the commits which were moved into place
+ *
+ * Add @commits to the saved index.  The mtimes of the directories they
+ * went into are left alone, since something else may have changed them
+ * too; the next query rescans those and saves the result.
+ */
+gboolean
+_ostree_repo_commit_index_add (OstreeRepo    *self,
+                               GPtrArray     *commits,
+                               GCancellable  *cancellable,
+                               GError       **error)
+{
+  g_auto(GLnxLockFile) lock = GLNX_LOCK_FILE_INIT;
+  g_autoptr(CommitIndex) index = NULL;
+  guint i;
+
+  if (commits->len == 0)
+    return TRUE;
+
+  if (!lock_index (self, LOCK_EX, &lock, cancellable, error))
+    return FALSE;
+
+  if (!load_index (self, &index, cancellable, error))
+    return FALSE;
+
+  for (i = 0; i < commits->len; i++)
+    {
+      CommitIndexRecord rec;
+
+      if (!load_record (self, commits->pdata[i], &rec, error))
+        return FALSE;
+      insert_record (index, &rec);
+    }
+
+  return save_index (self, index, cancellable, error);
+}
+
+/*
+ * _ostree_repo_commit_index_refresh:
+ *
+ * Rescan every changed objects directory and save the result; used by
+ * prune once it has deleted commits.
+ */
+gboolean
+_ostree_repo_commit_index_refresh (OstreeRepo    *self,
+                                   GCancellable  *cancellable,
+                                   GError       **error)
+{
+  g_auto(GLnxLockFile) lock = GLNX_LOCK_FILE_INIT;
+  g_autoptr(CommitIndex) index = NULL;
+  guint c;
+
+  if (!lock_index (self, LOCK_EX, &lock, cancellable, error))
+    return FALSE;
+
+  if (!load_index (self, &index, cancellable, error))
+    return FALSE;
+
+  for (c = 0; c < COMMIT_INDEX_N_DIRS; c++)
+    {
+      if (!refresh_dir (self, index, c, cancellable, error))
+        return FALSE;
+    }
+
+  return save_index (self, index, cancellable, error);
+}
+
+/*
+ * _ostree_repo_commit_index_lookup_prefix:
+ * @prefix: Lowercase hexadecimal checksum prefix
+ * @out_checksums: (out) (element-type utf8): Matching commits
+ *
+ * Find the commits in @self (not its parents) whose checksum starts
+ * with @prefix.  Only the objects directories which could contain
+ * matches are checked for changes.
+ */
+gboolean
+_ostree_repo_commit_index_lookup_prefix (OstreeRepo    *self,
+                                         const char    *prefix,
+                                         GPtrArray    **out_checksums,
+                                         GCancellable  *cancellable,
+                                         GError       **error)
+{
+  g_autoptr(GPtrArray) ret_checksums = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(CommitIndex) index = NULL;
+  CommitIndexMtime loaded_mtimes[COMMIT_INDEX_N_DIRS];
+  gsize prefix_len = strlen (prefix);
+  guint c;
+
+  if (!load_index (self, &index, cancellable, error))
+    return FALSE;
+  memcpy (loaded_mtimes, index->dir_mtimes, sizeof (loaded_mtimes));
+
+  for (c = 0; c < COMMIT_INDEX_N_DIRS; c++)
+    {
+      char dirname[3];
+      guint start, end, i;
+
+      g_snprintf (dirname, sizeof (dirname), "%02x", c);
+      if (strncmp (dirname, prefix, MIN (prefix_len, 2)) != 0)
+        continue;
+
+      if (!refresh_dir (self, index, c, cancellable, error))
+        return FALSE;
+
+      prefix_range (index, c, &start, &end);
+      for (i = start; i < end; i++)
+        {
+          CommitIndexRecord *rec = &g_array_index (index->records, CommitIndexRecord, i);
+          char checksum[OSTREE_SHA256_STRING_LEN+1];
+
+          ostree_checksum_inplace_from_bytes (rec->checksum, checksum);
+          if (g_str_has_prefix (checksum, prefix))
+            g_ptr_array_add (ret_checksums, g_strdup (checksum));
+        }
+    }
+
+  save_refreshed (self, index, loaded_mtimes, cancellable);
+
+  *out_checksums = g_steal_pointer (&ret_checksums);
+  return TRUE;
+}
+
+/*
+ * _ostree_repo_get_commit_index:
+ * @out_index: (out): Variant of type a(ssst): checksum, parent (empty
+ *   if none), root dirtree checksum and timestamp of each commit
+ *
+ * List all commits in @self (not its parents) from the commit index,
+ * sorted by checksum.
+ */
+gboolean
+_ostree_repo_get_commit_index (OstreeRepo    *self,
+                               GVariant     **out_index,
+                               GCancellable  *cancellable,
+                               GError       **error)
+{
+  g_auto(GVariantBuilder) builder = OT_VARIANT_BUILDER_INITIALIZER;
+  g_autoptr(CommitIndex) index = NULL;
+  CommitIndexMtime loaded_mtimes[COMMIT_INDEX_N_DIRS];
+  guint c, i;
+
+  if (!load_index (self, &index, cancellable, error))
+    return FALSE;
+  memcpy (loaded_mtimes, index->dir_mtimes, sizeof (loaded_mtimes));
+
+  for (c = 0; c < COMMIT_INDEX_N_DIRS; c++)
+    {
+      if (!refresh_dir (self, index, c, cancellable, error))
+        return FALSE;
+    }
+
+  save_refreshed (self, index, loaded_mtimes, cancellable);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssst)"));
+  for (i = 0; i < index->records->len; i++)
+    {
+      CommitIndexRecord *rec = &g_array_index (index->records, CommitIndexRecord, i);
+      char checksum[OSTREE_SHA256_STRING_LEN+1];
+      char parent[OSTREE_SHA256_STRING_LEN+1] = "";
+      char root_tree[OSTREE_SHA256_STRING_LEN+1];
+
+      ostree_checksum_inplace_from_bytes (rec->checksum, checksum);
+      if (memcmp (rec->parent, zero_checksum, OSTREE_SHA256_DIGEST_LEN) != 0)
+        ostree_checksum_inplace_from_bytes (rec->parent, parent);
+      ostree_checksum_inplace_from_bytes (rec->root_tree, root_tree);
+      g_variant_builder_add (&builder, "(ssst)", checksum, parent, root_tree, rec->timestamp);
+    }
+
+  *out_index = g_variant_ref_sink (g_variant_builder_end (&builder));
+  return TRUE;
+}
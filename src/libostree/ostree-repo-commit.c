@@ -31,7 +31,6 @@
 #include "ostree-core-private.h"
 #include "ostree-repo-private.h"
 #include "ostree-repo-file-enumerator.h"
-#include "ostree-checksum-input-stream.h"
 #include "ostree-mutable-tree.h"
 #include "ostree-varint.h"
 #include <sys/xattr.h>
@@ -110,6 +109,84 @@ write_file_metadata_to_xattr (int fd,
   return TRUE;
 }
 
+/* Apply the core.commit-sync policy to an object about to be staged.
+ * Whatever the policy, ostree_repo_commit_transaction() does a final
+ * syncfs(); the per-object work just means there is little left for it
+ * to write back by then, and it happens in the writer threads while a
+ * pull is still downloading.
+ */
+static gboolean
+sync_staged_object (OstreeRepo   *self,
+                    int           temp_dfd,
+                    int           fd,
+                    const char   *temp_filename,
+                    GError      **error)
+{
+  glnx_fd_close int owned_fd = -1;
+  struct stat stbuf;
+
+  if (self->disable_fsync || self->commit_sync == OSTREE_REPO_COMMIT_SYNC_SYNCFS)
+    return TRUE;
+
+  if (fd == -1)
+    {
+      if (fstatat (temp_dfd, temp_filename, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+      /* Nothing to flush for a symlink beyond the final syncfs */
+      if (!S_ISREG (stbuf.st_mode))
+        return TRUE;
+      if (self->commit_sync == OSTREE_REPO_COMMIT_SYNC_FDATASYNC)
+        {
+          owned_fd = openat (temp_dfd, temp_filename, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+          if (owned_fd == -1)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+          fd = owned_fd;
+        }
+    }
+  else if (fstat (fd, &stbuf) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  if (self->commit_sync == OSTREE_REPO_COMMIT_SYNC_FDATASYNC)
+    {
+      if (fdatasync (fd) == -1)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+    }
+  else
+    {
+      gboolean do_sync = FALSE;
+
+      /* Whichever writer crosses the threshold flushes the batch */
+      g_mutex_lock (&self->txn_sync_lock);
+      self->txn_unsynced_bytes += stbuf.st_size;
+      if (self->txn_unsynced_bytes >= self->commit_sync_batch_bytes)
+        {
+          self->txn_unsynced_bytes = 0;
+          do_sync = TRUE;
+        }
+      g_mutex_unlock (&self->txn_sync_lock);
+
+      if (do_sync && syncfs (self->tmp_dir_fd) < 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
 gboolean
 _ostree_repo_commit_loose_final (OstreeRepo        *self,
                                  const char        *checksum,
@@ -127,7 +204,11 @@ _ostree_repo_commit_loose_final (OstreeRepo        *self,
   _ostree_loose_path (tmpbuf, checksum, objtype, self->mode);
 
   if (self->in_transaction)
-    dest_dfd = self->commit_stagedir_fd;
+    {
+      if (!sync_staged_object (self, temp_dfd, fd, temp_filename, error))
+        goto out;
+      dest_dfd = self->commit_stagedir_fd;
+    }
   else
     dest_dfd = self->objects_dir_fd;
 
@@ -321,65 +402,27 @@ commit_loose_object_trusted (OstreeRepo        *self,
   return ret;
 }
 
-typedef struct
-{
-  OstreeObjectType objtype;
-  guint64 unpacked;
-  guint64 archived;
-} OstreeContentSizeCacheEntry;
-
-static OstreeContentSizeCacheEntry *
-content_size_cache_entry_new (OstreeObjectType objtype,
-                              guint64          unpacked,
-                              guint64          archived)
-{
-  OstreeContentSizeCacheEntry *entry = g_slice_new0 (OstreeContentSizeCacheEntry);
-
-  entry->objtype = objtype;
-  entry->unpacked = unpacked;
-  entry->archived = archived;
-
-  return entry;
-}
-
-static void
-content_size_cache_entry_free (gpointer entry)
-{
-  if (entry)
-    g_slice_free (OstreeContentSizeCacheEntry, entry);
-}
-
-static void
-repo_store_size_entry (OstreeRepo       *self,
-                       OstreeObjectType  objtype,
-                       const gchar      *checksum,
-                       guint64           unpacked,
-                       guint64           archived)
-{
-  if (G_UNLIKELY (self->object_sizes == NULL))
-    self->object_sizes = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                g_free, content_size_cache_entry_free);
-
-  g_hash_table_replace (self->object_sizes,
-                        g_strdup (checksum),
-                        content_size_cache_entry_new (objtype, unpacked, archived));
-}
-
 static int
-compare_ascii_checksums_for_sorting (gconstpointer  a_pp,
-                                     gconstpointer  b_pp)
+compare_object_names_for_sorting (gconstpointer  a_pp,
+                                  gconstpointer  b_pp)
 {
-  char *a = *((char**)a_pp);
-  char *b = *((char**)b_pp);
+  const char *a, *b;
+  OstreeObjectType a_objtype, b_objtype;
+
+  ostree_object_name_deserialize (*((GVariant**)a_pp), &a, &a_objtype);
+  ostree_object_name_deserialize (*((GVariant**)b_pp), &b, &b_objtype);
 
   return strcmp (a, b);
 }
 
 /*
  * Create sizes metadata GVariant and add it to the metadata variant given.
+ * Every object reachable from @root is included; sizes for objects which
+ * weren't written in this transaction come from the object size index.
  */
 static gboolean
 add_size_index_to_metadata (OstreeRepo        *self,
+                            OstreeRepoFile    *root,
                             GVariant          *original_metadata,
                             GVariant         **out_metadata,
                             GCancellable      *cancellable,
@@ -391,41 +434,53 @@ add_size_index_to_metadata (OstreeRepo        *self,
   /* original_metadata may be NULL */
   builder = ot_util_variant_builder_from_variant (original_metadata, G_VARIANT_TYPE ("a{sv}"));
 
-  if (self->object_sizes &&
-      g_hash_table_size (self->object_sizes) > 0)
+  if (self->generate_sizes && self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2)
     {
-      GHashTableIter entries = { 0 };
-      gchar *e_checksum = NULL;
-      OstreeContentSizeCacheEntry *e_size = NULL;
+      const char *root_contents = ostree_repo_file_tree_get_contents_checksum (root);
+      const char *root_metadata = ostree_repo_file_tree_get_metadata_checksum (root);
+      g_autoptr(GHashTable) reachable = ostree_repo_traverse_new_reachable ();
+      GHashTableIter hashiter;
+      gpointer key, value;
       GVariantBuilder index_builder;
       guint i;
       g_autoptr(GPtrArray) sorted_keys = NULL;
-      
-      g_hash_table_iter_init (&entries, self->object_sizes);
+
+      g_hash_table_add (reachable, g_variant_ref_sink (ostree_object_name_serialize (root_contents, OSTREE_OBJECT_TYPE_DIR_TREE)));
+      g_hash_table_add (reachable, g_variant_ref_sink (ostree_object_name_serialize (root_metadata, OSTREE_OBJECT_TYPE_DIR_META)));
+      if (!_ostree_repo_traverse_dirtree (self, root_contents, reachable,
+                                          cancellable, error))
+        goto out;
+
       g_variant_builder_init (&index_builder,
                               G_VARIANT_TYPE ("a" _OSTREE_OBJECT_SIZES_ENTRY_SIGNATURE));
 
       /* Sort the checksums so we can bsearch if desired */
       sorted_keys = g_ptr_array_new ();
-      while (g_hash_table_iter_next (&entries,
-                                     (gpointer *) &e_checksum,
-                                     (gpointer *) &e_size))
-        g_ptr_array_add (sorted_keys, e_checksum);
-      g_ptr_array_sort (sorted_keys, compare_ascii_checksums_for_sorting);
+      g_hash_table_iter_init (&hashiter, reachable);
+      while (g_hash_table_iter_next (&hashiter, &key, &value))
+        g_ptr_array_add (sorted_keys, key);
+      g_ptr_array_sort (sorted_keys, compare_object_names_for_sorting);
 
       for (i = 0; i < sorted_keys->len; i++)
         {
           guint8 csum[OSTREE_SHA256_DIGEST_LEN];
-          const char *e_checksum = sorted_keys->pdata[i];
-          GString *buffer = g_string_new (NULL);
+          const char *e_checksum;
+          OstreeObjectType e_objtype;
+          OstreeContentSizeCacheEntry e_size;
+          GString *buffer;
+
+          ostree_object_name_deserialize (sorted_keys->pdata[i], &e_checksum, &e_objtype);
+          if (!_ostree_repo_get_object_size_entry (self, e_objtype, e_checksum, &e_size,
+                                                   cancellable, error))
+            goto out;
 
+          buffer = g_string_new (NULL);
           ostree_checksum_inplace_to_bytes (e_checksum, csum);
           g_string_append_len (buffer, (char*)csum, sizeof (csum));
 
-          e_size = g_hash_table_lookup (self->object_sizes, e_checksum);
-          _ostree_write_varuint64 (buffer, e_size->archived);
-          _ostree_write_varuint64 (buffer, e_size->unpacked);
-          g_string_append_c (buffer, (guchar) e_size->objtype);
+          _ostree_write_varuint64 (buffer, e_size.archived);
+          _ostree_write_varuint64 (buffer, e_size.unpacked);
+          g_string_append_c (buffer, (guchar) e_size.objtype);
 
           g_variant_builder_add (&index_builder, "@ay",
                                  ot_gvariant_new_bytearray ((guint8*)buffer->str, buffer->len));
@@ -439,164 +494,7 @@ add_size_index_to_metadata (OstreeRepo        *self,
   ret = TRUE;
   *out_metadata = g_variant_builder_end (builder);
   g_variant_ref_sink (*out_metadata);
-
-  return ret;
-}
-
-static gboolean
-ostree_repo_commit_unpack_sizes (GVariant                    *entry,
-                                 OstreeContentSizeCacheEntry *sizes,
-                                 char                        *csum)
-{
-  gboolean ret = FALSE;
-  const guchar *buffer;
-  gsize bytes_read = 0;
-  gsize object_size = g_variant_get_size (entry);
-
-  if (object_size <= 32)
-    goto out;
-
-  buffer = g_variant_get_data (entry);
-  if (!buffer)
-    goto out;
-
-  ostree_checksum_inplace_from_bytes (buffer, csum);
-  buffer += 32;
-  object_size -= 32;
-
-  if (!_ostree_read_varuint64 (buffer, object_size, &(sizes->archived), &bytes_read))
-    goto out;
-  buffer += bytes_read;
-  object_size -= bytes_read;
-
-  if (!_ostree_read_varuint64 (buffer, object_size, &(sizes->unpacked), &bytes_read))
-    goto out;
-  buffer += bytes_read;
-  object_size -= bytes_read;
-
-  if (object_size < 1)
-    goto out;
-
-  if (*buffer < OSTREE_OBJECT_TYPE_FILE || *buffer > OSTREE_OBJECT_TYPE_LAST)
-    goto out;
-  sizes->objtype = (OstreeObjectType) *buffer;
-
-  ret = TRUE;
-out:
-  return ret;
-}
-
-/**
- * ostree_repo_get_commit_sizes
- * @self: Self
- * @rev: Commit checksum
- * @new_archived: (out) (optional): number of archived bytes for the commit
- *                missing from the repository, or %NULL
- * @new_unpacked: (out) (optional): number of unpacked bytes for the commit
- *                missing from the repository, or %NULL
- * @new_files: (out) (optional): number of files for the commit missing from
- *             the repository, or %NULL
- * @archived: (out) (optional): number of archived bytes for the commit in the
- *            repository, or %NULL
- * @unpacked: (out) (optional): number of unpacked bytes for the commit in the
- *            repository, or %NULL
- * @files: (out) (optional): number of files for the commit in the repository,
- *         or %NULL
- * @cancellable: a #GCancellable
- * @error: a #GError
- *
- * Reads the size data for the commit stored in the %ostree.sizes key in
- * the commit metadata. If this data is not available, %FALSE is
- * returned and @error is set to %G_IO_ERROR_NOT_FOUND.
- *
- * Returns: %TRUE on success, %FALSE on failure
- */
-gboolean
-ostree_repo_get_commit_sizes (OstreeRepo *self,
-                              const char *rev,
-                              gint64 *new_archived,
-                              gint64 *new_unpacked,
-                              gsize  *new_files,
-                              gint64 *archived,
-                              gint64 *unpacked,
-                              gsize  *files,
-                              GCancellable *cancellable,
-                              GError **error)
-{
-  gboolean ret = FALSE;
-  guint64 n_archived = 0;
-  guint64 n_unpacked = 0;
-  gsize n_files = 0;
-  guint64 t_archived = 0;
-  guint64 t_unpacked = 0;
-  gsize t_files = 0;
-  GVariantIter obj_iter;
-  g_autoptr(GVariant) object = NULL;
-  g_autoptr(GVariant) commit = NULL;
-  g_autoptr(GVariant) metadata = NULL;
-  g_autoptr(GVariant) sizes = NULL;
-
-  if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_COMMIT, rev,
-                                 &commit, error))
-    {
-      g_prefix_error (error, "Failed to read commit: ");
-      goto out;
-    }
-
-  metadata = g_variant_get_child_value (commit, 0);
-
-  sizes = g_variant_lookup_value (metadata, "ostree.sizes", G_VARIANT_TYPE("aay"));
-  if (!sizes)
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
-                   "No metadata key ostree.sizes in commit %s", rev);
-      goto out;
-    }
-
-  g_variant_iter_init (&obj_iter, sizes);
-  while ((object = g_variant_iter_next_value (&obj_iter)))
-    {
-      OstreeContentSizeCacheEntry entry;
-      char csum[65];
-      gboolean exists;
-
-      if (!ostree_repo_commit_unpack_sizes (object, &entry, csum))
-        {
-          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                       "Invalid object size metadata");
-          goto out;
-        }
-      g_variant_unref (object);
-      object = NULL;
-
-      t_archived += entry.archived;
-      t_unpacked += entry.unpacked;
-
-      if (entry.objtype == OSTREE_OBJECT_TYPE_FILE)
-        t_files++;
-
-      if (!ostree_repo_has_object (self, entry.objtype,
-                                   csum, &exists, cancellable, error))
-        goto out;
-
-      /* cache check completed, but file is not in cache */
-      if (!exists)
-        {
-          n_archived += entry.archived;
-          n_unpacked += entry.unpacked;
-          if (entry.objtype == OSTREE_OBJECT_TYPE_FILE)
-            n_files++;
-        }
-    }
-
-  ret = TRUE;
-  if (new_archived) *new_archived = n_archived;
-  if (new_unpacked) *new_unpacked = n_unpacked;
-  if (new_files) *new_files = n_files;
-  if (archived) *archived = t_archived;
-  if (unpacked) *unpacked = t_unpacked;
-  if (files) *files = t_files;
-out:
+ out:
   return ret;
 }
 
@@ -739,6 +637,87 @@ create_regular_tmpfile_linkable_with_content (OstreeRepo *self,
   return TRUE;
 }
 
+static void
+txn_stats_account (OstreeRepo        *self,
+                   OstreeObjectType   objtype,
+                   gboolean           written,
+                   guint64            length)
+{
+  OstreeRepoTransactionStats *stats = &self->txn_stats;
+
+  g_mutex_lock (&self->txn_stats_lock);
+  if (written)
+    {
+      if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+        {
+          stats->metadata_objects_written++;
+        }
+      else
+        {
+          stats->content_objects_written++;
+          stats->content_bytes_written += length;
+        }
+    }
+  if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+    stats->metadata_objects_total++;
+  else
+    stats->content_objects_total++;
+  g_mutex_unlock (&self->txn_stats_lock);
+}
+
+typedef struct {
+  GTask *task;
+  GTaskThreadFunc func;
+} WriteJob;
+
+static void
+write_pool_run (gpointer data,
+                gpointer user_data)
+{
+  WriteJob *job = data;
+
+  job->func (job->task, g_task_get_source_object (job->task),
+             g_task_get_task_data (job->task),
+             g_task_get_cancellable (job->task));
+
+  g_object_unref (job->task);
+  g_free (job);
+}
+
+/* Run @func for @task on the repo's own writer pool, rather than the
+ * default GIO pool shared with everything else in the process.  The
+ * pool is created on first use with core.write-threads threads; if
+ * that fails, @task returns the error.
+ */
+void
+_ostree_repo_write_pool_push (OstreeRepo      *self,
+                              GTask           *task,
+                              GTaskThreadFunc  func)
+{
+  WriteJob *job;
+  GError *local_error = NULL;
+
+  g_mutex_lock (&self->txn_stats_lock);
+  if (!self->write_pool)
+    self->write_pool = g_thread_pool_new (write_pool_run, self,
+                                          MAX (self->n_write_threads, 1), TRUE,
+                                          &local_error);
+  g_mutex_unlock (&self->txn_stats_lock);
+
+  /* Only fails if no thread could be started at all */
+  if (local_error)
+    {
+      g_prefix_error (&local_error, "Starting writer threads: ");
+      g_task_return_error (task, local_error);
+      return;
+    }
+
+  job = g_new0 (WriteJob, 1);
+  job->task = g_object_ref (task);
+  job->func = func;
+  g_thread_pool_push (self->write_pool, job, NULL);
+}
+
 static gboolean
 write_object (OstreeRepo         *self,
               OstreeObjectType    objtype,
@@ -755,12 +734,13 @@ write_object (OstreeRepo         *self,
   OstreeRepoMode repo_mode;
   g_autofree char *temp_filename = NULL;
   g_autofree guchar *ret_csum = NULL;
-  glnx_unref_object OstreeChecksumInputStream *checksum_input = NULL;
+  char actual_checksum_buf[OT_SHA256_STRING_LEN + 1];
+  g_auto(OtChecksum) checksum = { 0, };
+  glnx_unref_object OtChecksumInstream *checksum_input = NULL;
   g_autoptr(GInputStream) file_input = NULL;
   g_autoptr(GFileInfo) file_info = NULL;
   g_autoptr(GVariant) xattrs = NULL;
   gboolean have_obj;
-  GChecksum *checksum = NULL;
   gboolean temp_file_is_regular;
   gboolean temp_file_is_symlink;
   glnx_fd_close int temp_fd = -1;
@@ -790,9 +770,9 @@ write_object (OstreeRepo         *self,
 
   if (out_csum)
     {
-      checksum = g_checksum_new (G_CHECKSUM_SHA256);
+      ot_checksum_init (&checksum);
       if (input)
-        checksum_input = ostree_checksum_input_stream_new (input, checksum);
+        checksum_input = ot_checksum_instream_new (input, &checksum);
     }
 
   if (objtype == OSTREE_OBJECT_TYPE_FILE)
@@ -911,11 +891,12 @@ write_object (OstreeRepo         *self,
       unpacked_size = file_object_length;
     }
 
-  if (!checksum)
+  if (!checksum.initialized)
     actual_checksum = expected_checksum;
   else
     {
-      actual_checksum = g_checksum_get_string (checksum);
+      ot_checksum_get_hexdigest (&checksum, actual_checksum_buf, sizeof (actual_checksum_buf));
+      actual_checksum = actual_checksum_buf;
       if (expected_checksum && strcmp (actual_checksum, expected_checksum) != 0)
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
@@ -938,7 +919,7 @@ write_object (OstreeRepo         *self,
           goto out;
         }
 
-      repo_store_size_entry (self, objtype, actual_checksum, unpacked_size, stbuf.st_size);
+      _ostree_repo_store_size_entry (self, objtype, actual_checksum, unpacked_size, stbuf.st_size);
     }
 
   if (!_ostree_repo_has_loose_object (self, actual_checksum, objtype, &have_obj,
@@ -1007,34 +988,16 @@ write_object (OstreeRepo         *self,
       g_clear_pointer (&temp_filename, g_free);
     }
 
-  g_mutex_lock (&self->txn_stats_lock);
-  if (do_commit)
-    {
-      if (OSTREE_OBJECT_TYPE_IS_META (objtype))
-        {
-          self->txn_stats.metadata_objects_written++;
-        }
-      else
-        {
-          self->txn_stats.content_objects_written++;
-          self->txn_stats.content_bytes_written += file_object_length;
-        }
-    }
-  if (OSTREE_OBJECT_TYPE_IS_META (objtype))
-    self->txn_stats.metadata_objects_total++;
-  else
-    self->txn_stats.content_objects_total++;
-  g_mutex_unlock (&self->txn_stats_lock);
+  txn_stats_account (self, objtype, do_commit, file_object_length);
       
-  if (checksum)
-    ret_csum = ot_csum_from_gchecksum (checksum);
+  if (checksum.initialized)
+    ret_csum = ot_checksum_dup_digest (&checksum);
 
   ret = TRUE;
   ot_transfer_out_value(out_csum, &ret_csum);
  out:
   if (temp_filename)
     (void) unlinkat (self->tmp_dir_fd, temp_filename, 0);
-  g_clear_pointer (&checksum, (GDestroyNotify) g_checksum_free);
   return ret;
 }
 
@@ -1255,6 +1218,7 @@ ostree_repo_prepare_transaction (OstreeRepo     *self,
   g_return_val_if_fail (self->in_transaction == FALSE, FALSE);
 
   memset (&self->txn_stats, 0, sizeof (OstreeRepoTransactionStats));
+  self->txn_unsynced_bytes = 0;
 
   self->in_transaction = TRUE;
 
@@ -1276,6 +1240,7 @@ ostree_repo_prepare_transaction (OstreeRepo     *self,
 
 static gboolean
 rename_pending_loose_objects (OstreeRepo        *self,
+                              GPtrArray         *out_commits,
                               GCancellable      *cancellable,
                               GError           **error)
 {
@@ -1334,6 +1299,11 @@ rename_pending_loose_objects (OstreeRepo        *self,
               glnx_set_error_from_errno (error);
               goto out;
             }
+
+          if (g_str_has_suffix (child_dent->d_name, ".commit"))
+            g_ptr_array_add (out_commits, g_strdup_printf ("%c%c%.*s", dent->d_name[0], dent->d_name[1],
+                                                           (int) (strlen (child_dent->d_name) - strlen (".commit")),
+                                                           child_dent->d_name));
         }
     }
 
@@ -1559,6 +1529,7 @@ ostree_repo_commit_transaction (OstreeRepo                  *self,
                                 GError                     **error)
 {
   gboolean ret = FALSE;
+  g_autoptr(GPtrArray) commits = g_ptr_array_new_with_free_func (g_free);
 
   g_return_val_if_fail (self->in_transaction == TRUE, FALSE);
 
@@ -1581,7 +1552,10 @@ ostree_repo_commit_transaction (OstreeRepo                  *self,
         }
     }
 
-  if (!rename_pending_loose_objects (self, cancellable, error))
+  if (!rename_pending_loose_objects (self, commits, cancellable, error))
+    goto out;
+
+  if (!_ostree_repo_commit_index_add (self, commits, cancellable, error))
     goto out;
 
   if (!cleanup_tmpdir (self, cancellable, error))
@@ -1590,6 +1564,9 @@ ostree_repo_commit_transaction (OstreeRepo                  *self,
   if (self->loose_object_devino_hash)
     g_hash_table_remove_all (self->loose_object_devino_hash);
 
+  if (!_ostree_repo_flush_size_index (self, cancellable, error))
+    goto out;
+
   if (self->txn_refs)
     if (!_ostree_repo_update_refs (self, self->txn_refs, cancellable, error))
       goto out;
@@ -1634,6 +1611,8 @@ ostree_repo_abort_transaction (OstreeRepo     *self,
   if (self->loose_object_devino_hash)
     g_hash_table_remove_all (self->loose_object_devino_hash);
 
+  _ostree_repo_discard_pending_sizes (self);
+
   g_clear_pointer (&self->txn_refs, g_hash_table_destroy);
 
   if (self->commit_stagedir_fd != -1)
@@ -1771,8 +1750,6 @@ typedef struct {
   OstreeObjectType objtype;
   char *expected_checksum;
   GVariant *object;
-  GCancellable *cancellable;
-  GSimpleAsyncResult *result;
 
   guchar *result_csum;
 } WriteMetadataAsyncData;
@@ -1782,8 +1759,6 @@ write_metadata_async_data_free (gpointer user_data)
 {
   WriteMetadataAsyncData *data = user_data;
 
-  g_clear_object (&data->repo);
-  g_clear_object (&data->cancellable);
   g_variant_unref (data->object);
   g_free (data->result_csum);
   g_free (data->expected_checksum);
@@ -1791,19 +1766,21 @@ write_metadata_async_data_free (gpointer user_data)
 }
 
 static void
-write_metadata_thread (GSimpleAsyncResult  *res,
-                       GObject             *object,
+write_metadata_thread (GTask               *task,
+                       gpointer             object,
+                       gpointer             task_data,
                        GCancellable        *cancellable)
 {
   GError *error = NULL;
-  WriteMetadataAsyncData *data;
+  WriteMetadataAsyncData *data = task_data;
 
-  data = g_simple_async_result_get_op_res_gpointer (res);
-  if (!ostree_repo_write_metadata (data->repo, data->objtype, data->expected_checksum,
+  if (!ostree_repo_write_metadata (object, data->objtype, data->expected_checksum,
                                    data->object,
                                    &data->result_csum,
                                    cancellable, &error))
-    g_simple_async_result_take_error (res, error);
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
 }
 
 /**
@@ -1828,23 +1805,18 @@ ostree_repo_write_metadata_async (OstreeRepo               *self,
                                   GAsyncReadyCallback       callback,
                                   gpointer                  user_data)
 {
+  g_autoptr(GTask) task = NULL;
   WriteMetadataAsyncData *asyncdata;
 
   asyncdata = g_new0 (WriteMetadataAsyncData, 1);
-  asyncdata->repo = g_object_ref (self);
   asyncdata->objtype = objtype;
   asyncdata->expected_checksum = g_strdup (expected_checksum);
   asyncdata->object = g_variant_ref (object);
-  asyncdata->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
-
-  asyncdata->result = g_simple_async_result_new ((GObject*) self,
-                                                 callback, user_data,
-                                                 ostree_repo_write_metadata_async);
 
-  g_simple_async_result_set_op_res_gpointer (asyncdata->result, asyncdata,
-                                             write_metadata_async_data_free);
-  g_simple_async_result_run_in_thread (asyncdata->result, write_metadata_thread, G_PRIORITY_DEFAULT, cancellable);
-  g_object_unref (asyncdata->result);
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, ostree_repo_write_metadata_async);
+  g_task_set_task_data (task, asyncdata, write_metadata_async_data_free);
+  _ostree_repo_write_pool_push (self, task, write_metadata_thread);
 }
 
 gboolean
@@ -1853,15 +1825,15 @@ ostree_repo_write_metadata_finish (OstreeRepo        *self,
                                    guchar           **out_csum,
                                    GError           **error)
 {
-  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (result);
   WriteMetadataAsyncData *data;
 
-  g_warn_if_fail (g_simple_async_result_get_source_tag (simple) == ostree_repo_write_metadata_async);
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  g_warn_if_fail (g_task_get_source_tag (G_TASK (result)) == ostree_repo_write_metadata_async);
 
-  if (g_simple_async_result_propagate_error (simple, error))
+  if (!g_task_propagate_boolean (G_TASK (result), error))
     return FALSE;
 
-  data = g_simple_async_result_get_op_res_gpointer (simple);
+  data = g_task_get_task_data (G_TASK (result));
   /* Transfer ownership */
   *out_csum = data->result_csum;
   data->result_csum = NULL;
@@ -1944,12 +1916,9 @@ ostree_repo_write_content (OstreeRepo       *self,
 }
 
 typedef struct {
-  OstreeRepo *repo;
   char *expected_checksum;
   GInputStream *object;
   guint64 file_object_length;
-  GCancellable *cancellable;
-  GSimpleAsyncResult *result;
 
   guchar *result_csum;
 } WriteContentAsyncData;
@@ -1959,8 +1928,6 @@ write_content_async_data_free (gpointer user_data)
 {
   WriteContentAsyncData *data = user_data;
 
-  g_clear_object (&data->repo);
-  g_clear_object (&data->cancellable);
   g_clear_object (&data->object);
   g_free (data->result_csum);
   g_free (data->expected_checksum);
@@ -1968,19 +1935,21 @@ write_content_async_data_free (gpointer user_data)
 }
 
 static void
-write_content_thread (GSimpleAsyncResult  *res,
-                      GObject             *object,
+write_content_thread (GTask               *task,
+                      gpointer             object,
+                      gpointer             task_data,
                       GCancellable        *cancellable)
 {
   GError *error = NULL;
-  WriteContentAsyncData *data;
+  WriteContentAsyncData *data = task_data;
 
-  data = g_simple_async_result_get_op_res_gpointer (res);
-  if (!ostree_repo_write_content (data->repo, data->expected_checksum,
+  if (!ostree_repo_write_content (object, data->expected_checksum,
                                   data->object, data->file_object_length,
                                   &data->result_csum,
                                   cancellable, &error))
-    g_simple_async_result_take_error (res, error);
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
 }
 
 /**
@@ -2005,23 +1974,18 @@ ostree_repo_write_content_async (OstreeRepo               *self,
                                  GAsyncReadyCallback       callback,
                                  gpointer                  user_data)
 {
+  g_autoptr(GTask) task = NULL;
   WriteContentAsyncData *asyncdata;
 
   asyncdata = g_new0 (WriteContentAsyncData, 1);
-  asyncdata->repo = g_object_ref (self);
   asyncdata->expected_checksum = g_strdup (expected_checksum);
   asyncdata->object = g_object_ref (object);
   asyncdata->file_object_length = length;
-  asyncdata->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
-
-  asyncdata->result = g_simple_async_result_new ((GObject*) self,
-                                                 callback, user_data,
-                                                 ostree_repo_write_content_async);
 
-  g_simple_async_result_set_op_res_gpointer (asyncdata->result, asyncdata,
-                                             write_content_async_data_free);
-  g_simple_async_result_run_in_thread (asyncdata->result, write_content_thread, G_PRIORITY_DEFAULT, cancellable);
-  g_object_unref (asyncdata->result);
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, ostree_repo_write_content_async);
+  g_task_set_task_data (task, asyncdata, write_content_async_data_free);
+  _ostree_repo_write_pool_push (self, task, write_content_thread);
 }
 
 /**
@@ -2039,15 +2003,15 @@ ostree_repo_write_content_finish (OstreeRepo        *self,
                                   guchar           **out_csum,
                                   GError           **error)
 {
-  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (result);
   WriteContentAsyncData *data;
 
-  g_warn_if_fail (g_simple_async_result_get_source_tag (simple) == ostree_repo_write_content_async);
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  g_warn_if_fail (g_task_get_source_tag (G_TASK (result)) == ostree_repo_write_content_async);
 
-  if (g_simple_async_result_propagate_error (simple, error))
+  if (!g_task_propagate_boolean (G_TASK (result), error))
     return FALSE;
 
-  data = g_simple_async_result_get_op_res_gpointer (simple);
+  data = g_task_get_task_data (G_TASK (result));
   ot_transfer_out_value (out_csum, &data->result_csum);
   return TRUE;
 }
@@ -2140,7 +2104,7 @@ ostree_repo_write_commit_with_time (OstreeRepo      *self,
   OstreeRepoFile *repo_root = OSTREE_REPO_FILE (root);
 
   /* Add sizes information to our metadata object */
-  if (!add_size_index_to_metadata (self, metadata, &new_metadata,
+  if (!add_size_index_to_metadata (self, repo_root, metadata, &new_metadata,
                                    cancellable, error))
     goto out;
 
@@ -21,6 +21,7 @@
 #pragma once
 
 #include "ostree-repo.h"
+#include "ostree-rollsum.h"
 #include "libglnx.h"
 
 G_BEGIN_DECLS
@@ -32,6 +33,22 @@ G_BEGIN_DECLS
 #define _OSTREE_SUMMARY_CACHE_DIR "summaries"
 #define _OSTREE_CACHE_DIR "cache"
 
+#define _OSTREE_BLOCK_INDEX_DIR "block-index"
+#define OSTREE_BLOCK_INDEX_GVARIANT_FORMAT G_VARIANT_TYPE ("(utaya(uayt))")
+
+/* Summary metadata key (t, big endian): objects at least this large
+ * have a block index; see ostree-repo-block-index.c */
+#define OSTREE_SUMMARY_BLOCK_INDEX_MIN_SIZE "ostree.block-index-min-size"
+
+#define _OSTREE_TREE_BUNDLE_DIR "tree-bundles"
+#define OSTREE_TREE_BUNDLE_GVARIANT_FORMAT G_VARIANT_TYPE ("a(yayay)")
+/* Applies to the bundle both compressed and not */
+#define _OSTREE_MAX_TREE_BUNDLE_SIZE (256 * 1024 * 1024)
+
+/* Summary metadata key (a(ayt)): the commits which have a tree bundle,
+ * and its compressed size, big endian; see ostree-repo-tree-bundle.c */
+#define OSTREE_SUMMARY_TREE_BUNDLES "ostree.tree-bundles"
+
 typedef enum {
   OSTREE_REPO_TEST_ERROR_PRE_COMMIT = (1 << 0)
 } OstreeRepoTestErrorFlags;
@@ -57,6 +74,13 @@ struct OstreeRepoCommitModifier {
  *
  * Private instance structure.
  */
+/* How staged objects are made durable; see core.commit-sync */
+typedef enum {
+  OSTREE_REPO_COMMIT_SYNC_SYNCFS,
+  OSTREE_REPO_COMMIT_SYNC_FDATASYNC,
+  OSTREE_REPO_COMMIT_SYNC_BATCHED
+} OstreeRepoCommitSync;
+
 struct OstreeRepo {
   GObject parent;
 
@@ -77,9 +101,12 @@ struct OstreeRepo {
   char *remotes_config_dir;
 
   GHashTable *txn_refs;
-  GMutex txn_stats_lock;
+  GMutex txn_stats_lock; /* Also protects write_pool creation */
   OstreeRepoTransactionStats txn_stats;
 
+  GThreadPool *write_pool; /* Runs ostree_repo_write_*_async() */
+  guint n_write_threads;
+
   GMutex cache_lock;
   GPtrArray *cached_meta_indexes;
   GPtrArray *cached_content_indexes;
@@ -89,9 +116,16 @@ struct OstreeRepo {
   GError *writable_error;
   gboolean in_transaction;
   gboolean disable_fsync;
+  OstreeRepoCommitSync commit_sync;
+  guint64 commit_sync_batch_bytes;
+  GMutex txn_sync_lock;
+  guint64 txn_unsynced_bytes; /* Staged since the last batched syncfs; protected by txn_sync_lock */
   GHashTable *loose_object_devino_hash;
   GHashTable *updated_uncompressed_dirs;
-  GHashTable *object_sizes;
+  GMutex object_sizes_lock;
+  GHashTable *object_sizes; /* checksum -> OstreeContentSizeCacheEntry */
+  GArray *object_sizes_pending; /* Records not yet appended to the size index */
+  gboolean object_sizes_loaded;
 
   uid_t target_owner_uid;
   gid_t target_owner_gid;
@@ -105,6 +139,8 @@ struct OstreeRepo {
   gboolean enable_uncompressed_cache;
   gboolean generate_sizes;
   guint64 tmp_expiry_seconds;
+  guint64 block_index_min_size; /* 0 if disabled */
+  gboolean tree_bundles;
 
   OstreeRepo *parent_repo;
 };
@@ -115,6 +151,21 @@ typedef struct {
   char checksum[OSTREE_SHA256_STRING_LEN+1];
 } OstreeDevIno;
 
+typedef struct
+{
+  OstreeObjectType objtype;
+  guint64 unpacked;
+  guint64 archived;
+} OstreeContentSizeCacheEntry;
+
+/* Persistent object size index, appended to at commit_transaction() */
+#define _OSTREE_OBJECT_SIZE_INDEX_PATH "state/object-sizes"
+#define _OSTREE_OBJECT_SIZE_INDEX_LOCK "state/object-sizes.lock"
+
+/* Index of commit objects, see ostree-repo-commit-index.c */
+#define _OSTREE_COMMIT_INDEX_PATH "state/commit-index"
+#define _OSTREE_COMMIT_INDEX_LOCK "state/commit-index.lock"
+
 #define OSTREE_REPO_TMPDIR_STAGING "staging-"
 #define OSTREE_REPO_TMPDIR_FETCHER "fetcher-"
 
@@ -232,6 +283,13 @@ _ostree_repo_file_new_root (OstreeRepo  *repo,
                             const char  *contents_checksum,
                             const char  *metadata_checksum);
 
+gboolean
+_ostree_repo_traverse_dirtree (OstreeRepo      *repo,
+                               const char      *dirtree_checksum,
+                               GHashTable      *inout_reachable,
+                               GCancellable    *cancellable,
+                               GError         **error);
+
 gboolean
 _ostree_repo_traverse_dirtree_internal (OstreeRepo      *repo,
                                         const char      *dirtree_checksum,
@@ -280,6 +338,11 @@ _ostree_repo_commit_loose_final (OstreeRepo        *self,
                                  GCancellable      *cancellable,
                                  GError           **error);
 
+void
+_ostree_repo_write_pool_push (OstreeRepo      *self,
+                              GTask           *task,
+                              GTaskThreadFunc  func);
+
 typedef struct {
   int fd;
   char *temp_filename;
@@ -339,4 +402,150 @@ gboolean
 _ostree_repo_update_mtime (OstreeRepo        *self,
                            GError           **error);
 
+void
+_ostree_repo_store_size_entry (OstreeRepo       *self,
+                               OstreeObjectType  objtype,
+                               const char       *checksum,
+                               guint64           unpacked,
+                               guint64           archived);
+
+gboolean
+_ostree_repo_get_object_size_entry (OstreeRepo                  *self,
+                                    OstreeObjectType             objtype,
+                                    const char                  *checksum,
+                                    OstreeContentSizeCacheEntry *out_entry,
+                                    GCancellable                *cancellable,
+                                    GError                     **error);
+
+gboolean
+_ostree_repo_flush_size_index (OstreeRepo    *self,
+                               GCancellable  *cancellable,
+                               GError       **error);
+
+void
+_ostree_repo_discard_pending_sizes (OstreeRepo *self);
+
+gboolean
+_ostree_repo_compact_size_index (OstreeRepo    *self,
+                                 GCancellable  *cancellable,
+                                 GError       **error);
+
+gboolean
+_ostree_repo_get_commit_object_sizes (OstreeRepo    *self,
+                                      const char    *commit_checksum,
+                                      GVariant     **out_sizes,
+                                      GCancellable  *cancellable,
+                                      GError       **error);
+
+gboolean
+_ostree_repo_commit_index_add (OstreeRepo    *self,
+                               GPtrArray     *commits,
+                               GCancellable  *cancellable,
+                               GError       **error);
+
+gboolean
+_ostree_repo_commit_index_refresh (OstreeRepo    *self,
+                                   GCancellable  *cancellable,
+                                   GError       **error);
+
+gboolean
+_ostree_repo_commit_index_lookup_prefix (OstreeRepo    *self,
+                                         const char    *prefix,
+                                         GPtrArray    **out_checksums,
+                                         GCancellable  *cancellable,
+                                         GError       **error);
+
+void
+_ostree_repo_import_object_async (OstreeRepo          *self,
+                                  OstreeRepo          *source,
+                                  OstreeObjectType     objtype,
+                                  const char          *checksum,
+                                  gboolean             trusted,
+                                  GCancellable        *cancellable,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data);
+
+gboolean
+_ostree_repo_import_object_finish (OstreeRepo    *self,
+                                   GAsyncResult  *result,
+                                   GError       **error);
+
+gboolean
+_ostree_repo_get_commit_index (OstreeRepo    *self,
+                               GVariant     **out_index,
+                               GCancellable  *cancellable,
+                               GError       **error);
+
+gboolean
+_ostree_repo_load_file_bytes (OstreeRepo     *self,
+                              const char     *checksum,
+                              GBytes        **out_content,
+                              GCancellable   *cancellable,
+                              GError        **error);
+
+typedef struct {
+  OstreeBlockSignatures *sigs;
+  GBytes *header; /* The object up to its compressed content */
+  GArray *block_ends; /* guint64, see _ostree_block_index_get_block_range() */
+} OstreeBlockIndex;
+
+char *
+_ostree_get_relative_block_index_path (const char *checksum);
+
+void
+_ostree_block_index_free (OstreeBlockIndex *index);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(OstreeBlockIndex, _ostree_block_index_free)
+
+gboolean
+_ostree_block_index_parse (GBytes            *data,
+                           OstreeBlockIndex **out_index,
+                           GError           **error);
+
+void
+_ostree_block_index_get_block_range (OstreeBlockIndex *index,
+                                     guint             block,
+                                     guint64          *out_start,
+                                     guint64          *out_end);
+
+gboolean
+_ostree_block_index_inflate_block (OstreeBlockIndex  *index,
+                                   OtChecksum        *checksum,
+                                   guint              block,
+                                   const guint8      *compressed,
+                                   gsize              compressed_len,
+                                   guint8            *out_buf,
+                                   gsize             *out_len,
+                                   GError           **error);
+
+gboolean
+_ostree_repo_regenerate_block_index (OstreeRepo    *self,
+                                     GPtrArray     *commits,
+                                     guint64        min_size,
+                                     GCancellable  *cancellable,
+                                     GError       **error);
+
+gboolean
+_ostree_repo_prune_checksum_dir (OstreeRepo    *self,
+                                 const char    *dirname,
+                                 GHashTable    *keep,
+                                 GCancellable  *cancellable,
+                                 GError       **error);
+
+char *
+_ostree_get_relative_tree_bundle_path (const char *commit);
+
+gboolean
+_ostree_tree_bundle_parse (GBytes        *data,
+                           GVariant     **out_bundle,
+                           GCancellable  *cancellable,
+                           GError       **error);
+
+gboolean
+_ostree_repo_regenerate_tree_bundles (OstreeRepo    *self,
+                                      GPtrArray     *commits,
+                                      gboolean       enabled,
+                                      GVariant     **out_bundles,
+                                      GCancellable  *cancellable,
+                                      GError       **error);
+
 G_END_DECLS
@@ -26,8 +26,18 @@
 #include "ostree-repo-private.h"
 #include "otutil.h"
 
+/* An object which existed when prune started */
+typedef struct {
+  guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+  guint8 objtype;
+} OtPruneSnapshotEntry;
+
 typedef struct {
   OstreeRepo *repo;
+  OstreeRepoPruneFlags flags;
+  int depth;
+  GCancellable *cancellable;
+  GArray *snapshot;
   GHashTable *reachable;
   guint n_reachable_meta;
   guint n_reachable_content;
@@ -116,6 +126,54 @@ maybe_prune_loose_object (OtPruneData        *data,
   return ret;
 }
 
+static int
+compare_snapshot_entries (gconstpointer a,
+                          gconstpointer b)
+{
+  return memcmp (a, b, sizeof (OtPruneSnapshotEntry));
+}
+
+static gboolean
+snapshot_object_cb (OstreeRepo        *repo,
+                    const guchar      *csum,
+                    OstreeObjectType   objtype,
+                    gpointer           user_data,
+                    GError           **error)
+{
+  OtPruneData *data = user_data;
+  OtPruneSnapshotEntry entry;
+
+  memcpy (entry.csum, csum, sizeof (entry.csum));
+  entry.objtype = objtype;
+  g_array_append_val (data->snapshot, entry);
+  return TRUE;
+}
+
+static gboolean
+maybe_prune_loose_object_cb (OstreeRepo        *repo,
+                             const guchar      *csum,
+                             OstreeObjectType   objtype,
+                             gpointer           user_data,
+                             GError           **error)
+{
+  OtPruneData *data = user_data;
+  char checksum[OSTREE_SHA256_STRING_LEN+1];
+  OtPruneSnapshotEntry entry;
+
+  /* Objects written since we started may belong to a commit which
+   * isn't there yet, so only objects from the snapshot are candidates.
+   */
+  memcpy (entry.csum, csum, sizeof (entry.csum));
+  entry.objtype = objtype;
+  if (!bsearch (&entry, data->snapshot->data, data->snapshot->len,
+                sizeof (OtPruneSnapshotEntry), compare_snapshot_entries))
+    return TRUE;
+
+  ostree_checksum_inplace_from_bytes (csum, checksum);
+  return maybe_prune_loose_object (data, data->flags, checksum, objtype,
+                                   data->cancellable, error);
+}
+
 static gboolean
 _ostree_repo_prune_tmp (OstreeRepo *self,
                         GCancellable *cancellable,
@@ -292,13 +350,25 @@ ostree_repo_prune (OstreeRepo        *self,
   gboolean ret = FALSE;
   GHashTableIter hash_iter;
   gpointer key, value;
-  g_autoptr(GHashTable) objects = NULL;
   g_autoptr(GHashTable) all_refs = NULL;
   OtPruneData data = { 0, };
   gboolean refs_only = flags & OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY;
 
   data.repo = self;
+  data.flags = flags;
+  data.depth = depth;
+  data.cancellable = cancellable;
   data.reachable = ostree_repo_traverse_new_reachable ();
+  data.snapshot = g_array_new (FALSE, FALSE, sizeof (OtPruneSnapshotEntry));
+
+  /* Record which objects exist before finding what's reachable; just
+   * the binary names, so this stays small even for large repos.
+   */
+  if (!ostree_repo_foreach_object (self, OSTREE_REPO_LIST_OBJECTS_LOOSE | OSTREE_REPO_LIST_OBJECTS_NO_PARENTS,
+                                   0, 1, snapshot_object_cb, &data,
+                                   cancellable, error))
+    goto out;
+  g_array_sort (data.snapshot, compare_snapshot_entries);
 
   if (refs_only)
     {
@@ -319,24 +389,22 @@ ostree_repo_prune (OstreeRepo        *self,
         }
     }
 
-  if (!ostree_repo_list_objects (self, OSTREE_REPO_LIST_OBJECTS_ALL | OSTREE_REPO_LIST_OBJECTS_NO_PARENTS,
-                                 &objects, cancellable, error))
-    goto out;
-
   if (!refs_only)
     {
-      g_hash_table_iter_init (&hash_iter, objects);
-      while (g_hash_table_iter_next (&hash_iter, &key, &value))
-        {
-          GVariant *serialized_key = key;
-          const char *checksum;
-          OstreeObjectType objtype;
+      guint i;
 
-          ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+      /* The roots are the commit objects actually on disk, not the
+       * commit index, which is only a cache.
+       */
+      for (i = 0; i < data.snapshot->len; i++)
+        {
+          OtPruneSnapshotEntry *entry = &g_array_index (data.snapshot, OtPruneSnapshotEntry, i);
+          char checksum[OSTREE_SHA256_STRING_LEN+1];
 
-          if (objtype != OSTREE_OBJECT_TYPE_COMMIT)
+          if (entry->objtype != OSTREE_OBJECT_TYPE_COMMIT)
             continue;
 
+          ostree_checksum_inplace_from_bytes (entry->csum, checksum);
           g_debug ("Finding objects to keep for commit %s", checksum);
           if (!ostree_repo_traverse_commit_union (self, checksum, depth, data.reachable,
                                                   cancellable, error))
@@ -344,23 +412,16 @@ ostree_repo_prune (OstreeRepo        *self,
         }
     }
 
-  g_hash_table_iter_init (&hash_iter, objects);
-  while (g_hash_table_iter_next (&hash_iter, &key, &value))
-    {
-      GVariant *serialized_key = key;
-      GVariant *objdata = value;
-      const char *checksum;
-      OstreeObjectType objtype;
-      gboolean is_loose;
-      
-      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
-      g_variant_get_child (objdata, 0, "b", &is_loose);
-
-      if (!is_loose)
-        continue;
+  if (!ostree_repo_foreach_object (self, OSTREE_REPO_LIST_OBJECTS_LOOSE | OSTREE_REPO_LIST_OBJECTS_NO_PARENTS,
+                                   0, 1, maybe_prune_loose_object_cb, &data,
+                                   cancellable, error))
+    goto out;
 
-      if (!maybe_prune_loose_object (&data, flags, checksum, objtype,
-                                     cancellable, error))
+  if (!(flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE))
+    {
+      if (!_ostree_repo_compact_size_index (self, cancellable, error))
+        goto out;
+      if (!_ostree_repo_commit_index_refresh (self, cancellable, error))
         goto out;
     }
 
@@ -378,5 +439,7 @@ ostree_repo_prune (OstreeRepo        *self,
  out:
   if (data.reachable)
     g_hash_table_unref (data.reachable);
+  if (data.snapshot)
+    g_array_unref (data.snapshot);
   return ret;
 }
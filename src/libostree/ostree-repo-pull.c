@@ -39,6 +39,12 @@
 #define OSTREE_REPO_PULL_CONTENT_PRIORITY  (OSTREE_FETCHER_DEFAULT_PRIORITY)
 #define OSTREE_REPO_PULL_METADATA_PRIORITY (OSTREE_REPO_PULL_CONTENT_PRIORITY - 100)
 
+/* Content objects up to this size are received into memory and
+ * written directly into the repository, rather than first being
+ * spooled to a file in the fetcher tmpdir.
+ */
+#define OSTREE_REPO_PULL_CONTENT_BUFFER_MAX (1024 * 1024)
+
 typedef struct {
   OstreeRepo   *repo;
   int           tmpdir_dfd;
@@ -75,6 +81,7 @@ typedef struct {
   GHashTable       *summary_deltas_checksums;
   GPtrArray        *static_delta_superblocks;
   GHashTable       *expected_commit_sizes; /* Maps commit checksum to known size */
+  GHashTable       *tree_bundles; /* Maps commit checksum to the size of its tree bundle */
   GHashTable       *commit_to_depth; /* Maps commit checksum maximum depth */
   GHashTable       *scanned_metadata; /* Maps object name to itself */
   GHashTable       *requested_metadata; /* Maps object name to itself */
@@ -103,6 +110,9 @@ typedef struct {
 
   GPtrArray        *dirs;
 
+  guint64           block_index_min_size; /* From the summary; 0 if not reusing blocks */
+  GHashTable       *block_reuse_seeds; /* Maps path to file checksum in the previous commit */
+
   gboolean      have_previous_bytes;
   guint64       previous_bytes_sec;
   guint64       previous_total_downloaded;
@@ -113,6 +123,8 @@ typedef struct {
 
   GQueue scan_object_queue;
   GSource *idle_src;
+  guint n_outstanding_dirtree_scans;
+  guint n_outstanding_threads; /* See pull_wait_for_threads() */
 } OtPullData;
 
 typedef enum {
@@ -238,7 +250,8 @@ pull_termination_condition (OtPullData          *pull_data)
   gboolean current_write_idle = (pull_data->n_outstanding_metadata_write_requests == 0 &&
                                  pull_data->n_outstanding_content_write_requests == 0 &&
                                  pull_data->n_outstanding_deltapart_write_requests == 0 );
-  gboolean current_scan_idle = g_queue_is_empty (&pull_data->scan_object_queue);
+  gboolean current_scan_idle = (g_queue_is_empty (&pull_data->scan_object_queue) &&
+                                pull_data->n_outstanding_dirtree_scans == 0);
   gboolean current_idle = current_fetch_idle && current_write_idle && current_scan_idle;
 
   /* we only enter the main loop when we're fetching objects */
@@ -256,6 +269,19 @@ pull_termination_condition (OtPullData          *pull_data)
   return current_idle;
 }
 
+/* The completion callbacks of our thread tasks (dirtree scans, block
+ * reuse and tree bundles) use the pull data, which lives on the stack
+ * of ostree_repo_pull_with_options(); so it mustn't return before
+ * they have all run, even when the pull fails.  Once an error has been
+ * caught they only drop their result.
+ */
+static void
+pull_wait_for_threads (OtPullData *pull_data)
+{
+  while (pull_data->n_outstanding_threads > 0)
+    g_main_context_iteration (pull_data->main_context, TRUE);
+}
+
 static void
 check_outstanding_requests_handle_error (OtPullData          *pull_data,
                                          GError              *error)
@@ -400,6 +426,11 @@ enqueue_one_object_request (OtPullData        *pull_data,
                             FetchObjectType    fetchtype,
                             gboolean           object_is_stored);
 
+static void
+enqueue_block_reuse_request (OtPullData  *pull_data,
+                             const char  *checksum,
+                             const char  *seed_checksum);
+
 static gboolean
 matches_pull_dir (const char *current_file,
                   const char *pull_dir,
@@ -443,7 +474,7 @@ matches_pull_dir (const char *current_file,
 
 
 static gboolean
-pull_matches_subdir (OtPullData *pull_data,
+pull_matches_subdir (GPtrArray  *dirs,
                      const char *path,
                      const char *basename,
                      gboolean basename_is_dir)
@@ -451,14 +482,14 @@ pull_matches_subdir (OtPullData *pull_data,
   int i;
   g_autofree char *file = NULL;
 
-  if (pull_data->dirs == NULL)
+  if (dirs == NULL)
     return TRUE;
 
   file = g_strconcat (path, basename, NULL);
 
-  for (i = 0; i < pull_data->dirs->len; i++)
+  for (i = 0; i < dirs->len; i++)
     {
-      const char *pull_dir = g_ptr_array_index (pull_data->dirs, i);
+      const char *pull_dir = g_ptr_array_index (dirs, i);
       if (matches_pull_dir (file, pull_dir, basename_is_dir))
         return TRUE;
     }
@@ -466,36 +497,211 @@ pull_matches_subdir (OtPullData *pull_data,
   return FALSE;
 }
 
+static void
+content_import_on_complete (GObject        *object,
+                            GAsyncResult   *result,
+                            gpointer        user_data)
+{
+  OtPullData *pull_data = user_data;
+  GError *local_error = NULL;
+
+  (void) _ostree_repo_import_object_finish ((OstreeRepo*)object, result, &local_error);
+
+  pull_data->n_outstanding_content_write_requests--;
+  check_outstanding_requests_handle_error (pull_data, local_error);
+}
+
 static gboolean
-scan_dirtree_object (OtPullData   *pull_data,
-                     const char   *checksum,
-                     const char   *path,
-                     int           recursion_depth,
-                     GCancellable *cancellable,
-                     GError      **error)
+add_block_reuse_seeds_from_dirtree (OtPullData  *pull_data,
+                                    const char  *checksum,
+                                    const char  *path,
+                                    int          recursion_depth,
+                                    GError     **error)
 {
-  gboolean ret = FALSE;
-  int i, n;
   g_autoptr(GVariant) tree = NULL;
   g_autoptr(GVariant) files_variant = NULL;
   g_autoptr(GVariant) dirs_variant = NULL;
-  const char *dirname = NULL;
+  int i, n;
 
   if (recursion_depth > OSTREE_MAX_RECURSION)
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                    "Exceeded maximum recursion");
-      goto out;
+      return FALSE;
     }
 
-  if (!ostree_repo_load_variant (pull_data->repo, OSTREE_OBJECT_TYPE_DIR_TREE, checksum,
-                                 &tree, error))
-    goto out;
+  if (!ostree_repo_load_variant_if_exists (pull_data->repo, OSTREE_OBJECT_TYPE_DIR_TREE, checksum,
+                                           &tree, error))
+    return FALSE;
+
+  /* A partially pulled commit may lack parts of its tree */
+  if (tree == NULL)
+    return TRUE;
 
-  /* PARSE OSTREE_SERIALIZED_TREE_VARIANT */
   files_variant = g_variant_get_child_value (tree, 0);
   dirs_variant = g_variant_get_child_value (tree, 1);
 
+  n = g_variant_n_children (files_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *filename;
+      g_autoptr(GVariant) csum = NULL;
+
+      g_variant_get_child (files_variant, i, "(&s@ay)", &filename, &csum);
+      if (!ostree_checksum_bytes_peek_validate (csum, error))
+        return FALSE;
+
+      g_hash_table_replace (pull_data->block_reuse_seeds,
+                            g_strconcat (path, filename, NULL),
+                            ostree_checksum_from_bytes_v (csum));
+    }
+
+  n = g_variant_n_children (dirs_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *dirname;
+      g_autoptr(GVariant) tree_csum = NULL;
+      g_autoptr(GVariant) meta_csum = NULL;
+      g_autofree char *tree_checksum = NULL;
+      g_autofree char *subpath = NULL;
+
+      g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
+                           &dirname, &tree_csum, &meta_csum);
+      if (!ostree_checksum_bytes_peek_validate (tree_csum, error))
+        return FALSE;
+
+      tree_checksum = ostree_checksum_from_bytes_v (tree_csum);
+      subpath = g_strconcat (path, dirname, "/", NULL);
+      if (!add_block_reuse_seeds_from_dirtree (pull_data, tree_checksum, subpath,
+                                               recursion_depth + 1, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Record the files of @commit, the previous version of a ref we're
+ * pulling, by path; see lookup_block_reuse_seed().
+ */
+static gboolean
+add_block_reuse_seeds (OtPullData  *pull_data,
+                       const char  *commit,
+                       GError     **error)
+{
+  g_autoptr(GVariant) commit_v = NULL;
+  g_autoptr(GVariant) tree_csum = NULL;
+  g_autofree char *tree_checksum = NULL;
+
+  if (!ostree_repo_load_variant_if_exists (pull_data->repo, OSTREE_OBJECT_TYPE_COMMIT, commit,
+                                           &commit_v, error))
+    return FALSE;
+  if (commit_v == NULL)
+    return TRUE;
+
+  /* PARSE OSTREE_SERIALIZED_COMMIT_VARIANT */
+  tree_csum = g_variant_get_child_value (commit_v, 6);
+  if (!ostree_checksum_bytes_peek_validate (tree_csum, error))
+    return FALSE;
+  tree_checksum = ostree_checksum_from_bytes_v (tree_csum);
+
+  if (pull_data->block_reuse_seeds == NULL)
+    pull_data->block_reuse_seeds = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                          g_free, g_free);
+
+  return add_block_reuse_seeds_from_dirtree (pull_data, tree_checksum, "/", 0, error);
+}
+
+/* Find the version of @file_path in the previous commit, if it is
+ * large enough that the remote may have published a block index for
+ * its replacement.
+ */
+static gboolean
+lookup_block_reuse_seed (OtPullData   *pull_data,
+                         const char   *file_path,
+                         const char  **out_seed_checksum,
+                         GCancellable *cancellable,
+                         GError      **error)
+{
+  const char *seed_checksum;
+  gboolean have_seed;
+  g_autoptr(GFileInfo) seed_info = NULL;
+
+  *out_seed_checksum = NULL;
+
+  seed_checksum = g_hash_table_lookup (pull_data->block_reuse_seeds, file_path);
+  if (seed_checksum == NULL)
+    return TRUE;
+
+  if (!ostree_repo_has_object (pull_data->repo, OSTREE_OBJECT_TYPE_FILE, seed_checksum,
+                               &have_seed, cancellable, error))
+    return FALSE;
+  if (!have_seed)
+    return TRUE;
+
+  if (!ostree_repo_load_file (pull_data->repo, seed_checksum, NULL, &seed_info, NULL,
+                              cancellable, error))
+    return FALSE;
+
+  if (g_file_info_get_file_type (seed_info) == G_FILE_TYPE_REGULAR &&
+      (guint64) g_file_info_get_size (seed_info) >= pull_data->block_index_min_size)
+    *out_seed_checksum = seed_checksum;
+
+  return TRUE;
+}
+
+/* Loading a dirtree and checking which of its files we lack costs a
+ * syscall per file, so is done in a thread, leaving the main context
+ * free to dispatch fetches.  The thread holds its own references, and
+ * only the completion callback uses the pull data.
+ */
+typedef struct {
+  OtPullData *pull_data;
+  OstreeRepo *repo;
+  GPtrArray *dirs;
+  char *checksum;
+  char *path;
+  int recursion_depth;
+
+  GVariant *tree;
+  GArray *missing_files; /* Indexes of the files we don't have */
+} ScanDirtreeData;
+
+static void
+scan_dirtree_data_free (ScanDirtreeData *scan)
+{
+  g_object_unref (scan->repo);
+  g_clear_pointer (&scan->dirs, (GDestroyNotify) g_ptr_array_unref);
+  g_free (scan->checksum);
+  g_free (scan->path);
+  g_clear_pointer (&scan->tree, (GDestroyNotify) g_variant_unref);
+  g_clear_pointer (&scan->missing_files, (GDestroyNotify) g_array_unref);
+  g_free (scan);
+}
+
+static gboolean
+load_dirtree_for_scan (ScanDirtreeData *scan,
+                       GCancellable    *cancellable,
+                       GError         **error)
+{
+  g_autoptr(GVariant) files_variant = NULL;
+  guint i, n;
+
+  if (scan->recursion_depth > OSTREE_MAX_RECURSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Exceeded maximum recursion");
+      return FALSE;
+    }
+
+  if (!ostree_repo_load_variant (scan->repo, OSTREE_OBJECT_TYPE_DIR_TREE, scan->checksum,
+                                 &scan->tree, error))
+    return FALSE;
+
+  /* PARSE OSTREE_SERIALIZED_TREE_VARIANT */
+  files_variant = g_variant_get_child_value (scan->tree, 0);
+
+  scan->missing_files = g_array_new (FALSE, FALSE, sizeof (guint));
+
   n = g_variant_n_children (files_variant);
   for (i = 0; i < n; i++)
     {
@@ -507,31 +713,100 @@ scan_dirtree_object (OtPullData   *pull_data,
       g_variant_get_child (files_variant, i, "(&s@ay)", &filename, &csum);
 
       if (!ot_util_filename_validate (filename, error))
-        goto out;
+        return FALSE;
 
       /* Skip files if we're traversing a request only directory, unless it exactly
        * matches the path */
-      if (!pull_matches_subdir (pull_data, path, filename, FALSE))
+      if (!pull_matches_subdir (scan->dirs, scan->path, filename, FALSE))
         continue;
 
       file_checksum = ostree_checksum_from_bytes_v (csum);
 
-      if (!ostree_repo_has_object (pull_data->repo, OSTREE_OBJECT_TYPE_FILE, file_checksum,
+      if (!ostree_repo_has_object (scan->repo, OSTREE_OBJECT_TYPE_FILE, file_checksum,
                                    &file_is_stored, cancellable, error))
-        goto out;
+        return FALSE;
 
-      if (!file_is_stored && pull_data->remote_repo_local)
-        {
-          if (!ostree_repo_import_object_from_with_trust (pull_data->repo, pull_data->remote_repo_local,
-                                                          OSTREE_OBJECT_TYPE_FILE, file_checksum, !pull_data->is_untrusted,
-                                                          cancellable, error))
-            goto out;
-        }
-      else if (!file_is_stored && !g_hash_table_lookup (pull_data->requested_content, file_checksum))
+      if (!file_is_stored)
+        g_array_append_val (scan->missing_files, i);
+    }
+
+  return TRUE;
+}
+
+static void
+scan_dirtree_thread (GTask        *task,
+                     gpointer      source_object,
+                     gpointer      task_data,
+                     GCancellable *cancellable)
+{
+  ScanDirtreeData *scan = task_data;
+  GError *local_error = NULL;
+
+  if (!load_dirtree_for_scan (scan, cancellable, &local_error))
+    g_task_return_error (task, local_error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static gboolean
+scan_dirtree_object (OtPullData      *pull_data,
+                     ScanDirtreeData *scan,
+                     GCancellable    *cancellable,
+                     GError         **error)
+{
+  gboolean ret = FALSE;
+  const char *path = scan->path;
+  int i, n;
+  g_autoptr(GVariant) files_variant = NULL;
+  g_autoptr(GVariant) dirs_variant = NULL;
+  const char *dirname = NULL;
+
+  files_variant = g_variant_get_child_value (scan->tree, 0);
+  dirs_variant = g_variant_get_child_value (scan->tree, 1);
+
+  for (i = 0; i < scan->missing_files->len; i++)
+    {
+      const char *filename;
+      g_autoptr(GVariant) csum = NULL;
+      g_autofree char *file_checksum = NULL;
+
+      g_variant_get_child (files_variant, g_array_index (scan->missing_files, guint, i),
+                           "(&s@ay)", &filename, &csum);
+
+      file_checksum = ostree_checksum_from_bytes_v (csum);
+
+      if (!g_hash_table_lookup (pull_data->requested_content, file_checksum))
         {
           g_hash_table_add (pull_data->requested_content, file_checksum);
-          enqueue_one_object_request (pull_data, file_checksum, OSTREE_OBJECT_TYPE_FILE, path,
-                                      OSTREE_FETCH_OBJECT_CORE, FALSE);
+          if (pull_data->remote_repo_local)
+            {
+              /* Imports run on the repo's writer threads, so objects
+               * needing conversion between modes are done in parallel */
+              _ostree_repo_import_object_async (pull_data->repo, pull_data->remote_repo_local,
+                                                OSTREE_OBJECT_TYPE_FILE, file_checksum,
+                                                !pull_data->is_untrusted, cancellable,
+                                                content_import_on_complete, pull_data);
+              pull_data->n_outstanding_content_write_requests++;
+            }
+          else
+            {
+              const char *seed_checksum = NULL;
+
+              if (pull_data->block_reuse_seeds)
+                {
+                  g_autofree char *file_path = g_strconcat (path, filename, NULL);
+
+                  if (!lookup_block_reuse_seed (pull_data, file_path, &seed_checksum,
+                                                cancellable, error))
+                    goto out;
+                }
+
+              if (seed_checksum)
+                enqueue_block_reuse_request (pull_data, file_checksum, seed_checksum);
+              else
+                enqueue_one_object_request (pull_data, file_checksum, OSTREE_OBJECT_TYPE_FILE, path,
+                                            OSTREE_FETCH_OBJECT_CORE, FALSE);
+            }
           file_checksum = NULL;  /* Transfer ownership */
         }
     }
@@ -552,7 +827,7 @@ scan_dirtree_object (OtPullData   *pull_data,
       if (!ot_util_filename_validate (dirname, error))
         goto out;
 
-      if (!pull_matches_subdir (pull_data, path, dirname, TRUE))
+      if (!pull_matches_subdir (pull_data->dirs, path, dirname, TRUE))
         continue;
 
       tree_csum_bytes = ostree_checksum_bytes_peek_validate (tree_csum, error);
@@ -566,9 +841,9 @@ scan_dirtree_object (OtPullData   *pull_data,
       subpath = g_strconcat (path, dirname, "/", NULL);
 
       queue_scan_one_metadata_object_c (pull_data, tree_csum_bytes,
-                                        OSTREE_OBJECT_TYPE_DIR_TREE, subpath, recursion_depth + 1);
+                                        OSTREE_OBJECT_TYPE_DIR_TREE, subpath, scan->recursion_depth + 1);
       queue_scan_one_metadata_object_c (pull_data, meta_csum_bytes,
-                                        OSTREE_OBJECT_TYPE_DIR_META, subpath, recursion_depth + 1);
+                                        OSTREE_OBJECT_TYPE_DIR_META, subpath, scan->recursion_depth + 1);
     }
 
   ret = TRUE;
@@ -576,6 +851,51 @@ scan_dirtree_object (OtPullData   *pull_data,
   return ret;
 }
 
+static void
+scan_dirtree_on_complete (GObject      *object,
+                          GAsyncResult *result,
+                          gpointer      user_data)
+{
+  ScanDirtreeData *scan = g_task_get_task_data (G_TASK (result));
+  OtPullData *pull_data = scan->pull_data;
+  GError *local_error = NULL;
+
+  pull_data->n_outstanding_threads--;
+  pull_data->n_outstanding_dirtree_scans--;
+  if (pull_data->caught_error)
+    return;
+
+  if (g_task_propagate_boolean (G_TASK (result), &local_error))
+    (void) scan_dirtree_object (pull_data, scan, pull_data->cancellable, &local_error);
+
+  check_outstanding_requests_handle_error (pull_data, local_error);
+}
+
+static void
+queue_scan_dirtree_object (OtPullData *pull_data,
+                           const char *checksum,
+                           const char *path,
+                           int         recursion_depth)
+{
+  g_autoptr(GTask) task = NULL;
+  ScanDirtreeData *scan;
+
+  scan = g_new0 (ScanDirtreeData, 1);
+  scan->pull_data = pull_data;
+  scan->repo = g_object_ref (pull_data->repo);
+  scan->dirs = pull_data->dirs ? g_ptr_array_ref (pull_data->dirs) : NULL;
+  scan->checksum = g_strdup (checksum);
+  scan->path = g_strdup (path);
+  scan->recursion_depth = recursion_depth;
+
+  pull_data->n_outstanding_dirtree_scans++;
+  pull_data->n_outstanding_threads++;
+
+  task = g_task_new (NULL, pull_data->cancellable, scan_dirtree_on_complete, NULL);
+  g_task_set_task_data (task, scan, (GDestroyNotify) scan_dirtree_data_free);
+  g_task_run_in_thread (task, scan_dirtree_thread);
+}
+
 static gboolean
 fetch_ref_contents (OtPullData    *pull_data,
                     const char    *ref,
@@ -710,13 +1030,15 @@ content_fetch_on_complete (GObject        *object,
   g_autoptr(GInputStream) file_in = NULL;
   g_autoptr(GInputStream) object_input = NULL;
   g_autofree char *temp_path = NULL;
+  g_autoptr(GBytes) contents = NULL;
   const char *checksum;
   g_autofree char *checksum_obj = NULL;
   OstreeObjectType objtype;
   gboolean free_fetch_data = TRUE;
 
-  temp_path = _ostree_fetcher_mirrored_request_with_partial_finish (fetcher, result, error);
-  if (!temp_path)
+  if (!_ostree_fetcher_mirrored_request_buffered_finish (fetcher, result,
+                                                         &temp_path, &contents,
+                                                         error))
     goto out;
 
   ostree_object_name_deserialize (fetch_data->object, &checksum, &objtype);
@@ -728,6 +1050,10 @@ content_fetch_on_complete (GObject        *object,
   if (pull_data->is_mirror && pull_data->repo->mode == OSTREE_REPO_MODE_ARCHIVE_Z2)
     {
       gboolean have_object;
+
+      /* We never ask for a buffered response when mirroring */
+      g_assert (temp_path != NULL);
+
       if (!ostree_repo_has_object (pull_data->repo, OSTREE_OBJECT_TYPE_FILE, checksum,
                                    &have_object,
                                    cancellable, error))
@@ -746,21 +1072,39 @@ content_fetch_on_complete (GObject        *object,
     {
       /* Non-mirroring path */
 
-      if (!ostree_content_file_parse_at (TRUE, _ostree_fetcher_get_dfd (fetcher),
-                                         temp_path, FALSE,
-                                         &file_in, &file_info, &xattrs,
-                                         cancellable, error))
+      if (contents)
         {
-          /* If it appears corrupted, delete it */
-          (void) unlinkat (_ostree_fetcher_get_dfd (fetcher), temp_path, 0);
-          goto out;
+          /* Small object received into memory; parse it from there so
+           * the only disk write is of the final object, whose checksum
+           * is verified as it is written.
+           */
+          g_autoptr(GInputStream) contents_in =
+            g_memory_input_stream_new_from_bytes (contents);
+
+          if (!ostree_content_stream_parse (TRUE, contents_in,
+                                            g_bytes_get_size (contents), FALSE,
+                                            &file_in, &file_info, &xattrs,
+                                            cancellable, error))
+            goto out;
         }
+      else
+        {
+          if (!ostree_content_file_parse_at (TRUE, _ostree_fetcher_get_dfd (fetcher),
+                                             temp_path, FALSE,
+                                             &file_in, &file_info, &xattrs,
+                                             cancellable, error))
+            {
+              /* If it appears corrupted, delete it */
+              (void) unlinkat (_ostree_fetcher_get_dfd (fetcher), temp_path, 0);
+              goto out;
+            }
 
-      /* Also, delete it now that we've opened it, we'll hold
-       * a reference to the fd.  If we fail to write later, then
-       * the temp space will be cleaned up.
-       */
-      (void) unlinkat (_ostree_fetcher_get_dfd (fetcher), temp_path, 0);
+          /* Also, delete it now that we've opened it, we'll hold
+           * a reference to the fd.  If we fail to write later, then
+           * the temp space will be cleaned up.
+           */
+          (void) unlinkat (_ostree_fetcher_get_dfd (fetcher), temp_path, 0);
+        }
 
       if (!ostree_raw_file_to_content_stream (file_in, file_info, xattrs,
                                               &object_input, &length,
@@ -782,6 +1126,286 @@ content_fetch_on_complete (GObject        *object,
     fetch_object_data_free (fetch_data);
 }
 
+/* When the remote publishes block indexes (see
+ * ostree-repo-block-index.c), a large file replacing one we already
+ * have at the same path is rebuilt from the blocks of the old version
+ * it still contains, fetching only the other blocks, with range
+ * requests.  This does blocking I/O and scans the whole old file, so
+ * runs in a thread, holding its own references; any failure falls
+ * back to fetching the object whole.
+ */
+typedef struct {
+  OtPullData *pull_data;
+  OstreeRepo *repo;
+  OstreeFetcher *fetcher;
+  GPtrArray *meta_mirrorlist;
+  GPtrArray *content_mirrorlist;
+  char *checksum;
+  char *seed_checksum;
+} BlockReuseData;
+
+/* Missing blocks are fetched in runs of up to this much compressed data */
+#define OSTREE_REPO_PULL_BLOCK_RANGE_MAX (8 * 1024 * 1024)
+
+static void
+block_reuse_data_free (BlockReuseData *reuse)
+{
+  g_object_unref (reuse->repo);
+  g_object_unref (reuse->fetcher);
+  g_ptr_array_unref (reuse->meta_mirrorlist);
+  g_ptr_array_unref (reuse->content_mirrorlist);
+  g_free (reuse->checksum);
+  g_free (reuse->seed_checksum);
+  g_free (reuse);
+}
+
+static gboolean
+write_content_from_blocks (BlockReuseData *reuse,
+                           GCancellable   *cancellable,
+                           GError        **error)
+{
+  g_autofree char *index_path = _ostree_get_relative_block_index_path (reuse->checksum);
+  g_autofree char *object_path = _ostree_get_relative_object_path (reuse->checksum,
+                                                                   OSTREE_OBJECT_TYPE_FILE, TRUE);
+  g_autoptr(GBytes) index_bytes = NULL;
+  g_autoptr(OstreeBlockIndex) index = NULL;
+  g_autoptr(GInputStream) header_in = NULL;
+  g_autoptr(GFileInfo) file_info = NULL;
+  g_autoptr(GVariant) xattrs = NULL;
+  g_autoptr(GBytes) seed = NULL;
+  g_autoptr(GArray) matches = NULL;
+  g_autofree gint64 *seed_offsets = NULL;
+  g_autofree guint8 *block_buf = NULL;
+  g_auto(OtChecksum) block_checksum = { 0, };
+  g_autofree char *tmpname = NULL;
+  glnx_fd_close int fd = -1;
+  g_autoptr(GInputStream) content_in = NULL;
+  g_autoptr(GInputStream) object_input = NULL;
+  const guint8 *seed_data;
+  gsize seed_len;
+  guint32 block_size;
+  guint n_blocks;
+  guint n_reused = 0;
+  guint64 n_fetched_bytes = 0;
+  guint64 length;
+  guint i;
+
+  if (!_ostree_fetcher_mirrored_request_to_membuf (reuse->fetcher, reuse->meta_mirrorlist,
+                                                   index_path, FALSE, FALSE,
+                                                   &index_bytes, OSTREE_MAX_METADATA_SIZE,
+                                                   cancellable, error))
+    return FALSE;
+
+  if (!_ostree_block_index_parse (index_bytes, &index, error))
+    return FALSE;
+
+  /* The object header gives us the file metadata; the content itself
+   * is verified against the object checksum as it's written.
+   */
+  header_in = g_memory_input_stream_new_from_bytes (index->header);
+  if (!ostree_content_stream_parse (TRUE, header_in, g_bytes_get_size (index->header), FALSE,
+                                    NULL, &file_info, &xattrs, cancellable, error))
+    return FALSE;
+
+  if (g_file_info_get_file_type (file_info) != G_FILE_TYPE_REGULAR ||
+      (guint64) g_file_info_get_size (file_info) != index->sigs->size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Block index for %s doesn't match its header", reuse->checksum);
+      return FALSE;
+    }
+
+  if (!_ostree_repo_load_file_bytes (reuse->repo, reuse->seed_checksum, &seed,
+                                     cancellable, error))
+    return FALSE;
+  seed_data = g_bytes_get_data (seed, &seed_len);
+
+  block_size = index->sigs->block_size;
+  n_blocks = index->sigs->blocks->len;
+  seed_offsets = g_new (gint64, n_blocks);
+  for (i = 0; i < n_blocks; i++)
+    seed_offsets[i] = -1;
+
+  matches = _ostree_block_signatures_find (index->sigs, seed_data, seed_len);
+  for (i = 0; i < matches->len; i++)
+    {
+      const OstreeBlockMatch *match = &g_array_index (matches, OstreeBlockMatch, i);
+
+      if (seed_offsets[match->block] < 0)
+        {
+          seed_offsets[match->block] = match->offset;
+          n_reused++;
+        }
+    }
+
+  if (n_reused == 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "No blocks of %s found in %s", reuse->checksum, reuse->seed_checksum);
+      return FALSE;
+    }
+
+  if (!glnx_open_tmpfile_linkable_at (reuse->repo->tmp_dir_fd, ".", O_RDWR | O_CLOEXEC,
+                                      &fd, &tmpname, error))
+    return FALSE;
+  /* We only need the fd */
+  if (tmpname)
+    (void) unlinkat (reuse->repo->tmp_dir_fd, tmpname, 0);
+
+  block_buf = g_malloc (block_size);
+  ot_checksum_init (&block_checksum);
+
+  i = 0;
+  while (i < n_blocks)
+    {
+      g_autoptr(GBytes) range = NULL;
+      const guint8 *range_data;
+      guint64 range_start, range_end, start, end;
+      guint run_end;
+
+      if (seed_offsets[i] >= 0)
+        {
+          /* Only full blocks are matched */
+          if (glnx_loop_write (fd, seed_data + seed_offsets[i], block_size) < 0)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+          i++;
+          continue;
+        }
+
+      _ostree_block_index_get_block_range (index, i, &range_start, &range_end);
+      for (run_end = i + 1; run_end < n_blocks && seed_offsets[run_end] < 0; run_end++)
+        {
+          _ostree_block_index_get_block_range (index, run_end, &start, &end);
+          if (end - range_start > OSTREE_REPO_PULL_BLOCK_RANGE_MAX)
+            break;
+          range_end = end;
+        }
+
+      if (!_ostree_fetcher_mirrored_request_range_to_membuf (reuse->fetcher, reuse->content_mirrorlist,
+                                                             object_path, range_start,
+                                                             range_end - range_start, &range,
+                                                             cancellable, error))
+        return FALSE;
+      range_data = g_bytes_get_data (range, NULL);
+      n_fetched_bytes += range_end - range_start;
+
+      for (; i < run_end; i++)
+        {
+          gsize len;
+
+          _ostree_block_index_get_block_range (index, i, &start, &end);
+          if (!_ostree_block_index_inflate_block (index, &block_checksum, i,
+                                                  range_data + (start - range_start),
+                                                  end - start, block_buf, &len, error))
+            return FALSE;
+
+          if (glnx_loop_write (fd, block_buf, len) < 0)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+        }
+    }
+
+  if (lseek (fd, 0, SEEK_SET) < 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  content_in = g_unix_input_stream_new (fd, FALSE);
+  if (!ostree_raw_file_to_content_stream (content_in, file_info, xattrs,
+                                          &object_input, &length,
+                                          cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_write_content (reuse->repo, reuse->checksum, object_input, length,
+                                  NULL, cancellable, error))
+    return FALSE;
+
+  g_debug ("rebuilt %s reusing %u of %u blocks of %s, fetched %" G_GUINT64_FORMAT " bytes",
+           reuse->checksum, n_reused, n_blocks, reuse->seed_checksum, n_fetched_bytes);
+  return TRUE;
+}
+
+static void
+block_reuse_thread (GTask        *task,
+                    gpointer      source_object,
+                    gpointer      task_data,
+                    GCancellable *cancellable)
+{
+  BlockReuseData *reuse = task_data;
+  GError *local_error = NULL;
+
+  if (!write_content_from_blocks (reuse, cancellable, &local_error))
+    g_task_return_error (task, local_error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+block_reuse_on_complete (GObject      *object,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+  BlockReuseData *reuse = g_task_get_task_data (G_TASK (result));
+  OtPullData *pull_data = reuse->pull_data;
+  GError *local_error = NULL;
+
+  pull_data->n_outstanding_threads--;
+  pull_data->n_outstanding_content_fetches--;
+  if (pull_data->caught_error)
+    return;
+
+  if (g_task_propagate_boolean (G_TASK (result), &local_error))
+    pull_data->n_fetched_content++;
+  else if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    check_outstanding_requests_handle_error (pull_data, local_error);
+  else
+    {
+      g_debug ("reusing blocks for %s failed, fetching it whole: %s",
+               reuse->checksum, local_error->message);
+      /* Reusing blocks needs range requests, so don't try again */
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+        g_clear_pointer (&pull_data->block_reuse_seeds, (GDestroyNotify) g_hash_table_unref);
+      g_clear_error (&local_error);
+      pull_data->n_requested_content--;
+      enqueue_one_object_request (pull_data, reuse->checksum, OSTREE_OBJECT_TYPE_FILE, NULL,
+                                  OSTREE_FETCH_OBJECT_CORE, FALSE);
+    }
+}
+
+static void
+enqueue_block_reuse_request (OtPullData  *pull_data,
+                             const char  *checksum,
+                             const char  *seed_checksum)
+{
+  g_autoptr(GTask) task = NULL;
+  BlockReuseData *reuse;
+
+  g_debug ("queuing fetch of %s.file reusing blocks of %s", checksum, seed_checksum);
+
+  reuse = g_new0 (BlockReuseData, 1);
+  reuse->pull_data = pull_data;
+  reuse->repo = g_object_ref (pull_data->repo);
+  reuse->fetcher = g_object_ref (pull_data->fetcher);
+  reuse->meta_mirrorlist = g_ptr_array_ref (pull_data->meta_mirrorlist);
+  reuse->content_mirrorlist = g_ptr_array_ref (pull_data->content_mirrorlist);
+  reuse->checksum = g_strdup (checksum);
+  reuse->seed_checksum = g_strdup (seed_checksum);
+
+  pull_data->n_outstanding_content_fetches++;
+  pull_data->n_requested_content++;
+  pull_data->n_outstanding_threads++;
+
+  task = g_task_new (NULL, pull_data->cancellable, block_reuse_on_complete, NULL);
+  g_task_set_task_data (task, reuse, (GDestroyNotify) block_reuse_data_free);
+  g_task_run_in_thread (task, block_reuse_thread);
+}
+
 static void
 on_metadata_written (GObject           *object,
                      GAsyncResult      *result,
@@ -826,6 +1450,74 @@ on_metadata_written (GObject           *object,
   check_outstanding_requests_handle_error (pull_data, local_error);
 }
 
+static void
+prefetch_metadata_object (OtPullData       *pull_data,
+                          const guchar     *csum,
+                          OstreeObjectType  objtype,
+                          const char       *path)
+{
+  g_autofree char *checksum = ostree_checksum_from_bytes (csum);
+  gboolean is_stored;
+
+  if (g_hash_table_lookup (pull_data->requested_metadata, checksum))
+    return;
+
+  /* Errors are left for the scan of the object to report */
+  if (!ostree_repo_has_object (pull_data->repo, objtype, checksum, &is_stored, NULL, NULL) ||
+      is_stored)
+    return;
+
+  g_hash_table_add (pull_data->requested_metadata, g_strdup (checksum));
+  enqueue_one_object_request (pull_data, checksum, objtype, path, OSTREE_FETCH_OBJECT_CORE, FALSE);
+}
+
+/* Request the subdirectories of a dirtree as soon as we receive it,
+ * rather than after it has been written and scanned, so a deep tree
+ * doesn't cost a round trip per level.  The tree isn't verified yet:
+ * anything invalid is skipped here for its scan to report, and the
+ * objects we fetch are each verified when written.
+ */
+static void
+prefetch_dirtree_children (OtPullData *pull_data,
+                           GVariant   *tree,
+                           const char *path)
+{
+  g_autoptr(GVariant) dirs_variant = NULL;
+  int i, n;
+
+  /* PARSE OSTREE_SERIALIZED_TREE_VARIANT */
+  dirs_variant = g_variant_get_child_value (tree, 1);
+
+  n = g_variant_n_children (dirs_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *dirname;
+      g_autoptr(GVariant) tree_csum = NULL;
+      g_autoptr(GVariant) meta_csum = NULL;
+      const guchar *tree_csum_bytes;
+      const guchar *meta_csum_bytes;
+      g_autofree char *subpath = NULL;
+
+      g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
+                           &dirname, &tree_csum, &meta_csum);
+
+      if (!ot_util_filename_validate (dirname, NULL))
+        return;
+
+      if (!pull_matches_subdir (pull_data->dirs, path, dirname, TRUE))
+        continue;
+
+      tree_csum_bytes = ostree_checksum_bytes_peek_validate (tree_csum, NULL);
+      meta_csum_bytes = ostree_checksum_bytes_peek_validate (meta_csum, NULL);
+      if (tree_csum_bytes == NULL || meta_csum_bytes == NULL)
+        return;
+
+      subpath = g_strconcat (path, dirname, "/", NULL);
+      prefetch_metadata_object (pull_data, tree_csum_bytes, OSTREE_OBJECT_TYPE_DIR_TREE, subpath);
+      prefetch_metadata_object (pull_data, meta_csum_bytes, OSTREE_OBJECT_TYPE_DIR_META, subpath);
+    }
+}
+
 static void
 meta_fetch_on_complete (GObject           *object,
                         GAsyncResult      *result,
@@ -983,6 +1675,8 @@ meta_fetch_on_complete (GObject           *object,
           if (!write_commitpartial_for (pull_data, checksum, error))
             goto out;
         }
+      else if (objtype == OSTREE_OBJECT_TYPE_DIR_TREE)
+        prefetch_dirtree_children (pull_data, metadata, fetch_data->path);
       
       ostree_repo_write_metadata_async (pull_data->repo, objtype, checksum, metadata,
                                         pull_data->cancellable,
@@ -1146,6 +1840,196 @@ gpg_verify_unwritten_commit (OtPullData         *pull_data,
   return TRUE;
 }
 
+static void
+queue_scan_commit_tree (OtPullData   *pull_data,
+                        const guchar *tree_contents_csum,
+                        const guchar *tree_meta_csum,
+                        guint         recursion_depth)
+{
+  queue_scan_one_metadata_object_c (pull_data, tree_contents_csum,
+                                    OSTREE_OBJECT_TYPE_DIR_TREE, "/", recursion_depth);
+
+  queue_scan_one_metadata_object_c (pull_data, tree_meta_csum,
+                                    OSTREE_OBJECT_TYPE_DIR_META, NULL, recursion_depth);
+}
+
+/* When the remote publishes a tree bundle for a commit (see
+ * ostree-repo-tree-bundle.c), we fetch and write all its metadata
+ * before scanning its tree, which then needs no further metadata
+ * requests.  Like the other threads here, this one holds its own
+ * references; any failure falls back to scanning the tree normally.
+ */
+typedef struct {
+  OtPullData *pull_data;
+  OstreeRepo *repo;
+  OstreeFetcher *fetcher;
+  GPtrArray *meta_mirrorlist;
+  char *commit;
+  guint64 bundle_size;
+  guchar tree_contents_csum[OSTREE_SHA256_DIGEST_LEN];
+  guchar tree_meta_csum[OSTREE_SHA256_DIGEST_LEN];
+  guint recursion_depth;
+} TreeBundleData;
+
+static void
+tree_bundle_data_free (TreeBundleData *bundle_data)
+{
+  g_object_unref (bundle_data->repo);
+  g_object_unref (bundle_data->fetcher);
+  g_ptr_array_unref (bundle_data->meta_mirrorlist);
+  g_free (bundle_data->commit);
+  g_free (bundle_data);
+}
+
+static gboolean
+write_tree_bundle_objects (TreeBundleData *bundle_data,
+                           GCancellable   *cancellable,
+                           GError        **error)
+{
+  g_autofree char *bundle_path = _ostree_get_relative_tree_bundle_path (bundle_data->commit);
+  g_autoptr(GBytes) bundle_bytes = NULL;
+  g_autoptr(GVariant) bundle = NULL;
+  guint n_written = 0;
+  guint i, n;
+
+  if (!_ostree_fetcher_mirrored_request_to_membuf (bundle_data->fetcher,
+                                                   bundle_data->meta_mirrorlist,
+                                                   bundle_path, FALSE, FALSE,
+                                                   &bundle_bytes, bundle_data->bundle_size,
+                                                   cancellable, error))
+    return FALSE;
+
+  if (!_ostree_tree_bundle_parse (bundle_bytes, &bundle, cancellable, error))
+    return FALSE;
+
+  n = g_variant_n_children (bundle);
+  for (i = 0; i < n; i++)
+    {
+      guint8 objtype_u8;
+      OstreeObjectType objtype;
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autoptr(GVariant) data_v = NULL;
+      g_autoptr(GBytes) data = NULL;
+      g_autoptr(GVariant) object = NULL;
+      g_autofree char *checksum = NULL;
+      gboolean is_stored;
+
+      g_variant_get_child (bundle, i, "(y@ay@ay)", &objtype_u8, &csum_v, &data_v);
+      objtype = objtype_u8;
+      if (!(objtype == OSTREE_OBJECT_TYPE_DIR_TREE ||
+            objtype == OSTREE_OBJECT_TYPE_DIR_META))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Invalid object type %u in tree bundle", objtype_u8);
+          return FALSE;
+        }
+
+      if (!ostree_checksum_bytes_peek_validate (csum_v, error))
+        return FALSE;
+      checksum = ostree_checksum_from_bytes_v (csum_v);
+
+      if (!ostree_repo_has_object (bundle_data->repo, objtype, checksum, &is_stored,
+                                   cancellable, error))
+        return FALSE;
+      if (is_stored)
+        continue;
+
+      /* The object is verified against its checksum as it's written */
+      data = g_variant_get_data_as_bytes (data_v);
+      object = g_variant_ref_sink (g_variant_new_from_bytes (ostree_metadata_variant_type (objtype),
+                                                             data, FALSE));
+      if (!ostree_repo_write_metadata (bundle_data->repo, objtype, checksum, object, NULL,
+                                       cancellable, error))
+        return FALSE;
+      n_written++;
+    }
+
+  g_debug ("wrote %u of %u objects from the tree bundle of %s",
+           n_written, n, bundle_data->commit);
+  return TRUE;
+}
+
+static void
+tree_bundle_thread (GTask        *task,
+                    gpointer      source_object,
+                    gpointer      task_data,
+                    GCancellable *cancellable)
+{
+  TreeBundleData *bundle_data = task_data;
+  GError *local_error = NULL;
+
+  if (!write_tree_bundle_objects (bundle_data, cancellable, &local_error))
+    g_task_return_error (task, local_error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+tree_bundle_on_complete (GObject      *object,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+  TreeBundleData *bundle_data = g_task_get_task_data (G_TASK (result));
+  OtPullData *pull_data = bundle_data->pull_data;
+  GError *local_error = NULL;
+
+  pull_data->n_outstanding_threads--;
+  g_assert (pull_data->n_outstanding_metadata_fetches > 0);
+  pull_data->n_outstanding_metadata_fetches--;
+  if (pull_data->caught_error)
+    return;
+  pull_data->n_fetched_metadata++;
+
+  if (!g_task_propagate_boolean (G_TASK (result), &local_error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          check_outstanding_requests_handle_error (pull_data, local_error);
+          return;
+        }
+
+      g_debug ("using the tree bundle of %s failed, scanning its tree: %s",
+               bundle_data->commit, local_error->message);
+      g_clear_error (&local_error);
+    }
+
+  queue_scan_commit_tree (pull_data, bundle_data->tree_contents_csum,
+                          bundle_data->tree_meta_csum, bundle_data->recursion_depth);
+}
+
+static void
+enqueue_tree_bundle_request (OtPullData   *pull_data,
+                             const char   *commit,
+                             const guchar *tree_contents_csum,
+                             const guchar *tree_meta_csum,
+                             guint         recursion_depth)
+{
+  g_autoptr(GTask) task = NULL;
+  TreeBundleData *bundle_data;
+
+  g_debug ("queuing fetch of the tree bundle of %s", commit);
+
+  bundle_data = g_new0 (TreeBundleData, 1);
+  bundle_data->pull_data = pull_data;
+  bundle_data->repo = g_object_ref (pull_data->repo);
+  bundle_data->fetcher = g_object_ref (pull_data->fetcher);
+  bundle_data->meta_mirrorlist = g_ptr_array_ref (pull_data->meta_mirrorlist);
+  bundle_data->commit = g_strdup (commit);
+  bundle_data->bundle_size = MIN (*(guint64*) g_hash_table_lookup (pull_data->tree_bundles, commit),
+                                  _OSTREE_MAX_TREE_BUNDLE_SIZE);
+  memcpy (bundle_data->tree_contents_csum, tree_contents_csum, OSTREE_SHA256_DIGEST_LEN);
+  memcpy (bundle_data->tree_meta_csum, tree_meta_csum, OSTREE_SHA256_DIGEST_LEN);
+  bundle_data->recursion_depth = recursion_depth;
+
+  pull_data->n_outstanding_metadata_fetches++;
+  pull_data->n_requested_metadata++;
+  pull_data->n_outstanding_threads++;
+
+  task = g_task_new (NULL, pull_data->cancellable, tree_bundle_on_complete, NULL);
+  g_task_set_task_data (task, bundle_data, (GDestroyNotify) tree_bundle_data_free);
+  g_task_run_in_thread (task, tree_bundle_thread);
+}
+
 static gboolean
 scan_commit_object (OtPullData         *pull_data,
                     const char         *checksum,
@@ -1271,11 +2155,29 @@ scan_commit_object (OtPullData         *pull_data,
       if (tree_meta_csum_bytes == NULL)
         goto out;
 
-      queue_scan_one_metadata_object_c (pull_data, tree_contents_csum_bytes,
-                                        OSTREE_OBJECT_TYPE_DIR_TREE, "/", recursion_depth + 1);
+      /* A bundle holds the whole tree's metadata; it only pays off
+       * when we have none of it yet.
+       */
+      if (g_hash_table_contains (pull_data->tree_bundles, checksum))
+        {
+          char tree_contents_checksum[OSTREE_SHA256_STRING_LEN+1];
+          gboolean tree_is_stored;
 
-      queue_scan_one_metadata_object_c (pull_data, tree_meta_csum_bytes,
-                                        OSTREE_OBJECT_TYPE_DIR_META, NULL, recursion_depth + 1);
+          ostree_checksum_inplace_from_bytes (tree_contents_csum_bytes, tree_contents_checksum);
+          if (!ostree_repo_has_object (pull_data->repo, OSTREE_OBJECT_TYPE_DIR_TREE,
+                                       tree_contents_checksum, &tree_is_stored,
+                                       cancellable, error))
+            goto out;
+          if (tree_is_stored)
+            g_hash_table_remove (pull_data->tree_bundles, checksum);
+        }
+
+      if (g_hash_table_contains (pull_data->tree_bundles, checksum))
+        enqueue_tree_bundle_request (pull_data, checksum, tree_contents_csum_bytes,
+                                     tree_meta_csum_bytes, recursion_depth + 1);
+      else
+        queue_scan_commit_tree (pull_data, tree_contents_csum_bytes,
+                                tree_meta_csum_bytes, recursion_depth + 1);
     }
 
   ret = TRUE;
@@ -1385,9 +2287,7 @@ scan_one_metadata_object_c (OtPullData         *pull_data,
     }
   else if (is_stored && objtype == OSTREE_OBJECT_TYPE_DIR_TREE)
     {
-      if (!scan_dirtree_object (pull_data, tmp_checksum, path, recursion_depth,
-                                pull_data->cancellable, error))
-        goto out;
+      queue_scan_dirtree_object (pull_data, tmp_checksum, path, recursion_depth);
 
       g_hash_table_add (pull_data->scanned_metadata, g_variant_ref (object));
       pull_data->n_scanned_metadata++;
@@ -1472,12 +2372,29 @@ enqueue_one_object_request (OtPullData        *pull_data,
   else
     expected_max_size = 0;
 
-  _ostree_fetcher_mirrored_request_with_partial_async (pull_data->fetcher, mirrorlist,
+  if (is_meta)
+    {
+      _ostree_fetcher_mirrored_request_with_partial_async (pull_data->fetcher, mirrorlist,
+                                                           obj_subpath, expected_max_size,
+                                                           OSTREE_REPO_PULL_METADATA_PRIORITY,
+                                                           pull_data->cancellable,
+                                                           meta_fetch_on_complete, fetch_data);
+    }
+  else
+    {
+      /* When mirroring into an archive-z2 repo the fetched file is
+       * committed as is, so there's nothing to gain from buffering.
+       */
+      gboolean mirroring_archive =
+        pull_data->is_mirror && pull_data->repo->mode == OSTREE_REPO_MODE_ARCHIVE_Z2;
+
+      _ostree_fetcher_mirrored_request_buffered_async (pull_data->fetcher, mirrorlist,
                                                        obj_subpath, expected_max_size,
-                                                       is_meta ? OSTREE_REPO_PULL_METADATA_PRIORITY
-                                                               : OSTREE_REPO_PULL_CONTENT_PRIORITY,
+                                                       mirroring_archive ? 0 : OSTREE_REPO_PULL_CONTENT_BUFFER_MAX,
+                                                       OSTREE_REPO_PULL_CONTENT_PRIORITY,
                                                        pull_data->cancellable,
-                                                       is_meta ? meta_fetch_on_complete : content_fetch_on_complete, fetch_data);
+                                                       content_fetch_on_complete, fetch_data);
+    }
 }
 
 static gboolean
@@ -2411,6 +3328,7 @@ reinitialize_fetcher (OtPullData *pull_data, const char *remote_name, GError **e
  *   * inherit-transaction (b): Don't initiate, finish or abort a transaction, usefult to do mutliple pulls in one transaction.
  *   * http-headers (a(ss)): Additional headers to add to all HTTP requests
  *   * update-frequency (u): Frequency to call the async progress callback in milliseconds, if any; only values higher than 0 are valid
+ *   * reuse-blocks (b): When not using a static delta, rebuild large files from the blocks of their previous version where the remote publishes block indexes (Since: 2017.3)
  */
 gboolean
 ostree_repo_pull_with_options (OstreeRepo             *self,
@@ -2435,6 +3353,7 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
   char **configured_branches = NULL;
   guint64 bytes_transferred;
   guint64 end_time;
+  OstreeRepoTransactionStats txn_stats = { 0, };
   guint update_frequency = 0;
   OstreeRepoPullFlags flags = 0;
   const char *dir_to_pull = NULL;
@@ -2444,6 +3363,7 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
   GSource *update_timeout = NULL;
   gboolean disable_static_deltas = FALSE;
   gboolean require_static_deltas = FALSE;
+  gboolean reuse_blocks = FALSE;
   gboolean opt_gpg_verify_set = FALSE;
   gboolean opt_gpg_verify_summary_set = FALSE;
   const char *url_override = NULL;
@@ -2474,6 +3394,7 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
       (void) g_variant_lookup (options, "inherit-transaction", "b", &inherit_transaction);
       (void) g_variant_lookup (options, "http-headers", "@a(ss)", &pull_data->extra_headers);
       (void) g_variant_lookup (options, "update-frequency", "u", &update_frequency);
+      (void) g_variant_lookup (options, "reuse-blocks", "b", &reuse_blocks);
     }
 
   g_return_val_if_fail (pull_data->maxdepth >= -1, FALSE);
@@ -2512,6 +3433,9 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
   pull_data->expected_commit_sizes = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                             (GDestroyNotify)g_free,
                                                             (GDestroyNotify)g_free);
+  pull_data->tree_bundles = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                   (GDestroyNotify)g_free,
+                                                   (GDestroyNotify)g_free);
   pull_data->commit_to_depth = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                       (GDestroyNotify)g_free,
                                                       NULL);
@@ -2903,6 +3827,48 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
                                  g_strdup (delta),
                                  csum_data);
           }
+
+        if (!pull_data->remote_repo_local && !pull_data->is_commit_only)
+          {
+            g_autoptr(GVariant) bundles =
+              g_variant_lookup_value (additional_metadata, OSTREE_SUMMARY_TREE_BUNDLES,
+                                      G_VARIANT_TYPE ("a(ayt)"));
+
+            n = bundles ? g_variant_n_children (bundles) : 0;
+            for (i = 0; i < n; i++)
+              {
+                g_autoptr(GVariant) csum_v = NULL;
+                guint64 bundle_size;
+                guint64 *bundle_size_p;
+
+                g_variant_get_child (bundles, i, "(@ayt)", &csum_v, &bundle_size);
+                if (!validate_variant_is_csum (csum_v, error))
+                  goto out;
+
+                bundle_size = GUINT64_FROM_BE (bundle_size);
+                if (bundle_size == 0)
+                  continue;
+
+                bundle_size_p = g_new (guint64, 1);
+                *bundle_size_p = bundle_size;
+                g_hash_table_insert (pull_data->tree_bundles,
+                                     ostree_checksum_from_bytes_v (csum_v),
+                                     bundle_size_p);
+              }
+          }
+
+        /* Reassembling objects only makes sense when we fetch them over
+         * the network, and store them unpacked */
+        if (reuse_blocks && !pull_data->remote_repo_local && !mirroring_into_archive &&
+            !pull_data->dry_run)
+          {
+            g_autoptr(GVariant) min_size_v =
+              g_variant_lookup_value (additional_metadata, OSTREE_SUMMARY_BLOCK_INDEX_MIN_SIZE,
+                                      G_VARIANT_TYPE_UINT64);
+
+            if (min_size_v)
+              pull_data->block_index_min_size = GUINT64_FROM_BE (g_variant_get_uint64 (min_size_v));
+          }
       }
   }
 
@@ -3063,6 +4029,15 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
               goto out;
             }
           g_debug ("no delta superblock for %s-%s", from_revision ? from_revision : "empty", to_revision);
+          if (pull_data->block_index_min_size > 0 && from_revision &&
+              !add_block_reuse_seeds (pull_data, from_revision, error))
+            goto out;
+          /* Updating a ref, most of the new tree's metadata is
+           * usually unchanged, and already stored; fetch only what's
+           * missing rather than the whole tree bundle.
+           */
+          if (from_revision)
+            g_hash_table_remove (pull_data->tree_bundles, to_revision);
           queue_scan_one_metadata_object (pull_data, to_revision, OSTREE_OBJECT_TYPE_COMMIT, NULL, 0);
         }
       else
@@ -3157,12 +4132,23 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
     }
 
   if (!inherit_transaction &&
-      !ostree_repo_commit_transaction (pull_data->repo, NULL, cancellable, error))
+      !ostree_repo_commit_transaction (pull_data->repo, &txn_stats, cancellable, error))
     goto out;
 
   end_time = g_get_monotonic_time ();
 
   bytes_transferred = _ostree_fetcher_bytes_transferred (pull_data->fetcher);
+  if (bytes_transferred > 0)
+    {
+      guint64 bytes_spooled = _ostree_fetcher_bytes_spooled (pull_data->fetcher);
+
+      /* Every spooled byte is written to disk once more than it needs to be */
+      g_debug ("pull: %" G_GUINT64_FORMAT " bytes fetched, %" G_GUINT64_FORMAT
+               " spooled to tmpfiles, %" G_GUINT64_FORMAT " content bytes written; "
+               "%.2f disk bytes written per byte fetched",
+               bytes_transferred, bytes_spooled, txn_stats.content_bytes_written,
+               (double)(bytes_spooled + txn_stats.content_bytes_written) / bytes_transferred);
+    }
   if (bytes_transferred > 0 && pull_data->progress)
     {
       guint shift; 
@@ -3224,6 +4210,9 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
   else
     g_clear_error (&pull_data->cached_async_error);
 
+  /* Also before aborting the transaction, which they may write into */
+  pull_wait_for_threads (pull_data);
+
   if (!inherit_transaction)
     ostree_repo_abort_transaction (pull_data->repo, cancellable, NULL);
   g_main_context_unref (pull_data->main_context);
@@ -3243,12 +4232,14 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
   g_clear_pointer (&pull_data->static_delta_superblocks, (GDestroyNotify) g_ptr_array_unref);
   g_clear_pointer (&pull_data->commit_to_depth, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&pull_data->expected_commit_sizes, (GDestroyNotify) g_hash_table_unref);
+  g_clear_pointer (&pull_data->tree_bundles, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&pull_data->scanned_metadata, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&pull_data->summary_deltas_checksums, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&pull_data->requested_content, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&pull_data->requested_metadata, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&pull_data->idle_src, (GDestroyNotify) g_source_destroy);
   g_clear_pointer (&pull_data->dirs, (GDestroyNotify) g_ptr_array_unref);
+  g_clear_pointer (&pull_data->block_reuse_seeds, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&remote_config, (GDestroyNotify) g_key_file_unref);
   return ret;
 }
@@ -333,14 +333,11 @@ ostree_repo_resolve_partial_checksum (OstreeRepo   *self,
   gboolean ret = FALSE;
   static const char hexchars[] = "0123456789abcdef";
   gsize off;
-  g_autoptr(GHashTable) ref_list = NULL;
+  g_autoptr(GHashTable) matches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   g_autofree char *ret_rev = NULL;
-  guint length;
-  const char *checksum = NULL;
-  OstreeObjectType objtype;
+  OstreeRepo *repo;
   GHashTableIter hashiter;
-  gpointer key, value;
-  GVariant *first_commit;
+  gpointer key;
 
   g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
@@ -350,36 +347,33 @@ ostree_repo_resolve_partial_checksum (OstreeRepo   *self,
   if (off > OSTREE_SHA256_STRING_LEN || refspec[off] != '\0')
     return TRUE;
 
-  /* this looks through all objects and adds them to the ref_list if:
-     a) they are a commit object AND
-     b) the obj checksum starts with the partual checksum defined by "refspec" */
-  if (!ostree_repo_list_commit_objects_starting_with (self, refspec, &ref_list, NULL, error))
-    goto out;
-
-  length = g_hash_table_size (ref_list);
+  /* Look up the commits whose checksum starts with the partial
+     checksum defined by "refspec" in the commit index of this repo
+     and its parents */
+  for (repo = self; repo; repo = repo->parent_repo)
+    {
+      g_autoptr(GPtrArray) checksums = NULL;
+      guint i;
 
-  g_hash_table_iter_init (&hashiter, ref_list);
-  if (g_hash_table_iter_next (&hashiter, &key, &value))
-    first_commit = (GVariant*) key;
-  else
-    first_commit = NULL;
+      if (!_ostree_repo_commit_index_lookup_prefix (repo, refspec, &checksums, NULL, error))
+        goto out;
 
-  if (first_commit) 
-    ostree_object_name_deserialize (first_commit, &checksum, &objtype);
+      for (i = 0; i < checksums->len; i++)
+        g_hash_table_add (matches, g_strdup (checksums->pdata[i]));
+    }
 
-  /* length more than one - multiple commits match partial refspec: is not unique */
-  if (length > 1)
+  /* more than one - multiple commits match partial refspec: is not unique */
+  if (g_hash_table_size (matches) > 1)
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                    "Refspec %s not unique", refspec);
       goto out;
     }
-    
-  /* length is 1 - a single matching commit gives us our revision */
-  else if (length == 1)
-    {
-      ret_rev = g_strdup (checksum);
-    }
+
+  /* a single matching commit gives us our revision */
+  g_hash_table_iter_init (&hashiter, matches);
+  if (g_hash_table_iter_next (&hashiter, &key, NULL))
+    ret_rev = g_strdup (key);
 
   /* Note: if length is 0, then code will return TRUE
      because there is no error, but it will return full_checksum = NULL
@@ -0,0 +1,749 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2017 The OSTree Authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+#include "ostree-varint.h"
+#include "otutil.h"
+
+/*
+ * The object size index is a flat file of fixed-size records:
+ *
+ *   32 bytes - binary checksum
+ *   8 bytes  - archived size, big endian
+ *   8 bytes  - unpacked size, big endian
+ *   1 byte   - object type
+ *   7 bytes  - padding
+ *
+ * Records are appended; later records win.  A torn trailing record
+ * (e.g. from a crash) is ignored on read and truncated away on the next
+ * append.  Writers hold _OSTREE_OBJECT_SIZE_INDEX_LOCK, and the file is
+ * rewritten without superseded records and records for deleted objects
+ * by prune, or on append once most of its records are superseded.
+ */
+#define SIZE_INDEX_RECORD_LEN 56
+
+/* Compact on append once there are this many more records on disk
+ * than distinct objects.
+ */
+#define SIZE_INDEX_COMPACT_SLACK 4096
+
+static OstreeContentSizeCacheEntry *
+content_size_cache_entry_new (OstreeObjectType objtype,
+                              guint64          unpacked,
+                              guint64          archived)
+{
+  OstreeContentSizeCacheEntry *entry = g_slice_new0 (OstreeContentSizeCacheEntry);
+
+  entry->objtype = objtype;
+  entry->unpacked = unpacked;
+  entry->archived = archived;
+
+  return entry;
+}
+
+static void
+content_size_cache_entry_free (gpointer entry)
+{
+  if (entry)
+    g_slice_free (OstreeContentSizeCacheEntry, entry);
+}
+
+static GHashTable *
+object_sizes_table_new (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal,
+                                g_free, content_size_cache_entry_free);
+}
+
+static void
+ensure_object_sizes_table_unlocked (OstreeRepo *self)
+{
+  if (G_UNLIKELY (self->object_sizes == NULL))
+    self->object_sizes = object_sizes_table_new ();
+}
+
+static void
+size_index_record_init (guint8           *rec,
+                        OstreeObjectType  objtype,
+                        const char       *checksum,
+                        guint64           unpacked,
+                        guint64           archived)
+{
+  guint64 archived_be = GUINT64_TO_BE (archived);
+  guint64 unpacked_be = GUINT64_TO_BE (unpacked);
+
+  memset (rec, 0, SIZE_INDEX_RECORD_LEN);
+  ostree_checksum_inplace_to_bytes (checksum, rec);
+  memcpy (rec + 32, &archived_be, sizeof (archived_be));
+  memcpy (rec + 40, &unpacked_be, sizeof (unpacked_be));
+  rec[48] = (guint8) objtype;
+}
+
+/* Read the on-disk index into a new table, or set it to %NULL if there
+ * is no index.
+ */
+static gboolean
+read_size_index (OstreeRepo    *self,
+                 GHashTable   **out_records,
+                 GCancellable  *cancellable,
+                 GError       **error)
+{
+  glnx_fd_close int fd = -1;
+  g_autoptr(GBytes) contents = NULL;
+  g_autoptr(GHashTable) records = NULL;
+  const guint8 *buf;
+  gsize len;
+  gsize i;
+
+  if (!ot_openat_ignore_enoent (self->repo_dir_fd, _OSTREE_OBJECT_SIZE_INDEX_PATH, &fd, error))
+    return FALSE;
+
+  if (fd == -1)
+    {
+      *out_records = NULL;
+      return TRUE;
+    }
+
+  contents = glnx_fd_readall_bytes (fd, cancellable, error);
+  if (!contents)
+    return FALSE;
+
+  records = object_sizes_table_new ();
+  buf = g_bytes_get_data (contents, &len);
+  for (i = 0; i + SIZE_INDEX_RECORD_LEN <= len; i += SIZE_INDEX_RECORD_LEN)
+    {
+      const guint8 *rec = buf + i;
+      char checksum[OSTREE_SHA256_STRING_LEN+1];
+      guint64 archived, unpacked;
+      guint8 objtype = rec[48];
+
+      if (objtype < OSTREE_OBJECT_TYPE_FILE || objtype > OSTREE_OBJECT_TYPE_LAST)
+        continue;
+
+      ostree_checksum_inplace_from_bytes (rec, checksum);
+      memcpy (&archived, rec + 32, sizeof (archived));
+      memcpy (&unpacked, rec + 40, sizeof (unpacked));
+      g_hash_table_replace (records, g_strdup (checksum),
+                            content_size_cache_entry_new ((OstreeObjectType) objtype,
+                                                          GUINT64_FROM_BE (unpacked),
+                                                          GUINT64_FROM_BE (archived)));
+    }
+
+  *out_records = g_steal_pointer (&records);
+  return TRUE;
+}
+
+/* Load the on-disk index into self->object_sizes; entries already in
+ * memory were written by us more recently and take precedence.
+ */
+static gboolean
+ensure_size_index_loaded_unlocked (OstreeRepo    *self,
+                                   GCancellable  *cancellable,
+                                   GError       **error)
+{
+  g_autoptr(GHashTable) records = NULL;
+  GHashTableIter hashiter;
+  gpointer key, value;
+
+  if (self->object_sizes_loaded)
+    return TRUE;
+
+  ensure_object_sizes_table_unlocked (self);
+
+  if (!read_size_index (self, &records, cancellable, error))
+    return FALSE;
+
+  if (records != NULL)
+    {
+      g_hash_table_iter_init (&hashiter, self->object_sizes);
+      while (g_hash_table_iter_next (&hashiter, &key, &value))
+        {
+          g_hash_table_replace (records, key, value);
+          g_hash_table_iter_steal (&hashiter);
+        }
+
+      g_hash_table_unref (self->object_sizes);
+      self->object_sizes = g_steal_pointer (&records);
+    }
+
+  self->object_sizes_loaded = TRUE;
+  return TRUE;
+}
+
+static gboolean
+lock_size_index (OstreeRepo    *self,
+                 GLnxLockFile  *lock,
+                 GCancellable  *cancellable,
+                 GError       **error)
+{
+  if (!glnx_shutil_mkdir_p_at (self->repo_dir_fd, "state", 0777, cancellable, error))
+    return FALSE;
+
+  return glnx_make_lock_file (self->repo_dir_fd, _OSTREE_OBJECT_SIZE_INDEX_LOCK,
+                              LOCK_EX, lock, error);
+}
+
+/* Rewrite the index with only the latest record for each object that
+ * is still stored; must hold _OSTREE_OBJECT_SIZE_INDEX_LOCK.
+ */
+static gboolean
+compact_size_index_locked (OstreeRepo    *self,
+                           GCancellable  *cancellable,
+                           GError       **error)
+{
+  g_autoptr(GHashTable) records = NULL;
+  g_autoptr(GPtrArray) dropped = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GArray) out = NULL;
+  GHashTableIter hashiter;
+  gpointer key, value;
+  guint i;
+
+  if (!read_size_index (self, &records, cancellable, error))
+    return FALSE;
+  if (records == NULL)
+    return TRUE;
+
+  out = g_array_sized_new (FALSE, FALSE, SIZE_INDEX_RECORD_LEN, g_hash_table_size (records));
+
+  g_hash_table_iter_init (&hashiter, records);
+  while (g_hash_table_iter_next (&hashiter, &key, &value))
+    {
+      const char *checksum = key;
+      OstreeContentSizeCacheEntry *entry = value;
+      char loose_path[_OSTREE_LOOSE_PATH_MAX];
+      guint8 rec[SIZE_INDEX_RECORD_LEN];
+      struct stat stbuf;
+
+      _ostree_loose_path (loose_path, checksum, entry->objtype, self->mode);
+      if (fstatat (self->objects_dir_fd, loose_path, &stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+        {
+          if (errno != ENOENT)
+            {
+              glnx_set_prefix_error_from_errno (error, "Querying object %s.%s", checksum,
+                                                ostree_object_type_to_string (entry->objtype));
+              return FALSE;
+            }
+          g_ptr_array_add (dropped, g_strdup (checksum));
+          continue;
+        }
+
+      size_index_record_init (rec, entry->objtype, checksum, entry->unpacked, entry->archived);
+      g_array_append_val (out, rec);
+    }
+
+  if (!_ostree_repo_file_replace_contents (self, self->repo_dir_fd, _OSTREE_OBJECT_SIZE_INDEX_PATH,
+                                           (guint8*) out->data, out->len * SIZE_INDEX_RECORD_LEN,
+                                           cancellable, error))
+    return FALSE;
+
+  g_mutex_lock (&self->object_sizes_lock);
+  for (i = 0; self->object_sizes && i < dropped->len; i++)
+    g_hash_table_remove (self->object_sizes, dropped->pdata[i]);
+  g_mutex_unlock (&self->object_sizes_lock);
+
+  g_debug ("compacted object size index to %u records, dropped %u",
+           out->len, dropped->len);
+  return TRUE;
+}
+
+/*
+ * _ostree_repo_compact_size_index:
+ *
+ * Rewrite the persistent size index without superseded records and
+ * records for objects which are no longer stored; used by prune.
+ */
+gboolean
+_ostree_repo_compact_size_index (OstreeRepo    *self,
+                                 GCancellable  *cancellable,
+                                 GError       **error)
+{
+  g_auto(GLnxLockFile) lock = GLNX_LOCK_FILE_INIT;
+
+  if (!lock_size_index (self, &lock, cancellable, error))
+    return FALSE;
+
+  return compact_size_index_locked (self, cancellable, error);
+}
+
+/*
+ * _ostree_repo_store_size_entry:
+ *
+ * Record the sizes of an object; the entry is kept in memory and
+ * appended to the persistent index on the next
+ * _ostree_repo_flush_size_index().
+ */
+void
+_ostree_repo_store_size_entry (OstreeRepo       *self,
+                               OstreeObjectType  objtype,
+                               const char       *checksum,
+                               guint64           unpacked,
+                               guint64           archived)
+{
+  guint8 rec[SIZE_INDEX_RECORD_LEN];
+
+  size_index_record_init (rec, objtype, checksum, unpacked, archived);
+
+  g_mutex_lock (&self->object_sizes_lock);
+  ensure_object_sizes_table_unlocked (self);
+  g_hash_table_replace (self->object_sizes,
+                        g_strdup (checksum),
+                        content_size_cache_entry_new (objtype, unpacked, archived));
+  if (self->object_sizes_pending == NULL)
+    self->object_sizes_pending = g_array_new (FALSE, FALSE, SIZE_INDEX_RECORD_LEN);
+  g_array_append_val (self->object_sizes_pending, rec);
+  g_mutex_unlock (&self->object_sizes_lock);
+}
+
+static gboolean
+stat_loose_object (OstreeRepo       *self,
+                   OstreeObjectType  objtype,
+                   const char       *checksum,
+                   struct stat      *out_stbuf,
+                   GError          **error)
+{
+  char loose_path[_OSTREE_LOOSE_PATH_MAX];
+
+  _ostree_loose_path (loose_path, checksum, objtype, self->mode);
+
+  if (self->commit_stagedir_fd != -1 &&
+      fstatat (self->commit_stagedir_fd, loose_path, out_stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+    return TRUE;
+
+  if (fstatat (self->objects_dir_fd, loose_path, out_stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+    {
+      glnx_set_prefix_error_from_errno (error, "Querying object %s.%s", checksum,
+                                        ostree_object_type_to_string (objtype));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+ * _ostree_repo_get_object_size_entry:
+ *
+ * Look up the sizes of an object in the size index; if it isn't there,
+ * compute them from the stored object (which for content only requires
+ * reading its header) and add them to the index.
+ */
+gboolean
+_ostree_repo_get_object_size_entry (OstreeRepo                  *self,
+                                    OstreeObjectType             objtype,
+                                    const char                  *checksum,
+                                    OstreeContentSizeCacheEntry *out_entry,
+                                    GCancellable                *cancellable,
+                                    GError                     **error)
+{
+  OstreeContentSizeCacheEntry *entry;
+  struct stat stbuf;
+  guint64 unpacked;
+  gboolean found = FALSE;
+
+  g_mutex_lock (&self->object_sizes_lock);
+  if (!ensure_size_index_loaded_unlocked (self, cancellable, error))
+    {
+      g_mutex_unlock (&self->object_sizes_lock);
+      return FALSE;
+    }
+  entry = g_hash_table_lookup (self->object_sizes, checksum);
+  if (entry && entry->objtype == objtype)
+    {
+      *out_entry = *entry;
+      found = TRUE;
+    }
+  g_mutex_unlock (&self->object_sizes_lock);
+
+  if (found)
+    return TRUE;
+
+  if (!stat_loose_object (self, objtype, checksum, &stbuf, error))
+    return FALSE;
+
+  if (objtype == OSTREE_OBJECT_TYPE_FILE)
+    {
+      g_autoptr(GFileInfo) file_info = NULL;
+
+      if (!ostree_repo_load_file (self, checksum, NULL, &file_info, NULL,
+                                  cancellable, error))
+        return FALSE;
+
+      if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
+        unpacked = g_file_info_get_size (file_info);
+      else
+        unpacked = 0;
+    }
+  else
+    unpacked = stbuf.st_size;
+
+  _ostree_repo_store_size_entry (self, objtype, checksum, unpacked, stbuf.st_size);
+
+  out_entry->objtype = objtype;
+  out_entry->unpacked = unpacked;
+  out_entry->archived = stbuf.st_size;
+  return TRUE;
+}
+
+/*
+ * _ostree_repo_flush_size_index:
+ *
+ * Append any size entries recorded since the last flush to the
+ * persistent index.
+ */
+gboolean
+_ostree_repo_flush_size_index (OstreeRepo    *self,
+                               GCancellable  *cancellable,
+                               GError       **error)
+{
+  g_auto(GLnxLockFile) lock = GLNX_LOCK_FILE_INIT;
+  g_autoptr(GArray) pending = NULL;
+  glnx_fd_close int fd = -1;
+  struct stat stbuf;
+  guint n_known = 0;
+
+  g_mutex_lock (&self->object_sizes_lock);
+  pending = g_steal_pointer (&self->object_sizes_pending);
+  if (self->object_sizes_loaded)
+    n_known = g_hash_table_size (self->object_sizes);
+  g_mutex_unlock (&self->object_sizes_lock);
+
+  if (pending == NULL || pending->len == 0)
+    return TRUE;
+
+  if (!lock_size_index (self, &lock, cancellable, error))
+    return FALSE;
+
+  /* If we've loaded the index, we know how many distinct objects it
+   * covers; rewrite it once it is mostly superseded records.
+   */
+  if (n_known > 0 &&
+      fstatat (self->repo_dir_fd, _OSTREE_OBJECT_SIZE_INDEX_PATH, &stbuf, 0) == 0 &&
+      stbuf.st_size / SIZE_INDEX_RECORD_LEN > 2 * (guint64) n_known + SIZE_INDEX_COMPACT_SLACK)
+    {
+      if (!compact_size_index_locked (self, cancellable, error))
+        return FALSE;
+    }
+
+  fd = openat (self->repo_dir_fd, _OSTREE_OBJECT_SIZE_INDEX_PATH,
+               O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    {
+      glnx_set_prefix_error_from_errno (error, "Opening %s", _OSTREE_OBJECT_SIZE_INDEX_PATH);
+      return FALSE;
+    }
+
+  if (fstat (fd, &stbuf) < 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  /* Drop a torn record so that ours stay aligned */
+  if (stbuf.st_size % SIZE_INDEX_RECORD_LEN != 0 &&
+      ftruncate (fd, stbuf.st_size - (stbuf.st_size % SIZE_INDEX_RECORD_LEN)) < 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  if (glnx_loop_write (fd, pending->data, pending->len * SIZE_INDEX_RECORD_LEN) < 0)
+    {
+      glnx_set_prefix_error_from_errno (error, "Writing %s", _OSTREE_OBJECT_SIZE_INDEX_PATH);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+ * _ostree_repo_discard_pending_sizes:
+ *
+ * Forget size entries which haven't been flushed yet, e.g. because the
+ * transaction that wrote their objects was aborted.
+ */
+void
+_ostree_repo_discard_pending_sizes (OstreeRepo *self)
+{
+  g_mutex_lock (&self->object_sizes_lock);
+  g_clear_pointer (&self->object_sizes_pending, g_array_unref);
+  g_mutex_unlock (&self->object_sizes_lock);
+}
+
+static gboolean
+ostree_repo_commit_unpack_sizes (GVariant                    *entry,
+                                 OstreeContentSizeCacheEntry *sizes,
+                                 char                        *csum)
+{
+  gboolean ret = FALSE;
+  const guchar *buffer;
+  gsize bytes_read = 0;
+  gsize object_size = g_variant_get_size (entry);
+
+  if (object_size <= 32)
+    goto out;
+
+  buffer = g_variant_get_data (entry);
+  if (!buffer)
+    goto out;
+
+  ostree_checksum_inplace_from_bytes (buffer, csum);
+  buffer += 32;
+  object_size -= 32;
+
+  if (!_ostree_read_varuint64 (buffer, object_size, &(sizes->archived), &bytes_read))
+    goto out;
+  buffer += bytes_read;
+  object_size -= bytes_read;
+
+  if (!_ostree_read_varuint64 (buffer, object_size, &(sizes->unpacked), &bytes_read))
+    goto out;
+  buffer += bytes_read;
+  object_size -= bytes_read;
+
+  if (object_size < 1)
+    goto out;
+
+  if (*buffer < OSTREE_OBJECT_TYPE_FILE || *buffer > OSTREE_OBJECT_TYPE_LAST)
+    goto out;
+  sizes->objtype = (OstreeObjectType) *buffer;
+
+  ret = TRUE;
+out:
+  return ret;
+}
+
+/*
+ * _ostree_repo_get_commit_object_sizes:
+ * @self: Repo
+ * @commit_checksum: Commit checksum
+ * @out_sizes: (out): Sizes of type a{s(ytt)}, mapping each object
+ *   checksum to (objtype, archived, unpacked)
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Get the sizes of all objects referenced by a commit.  These are
+ * read from the %ostree.sizes commit metadata if present; otherwise the
+ * commit is traversed and sizes are taken from the object size index.
+ */
+gboolean
+_ostree_repo_get_commit_object_sizes (OstreeRepo    *self,
+                                      const char    *commit_checksum,
+                                      GVariant     **out_sizes,
+                                      GCancellable  *cancellable,
+                                      GError       **error)
+{
+  g_autoptr(GVariant) commit = NULL;
+  g_autoptr(GVariant) metadata = NULL;
+  g_autoptr(GVariant) sizes = NULL;
+  g_auto(GVariantBuilder) builder = OT_VARIANT_BUILDER_INITIALIZER;
+
+  if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_COMMIT, commit_checksum,
+                                 &commit, error))
+    return FALSE;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(ytt)}"));
+
+  metadata = g_variant_get_child_value (commit, 0);
+  sizes = g_variant_lookup_value (metadata, "ostree.sizes", G_VARIANT_TYPE ("aay"));
+  if (sizes)
+    {
+      GVariantIter obj_iter;
+      GVariant *object;
+
+      g_variant_iter_init (&obj_iter, sizes);
+      while ((object = g_variant_iter_next_value (&obj_iter)))
+        {
+          OstreeContentSizeCacheEntry entry;
+          char csum[OSTREE_SHA256_STRING_LEN+1];
+          gboolean valid = ostree_repo_commit_unpack_sizes (object, &entry, csum);
+
+          g_variant_unref (object);
+          if (!valid)
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Invalid object size metadata");
+              return FALSE;
+            }
+
+          g_variant_builder_add (&builder, "{s(ytt)}", csum,
+                                 (guint8) entry.objtype, entry.archived, entry.unpacked);
+        }
+    }
+  else
+    {
+      g_autoptr(GHashTable) reachable = NULL;
+      GHashTableIter hashiter;
+      gpointer key, value;
+
+      if (!ostree_repo_traverse_commit (self, commit_checksum, 0, &reachable,
+                                        cancellable, error))
+        return FALSE;
+
+      g_hash_table_iter_init (&hashiter, reachable);
+      while (g_hash_table_iter_next (&hashiter, &key, &value))
+        {
+          GVariant *serialized_key = key;
+          const char *checksum;
+          OstreeObjectType objtype;
+          OstreeContentSizeCacheEntry entry;
+
+          ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+          if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+            continue;
+
+          if (!_ostree_repo_get_object_size_entry (self, objtype, checksum, &entry,
+                                                   cancellable, error))
+            return FALSE;
+
+          g_variant_builder_add (&builder, "{s(ytt)}", checksum,
+                                 (guint8) entry.objtype, entry.archived, entry.unpacked);
+        }
+
+      /* Outside of a transaction, opportunistically persist what we
+       * computed; the index is only a cache so failure isn't fatal.
+       */
+      if (self->writable && !self->in_transaction)
+        {
+          g_autoptr(GError) local_error = NULL;
+
+          if (!_ostree_repo_flush_size_index (self, cancellable, &local_error))
+            g_debug ("Failed to update object size index: %s", local_error->message);
+        }
+    }
+
+  *out_sizes = g_variant_ref_sink (g_variant_builder_end (&builder));
+  return TRUE;
+}
+
+/**
+ * ostree_repo_get_commit_sizes
+ * @self: Self
+ * @rev: Commit checksum
+ * @new_archived: (out) (optional): number of archived bytes for the commit
+ *                missing from the repository, or %NULL
+ * @new_unpacked: (out) (optional): number of unpacked bytes for the commit
+ *                missing from the repository, or %NULL
+ * @new_files: (out) (optional): number of files for the commit missing from
+ *             the repository, or %NULL
+ * @archived: (out) (optional): number of archived bytes for the commit in the
+ *            repository, or %NULL
+ * @unpacked: (out) (optional): number of unpacked bytes for the commit in the
+ *            repository, or %NULL
+ * @files: (out) (optional): number of files for the commit in the repository,
+ *         or %NULL
+ * @cancellable: a #GCancellable
+ * @error: a #GError
+ *
+ * Reads the size data for the commit stored in the %ostree.sizes key in
+ * the commit metadata. If this data is not available, %FALSE is
+ * returned and @error is set to %G_IO_ERROR_NOT_FOUND.
+ *
+ * Returns: %TRUE on success, %FALSE on failure
+ */
+gboolean
+ostree_repo_get_commit_sizes (OstreeRepo *self,
+                              const char *rev,
+                              gint64 *new_archived,
+                              gint64 *new_unpacked,
+                              gsize  *new_files,
+                              gint64 *archived,
+                              gint64 *unpacked,
+                              gsize  *files,
+                              GCancellable *cancellable,
+                              GError **error)
+{
+  gboolean ret = FALSE;
+  guint64 n_archived = 0;
+  guint64 n_unpacked = 0;
+  gsize n_files = 0;
+  guint64 t_archived = 0;
+  guint64 t_unpacked = 0;
+  gsize t_files = 0;
+  GVariantIter obj_iter;
+  g_autoptr(GVariant) object = NULL;
+  g_autoptr(GVariant) commit = NULL;
+  g_autoptr(GVariant) metadata = NULL;
+  g_autoptr(GVariant) sizes = NULL;
+
+  if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_COMMIT, rev,
+                                 &commit, error))
+    {
+      g_prefix_error (error, "Failed to read commit: ");
+      goto out;
+    }
+
+  metadata = g_variant_get_child_value (commit, 0);
+
+  sizes = g_variant_lookup_value (metadata, "ostree.sizes", G_VARIANT_TYPE("aay"));
+  if (!sizes)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "No metadata key ostree.sizes in commit %s", rev);
+      goto out;
+    }
+
+  g_variant_iter_init (&obj_iter, sizes);
+  while ((object = g_variant_iter_next_value (&obj_iter)))
+    {
+      OstreeContentSizeCacheEntry entry;
+      char csum[65];
+      gboolean exists;
+
+      if (!ostree_repo_commit_unpack_sizes (object, &entry, csum))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Invalid object size metadata");
+          goto out;
+        }
+      g_variant_unref (object);
+      object = NULL;
+
+      t_archived += entry.archived;
+      t_unpacked += entry.unpacked;
+
+      if (entry.objtype == OSTREE_OBJECT_TYPE_FILE)
+        t_files++;
+
+      if (!ostree_repo_has_object (self, entry.objtype,
+                                   csum, &exists, cancellable, error))
+        goto out;
+
+      /* cache check completed, but file is not in cache */
+      if (!exists)
+        {
+          n_archived += entry.archived;
+          n_unpacked += entry.unpacked;
+          if (entry.objtype == OSTREE_OBJECT_TYPE_FILE)
+            n_files++;
+        }
+    }
+
+  ret = TRUE;
+  if (new_archived) *new_archived = n_archived;
+  if (new_unpacked) *new_unpacked = n_unpacked;
+  if (new_files) *new_files = n_files;
+  if (archived) *archived = t_archived;
+  if (unpacked) *unpacked = t_unpacked;
+  if (files) *files = t_files;
+out:
+  return ret;
+}
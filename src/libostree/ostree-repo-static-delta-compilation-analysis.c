@@ -218,12 +218,542 @@ string_array_nonempty_intersection (GPtrArray    *a,
   return FALSE;
 }
 
+/* Content fingerprints for objects which basename matching can't pair
+ * up (renamed or moved files).  Each object is split into
+ * content-defined chunks using a buzhash over a small window, and the
+ * chunk hashes are summarised as a MinHash signature: for each of
+ * MINHASH_N_HASHES hash functions, the smallest value over all chunks.
+ * The fraction of equal slots between two signatures estimates the
+ * fraction of chunks the objects share.  Signatures are fixed-size and
+ * computed by streaming, so memory doesn't depend on object sizes.
+ *
+ * Candidates are found with locality sensitive hashing: signatures
+ * are split into bands, and objects which are equal in any band are
+ * compared.
+ */
+#define MINHASH_N_HASHES 32
+#define MINHASH_N_BANDS 16
+#define MINHASH_ROWS_PER_BAND (MINHASH_N_HASHES / MINHASH_N_BANDS)
+/* Smaller objects have too few chunks for a useful estimate */
+#define MINHASH_MIN_SIZE (16 * 1024)
+#define MINHASH_SIMILARITY_THRESHOLD_PERCENT (40)
+/* Bands shared by many objects (e.g. runs of zeroes) say little */
+#define MINHASH_BUCKET_MAX 32
+
+#define FINGERPRINT_WINDOW 32
+#define FINGERPRINT_CHUNK_MASK 0x7ff
+#define FINGERPRINT_CHUNK_MAX (16 * 1024)
+#define FINGERPRINT_BUFSIZE (64 * 1024)
+
+#define FNV64_OFFSET G_GUINT64_CONSTANT (14695981039346656037)
+#define FNV64_PRIME G_GUINT64_CONSTANT (1099511628211)
+
+typedef struct {
+  OstreeDeltaContentSizeNames *sizenames; /* Unowned */
+  guint64 minhash[MINHASH_N_HASHES];
+  gboolean valid;
+} ContentFingerprint;
+
+static guint64
+mix64 (guint64 v)
+{
+  /* splitmix64 finalizer */
+  v = (v ^ (v >> 30)) * G_GUINT64_CONSTANT (0xbf58476d1ce4e5b9);
+  v = (v ^ (v >> 27)) * G_GUINT64_CONSTANT (0x94d049bb133111eb);
+  return v ^ (v >> 31);
+}
+
+static const guint32 *
+get_buzhash_table (void)
+{
+  static gsize initialized;
+  static guint32 table[256];
+
+  if (g_once_init_enter (&initialized))
+    {
+      guint i;
+
+      for (i = 0; i < G_N_ELEMENTS (table); i++)
+        table[i] = (guint32) mix64 (i + 1);
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return table;
+}
+
+static void
+fingerprint_add_chunk (ContentFingerprint *fp,
+                       guint64             chunk_hash)
+{
+  guint i;
+
+  for (i = 0; i < MINHASH_N_HASHES; i++)
+    {
+      guint64 v = mix64 (chunk_hash ^ (G_GUINT64_CONSTANT (0x9e3779b97f4a7c15) * (i + 1)));
+      if (v < fp->minhash[i])
+        fp->minhash[i] = v;
+    }
+  fp->valid = TRUE;
+}
+
+static gboolean
+compute_fingerprint (OstreeRepo          *repo,
+                     ContentFingerprint  *fp,
+                     GCancellable        *cancellable,
+                     GError             **error)
+{
+  const guint32 *table = get_buzhash_table ();
+  g_autoptr(GInputStream) in = NULL;
+  g_autofree guint8 *buf = g_malloc (FINGERPRINT_BUFSIZE);
+  guint8 window[FINGERPRINT_WINDOW] = { 0, };
+  guint window_pos = 0;
+  guint32 roll = 0;
+  guint64 chunk_hash = FNV64_OFFSET;
+  gsize chunk_len = 0;
+  gssize n;
+  guint i;
+
+  for (i = 0; i < MINHASH_N_HASHES; i++)
+    fp->minhash[i] = G_MAXUINT64;
+
+  if (!ostree_repo_load_file (repo, fp->sizenames->checksum, &in, NULL, NULL,
+                              cancellable, error))
+    return FALSE;
+
+  while ((n = g_input_stream_read (in, buf, FINGERPRINT_BUFSIZE, cancellable, error)) > 0)
+    {
+      gssize j;
+
+      for (j = 0; j < n; j++)
+        {
+          guint8 b = buf[j];
+          guint8 out = window[window_pos];
+
+          window[window_pos] = b;
+          window_pos = (window_pos + 1) % FINGERPRINT_WINDOW;
+          /* The byte leaving the window has been rotated a full 32
+           * bits, so it cancels without rotating its table entry. */
+          roll = ((roll << 1) | (roll >> 31)) ^ table[out] ^ table[b];
+
+          chunk_hash = (chunk_hash ^ b) * FNV64_PRIME;
+          chunk_len++;
+
+          if (chunk_len >= FINGERPRINT_WINDOW &&
+              ((roll & FINGERPRINT_CHUNK_MASK) == 0 || chunk_len >= FINGERPRINT_CHUNK_MAX))
+            {
+              fingerprint_add_chunk (fp, chunk_hash);
+              chunk_hash = FNV64_OFFSET;
+              chunk_len = 0;
+            }
+        }
+    }
+  if (n < 0)
+    return FALSE;
+
+  if (chunk_len > 0)
+    fingerprint_add_chunk (fp, chunk_hash);
+
+  return TRUE;
+}
+
+typedef struct {
+  OstreeRepo *repo;
+  GCancellable *cancellable;
+  GMutex lock;
+  GError *error;
+} FingerprintPoolData;
+
+static void
+fingerprint_pool_run (gpointer data,
+                      gpointer user_data)
+{
+  ContentFingerprint *fp = data;
+  FingerprintPoolData *pool_data = user_data;
+  GError *local_error = NULL;
+  gboolean failed;
+
+  g_mutex_lock (&pool_data->lock);
+  failed = pool_data->error != NULL;
+  g_mutex_unlock (&pool_data->lock);
+  if (failed)
+    return;
+
+  if (!compute_fingerprint (pool_data->repo, fp, pool_data->cancellable, &local_error))
+    {
+      g_mutex_lock (&pool_data->lock);
+      if (!pool_data->error)
+        pool_data->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&pool_data->lock);
+    }
+}
+
+struct OstreeDeltaAnalysisCache {
+  guint n_threads; /* For each compute_fingerprints() call */
+  GMutex lock;
+  GHashTable *sizenames; /* commit checksum -> GPtrArray<OstreeDeltaContentSizeNames> */
+  GHashTable *fingerprints; /* object checksum -> ContentFingerprint */
+};
+
+/* @n_threads bounds the threads each delta uses to fingerprint objects,
+ * so that deltas generated in parallel don't each use every CPU.
+ */
+OstreeDeltaAnalysisCache *
+_ostree_delta_analysis_cache_new (guint n_threads)
+{
+  OstreeDeltaAnalysisCache *cache = g_new0 (OstreeDeltaAnalysisCache, 1);
+
+  cache->n_threads = n_threads;
+  g_mutex_init (&cache->lock);
+  cache->sizenames = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, (GDestroyNotify) g_ptr_array_unref);
+  cache->fingerprints = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  return cache;
+}
+
+void
+_ostree_delta_analysis_cache_free (OstreeDeltaAnalysisCache *cache)
+{
+  g_mutex_clear (&cache->lock);
+  g_hash_table_unref (cache->sizenames);
+  g_hash_table_unref (cache->fingerprints);
+  g_free (cache);
+}
+
+/* Like build_content_sizenames_filtered(), but if @cache is given,
+ * the commit is only traversed the first time; the entries of
+ * @out_sizenames are then owned by @cache.
+ */
+static gboolean
+get_content_sizenames (OstreeRepo                *repo,
+                       OstreeDeltaAnalysisCache  *cache,
+                       GVariant                  *commit,
+                       GHashTable                *include_only_objects,
+                       GPtrArray                **out_sizenames,
+                       GCancellable              *cancellable,
+                       GError                   **error)
+{
+  g_autofree char *commit_checksum = NULL;
+  g_autoptr(GPtrArray) ret_sizenames = NULL;
+  GPtrArray *all_sizenames;
+  guint i;
+
+  if (!cache)
+    return build_content_sizenames_filtered (repo, commit, include_only_objects,
+                                             out_sizenames, cancellable, error);
+
+  commit_checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                                 g_variant_get_data (commit),
+                                                 g_variant_get_size (commit));
+
+  g_mutex_lock (&cache->lock);
+  all_sizenames = g_hash_table_lookup (cache->sizenames, commit_checksum);
+  g_mutex_unlock (&cache->lock);
+
+  if (!all_sizenames)
+    {
+      g_autoptr(GPtrArray) built_sizenames = NULL;
+
+      if (!build_content_sizenames_filtered (repo, commit, NULL, &built_sizenames,
+                                             cancellable, error))
+        return FALSE;
+
+      /* Another delta may have raced with us; keep the first */
+      g_mutex_lock (&cache->lock);
+      all_sizenames = g_hash_table_lookup (cache->sizenames, commit_checksum);
+      if (!all_sizenames)
+        {
+          all_sizenames = built_sizenames;
+          g_hash_table_insert (cache->sizenames, g_steal_pointer (&commit_checksum),
+                               g_steal_pointer (&built_sizenames));
+        }
+      g_mutex_unlock (&cache->lock);
+    }
+
+  /* Filtering keeps the order by size */
+  ret_sizenames = g_ptr_array_new ();
+  for (i = 0; i < all_sizenames->len; i++)
+    {
+      OstreeDeltaContentSizeNames *sizenames = all_sizenames->pdata[i];
+
+      if (!include_only_objects ||
+          g_hash_table_contains (include_only_objects, sizenames->checksum))
+        g_ptr_array_add (ret_sizenames, sizenames);
+    }
+
+  *out_sizenames = g_steal_pointer (&ret_sizenames);
+  return TRUE;
+}
+
+/* Compute the fingerprints of @fingerprints in parallel, one object
+ * per job.  Fingerprints found in @cache (if any) are reused, and new
+ * ones added to it.
+ */
+static gboolean
+compute_fingerprints (OstreeRepo                *repo,
+                      OstreeDeltaAnalysisCache  *cache,
+                      GArray                    *fingerprints,
+                      GCancellable              *cancellable,
+                      GError                   **error)
+{
+  FingerprintPoolData pool_data = { repo, cancellable, };
+  g_autoptr(GPtrArray) pending = g_ptr_array_new ();
+  GThreadPool *pool;
+  guint i;
+
+  if (cache)
+    g_mutex_lock (&cache->lock);
+  for (i = 0; i < fingerprints->len; i++)
+    {
+      ContentFingerprint *fp = &g_array_index (fingerprints, ContentFingerprint, i);
+      ContentFingerprint *cached = cache ?
+        g_hash_table_lookup (cache->fingerprints, fp->sizenames->checksum) : NULL;
+
+      if (cached)
+        {
+          memcpy (fp->minhash, cached->minhash, sizeof (fp->minhash));
+          fp->valid = cached->valid;
+        }
+      else
+        g_ptr_array_add (pending, fp);
+    }
+  if (cache)
+    g_mutex_unlock (&cache->lock);
+
+  if (pending->len == 0)
+    return TRUE;
+
+  g_mutex_init (&pool_data.lock);
+  pool = g_thread_pool_new (fingerprint_pool_run, &pool_data,
+                            MIN (cache ? cache->n_threads : g_get_num_processors (), pending->len),
+                            FALSE, error);
+  if (!pool)
+    {
+      g_mutex_clear (&pool_data.lock);
+      return FALSE;
+    }
+
+  for (i = 0; i < pending->len; i++)
+    g_thread_pool_push (pool, pending->pdata[i], NULL);
+
+  /* Waits for all jobs */
+  g_thread_pool_free (pool, FALSE, TRUE);
+  g_mutex_clear (&pool_data.lock);
+
+  if (pool_data.error)
+    {
+      g_propagate_error (error, pool_data.error);
+      return FALSE;
+    }
+
+  if (cache)
+    {
+      g_mutex_lock (&cache->lock);
+      for (i = 0; i < pending->len; i++)
+        {
+          ContentFingerprint *fp = pending->pdata[i];
+          ContentFingerprint *cached = g_memdup (fp, sizeof (*fp));
+
+          /* Only the signature is reused */
+          cached->sizenames = NULL;
+          g_hash_table_replace (cache->fingerprints,
+                                g_strdup (fp->sizenames->checksum), cached);
+        }
+      g_mutex_unlock (&cache->lock);
+    }
+
+  return TRUE;
+}
+
+static guint64
+fingerprint_band_key (ContentFingerprint *fp,
+                      guint               band)
+{
+  guint64 key = mix64 (band + 1);
+  guint i;
+
+  for (i = 0; i < MINHASH_ROWS_PER_BAND; i++)
+    key = mix64 (key ^ fp->minhash[band * MINHASH_ROWS_PER_BAND + i]);
+
+  return key;
+}
+
+static guint
+fingerprint_similarity_percent (ContentFingerprint *a,
+                                ContentFingerprint *b)
+{
+  guint i, n_equal = 0;
+
+  for (i = 0; i < MINHASH_N_HASHES; i++)
+    {
+      if (a->minhash[i] == b->minhash[i])
+        n_equal++;
+    }
+
+  return n_equal * 100 / MINHASH_N_HASHES;
+}
+
+static void
+fingerprint_init (GArray                      *fingerprints,
+                  OstreeDeltaContentSizeNames *sizenames)
+{
+  ContentFingerprint fp = { sizenames, };
+
+  g_array_append_val (fingerprints, fp);
+}
+
+/*
+ * For each object in @to_sizes which isn't yet a key of
+ * @modified_regfile_content, find the object in @from_sizes with the
+ * most similar content fingerprint, if any is similar enough.  Only
+ * objects which @to_reachable_objects no longer contains are
+ * candidates: a file which didn't change is rarely where another one
+ * came from.
+ */
+static gboolean
+compute_similar_objects_by_content (OstreeRepo     *repo,
+                                    OstreeDeltaAnalysisCache *cache,
+                                    GPtrArray      *from_sizes,
+                                    GPtrArray      *to_sizes,
+                                    GHashTable     *to_reachable_objects,
+                                    GHashTable     *modified_regfile_content,
+                                    GCancellable   *cancellable,
+                                    GError        **error)
+{
+  g_autoptr(GArray) from_fingerprints = g_array_new (FALSE, FALSE, sizeof (ContentFingerprint));
+  g_autoptr(GArray) to_fingerprints = g_array_new (FALSE, FALSE, sizeof (ContentFingerprint));
+  g_autoptr(GHashTable) bands =
+    g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, (GDestroyNotify) g_array_unref);
+  guint n_found = 0;
+  guint i;
+
+  for (i = 0; i < to_sizes->len; i++)
+    {
+      OstreeDeltaContentSizeNames *to_sizenames = to_sizes->pdata[i];
+
+      if (to_sizenames->size >= MINHASH_MIN_SIZE &&
+          !g_hash_table_contains (modified_regfile_content, to_sizenames->checksum))
+        fingerprint_init (to_fingerprints, to_sizenames);
+    }
+
+  if (to_fingerprints->len == 0)
+    return TRUE;
+
+  for (i = 0; i < from_sizes->len; i++)
+    {
+      OstreeDeltaContentSizeNames *from_sizenames = from_sizes->pdata[i];
+      g_autoptr(GVariant) objname = NULL;
+
+      if (from_sizenames->size < MINHASH_MIN_SIZE)
+        continue;
+
+      objname = ostree_object_name_serialize (from_sizenames->checksum, OSTREE_OBJECT_TYPE_FILE);
+      if (g_hash_table_contains (to_reachable_objects, objname))
+        continue;
+
+      fingerprint_init (from_fingerprints, from_sizenames);
+    }
+
+  if (from_fingerprints->len == 0)
+    return TRUE;
+
+  if (!compute_fingerprints (repo, cache, from_fingerprints, cancellable, error))
+    return FALSE;
+  if (!compute_fingerprints (repo, cache, to_fingerprints, cancellable, error))
+    return FALSE;
+
+  for (i = 0; i < from_fingerprints->len; i++)
+    {
+      ContentFingerprint *fp = &g_array_index (from_fingerprints, ContentFingerprint, i);
+      guint band;
+
+      if (!fp->valid)
+        continue;
+
+      for (band = 0; band < MINHASH_N_BANDS; band++)
+        {
+          guint64 key = fingerprint_band_key (fp, band);
+          GArray *bucket = g_hash_table_lookup (bands, &key);
+
+          if (!bucket)
+            {
+              bucket = g_array_new (FALSE, FALSE, sizeof (guint));
+              g_hash_table_insert (bands, g_memdup (&key, sizeof (key)), bucket);
+            }
+          if (bucket->len < MINHASH_BUCKET_MAX)
+            g_array_append_val (bucket, i);
+        }
+    }
+
+  for (i = 0; i < to_fingerprints->len; i++)
+    {
+      ContentFingerprint *to_fp = &g_array_index (to_fingerprints, ContentFingerprint, i);
+      ContentFingerprint *best = NULL;
+      guint best_similarity = 0;
+      guint64 best_size_delta = G_MAXUINT64;
+      guint band;
+
+      if (!to_fp->valid)
+        continue;
+
+      for (band = 0; band < MINHASH_N_BANDS; band++)
+        {
+          guint64 key = fingerprint_band_key (to_fp, band);
+          GArray *bucket = g_hash_table_lookup (bands, &key);
+          guint j;
+
+          if (!bucket)
+            continue;
+
+          for (j = 0; j < bucket->len; j++)
+            {
+              ContentFingerprint *from_fp =
+                &g_array_index (from_fingerprints, ContentFingerprint,
+                                g_array_index (bucket, guint, j));
+              guint similarity = fingerprint_similarity_percent (from_fp, to_fp);
+              guint64 size_delta = ABS ((gint64) from_fp->sizenames->size -
+                                        (gint64) to_fp->sizenames->size);
+
+              if (similarity < MINHASH_SIMILARITY_THRESHOLD_PERCENT)
+                continue;
+
+              /* Prefer the closest size among equally similar objects */
+              if (similarity > best_similarity ||
+                  (similarity == best_similarity && size_delta < best_size_delta))
+                {
+                  best = from_fp;
+                  best_similarity = similarity;
+                  best_size_delta = size_delta;
+                }
+            }
+        }
+
+      if (best)
+        {
+          g_hash_table_insert (modified_regfile_content,
+                               g_strdup (to_fp->sizenames->checksum),
+                               g_strdup (best->sizenames->checksum));
+          n_found++;
+        }
+    }
+
+  g_debug ("Content fingerprints: %u objects from, %u to, %u matched",
+           from_fingerprints->len, to_fingerprints->len, n_found);
+
+  return TRUE;
+}
+
 /*
  * Build up a map of files with matching basenames and similar size,
- * and use it to find apparently similar objects.
+ * and use it to find apparently similar objects.  If @by_content is
+ * set, objects left without a match are then compared by content
+ * fingerprint against those removed from the from commit, which
+ * catches renamed and moved files.
  *
- * @new_reachable_regfile_content is a Set<checksum> of new regular
- * file objects.
+ * @to_reachable_objects is the Set<serialized object name> reachable
+ * from @to_commit, and @new_reachable_regfile_content the
+ * Set<checksum> of its new regular file objects.  @cache may be
+ * %NULL, or shared between the deltas of a release train, which have
+ * commits and objects in common.
  *
  * Currently, @out_modified_regfile_content will be a Map<to checksum,from checksum>;
  * however in the future it would be easy to have this function return
@@ -233,10 +763,13 @@ string_array_nonempty_intersection (GPtrArray    *a,
  */
 gboolean
 _ostree_delta_compute_similar_objects (OstreeRepo                 *repo,
+                                       OstreeDeltaAnalysisCache   *cache,
                                        GVariant                   *from_commit,
                                        GVariant                   *to_commit,
+                                       GHashTable                 *to_reachable_objects,
                                        GHashTable                 *new_reachable_regfile_content,
                                        guint                       similarity_percent_threshold,
+                                       gboolean                    by_content,
                                        GHashTable                **out_modified_regfile_content,
                                        GCancellable               *cancellable,
                                        GError                    **error)
@@ -250,14 +783,14 @@ _ostree_delta_compute_similar_objects (OstreeRepo                 *repo,
   guint lower;
   guint upper;
 
-  if (!build_content_sizenames_filtered (repo, from_commit, NULL,
-                                         &from_sizes,
-                                         cancellable, error))
+  if (!get_content_sizenames (repo, cache, from_commit, NULL,
+                              &from_sizes,
+                              cancellable, error))
     goto out;
 
-  if (!build_content_sizenames_filtered (repo, to_commit, new_reachable_regfile_content,
-                                         &to_sizes,
-                                         cancellable, error))
+  if (!get_content_sizenames (repo, cache, to_commit, new_reachable_regfile_content,
+                              &to_sizes,
+                              cancellable, error))
     goto out;
   
   /* Iterate over all newly added objects, find objects which have
@@ -320,6 +853,13 @@ _ostree_delta_compute_similar_objects (OstreeRepo                 *repo,
         }
     }
 
+  if (by_content &&
+      !compute_similar_objects_by_content (repo, cache, from_sizes, to_sizes,
+                                           to_reachable_objects,
+                                           ret_modified_regfile_content,
+                                           cancellable, error))
+    goto out;
+
   ret = TRUE;
   if (out_modified_regfile_content)
     *out_modified_regfile_content = g_steal_pointer (&ret_modified_regfile_content);
@@ -36,7 +36,21 @@
 #include "ostree-varint.h"
 #include "bsdiff/bsdiff.h"
 
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
 #define CONTENT_SIZE_SIMILARITY_THRESHOLD_PERCENT (30)
+/* Only use a rollsum if it covers this much of the object... */
+#define ROLLSUM_MATCH_THRESHOLD_PERCENT (50)
+/* ...unless the pair is too large for bsdiff (or bsdiff is disabled
+ * and it is large anyway), and the alternative is shipping the whole
+ * object */
+#define LARGE_OBJECT_ROLLSUM_MATCH_THRESHOLD_PERCENT (10)
+/* Number of unpacked source objects kept mapped between uses */
+#define FROM_CONTENTS_CACHE_MAX (16)
+/* Total size of the unpacked objects shared between deltas */
+#define SHARED_CONTENTS_CACHE_MAX_BYTES (512 * 1024 * 1024)
 
 typedef struct {
   guint64 uncompressed_size;
@@ -49,6 +63,21 @@ typedef struct {
   GPtrArray *xattrs;
 } OstreeStaticDeltaPartBuilder;
 
+/* State shared between the deltas to one commit, see
+ * ostree_repo_static_delta_generate_many().  Only the members
+ * guarded by @lock change once generation has started.
+ */
+typedef struct {
+  const char *to;
+  GHashTable *to_reachable_objects;
+  GHashTable *content_file_types; /* checksum -> GFileType */
+  OstreeDeltaAnalysisCache *analysis_cache;
+  GMutex lock;
+  GHashTable *contents; /* checksum -> SharedContent, see get_content() */
+  GQueue contents_lru; /* SharedContent links, most recently used first */
+  guint64 contents_size;
+} DeltaSharedState;
+
 typedef struct {
   GPtrArray *parts;
   GPtrArray *fallback_objects;
@@ -58,15 +87,20 @@ typedef struct {
   guint64 max_chunk_size_bytes;
   guint64 rollsum_size;
   guint n_rollsum;
+  guint n_large_rollsum; /* Of n_rollsum, pairs below ROLLSUM_MATCH_THRESHOLD_PERCENT */
   guint n_bsdiff;
   guint n_fallback;
   gboolean swap_endian;
+  GHashTable *from_contents; /* checksum -> GBytes, see get_from_content() */
+  GQueue from_contents_lru; /* checksums, most recently used first */
+  DeltaSharedState *shared; /* Unowned, may be NULL */
 } OstreeStaticDeltaBuilder;
 
 typedef enum {
   DELTAOPT_FLAG_NONE = (1 << 0),
   DELTAOPT_FLAG_DISABLE_BSDIFF = (1 << 1),
-  DELTAOPT_FLAG_VERBOSE = (1 << 2)
+  DELTAOPT_FLAG_VERBOSE = (1 << 2),
+  DELTAOPT_FLAG_DISABLE_SIMILARITY_BY_CONTENT = (1 << 3)
 } DeltaOpts;
 
 static void
@@ -439,46 +473,139 @@ content_bsdiffs_free (ContentBsdiff  *bsdiff)
   g_free (bsdiff);
 }
 
-/* Load a content object, uncompressing it to an unlinked tmpfile
-   that's mmap()'d and suitable for seeking.
+typedef struct {
+  char *checksum;
+  GBytes *content;
+  GList link; /* In DeltaSharedState.contents_lru, data is this entry */
+} SharedContent;
+
+static void
+shared_content_free (SharedContent *entry)
+{
+  g_free (entry->checksum);
+  g_bytes_unref (entry->content);
+  g_free (entry);
+}
+
+/* Like _ostree_repo_load_file_bytes(), but when generating several
+ * deltas, objects are only unpacked once for all of them.  Unpacked
+ * objects may be temporary files (e.g. in archive-z2 repos), so only
+ * the most recently used, up to SHARED_CONTENTS_CACHE_MAX_BYTES, are
+ * kept; evicted ones are released as soon as no delta uses them.
  */
 static gboolean
-get_unpacked_unlinked_content (OstreeRepo       *repo,
-                               const char       *checksum,
-                               GBytes          **out_content,
-                               GCancellable     *cancellable,
-                               GError          **error)
+get_content (OstreeRepo                *repo,
+             OstreeStaticDeltaBuilder  *builder,
+             const char                *checksum,
+             GBytes                   **out_content,
+             GCancellable              *cancellable,
+             GError                   **error)
 {
-  g_autofree char *tmpname = NULL;
-  glnx_fd_close int fd = -1;
-  g_autoptr(GBytes) ret_content = NULL;
-  g_autoptr(GInputStream) istream = NULL;
-  g_autoptr(GOutputStream) out = NULL;
-
-  if (!glnx_open_tmpfile_linkable_at (AT_FDCWD, "/tmp", O_RDWR | O_CLOEXEC,
-                                      &fd, &tmpname, error))
-    return FALSE;
-  /* We don't need the file name */
-  if (tmpname)
-    (void) unlinkat (AT_FDCWD, tmpname, 0);
+  DeltaSharedState *shared = builder->shared;
+  g_autoptr(GBytes) content = NULL;
+  SharedContent *entry;
 
-  if (!ostree_repo_load_file (repo, checksum, &istream, NULL, NULL,
-                              cancellable, error))
-    return FALSE;
+  if (!shared)
+    return _ostree_repo_load_file_bytes (repo, checksum, out_content, cancellable, error);
+
+  g_mutex_lock (&shared->lock);
+  entry = g_hash_table_lookup (shared->contents, checksum);
+  if (entry)
+    {
+      g_queue_unlink (&shared->contents_lru, &entry->link);
+      g_queue_push_head_link (&shared->contents_lru, &entry->link);
+      content = g_bytes_ref (entry->content);
+    }
+  g_mutex_unlock (&shared->lock);
+
+  if (!content)
+    {
+      if (!_ostree_repo_load_file_bytes (repo, checksum, &content, cancellable, error))
+        return FALSE;
 
-  out = g_unix_output_stream_new (fd, FALSE);
-  if (g_output_stream_splice (out, istream, G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
-                              cancellable, error) < 0)
+      g_mutex_lock (&shared->lock);
+      entry = g_hash_table_lookup (shared->contents, checksum);
+      if (entry)
+        {
+          g_bytes_unref (content);
+          content = g_bytes_ref (entry->content);
+        }
+      else if (g_bytes_get_size (content) <= SHARED_CONTENTS_CACHE_MAX_BYTES)
+        {
+          entry = g_new0 (SharedContent, 1);
+          entry->checksum = g_strdup (checksum);
+          entry->content = g_bytes_ref (content);
+          entry->link.data = entry;
+          g_hash_table_insert (shared->contents, entry->checksum, entry);
+          g_queue_push_head_link (&shared->contents_lru, &entry->link);
+          shared->contents_size += g_bytes_get_size (content);
+
+          while (shared->contents_size > SHARED_CONTENTS_CACHE_MAX_BYTES)
+            {
+              SharedContent *oldest = g_queue_pop_tail_link (&shared->contents_lru)->data;
+
+              shared->contents_size -= g_bytes_get_size (oldest->content);
+              /* Frees oldest */
+              g_hash_table_remove (shared->contents, oldest->checksum);
+            }
+        }
+      g_mutex_unlock (&shared->lock);
+    }
+
+  *out_content = g_steal_pointer (&content);
+  return TRUE;
+}
+
+/* Like get_content(), for objects used as the source
+ * of a rollsum or bsdiff.  One source object is often paired with many
+ * targets (e.g. a library and its copies under several names), so the
+ * most recently used ones are kept, rather than unpacked every time.
+ * The buffers are mapped files, so keeping them costs address space,
+ * not memory.
+ */
+static gboolean
+get_from_content (OstreeRepo                *repo,
+                  OstreeStaticDeltaBuilder  *builder,
+                  const char                *checksum,
+                  GBytes                   **out_content,
+                  GCancellable              *cancellable,
+                  GError                   **error)
+{
+  GBytes *content;
+  GList *link;
+
+  if (!builder->from_contents)
+    builder->from_contents = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, (GDestroyNotify) g_bytes_unref);
+
+  content = g_hash_table_lookup (builder->from_contents, checksum);
+  if (content)
+    {
+      link = g_queue_find_custom (&builder->from_contents_lru, checksum, (GCompareFunc) strcmp);
+      g_assert (link);
+      g_queue_unlink (&builder->from_contents_lru, link);
+      g_queue_push_head_link (&builder->from_contents_lru, link);
+      *out_content = g_bytes_ref (content);
+      return TRUE;
+    }
+
+  if (!get_content (repo, builder, checksum, &content, cancellable, error))
     return FALSE;
 
-  { g_autoptr(GMappedFile) mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
-    if (!mfile)
-      return FALSE;
-    ret_content = g_mapped_file_get_bytes (mfile);
+  if (g_queue_get_length (&builder->from_contents_lru) >= FROM_CONTENTS_CACHE_MAX)
+    {
+      char *oldest = g_queue_pop_tail (&builder->from_contents_lru);
+      /* Frees oldest */
+      g_hash_table_remove (builder->from_contents, oldest);
+    }
+
+  {
+    char *key = g_strdup (checksum);
+    g_hash_table_insert (builder->from_contents, key, g_bytes_ref (content));
+    g_queue_push_head (&builder->from_contents_lru, key);
   }
 
-  if (out_content)
-    *out_content = g_steal_pointer (&ret_content);
+  *out_content = content;
   return TRUE;
 }
 
@@ -521,8 +648,31 @@ try_content_bsdiff (OstreeRepo                       *repo,
   return ret;
 }
 
+static gint
+compare_bsdiff_sources (gconstpointer a,
+                        gconstpointer b,
+                        gpointer      user_data)
+{
+  GHashTable *bsdiff_content_objects = user_data;
+  const char *checksum_a = *(const char **)a;
+  const char *checksum_b = *(const char **)b;
+  ContentBsdiff *bsdiff_a = g_hash_table_lookup (bsdiff_content_objects, checksum_a);
+  ContentBsdiff *bsdiff_b = g_hash_table_lookup (bsdiff_content_objects, checksum_b);
+  int r = strcmp (bsdiff_a->from_checksum, bsdiff_b->from_checksum);
+
+  return r != 0 ? r : strcmp (checksum_a, checksum_b);
+}
+
+/*
+ * Pairs too large for bsdiff get a rollsum for any worthwhile overlap,
+ * rather than shipping the whole object: its copy and insert
+ * operations are computed over mapped files and applied by streaming
+ * through them.  For those it's worth trying rsync-style block
+ * matching too.
+ */
 static gboolean
 try_content_rollsum (OstreeRepo                       *repo,
+                     OstreeStaticDeltaBuilder         *builder,
                      DeltaOpts                        opts,
                      const char                       *from,
                      const char                       *to,
@@ -535,34 +685,61 @@ try_content_rollsum (OstreeRepo                       *repo,
   g_autoptr(GBytes) tmp_to = NULL;
   OstreeRollsumMatches *matches = NULL;
   ContentRollsum *ret_rollsum = NULL;
+  gboolean used_block_signatures = FALSE;
+  gboolean large;
+  guint match_ratio;
 
   *out_rollsum = NULL;
 
   /* Load the content objects, splice them to uncompressed temporary files that
    * we can just mmap() and seek around in conveniently.
    */
-  if (!get_unpacked_unlinked_content (repo, from, &tmp_from, cancellable, error))
+  if (!get_from_content (repo, builder, from, &tmp_from, cancellable, error))
     goto out;
-  if (!get_unpacked_unlinked_content (repo, to, &tmp_to, cancellable, error))
+  if (!get_content (repo, builder, to, &tmp_to, cancellable, error))
     goto out;
 
+  large = g_bytes_get_size (tmp_from) + g_bytes_get_size (tmp_to) > builder->max_bsdiff_size_bytes;
+
   matches = _ostree_compute_rollsum_matches (tmp_from, tmp_to);
 
-  { guint match_ratio = (matches->bufmatches*100)/matches->total;
+  /* Content-defined chunks only match where both sides split the same
+   * way; fixed blocks found at any offset do better on densely
+   * changed files, at the cost of scanning every byte.
+   */
+  if (large)
+    {
+      OstreeRollsumMatches *block_matches = _ostree_compute_block_matches (tmp_from, tmp_to);
 
-    /* Only proceed if the file contains (arbitrary) more than 50% of
-     * the previous chunks.
-     */
-    if (match_ratio < 50)
-      {
-        ret = TRUE;
-        goto out;
-      }
-  }
+      if (block_matches->match_size > matches->match_size)
+        {
+          _ostree_rollsum_matches_free (matches);
+          matches = block_matches;
+          used_block_signatures = TRUE;
+        }
+      else
+        _ostree_rollsum_matches_free (block_matches);
+    }
+
+  /* Only proceed if the file contains enough of the previous
+   * chunks.
+   */
+  match_ratio = (matches->bufmatches*100)/matches->total;
+  if (matches->matches->len == 0 ||
+      match_ratio < (large ? LARGE_OBJECT_ROLLSUM_MATCH_THRESHOLD_PERCENT
+                           : ROLLSUM_MATCH_THRESHOLD_PERCENT))
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  if (match_ratio < ROLLSUM_MATCH_THRESHOLD_PERCENT)
+    builder->n_large_rollsum++;
 
   if (opts & DELTAOPT_FLAG_VERBOSE)
     {
-      g_printerr ("rollsum for %s; crcs=%u bufs=%u total=%u matchsize=%llu\n",
+      g_printerr ("%s for %s; crcs=%u bufs=%u total=%u matchsize=%llu\n",
+                  used_block_signatures ? "block signatures" : "rollsum",
                   to, matches->crcmatches,
                   matches->bufmatches,
                   matches->total, (unsigned long long)matches->match_size);
@@ -641,8 +818,8 @@ process_one_rollsum (OstreeRepo                       *repo,
       *current_part_val = current_part = allocate_part (builder);
     }
 
-  if (!get_unpacked_unlinked_content (repo, to_checksum, &tmp_to,
-                                      cancellable, error))
+  if (!get_content (repo, builder, to_checksum, &tmp_to,
+                    cancellable, error))
     goto out;
 
   tmp_to_buf = g_bytes_get_data (tmp_to, &tmp_to_len);
@@ -767,11 +944,11 @@ process_one_bsdiff (OstreeRepo                       *repo,
       *current_part_val = current_part = allocate_part (builder);
     }
 
-  if (!get_unpacked_unlinked_content (repo, bsdiff_content->from_checksum, &tmp_from,
-                                      cancellable, error))
+  if (!get_from_content (repo, builder, bsdiff_content->from_checksum, &tmp_from,
+                         cancellable, error))
     goto out;
-  if (!get_unpacked_unlinked_content (repo, to_checksum, &tmp_to,
-                                      cancellable, error))
+  if (!get_content (repo, builder, to_checksum, &tmp_to,
+                    cancellable, error))
     goto out;
 
   tmp_to_buf = g_bytes_get_data (tmp_to, &tmp_to_len);
@@ -862,6 +1039,36 @@ check_object_world_readable (OstreeRepo   *repo,
   return TRUE;
 }
 
+static gboolean
+get_content_file_type (OstreeRepo                *repo,
+                       OstreeStaticDeltaBuilder  *builder,
+                       const char                *checksum,
+                       GFileType                 *out_ftype,
+                       GCancellable              *cancellable,
+                       GError                   **error)
+{
+  g_autoptr(GFileInfo) finfo = NULL;
+
+  if (builder->shared)
+    {
+      gpointer ftype;
+
+      if (g_hash_table_lookup_extended (builder->shared->content_file_types,
+                                        checksum, NULL, &ftype))
+        {
+          *out_ftype = GPOINTER_TO_UINT (ftype);
+          return TRUE;
+        }
+    }
+
+  if (!ostree_repo_load_file (repo, checksum, NULL, &finfo, NULL,
+                              cancellable, error))
+    return FALSE;
+
+  *out_ftype = g_file_info_get_file_type (finfo);
+  return TRUE;
+}
+
 static gboolean 
 generate_delta_lowlatency (OstreeRepo                       *repo,
                            const char                       *from,
@@ -874,6 +1081,7 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
   gboolean ret = FALSE;
   GHashTableIter hashiter;
   gpointer key, value;
+  guint i;
   OstreeStaticDeltaPartBuilder *current_part = NULL;
   g_autoptr(GFile) root_from = NULL;
   g_autoptr(GVariant) from_commit = NULL;
@@ -910,8 +1118,10 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
                                  &to_commit, error))
     goto out;
 
-  if (!ostree_repo_traverse_commit (repo, to, 0, &to_reachable_objects,
-                                    cancellable, error))
+  if (builder->shared)
+    to_reachable_objects = g_hash_table_ref (builder->shared->to_reachable_objects);
+  else if (!ostree_repo_traverse_commit (repo, to, 0, &to_reachable_objects,
+                                         cancellable, error))
     goto out;
 
   new_reachable_metadata = ostree_repo_traverse_new_reachable ();
@@ -934,14 +1144,12 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
         g_hash_table_add (new_reachable_metadata, g_variant_ref (serialized_key));
       else
         {
-          g_autoptr(GFileInfo) finfo = NULL;
           GFileType ftype;
 
-          if (!ostree_repo_load_file (repo, checksum, NULL, &finfo, NULL,
+          if (!get_content_file_type (repo, builder, checksum, &ftype,
                                       cancellable, error))
             goto out;
 
-          ftype = g_file_info_get_file_type (finfo);
           if (ftype == G_FILE_TYPE_REGULAR)
             g_hash_table_add (new_reachable_regfile_content, g_strdup (checksum));
           else if (ftype == G_FILE_TYPE_SYMBOLIC_LINK)
@@ -953,9 +1161,13 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
 
   if (from_commit)
     {
-      if (!_ostree_delta_compute_similar_objects (repo, from_commit, to_commit,
+      if (!_ostree_delta_compute_similar_objects (repo,
+                                                  builder->shared ? builder->shared->analysis_cache : NULL,
+                                                  from_commit, to_commit,
+                                                  to_reachable_objects,
                                                   new_reachable_regfile_content,
                                                   CONTENT_SIZE_SIMILARITY_THRESHOLD_PERCENT,
+                                                  !(opts & DELTAOPT_FLAG_DISABLE_SIMILARITY_BY_CONTENT),
                                                   &modified_regfile_content,
                                                   cancellable, error))
         goto out;
@@ -1009,7 +1221,7 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
           continue;
         }
 
-      if (!try_content_rollsum (repo, opts, from_checksum, to_checksum,
+      if (!try_content_rollsum (repo, builder, opts, from_checksum, to_checksum,
                                 &rollsum, cancellable, error))
         goto out;
 
@@ -1073,21 +1285,31 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
       builder->n_rollsum++;
     }
 
-  /* Now do bsdiff'ed objects */
+  /* Now do bsdiff'ed objects, grouped by source so that each one is
+   * unpacked once.
+   */
 
-  g_hash_table_iter_init (&hashiter, bsdiff_optimized_content_objects);
-  while (g_hash_table_iter_next (&hashiter, &key, &value))
-    {
-      const char *checksum = key;
-      ContentBsdiff *bsdiff = value;
+  { g_autoptr(GPtrArray) bsdiff_targets = g_ptr_array_new ();
 
-      if (!process_one_bsdiff (repo, builder, &current_part,
-                               checksum, bsdiff,
-                               cancellable, error))
-        goto out;
+    g_hash_table_iter_init (&hashiter, bsdiff_optimized_content_objects);
+    while (g_hash_table_iter_next (&hashiter, &key, &value))
+      g_ptr_array_add (bsdiff_targets, key);
+    g_ptr_array_sort_with_data (bsdiff_targets, compare_bsdiff_sources,
+                                bsdiff_optimized_content_objects);
 
-      builder->n_bsdiff++;
-    }
+    for (i = 0; i < bsdiff_targets->len; i++)
+      {
+        const char *checksum = bsdiff_targets->pdata[i];
+        ContentBsdiff *bsdiff = g_hash_table_lookup (bsdiff_optimized_content_objects, checksum);
+
+        if (!process_one_bsdiff (repo, builder, &current_part,
+                                 checksum, bsdiff,
+                                 cancellable, error))
+          goto out;
+
+        builder->n_bsdiff++;
+      }
+  }
 
   /* Scan for large objects, so we can fall back to plain HTTP-based
    * fetch.
@@ -1160,6 +1382,119 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
   return ret;
 }
 
+#ifdef HAVE_LIBZSTD
+/* We compress the whole part in one shot rather than going through a
+ * GConverter; this lets libzstd spread the work over its worker
+ * threads without us having to drive the non-blocking streaming API.
+ */
+static gboolean
+compress_part_zstd (GBytes        *input,
+                    int            level,
+                    GBytes       **out_payload,
+                    GError       **error)
+{
+  gboolean ret = FALSE;
+  ZSTD_CCtx *cctx = NULL;
+  gsize input_size;
+  const guint8 *input_data = g_bytes_get_data (input, &input_size);
+  gsize bound = ZSTD_compressBound (input_size);
+  g_autofree guint8 *buf = NULL;
+  size_t res;
+
+  cctx = ZSTD_createCCtx ();
+  if (!cctx)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Failed to allocate zstd context");
+      goto out;
+    }
+
+  res = ZSTD_CCtx_setParameter (cctx, ZSTD_c_compressionLevel, level);
+  if (ZSTD_isError (res))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid zstd compression level %d: %s", level, ZSTD_getErrorName (res));
+      goto out;
+    }
+  /* Parts often contain many similar files, well beyond the default window */
+  (void) ZSTD_CCtx_setParameter (cctx, ZSTD_c_enableLongDistanceMatching, 1);
+  /* This fails if libzstd was built without threading; that's fine */
+  (void) ZSTD_CCtx_setParameter (cctx, ZSTD_c_nbWorkers, (int) g_get_num_processors ());
+
+  buf = g_malloc (bound);
+  res = ZSTD_compress2 (cctx, buf, bound, input_data, input_size);
+  if (ZSTD_isError (res))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "zstd compression failed: %s", ZSTD_getErrorName (res));
+      goto out;
+    }
+
+  buf = g_realloc (buf, res);
+  *out_payload = g_bytes_new_take (g_steal_pointer (&buf), res);
+
+  ret = TRUE;
+ out:
+  if (cctx)
+    ZSTD_freeCCtx (cctx);
+  return ret;
+}
+#endif
+
+static gboolean
+compress_part (guint8         compression_type,
+               int            compression_level,
+               GVariant      *part_content,
+               GBytes       **out_payload,
+               GCancellable  *cancellable,
+               GError       **error)
+{
+  gboolean ret = FALSE;
+
+  switch (compression_type)
+    {
+    case 0:
+      *out_payload = g_variant_get_data_as_bytes (part_content);
+      break;
+    case 'x':
+      {
+        g_autoptr(GConverter) compressor = (GConverter*)_ostree_lzma_compressor_new (NULL);
+        g_autoptr(GInputStream) part_payload_in = ot_variant_read (part_content);
+        g_autoptr(GMemoryOutputStream) part_payload_out =
+          (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+        g_autoptr(GOutputStream) part_payload_compressor =
+          g_converter_output_stream_new ((GOutputStream*)part_payload_out, compressor);
+        gssize n_bytes_written;
+
+        n_bytes_written = g_output_stream_splice (part_payload_compressor, part_payload_in,
+                                                  G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET | G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                                                  cancellable, error);
+        if (n_bytes_written < 0)
+          goto out;
+
+        *out_payload = g_memory_output_stream_steal_as_bytes (part_payload_out);
+      }
+      break;
+#ifdef HAVE_LIBZSTD
+    case 'z':
+      {
+        g_autoptr(GBytes) content_bytes = g_variant_get_data_as_bytes (part_content);
+        if (!compress_part_zstd (content_bytes, compression_level, out_payload, error))
+          goto out;
+      }
+      break;
+#endif
+    default:
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Unsupported static delta compression type '%c'", compression_type);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
 static gboolean
 get_fallback_headers (OstreeRepo               *self,
                       OstreeStaticDeltaBuilder *builder,
@@ -1227,44 +1562,37 @@ get_fallback_headers (OstreeRepo               *self,
   return ret;
 }
 
-/**
- * ostree_repo_static_delta_generate:
- * @self: Repo
- * @opt: High level optimization choice
- * @from: ASCII SHA256 checksum of origin, or %NULL
- * @to: ASCII SHA256 checksum of target
- * @metadata: (allow-none): Optional metadata
- * @params: (allow-none): Parameters, see below
- * @cancellable: Cancellable
- * @error: Error
- *
- * Generate a lookaside "static delta" from @from (%NULL means
- * from-empty) which can generate the objects in @to.  This delta is
- * an optimization over fetching individual objects, and can be
- * conveniently stored and applied offline.
- *
- * The @params argument should be an a{sv}.  The following attributes
- * are known:
- *   - min-fallback-size: u: Minimum uncompressed size in megabytes to use fallback, 0 to disable fallbacks
- *   - max-chunk-size: u: Maximum size in megabytes of a delta part
- *   - max-bsdiff-size: u: Maximum size in megabytes to consider bsdiff compression
- *   for input files
- *   - compression: y: Compression type: 0=none, x=lzma, g=gzip
- *   - bsdiff-enabled: b: Enable bsdiff compression.  Default TRUE.
- *   - inline-parts: b: Put part data in header, to get a single file delta.  Default FALSE.
- *   - verbose: b: Print diagnostic messages.  Default FALSE.
- *   - endianness: b: Deltas use host byte order by default; this option allows choosing (G_BIG_ENDIAN or G_LITTLE_ENDIAN)
- *   - filename: ay: Save delta superblock to this filename, and parts in the same directory.  Default saves to repository.
+/* Returns the peak resident set size in bytes, or 0 if unknown.  This
+ * is the process high-water mark; we leave resetting it (through
+ * /proc/self/clear_refs) to the application, as it's process-wide
+ * state.
  */
-gboolean
-ostree_repo_static_delta_generate (OstreeRepo                   *self,
-                                   OstreeStaticDeltaGenerateOpt  opt,
-                                   const char                   *from,
-                                   const char                   *to,
-                                   GVariant                     *metadata,
-                                   GVariant                     *params,
-                                   GCancellable                 *cancellable,
-                                   GError                      **error)
+static guint64
+get_peak_rss (void)
+{
+  g_autofree char *status = NULL;
+  const char *hwm;
+
+  if (!g_file_get_contents ("/proc/self/status", &status, NULL, NULL))
+    return 0;
+
+  hwm = strstr (status, "\nVmHWM:");
+  if (!hwm)
+    return 0;
+
+  return g_ascii_strtoull (hwm + strlen ("\nVmHWM:"), NULL, 10) * 1024;
+}
+
+static gboolean
+generate_delta (OstreeRepo                   *self,
+                OstreeStaticDeltaGenerateOpt  opt,
+                const char                   *from,
+                const char                   *to,
+                GVariant                     *metadata,
+                GVariant                     *params,
+                DeltaSharedState             *shared,
+                GCancellable                 *cancellable,
+                GError                      **error)
 {
   gboolean ret = FALSE;
   OstreeStaticDeltaBuilder builder = { 0, };
@@ -1288,9 +1616,14 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
   g_autoptr(GVariant) detached = NULL;
   gboolean inline_parts;
   guint endianness = G_BYTE_ORDER;
+  guint8 compression_type_char;
+  gint32 compression_level;
   glnx_fd_close int tmp_dfd = -1;
+  guint64 peak_rss;
   builder.parts = g_ptr_array_new_with_free_func ((GDestroyNotify)ostree_static_delta_part_builder_unref);
   builder.fallback_objects = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  g_queue_init (&builder.from_contents_lru);
+  builder.shared = shared;
 
   if (!g_variant_lookup (params, "min-fallback-size", "u", &min_fallback_size))
     min_fallback_size = 4;
@@ -1315,6 +1648,13 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
       delta_opts |= DELTAOPT_FLAG_DISABLE_BSDIFF;
   }
 
+  { gboolean by_content;
+    if (!g_variant_lookup (params, "similarity-by-content", "b", &by_content))
+      by_content = TRUE;
+    if (!by_content)
+      delta_opts |= DELTAOPT_FLAG_DISABLE_SIMILARITY_BY_CONTENT;
+  }
+
   { gboolean verbose;
     if (!g_variant_lookup (params, "verbose", "b", &verbose))
       verbose = FALSE;
@@ -1325,6 +1665,25 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
   if (!g_variant_lookup (params, "inline-parts", "b", &inline_parts))
     inline_parts = FALSE;
 
+  if (!g_variant_lookup (params, "compression", "y", &compression_type_char))
+    compression_type_char = 'x';
+  if (!g_variant_lookup (params, "compression-level", "i", &compression_level))
+    compression_level = 3;
+
+  switch (compression_type_char)
+    {
+    case 0:
+    case 'x':
+#ifdef HAVE_LIBZSTD
+    case 'z':
+#endif
+      break;
+    default:
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Unsupported static delta compression type '%c'", compression_type_char);
+      goto out;
+    }
+
   if (!g_variant_lookup (params, "filename", "^&ay", &opt_filename))
     opt_filename = NULL;
 
@@ -1401,16 +1760,12 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
       g_autoptr(GBytes) checksum_bytes = NULL;
       g_autoptr(GOutputStream) part_temp_outstream = NULL;
       g_autoptr(GInputStream) part_in = NULL;
-      g_autoptr(GInputStream) part_payload_in = NULL;
-      g_autoptr(GMemoryOutputStream) part_payload_out = NULL;
-      g_autoptr(GConverterOutputStream) part_payload_compressor = NULL;
-      g_autoptr(GConverter) compressor = NULL;
+      g_autoptr(GBytes) payload = NULL;
       g_autoptr(GVariant) delta_part_content = NULL;
       g_autoptr(GVariant) delta_part = NULL;
       g_autoptr(GVariant) delta_part_header = NULL;
       g_auto(GVariantBuilder) mode_builder = OT_VARIANT_BUILDER_INITIALIZER;
       g_auto(GVariantBuilder) xattr_builder = OT_VARIANT_BUILDER_INITIALIZER;
-      guint8 compression_type_char;
 
       g_variant_builder_init (&mode_builder, G_VARIANT_TYPE ("a(uuu)"));
       g_variant_builder_init (&xattr_builder, G_VARIANT_TYPE ("aa(ayay)"));
@@ -1434,27 +1789,14 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
                                           ot_gvariant_new_ay_bytes (operations_b));
       g_variant_ref_sink (delta_part_content);
 
-      /* Hardcode xz for now */
-      compressor = (GConverter*)_ostree_lzma_compressor_new (NULL);
-      compression_type_char = 'x';
-      part_payload_in = ot_variant_read (delta_part_content);
-      part_payload_out = (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
-      part_payload_compressor = (GConverterOutputStream*)g_converter_output_stream_new ((GOutputStream*)part_payload_out, compressor);
-
-      {
-        gssize n_bytes_written = g_output_stream_splice ((GOutputStream*)part_payload_compressor, part_payload_in,
-                                                         G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET | G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
-                                                         cancellable, error);
-        if (n_bytes_written < 0)
-          goto out;
-      }
+      if (!compress_part (compression_type_char, compression_level, delta_part_content,
+                          &payload, cancellable, error))
+        goto out;
 
       /* FIXME - avoid duplicating memory here */
-      { g_autoptr(GBytes) payload = g_memory_output_stream_steal_as_bytes (part_payload_out);
-        delta_part = g_variant_ref_sink (g_variant_new ("(y@ay)",
-                                                        compression_type_char,
-                                                        ot_gvariant_new_ay_bytes (payload)));
-      }
+      delta_part = g_variant_ref_sink (g_variant_new ("(y@ay)",
+                                                      compression_type_char,
+                                                      ot_gvariant_new_ay_bytes (payload)));
 
       if (inline_parts)
         {
@@ -1592,6 +1934,19 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
                   builder.n_rollsum,
                   builder.rollsum_size);
       g_printerr ("bsdiff=%u objects\n", builder.n_bsdiff);
+      if (builder.n_large_rollsum > 0)
+        g_printerr ("rollsum instead of bsdiff for large objects=%u\n", builder.n_large_rollsum);
+    }
+
+  /* Deltas generated in parallel share one process peak */
+  peak_rss = shared ? 0 : get_peak_rss ();
+  if (peak_rss > 0)
+    {
+      g_autofree char *peak_rss_str = g_format_size (peak_rss);
+
+      if (delta_opts & DELTAOPT_FLAG_VERBOSE)
+        g_printerr ("peak rss=%s\n", peak_rss_str);
+      g_debug ("Static delta %s-%s: peak RSS %s", from ? from : "empty", to, peak_rss_str);
     }
 
   if (!glnx_file_replace_contents_at (descriptor_dfd, descriptor_name,
@@ -1612,5 +1967,217 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
       }
   g_clear_pointer (&builder.parts, g_ptr_array_unref);
   g_clear_pointer (&builder.fallback_objects, g_ptr_array_unref);
+  g_clear_pointer (&builder.from_contents, g_hash_table_unref);
+  g_queue_clear (&builder.from_contents_lru);
+  return ret;
+}
+
+/**
+ * ostree_repo_static_delta_generate:
+ * @self: Repo
+ * @opt: High level optimization choice
+ * @from: ASCII SHA256 checksum of origin, or %NULL
+ * @to: ASCII SHA256 checksum of target
+ * @metadata: (allow-none): Optional metadata
+ * @params: (allow-none): Parameters, see below
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Generate a lookaside "static delta" from @from (%NULL means
+ * from-empty) which can generate the objects in @to.  This delta is
+ * an optimization over fetching individual objects, and can be
+ * conveniently stored and applied offline.
+ *
+ * The @params argument should be an a{sv}.  The following attributes
+ * are known:
+ *   - min-fallback-size: u: Minimum uncompressed size in megabytes to use fallback, 0 to disable fallbacks
+ *   - max-chunk-size: u: Maximum size in megabytes of a delta part
+ *   - max-bsdiff-size: u: Maximum size in megabytes to consider bsdiff compression
+ *   for input files; larger files which partially match their previous version are
+ *   encoded as copies of the matching chunks instead
+ *   - compression: y: Compression type: 0=none, x=lzma, z=zstd (if built with libzstd).  Default x.
+ *   - compression-level: i: Compression level, only used for zstd.  Default 3.
+ *   - bsdiff-enabled: b: Enable bsdiff compression.  Default TRUE.
+ *   - similarity-by-content: b: Also match modified files by content fingerprint, to find
+ *   renamed and moved files.  Default TRUE.
+ *   - inline-parts: b: Put part data in header, to get a single file delta.  Default FALSE.
+ *   - verbose: b: Print diagnostic messages.  Default FALSE.
+ *   - endianness: b: Deltas use host byte order by default; this option allows choosing (G_BIG_ENDIAN or G_LITTLE_ENDIAN)
+ *   - filename: ay: Save delta superblock to this filename, and parts in the same directory.  Default saves to repository.
+ */
+gboolean
+ostree_repo_static_delta_generate (OstreeRepo                   *self,
+                                   OstreeStaticDeltaGenerateOpt  opt,
+                                   const char                   *from,
+                                   const char                   *to,
+                                   GVariant                     *metadata,
+                                   GVariant                     *params,
+                                   GCancellable                 *cancellable,
+                                   GError                      **error)
+{
+  return generate_delta (self, opt, from, to, metadata, params, NULL,
+                         cancellable, error);
+}
+
+typedef struct {
+  OstreeRepo *repo;
+  OstreeStaticDeltaGenerateOpt opt;
+  GVariant *metadata;
+  GVariant *params;
+  DeltaSharedState *shared;
+  GCancellable *cancellable;
+  GMutex lock;
+  GError *error;
+} GenerateManyData;
+
+static void
+generate_many_pool_run (gpointer data,
+                        gpointer user_data)
+{
+  const char *from = data;
+  GenerateManyData *many_data = user_data;
+  GError *local_error = NULL;
+  gboolean failed;
+
+  g_mutex_lock (&many_data->lock);
+  failed = many_data->error != NULL;
+  g_mutex_unlock (&many_data->lock);
+  if (failed)
+    return;
+
+  if (!generate_delta (many_data->repo, many_data->opt, from, many_data->shared->to,
+                       many_data->metadata, many_data->params, many_data->shared,
+                       many_data->cancellable, &local_error))
+    {
+      g_prefix_error (&local_error, "Generating delta %s-%s: ", from, many_data->shared->to);
+      g_mutex_lock (&many_data->lock);
+      if (!many_data->error)
+        many_data->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&many_data->lock);
+      g_clear_error (&local_error);
+    }
+}
+
+/**
+ * ostree_repo_static_delta_generate_many:
+ * @self: Repo
+ * @opt: High level optimization choice
+ * @from_revs: (array zero-terminated=1): ASCII SHA256 checksums of origins
+ * @to: ASCII SHA256 checksum of target
+ * @metadata: (allow-none): Optional metadata
+ * @params: (allow-none): Parameters, see below
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Generate static deltas from each of @from_revs to @to, as
+ * ostree_repo_static_delta_generate() would, typically from the last
+ * few releases to a new one.  The target commit is traversed once, and
+ * unpacked objects and similarity analysis are shared between the
+ * deltas, which are generated in parallel.
+ *
+ * The @params are those of ostree_repo_static_delta_generate(), except
+ * for filename, plus:
+ *   - n-jobs: u: Number of deltas to generate at once.  Default is the number of CPUs.
+ *
+ * Since: 2017.3
+ */
+gboolean
+ostree_repo_static_delta_generate_many (OstreeRepo                   *self,
+                                        OstreeStaticDeltaGenerateOpt  opt,
+                                        const char * const           *from_revs,
+                                        const char                   *to,
+                                        GVariant                     *metadata,
+                                        GVariant                     *params,
+                                        GCancellable                 *cancellable,
+                                        GError                      **error)
+{
+  gboolean ret = FALSE;
+  DeltaSharedState shared = { to, };
+  GenerateManyData many_data = { self, opt, metadata, params, &shared, cancellable, };
+  GThreadPool *pool = NULL;
+  GHashTableIter hashiter;
+  gpointer key;
+  const char *opt_filename;
+  guint n_jobs;
+  guint i;
+
+  g_return_val_if_fail (from_revs != NULL, FALSE);
+
+  if (g_variant_lookup (params, "filename", "^&ay", &opt_filename))
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                           "Cannot specify a filename for multiple static deltas");
+      return FALSE;
+    }
+
+  if (!g_variant_lookup (params, "n-jobs", "u", &n_jobs) || n_jobs == 0)
+    n_jobs = g_get_num_processors ();
+  n_jobs = MIN (n_jobs, MAX (g_strv_length ((char **) from_revs), 1));
+
+  g_mutex_init (&shared.lock);
+  g_mutex_init (&many_data.lock);
+  shared.content_file_types = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  shared.contents = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           NULL, (GDestroyNotify) shared_content_free);
+  g_queue_init (&shared.contents_lru);
+  /* Deltas fingerprint objects in parallel too; share the CPUs */
+  shared.analysis_cache = _ostree_delta_analysis_cache_new (MAX (g_get_num_processors () / n_jobs, 1));
+
+  if (!ostree_repo_traverse_commit (self, to, 0, &shared.to_reachable_objects,
+                                    cancellable, error))
+    goto out;
+
+  /* Every delta needs the types of most of these */
+  g_hash_table_iter_init (&hashiter, shared.to_reachable_objects);
+  while (g_hash_table_iter_next (&hashiter, &key, NULL))
+    {
+      g_autoptr(GFileInfo) finfo = NULL;
+      const char *checksum;
+      OstreeObjectType objtype;
+
+      ostree_object_name_deserialize (key, &checksum, &objtype);
+      if (objtype != OSTREE_OBJECT_TYPE_FILE)
+        continue;
+
+      if (!ostree_repo_load_file (self, checksum, NULL, &finfo, NULL,
+                                  cancellable, error))
+        goto out;
+
+      g_hash_table_insert (shared.content_file_types, g_strdup (checksum),
+                           GUINT_TO_POINTER (g_file_info_get_file_type (finfo)));
+    }
+
+  pool = g_thread_pool_new (generate_many_pool_run, &many_data, n_jobs, FALSE, error);
+  if (!pool)
+    goto out;
+
+  for (i = 0; from_revs[i] != NULL; i++)
+    g_thread_pool_push (pool, (gpointer) from_revs[i], NULL);
+
+  /* Waits for all jobs */
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  if (many_data.error)
+    {
+      g_propagate_error (error, g_steal_pointer (&many_data.error));
+      goto out;
+    }
+
+  { guint64 peak_rss = get_peak_rss ();
+    if (peak_rss > 0)
+      {
+        g_autofree char *peak_rss_str = g_format_size (peak_rss);
+        g_debug ("Static deltas to %s: peak RSS %s", to, peak_rss_str);
+      }
+  }
+
+  ret = TRUE;
+ out:
+  g_mutex_clear (&shared.lock);
+  g_mutex_clear (&many_data.lock);
+  g_clear_pointer (&shared.to_reachable_objects, g_hash_table_unref);
+  g_clear_pointer (&shared.content_file_types, g_hash_table_unref);
+  g_clear_pointer (&shared.contents, g_hash_table_unref);
+  g_clear_pointer (&shared.analysis_cache, _ostree_delta_analysis_cache_free);
   return ret;
 }
@@ -26,8 +26,10 @@
 #include "ostree-core-private.h"
 #include "ostree-repo-private.h"
 #include "ostree-lzma-decompressor.h"
+#ifdef HAVE_LIBZSTD
+#include "ostree-zstd-decompressor.h"
+#endif
 #include "ostree-cmdprivate.h"
-#include "ostree-checksum-input-stream.h"
 #include "ostree-repo-static-delta-private.h"
 #include "otutil.h"
 
@@ -466,7 +468,7 @@ _ostree_static_delta_part_open (GInputStream   *part_in,
   const gboolean skip_checksum = (flags & OSTREE_STATIC_DELTA_OPEN_FLAGS_SKIP_CHECKSUM) > 0;
   gsize bytes_read;
   guint8 comptype;
-  g_autoptr(GChecksum) checksum = NULL;
+  g_auto(OtChecksum) checksum = { 0, };
   g_autoptr(GInputStream) checksum_in = NULL;
   g_autoptr(GVariant) ret_part = NULL;
   GInputStream *source_in;
@@ -477,8 +479,8 @@ _ostree_static_delta_part_open (GInputStream   *part_in,
 
   if (!skip_checksum)
     {
-      checksum = g_checksum_new (G_CHECKSUM_SHA256);
-      checksum_in = (GInputStream*)ostree_checksum_input_stream_new (part_in, checksum);
+      ot_checksum_init (&checksum);
+      checksum_in = (GInputStream*)ot_checksum_instream_new (part_in, &checksum);
       source_in = checksum_in;
     }
   else
@@ -519,19 +521,30 @@ _ostree_static_delta_part_open (GInputStream   *part_in,
         }
 
       if (!skip_checksum)
-        g_checksum_update (checksum, g_variant_get_data (ret_part),
-                           g_variant_get_size (ret_part));
+        ot_checksum_update (&checksum, g_variant_get_data (ret_part),
+                            g_variant_get_size (ret_part));
       
       break;
     case 'x':
+#ifdef HAVE_LIBZSTD
+    case 'z':
+#endif
       {
         g_autofree char *tmppath = g_strdup ("/var/tmp/ostree-delta-XXXXXX");
-        g_autoptr(GConverter) decomp = (GConverter*) _ostree_lzma_decompressor_new ();
-        g_autoptr(GInputStream) convin = g_converter_input_stream_new (source_in, decomp);
+        g_autoptr(GConverter) decomp = NULL;
+        g_autoptr(GInputStream) convin = NULL;
         g_autoptr(GOutputStream) unpacked_out = NULL;
         glnx_fd_close int unpacked_fd = -1;
         gssize n_bytes_written;
 
+#ifdef HAVE_LIBZSTD
+        if (comptype == 'z')
+          decomp = (GConverter*) _ostree_zstd_decompressor_new ();
+        else
+#endif
+          decomp = (GConverter*) _ostree_lzma_decompressor_new ();
+        convin = g_converter_input_stream_new (source_in, decomp);
+
         unpacked_fd = g_mkstemp_full (tmppath, O_RDWR | O_CLOEXEC, 0640);
         if (unpacked_fd < 0)
           {
@@ -568,9 +581,10 @@ _ostree_static_delta_part_open (GInputStream   *part_in,
       goto out;
     }
 
-  if (checksum)
+  if (checksum.initialized)
     {
-      const char *actual_checksum = g_checksum_get_string (checksum);
+      char actual_checksum[OT_SHA256_STRING_LEN + 1];
+      ot_checksum_get_hexdigest (&checksum, actual_checksum, sizeof (actual_checksum));
       g_assert (expected_checksum != NULL);
       if (strcmp (actual_checksum, expected_checksum) != 0)
         {
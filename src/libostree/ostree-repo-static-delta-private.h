@@ -34,7 +34,7 @@ G_BEGIN_DECLS
 /**
  * OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT_V0:
  *
- *   y  compression type (0: none, 'x': lzma)
+ *   y  compression type (0: none, 'x': lzma, 'z': zstd)
  *   ---
  *   a(uuu) modes
  *   aa(ayay) xattrs
@@ -178,12 +178,21 @@ typedef struct {
 
 void _ostree_delta_content_sizenames_free (gpointer v);
 
+/* Shares commit contents and fingerprints between deltas */
+typedef struct OstreeDeltaAnalysisCache OstreeDeltaAnalysisCache;
+
+OstreeDeltaAnalysisCache *_ostree_delta_analysis_cache_new (guint n_threads);
+void _ostree_delta_analysis_cache_free (OstreeDeltaAnalysisCache *cache);
+
 gboolean
 _ostree_delta_compute_similar_objects (OstreeRepo                 *repo,
+                                       OstreeDeltaAnalysisCache   *cache,
                                        GVariant                   *from_commit,
                                        GVariant                   *to_commit,
+                                       GHashTable                 *to_reachable_objects,
                                        GHashTable                 *new_reachable_regfile_content,
                                        guint                       similarity_percent_threshold,
+                                       gboolean                    by_content,
                                        GHashTable                **out_modified_regfile_content,
                                        GCancellable               *cancellable,
                                        GError                    **error);
@@ -25,6 +25,7 @@
 #include "libglnx.h"
 #include "ostree.h"
 #include "otutil.h"
+#include "ostree-repo-private.h"
 
 struct _OstreeRepoRealCommitTraverseIter {
   gboolean initialized;
@@ -427,6 +428,23 @@ traverse_dirtree (OstreeRepo           *repo,
   return ret;
 }
 
+/*
+ * _ostree_repo_traverse_dirtree:
+ *
+ * Add all objects reachable from the dirtree @dirtree_checksum (but not
+ * the dirtree itself) to @inout_reachable.
+ */
+gboolean
+_ostree_repo_traverse_dirtree (OstreeRepo      *repo,
+                               const char      *dirtree_checksum,
+                               GHashTable      *inout_reachable,
+                               GCancellable    *cancellable,
+                               GError         **error)
+{
+  return traverse_dirtree (repo, dirtree_checksum, inout_reachable, FALSE,
+                           cancellable, error);
+}
+
 /**
  * ostree_repo_traverse_commit_union: (skip)
  * @repo: Repo
@@ -0,0 +1,263 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2017 The OSTree Authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+#include "otutil.h"
+
+/*
+ * A tree bundle holds all the dirtree and dirmeta objects of a commit,
+ * so a client pulling it without a static delta gets the metadata of
+ * the whole tree in one request, rather than one per directory, and
+ * can go straight to fetching content.
+ *
+ * Bundles are stored in tree-bundles/XX/YYYY..., named after their
+ * commit, as a zlib compressed GVariant of type
+ * OSTREE_TREE_BUNDLE_GVARIANT_FORMAT:
+ *
+ *   a(yayay) - for each object, its type, checksum and data
+ *
+ * Clients verify each object against its checksum as they write it,
+ * and only use those reachable from the commit, which they have
+ * already verified.
+ *
+ * Clients only fetch a bundle when they have none of the commit's
+ * tree, and aren't updating a ref they already have: otherwise most
+ * of its metadata would be downloaded again for nothing.
+ *
+ * They are maintained by ostree_repo_regenerate_summary() when
+ * core.tree-bundles is set, for the commits the summary references,
+ * and listed in the summary under OSTREE_SUMMARY_TREE_BUNDLES.
+ */
+
+char *
+_ostree_get_relative_tree_bundle_path (const char *commit)
+{
+  g_assert (strlen (commit) == OSTREE_SHA256_STRING_LEN);
+
+  return g_strdup_printf (_OSTREE_TREE_BUNDLE_DIR "/%c%c/%s",
+                          commit[0], commit[1], commit + 2);
+}
+
+/*
+ * _ostree_tree_bundle_parse:
+ * @data: Compressed bundle, untrusted
+ * @out_bundle: (out): Bundle of type OSTREE_TREE_BUNDLE_GVARIANT_FORMAT
+ *
+ * Decompress a tree bundle.  The objects it contains must still be
+ * validated by the caller.
+ */
+gboolean
+_ostree_tree_bundle_parse (GBytes        *data,
+                           GVariant     **out_bundle,
+                           GCancellable  *cancellable,
+                           GError       **error)
+{
+  g_autoptr(GInputStream) mem_in = g_memory_input_stream_new_from_bytes (data);
+  g_autoptr(GConverter) decompressor =
+    (GConverter*) g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_ZLIB);
+  g_autoptr(GInputStream) conv_in = g_converter_input_stream_new (mem_in, decompressor);
+  g_autoptr(GByteArray) buf = g_byte_array_new ();
+  g_autoptr(GBytes) bundle_bytes = NULL;
+  guint8 chunk[8192];
+
+  while (TRUE)
+    {
+      gssize bytes_read = g_input_stream_read (conv_in, chunk, sizeof (chunk),
+                                               cancellable, error);
+      if (bytes_read < 0)
+        return FALSE;
+      if (bytes_read == 0)
+        break;
+
+      if (buf->len + bytes_read > _OSTREE_MAX_TREE_BUNDLE_SIZE)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Tree bundle exceeds maximum size of %u bytes",
+                       _OSTREE_MAX_TREE_BUNDLE_SIZE);
+          return FALSE;
+        }
+      g_byte_array_append (buf, chunk, bytes_read);
+    }
+
+  bundle_bytes = g_byte_array_free_to_bytes (g_steal_pointer (&buf));
+  *out_bundle = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_TREE_BUNDLE_GVARIANT_FORMAT,
+                                                              bundle_bytes, FALSE));
+  return TRUE;
+}
+
+/* Sets @out_size to 0 if the commit's metadata is too large to bundle */
+static gboolean
+write_tree_bundle (OstreeRepo    *self,
+                   const char    *commit,
+                   guint64       *out_size,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  g_autofree char *bundle_path = _ostree_get_relative_tree_bundle_path (commit);
+  g_autofree char *bundle_dir = g_path_get_dirname (bundle_path);
+  g_autoptr(GHashTable) reachable = NULL;
+  g_autoptr(GVariantBuilder) builder = NULL;
+  g_autoptr(GVariant) bundle = NULL;
+  g_autoptr(GOutputStream) mem_out = NULL;
+  g_autoptr(GConverter) compressor = NULL;
+  g_autoptr(GOutputStream) conv_out = NULL;
+  g_autoptr(GBytes) compressed = NULL;
+  GHashTableIter hashiter;
+  gpointer key, value;
+  gsize bytes_written;
+  guint n_objects = 0;
+
+  if (!ostree_repo_traverse_commit (self, commit, 0, &reachable,
+                                    cancellable, error))
+    return FALSE;
+
+  builder = g_variant_builder_new (OSTREE_TREE_BUNDLE_GVARIANT_FORMAT);
+
+  g_hash_table_iter_init (&hashiter, reachable);
+  while (g_hash_table_iter_next (&hashiter, &key, &value))
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      g_autoptr(GVariant) object = NULL;
+      g_autoptr(GBytes) object_bytes = NULL;
+
+      ostree_object_name_deserialize (key, &checksum, &objtype);
+      if (!(objtype == OSTREE_OBJECT_TYPE_DIR_TREE ||
+            objtype == OSTREE_OBJECT_TYPE_DIR_META))
+        continue;
+
+      if (!ostree_repo_load_variant (self, objtype, checksum, &object, error))
+        return FALSE;
+
+      object_bytes = g_variant_get_data_as_bytes (object);
+      g_variant_builder_add (builder, "(y@ay@ay)", (guint8) objtype,
+                             ostree_checksum_to_bytes_v (checksum),
+                             ot_gvariant_new_ay_bytes (object_bytes));
+      n_objects++;
+    }
+
+  bundle = g_variant_ref_sink (g_variant_builder_end (builder));
+  if (g_variant_get_size (bundle) > _OSTREE_MAX_TREE_BUNDLE_SIZE)
+    {
+      g_debug ("not bundling %s, %" G_GSIZE_FORMAT " bytes of metadata",
+               commit, g_variant_get_size (bundle));
+      *out_size = 0;
+      return TRUE;
+    }
+
+  mem_out = g_memory_output_stream_new_resizable ();
+  compressor = (GConverter*) g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_ZLIB, 9);
+  conv_out = g_converter_output_stream_new (mem_out, compressor);
+  if (!g_output_stream_write_all (conv_out, g_variant_get_data (bundle), g_variant_get_size (bundle),
+                                  &bytes_written, cancellable, error))
+    return FALSE;
+  if (!g_output_stream_close (conv_out, cancellable, error))
+    return FALSE;
+  compressed = g_memory_output_stream_steal_as_bytes ((GMemoryOutputStream*) mem_out);
+
+  if (!glnx_shutil_mkdir_p_at (self->repo_dir_fd, bundle_dir, 0755, cancellable, error))
+    return FALSE;
+
+  if (!_ostree_repo_file_replace_contents (self, self->repo_dir_fd, bundle_path,
+                                           g_bytes_get_data (compressed, NULL),
+                                           g_bytes_get_size (compressed),
+                                           cancellable, error))
+    return FALSE;
+
+  g_debug ("wrote tree bundle for %s: %u objects, %" G_GSIZE_FORMAT " bytes",
+           commit, n_objects, g_bytes_get_size (compressed));
+
+  *out_size = g_bytes_get_size (compressed);
+  return TRUE;
+}
+
+/*
+ * _ostree_repo_regenerate_tree_bundles:
+ * @self: Repo
+ * @commits: Checksums of the commits to bundle
+ * @enabled: Whether to bundle them, or delete all bundles
+ * @out_bundles: (out): The summary's OSTREE_SUMMARY_TREE_BUNDLES, or %NULL if not @enabled
+ *
+ * Ensure each complete commit of @commits has a tree bundle, and
+ * delete all other bundles.
+ */
+gboolean
+_ostree_repo_regenerate_tree_bundles (OstreeRepo    *self,
+                                      GPtrArray     *commits,
+                                      gboolean       enabled,
+                                      GVariant     **out_bundles,
+                                      GCancellable  *cancellable,
+                                      GError       **error)
+{
+  g_autoptr(GHashTable) bundled = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GVariantBuilder) builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ayt)"));
+  guint i;
+
+  for (i = 0; enabled && i < commits->len; i++)
+    {
+      const char *commit = commits->pdata[i];
+      g_autofree char *bundle_path = _ostree_get_relative_tree_bundle_path (commit);
+      OstreeRepoCommitState commitstate;
+      struct stat stbuf;
+      guint64 size;
+
+      if (g_hash_table_contains (bundled, commit))
+        continue;
+
+      if (!ostree_repo_load_commit (self, commit, NULL, &commitstate, error))
+        return FALSE;
+      if ((commitstate & OSTREE_REPO_COMMIT_STATE_PARTIAL) > 0)
+        continue;
+
+      /* Like commits, bundles never change once written */
+      if (fstatat (self->repo_dir_fd, bundle_path, &stbuf, 0) == 0)
+        size = stbuf.st_size;
+      else if (errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+      else if (!write_tree_bundle (self, commit, &size, cancellable, error))
+        {
+          g_prefix_error (error, "Writing tree bundle for %s: ", commit);
+          return FALSE;
+        }
+
+      if (size == 0)
+        continue;
+
+      g_hash_table_add (bundled, g_strdup (commit));
+      g_variant_builder_add (builder, "(@ayt)", ostree_checksum_to_bytes_v (commit),
+                             GUINT64_TO_BE (size));
+    }
+
+  if (!_ostree_repo_prune_checksum_dir (self, _OSTREE_TREE_BUNDLE_DIR, bundled,
+                                        cancellable, error))
+    return FALSE;
+
+  if (enabled)
+    *out_bundles = g_variant_ref_sink (g_variant_builder_end (builder));
+  else
+    *out_bundles = NULL;
+  return TRUE;
+}
@@ -537,8 +537,14 @@ ostree_repo_finalize (GObject *object)
   g_clear_pointer (&self->cached_content_indexes, (GDestroyNotify) g_ptr_array_unref);
   g_clear_error (&self->writable_error);
   g_clear_pointer (&self->object_sizes, (GDestroyNotify) g_hash_table_unref);
+  g_clear_pointer (&self->object_sizes_pending, (GDestroyNotify) g_array_unref);
+  g_mutex_clear (&self->object_sizes_lock);
   g_mutex_clear (&self->cache_lock);
+  /* Don't wait; the last reference may be dropped by a writer thread */
+  if (self->write_pool)
+    g_thread_pool_free (self->write_pool, TRUE, FALSE);
   g_mutex_clear (&self->txn_stats_lock);
+  g_mutex_clear (&self->txn_sync_lock);
 
   g_clear_pointer (&self->remotes, g_hash_table_destroy);
   g_mutex_clear (&self->remotes_lock);
@@ -689,7 +695,9 @@ ostree_repo_init (OstreeRepo *self)
                                                  test_error_keys, G_N_ELEMENTS (test_error_keys));
 
   g_mutex_init (&self->cache_lock);
+  g_mutex_init (&self->txn_sync_lock);
   g_mutex_init (&self->txn_stats_lock);
+  g_mutex_init (&self->object_sizes_lock);
 
   self->remotes = g_hash_table_new_full (g_str_hash, g_str_equal,
                                          (GDestroyNotify) NULL,
@@ -2219,6 +2227,61 @@ ostree_repo_open (OstreeRepo    *self,
     self->tmp_expiry_seconds = g_ascii_strtoull (tmp_expiry_seconds, NULL, 10);
   }
 
+  { g_autofree char *commit_sync = NULL;
+    g_autofree char *batch_mb = NULL;
+
+    if (!ot_keyfile_get_value_with_default (self->config, "core", "commit-sync", "syncfs",
+                                            &commit_sync, error))
+      goto out;
+
+    if (strcmp (commit_sync, "syncfs") == 0)
+      self->commit_sync = OSTREE_REPO_COMMIT_SYNC_SYNCFS;
+    else if (strcmp (commit_sync, "fdatasync") == 0)
+      self->commit_sync = OSTREE_REPO_COMMIT_SYNC_FDATASYNC;
+    else if (strcmp (commit_sync, "batched") == 0)
+      self->commit_sync = OSTREE_REPO_COMMIT_SYNC_BATCHED;
+    else
+      {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "Invalid core.commit-sync value '%s'", commit_sync);
+        goto out;
+      }
+
+    if (!ot_keyfile_get_value_with_default (self->config, "core", "commit-sync-batch-mb", "64",
+                                            &batch_mb, error))
+      goto out;
+
+    self->commit_sync_batch_bytes =
+      MAX (g_ascii_strtoull (batch_mb, NULL, 10), 1) * 1024 * 1024;
+  }
+
+  { g_autofree char *write_threads = NULL;
+
+    /* 0 picks a default based on the number of CPUs */
+    if (!ot_keyfile_get_value_with_default (self->config, "core", "write-threads", "0",
+                                            &write_threads, error))
+      goto out;
+
+    self->n_write_threads = g_ascii_strtoull (write_threads, NULL, 10);
+    if (self->n_write_threads == 0)
+      self->n_write_threads = CLAMP (g_get_num_processors (), 2, 8);
+    self->n_write_threads = MIN (self->n_write_threads, 64);
+  }
+
+  { g_autofree char *block_index_min_size = NULL;
+
+    /* 0 disables block indexes; see ostree-repo-block-index.c */
+    if (!ot_keyfile_get_value_with_default (self->config, "core", "block-index-min-size", "0",
+                                            &block_index_min_size, error))
+      goto out;
+
+    self->block_index_min_size = g_ascii_strtoull (block_index_min_size, NULL, 10);
+  }
+
+  if (!ot_keyfile_get_boolean_with_default (self->config, "core", "tree-bundles",
+                                            FALSE, &self->tree_bundles, error))
+    goto out;
+
   if (!append_remotes_d (self, cancellable, error))
     goto out;
 
@@ -2385,90 +2448,167 @@ ostree_repo_get_parent (OstreeRepo  *self)
   return self->parent_repo;
 }
 
+/* Parse a filename in an objects/XX directory, returning %FALSE if
+ * it isn't a loose object of @self.
+ */
 static gboolean
-list_loose_objects_at (OstreeRepo             *self,
-                       GHashTable             *inout_objects,
-                       const char             *prefix,
-                       int                     dfd,
-                       const char             *commit_starting_with,
-                       GCancellable           *cancellable,
-                       GError                **error)
+parse_loose_object_name (OstreeRepo        *self,
+                         const char        *name,
+                         OstreeObjectType  *out_objtype)
 {
-  gboolean ret = FALSE;
-  DIR *d = NULL;
-  struct dirent *dent;
-  GVariant *key, *value;
+  const char *dot = strrchr (name, '.');
 
-  d = fdopendir (dfd);
-  if (!d)
-    {
-      glnx_set_error_from_errno (error);
-      goto out;
-    }
+  if (!dot || (dot - name) != 62)
+    return FALSE;
 
-  while ((dent = readdir (d)) != NULL)
-    {
-      const char *name = dent->d_name;
-      const char *dot;
-      OstreeObjectType objtype;
-      char buf[OSTREE_SHA256_STRING_LEN+1];
+  if ((self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2
+       && strcmp (dot, ".filez") == 0) ||
+      ((self->mode == OSTREE_REPO_MODE_BARE || self->mode == OSTREE_REPO_MODE_BARE_USER)
+       && strcmp (dot, ".file") == 0))
+    *out_objtype = OSTREE_OBJECT_TYPE_FILE;
+  else if (strcmp (dot, ".dirtree") == 0)
+    *out_objtype = OSTREE_OBJECT_TYPE_DIR_TREE;
+  else if (strcmp (dot, ".dirmeta") == 0)
+    *out_objtype = OSTREE_OBJECT_TYPE_DIR_META;
+  else if (strcmp (dot, ".commit") == 0)
+    *out_objtype = OSTREE_OBJECT_TYPE_COMMIT;
+  else
+    return FALSE;
 
-      if (strcmp (name, ".") == 0 ||
-          strcmp (name, "..") == 0)
-        continue;
+  return TRUE;
+}
 
-      dot = strrchr (name, '.');
-      if (!dot)
-        continue;
+/* Call @func for each loose object of @self in the objects/XX
+ * directories belonging to @shard, reading the directories one at a
+ * time so memory use doesn't grow with the size of the repository.
+ * Objects which @skip_repo also has are skipped.
+ */
+static gboolean
+foreach_loose_object (OstreeRepo                  *self,
+                      guint                        shard,
+                      guint                        n_shards,
+                      OstreeRepo                  *skip_repo,
+                      OstreeRepoForeachObjectFunc  func,
+                      gpointer                     user_data,
+                      GCancellable                *cancellable,
+                      GError                     **error)
+{
+  static const gchar hexchars[] = "0123456789abcdef";
+  guint c;
 
-      if ((self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2
-           && strcmp (dot, ".filez") == 0) ||
-          ((self->mode == OSTREE_REPO_MODE_BARE || self->mode == OSTREE_REPO_MODE_BARE_USER)
-           && strcmp (dot, ".file") == 0))
-        objtype = OSTREE_OBJECT_TYPE_FILE;
-      else if (strcmp (dot, ".dirtree") == 0)
-        objtype = OSTREE_OBJECT_TYPE_DIR_TREE;
-      else if (strcmp (dot, ".dirmeta") == 0)
-        objtype = OSTREE_OBJECT_TYPE_DIR_META;
-      else if (strcmp (dot, ".commit") == 0)
-        objtype = OSTREE_OBJECT_TYPE_COMMIT;
-      else
-        continue;
+  for (c = 0; c < 256; c++)
+    {
+      char prefix[3];
+      int dfd;
+      DIR *d;
+      struct dirent *dent;
+      gboolean ok = TRUE;
 
-      if ((dot - name) != 62)
+      if (n_shards > 1 && (c % n_shards) != shard)
         continue;
 
-      memcpy (buf, prefix, 2);
-      memcpy (buf + 2, name, 62);
-      buf[sizeof(buf)-1] = '\0';
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
 
-      /* if we passed in a "starting with" argument, then
-         we only want to return .commit objects with a checksum
-         that matches the commit_starting_with argument */
-      if (commit_starting_with)
+      prefix[0] = hexchars[c >> 4];
+      prefix[1] = hexchars[c & 0xF];
+      prefix[2] = '\0';
+      dfd = ot_opendirat (self->objects_dir_fd, prefix, FALSE);
+      if (dfd == -1)
         {
-          /* object is not a commit, do not add to array */
-          if (objtype != OSTREE_OBJECT_TYPE_COMMIT)
-              continue;
+          if (errno == ENOENT)
+            continue;
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
 
-          /* commit checksum does not match "starting with", do not add to array */     
-          if (!g_str_has_prefix (buf, commit_starting_with))
+      d = fdopendir (dfd);
+      if (!d)
+        {
+          glnx_set_error_from_errno (error);
+          (void) close (dfd);
+          return FALSE;
+        }
+
+      while (ok && (dent = readdir (d)) != NULL)
+        {
+          OstreeObjectType objtype;
+          char buf[OSTREE_SHA256_STRING_LEN+1];
+          guchar csum[OSTREE_SHA256_DIGEST_LEN];
+
+          if (!parse_loose_object_name (self, dent->d_name, &objtype))
             continue;
+
+          memcpy (buf, prefix, 2);
+          memcpy (buf + 2, dent->d_name, 62);
+          buf[sizeof(buf)-1] = '\0';
+
+          if (skip_repo)
+            {
+              gboolean have_object;
+
+              if (!_ostree_repo_has_loose_object (skip_repo, buf, objtype, &have_object,
+                                                  cancellable, error))
+                {
+                  ok = FALSE;
+                  break;
+                }
+              if (have_object)
+                continue;
+            }
+
+          ostree_checksum_inplace_to_bytes (buf, csum);
+          /* Always report the repository the caller asked about */
+          ok = func (skip_repo ? skip_repo : self, csum, objtype, user_data, error);
         }
 
-      key = ostree_object_name_serialize (buf, objtype);
-      value = g_variant_new ("(b@as)",
-                             TRUE, g_variant_new_strv (NULL, 0));
-      /* transfer ownership */
-      g_hash_table_replace (inout_objects, g_variant_ref_sink (key),
-                            g_variant_ref_sink (value));
+      (void) closedir (d);
+      if (!ok)
+        return FALSE;
     }
 
-  ret = TRUE;
- out:
-  if (d)
-    (void) closedir (d);
-  return ret;
+  return TRUE;
+}
+
+typedef struct {
+  GHashTable *objects;
+  const char *commit_starting_with;
+} ListLooseObjectsData;
+
+static gboolean
+list_loose_objects_cb (OstreeRepo        *repo,
+                       const guchar      *csum,
+                       OstreeObjectType   objtype,
+                       gpointer           user_data,
+                       GError           **error)
+{
+  ListLooseObjectsData *data = user_data;
+  char buf[OSTREE_SHA256_STRING_LEN+1];
+  GVariant *key, *value;
+
+  ostree_checksum_inplace_from_bytes (csum, buf);
+
+  /* if we passed in a "starting with" argument, then
+     we only want to return .commit objects with a checksum
+     that matches the commit_starting_with argument */
+  if (data->commit_starting_with)
+    {
+      /* object is not a commit, do not add to array */
+      if (objtype != OSTREE_OBJECT_TYPE_COMMIT)
+        return TRUE;
+
+      /* commit checksum does not match "starting with", do not add to array */
+      if (!g_str_has_prefix (buf, data->commit_starting_with))
+        return TRUE;
+    }
+
+  key = ostree_object_name_serialize (buf, objtype);
+  value = g_variant_new ("(b@as)",
+                         TRUE, g_variant_new_strv (NULL, 0));
+  /* transfer ownership */
+  g_hash_table_replace (data->objects, g_variant_ref_sink (key),
+                        g_variant_ref_sink (value));
+  return TRUE;
 }
 
 static gboolean
@@ -2478,38 +2618,10 @@ list_loose_objects (OstreeRepo                     *self,
                     GCancellable                   *cancellable,
                     GError                        **error)
 {
-  gboolean ret = FALSE;
-  guint c;
-  int dfd = -1;
-  static const gchar hexchars[] = "0123456789abcdef";
+  ListLooseObjectsData data = { inout_objects, commit_starting_with };
 
-  for (c = 0; c < 256; c++)
-    {
-      char buf[3];
-      buf[0] = hexchars[c >> 4];
-      buf[1] = hexchars[c & 0xF];
-      buf[2] = '\0';
-      dfd = ot_opendirat (self->objects_dir_fd, buf, FALSE);
-      if (dfd == -1)
-        {
-          if (errno == ENOENT)
-            continue;
-          else
-            {
-              glnx_set_error_from_errno (error);
-              goto out;
-            }
-        }
-      /* Takes ownership of dfd */
-      if (!list_loose_objects_at (self, inout_objects, buf, dfd,
-                                       commit_starting_with,
-                                       cancellable, error))
-        goto out;
-    }
-
-  ret = TRUE;
- out:
-  return ret;
+  return foreach_loose_object (self, 0, 1, NULL, list_loose_objects_cb, &data,
+                               cancellable, error);
 }
 
 static gboolean
@@ -2927,6 +3039,68 @@ ostree_repo_load_file (OstreeRepo         *self,
   return ret;
 }
 
+/*
+ * _ostree_repo_load_file_bytes:
+ *
+ * Load a content object as an mmap()'d buffer suitable for seeking.
+ * Regular files in bare repos are mapped directly; otherwise the object
+ * is uncompressed to an unlinked tmpfile in the repo's tmpdir (rather
+ * than /tmp, which is often backed by memory).
+ */
+gboolean
+_ostree_repo_load_file_bytes (OstreeRepo     *self,
+                              const char     *checksum,
+                              GBytes        **out_content,
+                              GCancellable   *cancellable,
+                              GError        **error)
+{
+  g_autofree char *tmpname = NULL;
+  glnx_fd_close int fd = -1;
+  g_autoptr(GBytes) ret_content = NULL;
+  g_autoptr(GInputStream) istream = NULL;
+  g_autoptr(GOutputStream) out = NULL;
+
+  if (self->mode == OSTREE_REPO_MODE_BARE ||
+      self->mode == OSTREE_REPO_MODE_BARE_USER)
+    {
+      char loose_path[_OSTREE_LOOSE_PATH_MAX];
+
+      _ostree_loose_path (loose_path, checksum, OSTREE_OBJECT_TYPE_FILE, self->mode);
+      /* May be in a parent repo, which we handle below */
+      if (!ot_openat_ignore_enoent (self->objects_dir_fd, loose_path, &fd, error))
+        return FALSE;
+    }
+
+  if (fd == -1)
+    {
+      if (!glnx_open_tmpfile_linkable_at (self->tmp_dir_fd, ".", O_RDWR | O_CLOEXEC,
+                                          &fd, &tmpname, error))
+        return FALSE;
+      /* We don't need the file name */
+      if (tmpname)
+        (void) unlinkat (self->tmp_dir_fd, tmpname, 0);
+
+      if (!ostree_repo_load_file (self, checksum, &istream, NULL, NULL,
+                                  cancellable, error))
+        return FALSE;
+
+      out = g_unix_output_stream_new (fd, FALSE);
+      if (g_output_stream_splice (out, istream, G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                  cancellable, error) < 0)
+        return FALSE;
+    }
+
+  { g_autoptr(GMappedFile) mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+    if (!mfile)
+      return FALSE;
+    ret_content = g_mapped_file_get_bytes (mfile);
+  }
+
+  if (out_content)
+    *out_content = g_steal_pointer (&ret_content);
+  return TRUE;
+}
+
 /**
  * ostree_repo_load_object_stream:
  * @self: Repo
@@ -3400,6 +3574,79 @@ import_one_object_link (OstreeRepo    *self,
   return ret;
 }
 
+static gboolean
+repo_mode_is_bare (OstreeRepoMode mode)
+{
+  return mode == OSTREE_REPO_MODE_BARE || mode == OSTREE_REPO_MODE_BARE_USER;
+}
+
+/* Import a regular file content object between two bare or bare-user
+ * repos (in any combination) by copying the payload with
+ * ot_regfile_copy_bytes(), which reflinks where the filesystem allows,
+ * then applying the metadata the way the target's mode stores it.
+ * Symlinks aren't handled; @out_was_supported is set to %FALSE for
+ * them.
+ */
+static gboolean
+import_one_object_reflink (OstreeRepo    *self,
+                           OstreeRepo    *source,
+                           const char    *checksum,
+                           gboolean      *out_was_supported,
+                           GCancellable  *cancellable,
+                           GError       **error)
+{
+  g_autoptr(GFileInfo) file_info = NULL;
+  g_autoptr(GVariant) xattrs = NULL;
+  g_autoptr(GOutputStream) out_stream = NULL;
+  glnx_fd_close int src_fd = -1;
+  char loose_path_buf[_OSTREE_LOOSE_PATH_MAX];
+  OstreeRepoContentBareCommit state = { -1, NULL };
+  gboolean have_object;
+
+  *out_was_supported = FALSE;
+
+  if (!ostree_repo_load_file (source, checksum, NULL, &file_info, &xattrs,
+                              cancellable, error))
+    return FALSE;
+
+  if (g_file_info_get_file_type (file_info) != G_FILE_TYPE_REGULAR)
+    return TRUE;
+
+  _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, source->mode);
+  if (!ot_openat_ignore_enoent (source->objects_dir_fd, loose_path_buf, &src_fd, error))
+    return FALSE;
+  /* Probably in a parent repo; let the copy path deal with it */
+  if (src_fd == -1)
+    return TRUE;
+
+  *out_was_supported = TRUE;
+
+  /* No preallocation, so a reflink can share all of the source's
+   * extents.  The stream owns the temporary file's fd.
+   */
+  if (!_ostree_repo_open_content_bare (self, checksum, 0, &state, &out_stream, &have_object,
+                                       cancellable, error))
+    return FALSE;
+  if (have_object)
+    return TRUE;
+
+  if (!ot_regfile_copy_bytes (src_fd, state.fd, g_file_info_get_size (file_info),
+                              cancellable, error))
+    {
+      g_free (state.temp_filename);
+      return FALSE;
+    }
+
+  if (!_ostree_repo_commit_trusted_content_bare (self, checksum, &state,
+                                                 g_file_info_get_attribute_uint32 (file_info, "unix::uid"),
+                                                 g_file_info_get_attribute_uint32 (file_info, "unix::gid"),
+                                                 g_file_info_get_attribute_uint32 (file_info, "unix::mode"),
+                                                 xattrs, cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
 /**
  * ostree_repo_import_object_from:
  * @self: Destination repo
@@ -3442,9 +3689,12 @@ ostree_repo_import_object_from (OstreeRepo           *self,
  * Copy object named by @objtype and @checksum into @self from the
  * source repository @source.  If both repositories are of the same
  * type and on the same filesystem, this will simply be a fast Unix
- * hard link operation.
+ * hard link operation.  Metadata objects are stored the same way in
+ * every mode, so they are hard linked regardless of type.
  *
- * Otherwise, a copy will be performed.
+ * Otherwise, a copy will be performed; between bare and bare-user
+ * repositories, trusted content is copied with a reflink where the
+ * filesystem supports it.
  */
 gboolean
 ostree_repo_import_object_from_with_trust (OstreeRepo           *self,
@@ -3458,8 +3708,11 @@ ostree_repo_import_object_from_with_trust (OstreeRepo           *self,
   gboolean ret = FALSE;
   gboolean hardlink_was_supported = FALSE;
 
+  /* Metadata objects are stored identically in every repo mode, so
+   * they can be linked whenever the content objects could be.
+   */
   if (trusted && /* Don't hardlink into untrusted remotes */
-      self->mode == source->mode)
+      (self->mode == source->mode || OSTREE_OBJECT_TYPE_IS_META (objtype)))
     {
       if (!import_one_object_link (self, source, checksum, objtype,
                                    &hardlink_was_supported,
@@ -3477,9 +3730,23 @@ ostree_repo_import_object_from_with_trust (OstreeRepo           *self,
 
       if (!has_object)
         {
-          if (!import_one_object_copy (self, source, checksum, objtype, trusted,
-                                       cancellable, error))
-            goto out;
+          gboolean reflink_was_supported = FALSE;
+
+          if (trusted && objtype == OSTREE_OBJECT_TYPE_FILE &&
+              repo_mode_is_bare (self->mode) && repo_mode_is_bare (source->mode))
+            {
+              if (!import_one_object_reflink (self, source, checksum,
+                                              &reflink_was_supported,
+                                              cancellable, error))
+                goto out;
+            }
+
+          if (!reflink_was_supported)
+            {
+              if (!import_one_object_copy (self, source, checksum, objtype, trusted,
+                                           cancellable, error))
+                goto out;
+            }
         }
     }
 
@@ -3488,6 +3755,83 @@ ostree_repo_import_object_from_with_trust (OstreeRepo           *self,
   return ret;
 }
 
+typedef struct {
+  OstreeRepo *source;
+  OstreeObjectType objtype;
+  char *checksum;
+  gboolean trusted;
+} ImportObjectAsyncData;
+
+static void
+import_object_async_data_free (gpointer user_data)
+{
+  ImportObjectAsyncData *data = user_data;
+
+  g_clear_object (&data->source);
+  g_free (data->checksum);
+  g_free (data);
+}
+
+static void
+import_object_thread (GTask               *task,
+                      gpointer             object,
+                      gpointer             task_data,
+                      GCancellable        *cancellable)
+{
+  GError *error = NULL;
+  ImportObjectAsyncData *data = task_data;
+
+  if (!ostree_repo_import_object_from_with_trust (object, data->source, data->objtype,
+                                                  data->checksum, data->trusted,
+                                                  cancellable, &error))
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+/*
+ * _ostree_repo_import_object_async:
+ *
+ * Like ostree_repo_import_object_from_with_trust(), but runs on the
+ * writer pool of @self, so that converting objects between repo modes
+ * (e.g. compressing into archive-z2) is spread over several cores.
+ */
+void
+_ostree_repo_import_object_async (OstreeRepo          *self,
+                                  OstreeRepo          *source,
+                                  OstreeObjectType     objtype,
+                                  const char          *checksum,
+                                  gboolean             trusted,
+                                  GCancellable        *cancellable,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  ImportObjectAsyncData *asyncdata;
+
+  asyncdata = g_new0 (ImportObjectAsyncData, 1);
+  asyncdata->source = g_object_ref (source);
+  asyncdata->objtype = objtype;
+  asyncdata->checksum = g_strdup (checksum);
+  asyncdata->trusted = trusted;
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, _ostree_repo_import_object_async);
+  g_task_set_task_data (task, asyncdata, import_object_async_data_free);
+  _ostree_repo_write_pool_push (self, task, import_object_thread);
+}
+
+gboolean
+_ostree_repo_import_object_finish (OstreeRepo    *self,
+                                   GAsyncResult  *result,
+                                   GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  g_warn_if_fail (g_task_get_source_tag (G_TASK (result)) == _ostree_repo_import_object_async);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
 
 /**
  * ostree_repo_query_object_storage_size:
@@ -3686,6 +4030,64 @@ ostree_repo_list_objects (OstreeRepo                  *self,
   return ret;
 }
 
+/**
+ * ostree_repo_foreach_object:
+ * @self: Repo
+ * @flags: Flags controlling enumeration
+ * @shard: Index of the shard to enumerate, less than @n_shards
+ * @n_shards: Number of shards, or 0 or 1 to enumerate everything
+ * @func: (scope call): Called for each object
+ * @user_data: Data for @func
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Synchronously enumerate objects in the repository, calling @func
+ * for each one as it is found.  Unlike ostree_repo_list_objects(),
+ * nothing is accumulated, so this is suitable for very large
+ * repositories.
+ *
+ * Objects are split into @n_shards disjoint sets by checksum prefix;
+ * calling this concurrently from @n_shards threads, each with a
+ * different @shard, visits every object exactly once.  Objects which
+ * are also present in a parent repository are only reported once.
+ * If @func returns %FALSE, enumeration stops and its error is
+ * returned.  Deleting the current object from @func is allowed.
+ *
+ * Returns: %TRUE on success, %FALSE on error, and @error will be set
+ */
+gboolean
+ostree_repo_foreach_object (OstreeRepo                  *self,
+                            OstreeRepoListObjectsFlags   flags,
+                            guint                        shard,
+                            guint                        n_shards,
+                            OstreeRepoForeachObjectFunc  func,
+                            gpointer                     user_data,
+                            GCancellable                *cancellable,
+                            GError                     **error)
+{
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+  g_return_val_if_fail (self->inited, FALSE);
+  g_return_val_if_fail (n_shards <= 1 || shard < n_shards, FALSE);
+
+  if (flags & OSTREE_REPO_LIST_OBJECTS_ALL)
+    flags |= (OSTREE_REPO_LIST_OBJECTS_LOOSE | OSTREE_REPO_LIST_OBJECTS_PACKED);
+
+  if (flags & OSTREE_REPO_LIST_OBJECTS_LOOSE)
+    {
+      if (!foreach_loose_object (self, shard, n_shards, NULL, func, user_data,
+                                 cancellable, error))
+        return FALSE;
+      if ((flags & OSTREE_REPO_LIST_OBJECTS_NO_PARENTS) == 0 && self->parent_repo)
+        {
+          if (!foreach_loose_object (self->parent_repo, shard, n_shards, self,
+                                     func, user_data, cancellable, error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
 /**
  * ostree_repo_list_commit_objects_starting_with:
  * @self: Repo
@@ -4740,6 +5142,77 @@ ostree_repo_verify_summary (OstreeRepo    *self,
                                                 error);
 }
 
+/*
+ * _ostree_repo_prune_checksum_dir:
+ * @self: Repo
+ * @dirname: Directory relative to the repo, laid out as XX/YYYY...
+ * @keep: Set of checksums
+ *
+ * Delete the files of @dirname, named by checksum like loose objects,
+ * that aren't in @keep.  It's fine if @dirname doesn't exist.
+ */
+gboolean
+_ostree_repo_prune_checksum_dir (OstreeRepo    *self,
+                                 const char    *dirname,
+                                 GHashTable    *keep,
+                                 GCancellable  *cancellable,
+                                 GError       **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  struct stat stbuf;
+
+  if (fstatat (self->repo_dir_fd, dirname, &stbuf, 0) < 0)
+    {
+      if (errno == ENOENT)
+        return TRUE;
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  if (!glnx_dirfd_iterator_init_at (self->repo_dir_fd, dirname, FALSE,
+                                    &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      g_auto(GLnxDirFdIterator) sub_iter = { 0, };
+      struct dirent *dent;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+      if (dent->d_type != DT_DIR || strlen (dent->d_name) != 2)
+        continue;
+
+      if (!glnx_dirfd_iterator_init_at (dfd_iter.fd, dent->d_name, FALSE, &sub_iter, error))
+        return FALSE;
+
+      while (TRUE)
+        {
+          struct dirent *sub_dent;
+          g_autofree char *checksum = NULL;
+
+          if (!glnx_dirfd_iterator_next_dent (&sub_iter, &sub_dent, cancellable, error))
+            return FALSE;
+          if (sub_dent == NULL)
+            break;
+
+          checksum = g_strconcat (dent->d_name, sub_dent->d_name, NULL);
+          if (g_hash_table_contains (keep, checksum))
+            continue;
+
+          if (unlinkat (sub_iter.fd, sub_dent->d_name, 0) < 0 && errno != ENOENT)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+        }
+    }
+
+  return TRUE;
+}
+
 /**
  * ostree_repo_regenerate_summary:
  * @self: Repo
@@ -4752,6 +5225,14 @@ ostree_repo_verify_summary (OstreeRepo    *self,
  *
  * It is regenerated automatically after a commit if
  * `core/commit-update-summary` is set.
+ *
+ * If `core/block-index-min-size` is set, the block indexes of the
+ * large files in the referenced commits are also brought up to date,
+ * so clients can fetch only the changed parts of them.
+ *
+ * If `core/tree-bundles` is set, each referenced commit also gets a
+ * bundle of all its dirtree and dirmeta objects, which clients fetch
+ * in one request.
  */
 gboolean
 ostree_repo_regenerate_summary (OstreeRepo     *self,
@@ -4763,6 +5244,7 @@ ostree_repo_regenerate_summary (OstreeRepo     *self,
   g_autoptr(GHashTable) refs = NULL;
   g_autoptr(GVariantBuilder) refs_builder = NULL;
   g_autoptr(GVariant) summary = NULL;
+  g_autoptr(GPtrArray) commits = g_ptr_array_new ();
   GList *ordered_keys = NULL;
   GList *iter = NULL;
   g_auto(GVariantDict) additional_metadata_builder = OT_VARIANT_BUILDER_INITIALIZER;
@@ -4800,8 +5282,29 @@ ostree_repo_regenerate_summary (OstreeRepo     *self,
                                                   (guint64) g_variant_get_size (commit_obj),
                                                   ostree_checksum_to_bytes_v (commit),
                                                   ot_gvariant_new_empty_string_dict ()));
+      g_ptr_array_add (commits, (char*) commit);
     }
 
+  /* Also deletes the indexes of objects no longer referenced, or all of
+   * them if core.block-index-min-size has been unset */
+  if (!_ostree_repo_regenerate_block_index (self, commits, self->block_index_min_size,
+                                            cancellable, error))
+    goto out;
+
+  if (self->block_index_min_size > 0)
+    g_variant_dict_insert_value (&additional_metadata_builder, OSTREE_SUMMARY_BLOCK_INDEX_MIN_SIZE,
+                                 g_variant_new_uint64 (GUINT64_TO_BE (self->block_index_min_size)));
+
+  { g_autoptr(GVariant) tree_bundles = NULL;
+
+    if (!_ostree_repo_regenerate_tree_bundles (self, commits, self->tree_bundles, &tree_bundles,
+                                               cancellable, error))
+      goto out;
+
+    if (tree_bundles)
+      g_variant_dict_insert_value (&additional_metadata_builder, OSTREE_SUMMARY_TREE_BUNDLES,
+                                   tree_bundles);
+  }
 
   {
     guint i;
@@ -755,6 +755,11 @@ ostree_repo_checkout_tree (OstreeRepo               *self,
  * options.  This is used by ostree_repo_checkout_at() which
  * supercedes previous separate enumeration usage in
  * ostree_repo_checkout_tree() and ostree_repo_checkout_tree_at().
+ *
+ * If @prefer_reflinks is set, regular files from bare repositories are
+ * copied instead of hardlinked, using reflinks where the filesystem
+ * supports them, so the checkout can be modified without corrupting
+ * the repository.
  */
 typedef struct {
   OstreeRepoCheckoutMode mode;
@@ -764,7 +769,8 @@ typedef struct {
   gboolean enable_fsync;  /* Deprecated */
   gboolean process_whiteouts;
   gboolean no_copy_fallback;
-  gboolean unused_bools[7];
+  gboolean prefer_reflinks;
+  gboolean unused_bools[6];
 
   const char *subpath;
 
@@ -834,6 +840,34 @@ gboolean ostree_repo_list_objects (OstreeRepo                  *self,
                                    GCancellable                *cancellable,
                                    GError                     **error);
 
+/**
+ * OstreeRepoForeachObjectFunc:
+ * @repo: Repo
+ * @csum: (array fixed-size=32): Binary checksum of the object
+ * @objtype: Object type
+ * @user_data: User data
+ * @error: Error
+ *
+ * Called by ostree_repo_foreach_object() for each object.
+ *
+ * Returns: %FALSE and sets @error to stop the enumeration
+ */
+typedef gboolean (*OstreeRepoForeachObjectFunc) (OstreeRepo        *repo,
+                                                 const guchar      *csum,
+                                                 OstreeObjectType   objtype,
+                                                 gpointer           user_data,
+                                                 GError           **error);
+
+_OSTREE_PUBLIC
+gboolean ostree_repo_foreach_object (OstreeRepo                  *self,
+                                     OstreeRepoListObjectsFlags   flags,
+                                     guint                        shard,
+                                     guint                        n_shards,
+                                     OstreeRepoForeachObjectFunc  func,
+                                     gpointer                     user_data,
+                                     GCancellable                *cancellable,
+                                     GError                     **error);
+
 _OSTREE_PUBLIC
 gboolean ostree_repo_list_commit_objects_starting_with ( OstreeRepo                  *self,
                                                          const char                  *start,
@@ -869,6 +903,16 @@ gboolean ostree_repo_static_delta_generate (OstreeRepo                   *self,
                                             GCancellable                 *cancellable,
                                             GError                      **error);
 
+_OSTREE_PUBLIC
+gboolean ostree_repo_static_delta_generate_many (OstreeRepo                   *self,
+                                                 OstreeStaticDeltaGenerateOpt  opt,
+                                                 const char * const           *from_revs,
+                                                 const char                   *to,
+                                                 GVariant                     *metadata,
+                                                 GVariant                     *params,
+                                                 GCancellable                 *cancellable,
+                                                 GError                      **error);
+
 _OSTREE_PUBLIC
 gboolean ostree_repo_static_delta_execute_offline (OstreeRepo                    *self,
                                                    GFile                         *dir_or_file,
@@ -27,30 +27,360 @@
 #include "libglnx.h"
 #include "bupsplit.h"
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #define ROLLSUM_BLOB_MAX (8192*4)
 
-static GHashTable *
-rollsum_chunks_crc32 (GBytes           *bytes)
+/* The bup rolling checksum over a window of BUP_WINDOWSIZE bytes,
+ * reimplemented so that it can be vectorized.  This must produce
+ * exactly the same boundaries as bupsplit_find_ofs().
+ *
+ * Bytes before the start of the buffer are treated as zero, as bup
+ * does.  Expanding the recurrence in bupsplit.c, the value tested at
+ * offset t is:
+ *
+ *   s2(t) = W*(W-1)*C + sum_{j=t-W+1}^{t} (t-j+1) * buf[j]
+ *         = W*(W-1)*C + (t+1) * (P(t) - P(t-W)) - (Q(t) - Q(t-W))
+ *
+ * where P and Q are the prefix sums of buf[j] and j*buf[j].  We only
+ * look at the low BUP_BLOBBITS bits of s2, so all of this can be done
+ * in 16 bit arithmetic, which gives 8 (SSE2) or 16 (AVX2) offsets per
+ * vector.
+ */
+#define ROLLSUM_CHAR_OFFSET 31
+#define ROLLSUM_S1_INIT (BUP_WINDOWSIZE * ROLLSUM_CHAR_OFFSET)
+#define ROLLSUM_S2_INIT (BUP_WINDOWSIZE * (BUP_WINDOWSIZE-1) * ROLLSUM_CHAR_OFFSET)
+#define ROLLSUM_MASK (BUP_BLOBSIZE-1)
+/* Must be a power of two, and hold a window plus a vector's worth */
+#define ROLLSUM_PREFIX_RING 128
+
+/* Compute the exact rollsum state after consuming buf[0..t] */
+static void
+rollsum_state_at (const guint8 *buf,
+                  int           t,
+                  guint32      *out_s1,
+                  guint32      *out_s2)
 {
-  gsize start = 0;
-  gboolean rollsum_end = FALSE;
-  GHashTable *ret_rollsums = NULL;
-  const guint8 *buf;
-  gsize buflen;
-  gsize remaining;
+  guint32 s1 = ROLLSUM_S1_INIT;
+  guint32 s2 = ROLLSUM_S2_INIT;
+  int k;
+
+  for (k = 0; k < BUP_WINDOWSIZE && k <= t; k++)
+    {
+      s1 += buf[t-k];
+      s2 += (k+1) * buf[t-k];
+    }
+
+  *out_s1 = s1;
+  *out_s2 = s2;
+}
+
+static int
+rollsum_found (const guint8 *buf,
+               int           t,
+               int          *bits)
+{
+  if (bits)
+    {
+      guint32 s1, s2;
+      unsigned rsum;
+
+      rollsum_state_at (buf, t, &s1, &s2);
+      rsum = (s1 << 16) | (s2 & 0xffff);
+      rsum >>= BUP_BLOBBITS;
+      for (*bits = BUP_BLOBBITS; (rsum >>= 1) & 1; (*bits)++)
+        ;
+    }
+  return t + 1;
+}
+
+/* Continue the scalar recurrence from offset @start to @len */
+static int
+rollsum_find_ofs_scalar_from (const guint8 *buf,
+                              int           start,
+                              int           len,
+                              int          *bits)
+{
+  guint32 s1 = ROLLSUM_S1_INIT;
+  guint32 s2 = ROLLSUM_S2_INIT;
+  int t = start;
+
+  if (start > 0)
+    rollsum_state_at (buf, start - 1, &s1, &s2);
+
+  /* While the window is still filling, the dropped byte is zero */
+  for (; t < len && t < BUP_WINDOWSIZE; t++)
+    {
+      s1 += buf[t];
+      s2 += s1 - ROLLSUM_S1_INIT;
+      if ((s2 & ROLLSUM_MASK) == ROLLSUM_MASK)
+        return rollsum_found (buf, t, bits);
+    }
+
+  for (; t < len; t++)
+    {
+      guint8 drop = buf[t - BUP_WINDOWSIZE];
+      s1 += buf[t] - drop;
+      s2 += s1 - BUP_WINDOWSIZE * (drop + ROLLSUM_CHAR_OFFSET);
+      if ((s2 & ROLLSUM_MASK) == ROLLSUM_MASK)
+        return rollsum_found (buf, t, bits);
+    }
+
+  return 0;
+}
 
-  ret_rollsums = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)g_ptr_array_unref);
+static int
+rollsum_find_ofs_scalar (const guint8 *buf,
+                         int           len,
+                         int          *bits)
+{
+  return rollsum_find_ofs_scalar_from (buf, 0, len, bits);
+}
+
+#if defined(__SSE2__)
+static int
+rollsum_find_ofs_sse2 (const guint8 *buf,
+                       int           len,
+                       int          *bits)
+{
+  guint16 pring[ROLLSUM_PREFIX_RING] __attribute__((aligned(16))) = { 0, };
+  guint16 qring[ROLLSUM_PREFIX_RING] __attribute__((aligned(16))) = { 0, };
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i mask = _mm_set1_epi16 (ROLLSUM_MASK);
+  const __m128i s2_init = _mm_set1_epi16 ((guint16) ROLLSUM_S2_INIT);
+  const __m128i lanes = _mm_setr_epi16 (0, 1, 2, 3, 4, 5, 6, 7);
+  const __m128i step = _mm_set1_epi16 (8);
+  __m128i idx = lanes;
+  __m128i pcarry = zero;
+  __m128i qcarry = zero;
+  int t;
+
+  for (t = 0; t + 8 <= len; t += 8)
+    {
+      __m128i x = _mm_unpacklo_epi8 (_mm_loadl_epi64 ((const __m128i *)(buf + t)), zero);
+      __m128i y = _mm_mullo_epi16 (x, idx);
+      __m128i p, q, pold, qold, s2, hit;
+      int hits;
+
+      /* Inclusive prefix sums within the vector */
+      x = _mm_add_epi16 (x, _mm_slli_si128 (x, 2));
+      y = _mm_add_epi16 (y, _mm_slli_si128 (y, 2));
+      x = _mm_add_epi16 (x, _mm_slli_si128 (x, 4));
+      y = _mm_add_epi16 (y, _mm_slli_si128 (y, 4));
+      x = _mm_add_epi16 (x, _mm_slli_si128 (x, 8));
+      y = _mm_add_epi16 (y, _mm_slli_si128 (y, 8));
+      p = _mm_add_epi16 (x, pcarry);
+      q = _mm_add_epi16 (y, qcarry);
+
+      pold = _mm_load_si128 ((const __m128i *)&pring[(t - BUP_WINDOWSIZE) & (ROLLSUM_PREFIX_RING-1)]);
+      qold = _mm_load_si128 ((const __m128i *)&qring[(t - BUP_WINDOWSIZE) & (ROLLSUM_PREFIX_RING-1)]);
+      _mm_store_si128 ((__m128i *)&pring[t & (ROLLSUM_PREFIX_RING-1)], p);
+      _mm_store_si128 ((__m128i *)&qring[t & (ROLLSUM_PREFIX_RING-1)], q);
+
+      /* idx + 1 is t+1 for each lane */
+      s2 = _mm_mullo_epi16 (_mm_sub_epi16 (p, pold), _mm_add_epi16 (idx, _mm_set1_epi16 (1)));
+      s2 = _mm_sub_epi16 (s2, _mm_sub_epi16 (q, qold));
+      s2 = _mm_add_epi16 (s2, s2_init);
+      hit = _mm_cmpeq_epi16 (_mm_and_si128 (s2, mask), mask);
+      hits = _mm_movemask_epi8 (hit);
+      if (hits)
+        return rollsum_found (buf, t + (__builtin_ctz (hits) / 2), bits);
+
+      /* Broadcast the last lane as the carry for the next vector */
+      pcarry = _mm_shufflehi_epi16 (p, 0xFF);
+      pcarry = _mm_unpackhi_epi64 (pcarry, pcarry);
+      qcarry = _mm_shufflehi_epi16 (q, 0xFF);
+      qcarry = _mm_unpackhi_epi64 (qcarry, qcarry);
+      idx = _mm_add_epi16 (idx, step);
+    }
+
+  return rollsum_find_ofs_scalar_from (buf, t, len, bits);
+}
+
+__attribute__((target("avx2")))
+static int
+rollsum_find_ofs_avx2 (const guint8 *buf,
+                       int           len,
+                       int          *bits)
+{
+  guint16 pring[ROLLSUM_PREFIX_RING] __attribute__((aligned(32))) = { 0, };
+  guint16 qring[ROLLSUM_PREFIX_RING] __attribute__((aligned(32))) = { 0, };
+  const __m256i zero = _mm256_setzero_si256 ();
+  const __m256i one = _mm256_set1_epi16 (1);
+  const __m256i mask = _mm256_set1_epi16 (ROLLSUM_MASK);
+  const __m256i s2_init = _mm256_set1_epi16 ((guint16) ROLLSUM_S2_INIT);
+  const __m256i step = _mm256_set1_epi16 (16);
+  __m256i idx = _mm256_setr_epi16 (0, 1, 2, 3, 4, 5, 6, 7,
+                                   8, 9, 10, 11, 12, 13, 14, 15);
+  __m256i pcarry = zero;
+  __m256i qcarry = zero;
+  int t;
+
+  for (t = 0; t + 16 <= len; t += 16)
+    {
+      __m256i x = _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((const __m128i *)(buf + t)));
+      __m256i y = _mm256_mullo_epi16 (x, idx);
+      __m256i p, q, pold, qold, s2, hit, tmp;
+      int hits;
+
+      /* Inclusive prefix sums within each 128 bit lane... */
+      x = _mm256_add_epi16 (x, _mm256_slli_si256 (x, 2));
+      y = _mm256_add_epi16 (y, _mm256_slli_si256 (y, 2));
+      x = _mm256_add_epi16 (x, _mm256_slli_si256 (x, 4));
+      y = _mm256_add_epi16 (y, _mm256_slli_si256 (y, 4));
+      x = _mm256_add_epi16 (x, _mm256_slli_si256 (x, 8));
+      y = _mm256_add_epi16 (y, _mm256_slli_si256 (y, 8));
+      /* ...then carry the low lane's total into the high lane */
+      tmp = _mm256_permute2x128_si256 (x, x, 0x08);
+      tmp = _mm256_shufflehi_epi16 (tmp, 0xFF);
+      x = _mm256_add_epi16 (x, _mm256_unpackhi_epi64 (tmp, tmp));
+      tmp = _mm256_permute2x128_si256 (y, y, 0x08);
+      tmp = _mm256_shufflehi_epi16 (tmp, 0xFF);
+      y = _mm256_add_epi16 (y, _mm256_unpackhi_epi64 (tmp, tmp));
+      p = _mm256_add_epi16 (x, pcarry);
+      q = _mm256_add_epi16 (y, qcarry);
+
+      pold = _mm256_load_si256 ((const __m256i *)&pring[(t - BUP_WINDOWSIZE) & (ROLLSUM_PREFIX_RING-1)]);
+      qold = _mm256_load_si256 ((const __m256i *)&qring[(t - BUP_WINDOWSIZE) & (ROLLSUM_PREFIX_RING-1)]);
+      _mm256_store_si256 ((__m256i *)&pring[t & (ROLLSUM_PREFIX_RING-1)], p);
+      _mm256_store_si256 ((__m256i *)&qring[t & (ROLLSUM_PREFIX_RING-1)], q);
+
+      s2 = _mm256_mullo_epi16 (_mm256_sub_epi16 (p, pold), _mm256_add_epi16 (idx, one));
+      s2 = _mm256_sub_epi16 (s2, _mm256_sub_epi16 (q, qold));
+      s2 = _mm256_add_epi16 (s2, s2_init);
+      hit = _mm256_cmpeq_epi16 (_mm256_and_si256 (s2, mask), mask);
+      hits = _mm256_movemask_epi8 (hit);
+      if (hits)
+        return rollsum_found (buf, t + (__builtin_ctz (hits) / 2), bits);
+
+      tmp = _mm256_permute2x128_si256 (p, p, 0x11);
+      tmp = _mm256_shufflehi_epi16 (tmp, 0xFF);
+      pcarry = _mm256_unpackhi_epi64 (tmp, tmp);
+      tmp = _mm256_permute2x128_si256 (q, q, 0x11);
+      tmp = _mm256_shufflehi_epi16 (tmp, 0xFF);
+      qcarry = _mm256_unpackhi_epi64 (tmp, tmp);
+      idx = _mm256_add_epi16 (idx, step);
+    }
+
+  return rollsum_find_ofs_scalar_from (buf, t, len, bits);
+}
+#endif
 
-  buf = g_bytes_get_data (bytes, &buflen);
+gboolean
+_ostree_rollsum_impl_supported (OstreeRollsumImpl impl)
+{
+  switch (impl)
+    {
+    case OSTREE_ROLLSUM_IMPL_SCALAR:
+      return TRUE;
+#if defined(__SSE2__)
+    case OSTREE_ROLLSUM_IMPL_SSE2:
+      return TRUE;
+    case OSTREE_ROLLSUM_IMPL_AVX2:
+      return __builtin_cpu_supports ("avx2");
+#endif
+    default:
+      return FALSE;
+    }
+}
+
+/*
+ * _ostree_rollsum_find_ofs_with_impl:
+ *
+ * Like bupsplit_find_ofs(), using a specific implementation, which
+ * must be supported.  Mainly useful for tests and benchmarks.
+ */
+int
+_ostree_rollsum_find_ofs_with_impl (OstreeRollsumImpl  impl,
+                                    const guint8      *buf,
+                                    int                len,
+                                    int               *bits)
+{
+  switch (impl)
+    {
+    case OSTREE_ROLLSUM_IMPL_SCALAR:
+      return rollsum_find_ofs_scalar (buf, len, bits);
+#if defined(__SSE2__)
+    case OSTREE_ROLLSUM_IMPL_SSE2:
+      return rollsum_find_ofs_sse2 (buf, len, bits);
+    case OSTREE_ROLLSUM_IMPL_AVX2:
+      return rollsum_find_ofs_avx2 (buf, len, bits);
+#endif
+    default:
+      g_assert_not_reached ();
+      return 0;
+    }
+}
+
+/*
+ * _ostree_rollsum_find_ofs:
+ *
+ * Like bupsplit_find_ofs(), using the fastest implementation the CPU
+ * supports.
+ */
+int
+_ostree_rollsum_find_ofs (const guint8 *buf,
+                          int           len,
+                          int          *bits)
+{
+  static gsize impl_initialized;
+  static OstreeRollsumImpl impl;
+
+  if (g_once_init_enter (&impl_initialized))
+    {
+      if (_ostree_rollsum_impl_supported (OSTREE_ROLLSUM_IMPL_AVX2))
+        impl = OSTREE_ROLLSUM_IMPL_AVX2;
+      else if (_ostree_rollsum_impl_supported (OSTREE_ROLLSUM_IMPL_SSE2))
+        impl = OSTREE_ROLLSUM_IMPL_SSE2;
+      else
+        impl = OSTREE_ROLLSUM_IMPL_SCALAR;
+      g_once_init_leave (&impl_initialized, 1);
+    }
+
+  return _ostree_rollsum_find_ofs_with_impl (impl, buf, len, bits);
+}
+
+typedef struct {
+  guint32 crc;
+  guint64 start;
+  guint64 size;
+} RollsumChunkCrc;
+
+static gint
+compare_chunk_crcs (gconstpointer ap,
+                    gconstpointer bp)
+{
+  const RollsumChunkCrc *a = ap;
+  const RollsumChunkCrc *b = bp;
+
+  if (a->crc != b->crc)
+    return a->crc < b->crc ? -1 : 1;
+  if (a->start != b->start)
+    return a->start < b->start ? -1 : 1;
+  return 0;
+}
+
+/* Returns the content-defined chunks of @buf, split where the bup
+ * rolling checksum finds a boundary, sorted by (crc, start) */
+static GArray *
+rollsum_chunks_crc32 (const guint8     *buf,
+                      gsize             buflen)
+{
+  GArray *ret_chunks = g_array_new (FALSE, FALSE, sizeof (RollsumChunkCrc));
+  gsize start = 0;
+  gboolean rollsum_end = FALSE;
+  gsize remaining = buflen;
 
-  remaining = buflen;
   while (remaining > 0)
     {
+      RollsumChunkCrc val;
       int offset, bits;
 
       if (!rollsum_end)
         {
-          offset = bupsplit_find_ofs (buf + start, MIN(G_MAXINT32, remaining), &bits); 
+          offset = _ostree_rollsum_find_ofs (buf + start, MIN(G_MAXINT32, remaining), &bits);
           if (offset == 0)
             {
               rollsum_end = TRUE;
@@ -63,27 +393,18 @@ rollsum_chunks_crc32 (GBytes           *bytes)
         offset = MIN(ROLLSUM_BLOB_MAX, remaining);
 
       /* Use zlib's crc32 */
-      { guint32 crc = crc32 (0L, NULL, 0);
-        GVariant *val;
-        GPtrArray *matches;
-
-        crc = crc32 (crc, buf, offset);
-
-        val = g_variant_ref_sink (g_variant_new ("(utt)", crc, (guint64) start, (guint64)offset));
-        matches = g_hash_table_lookup (ret_rollsums, GUINT_TO_POINTER (crc));
-        if (!matches)
-          {
-            matches = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
-            g_hash_table_insert (ret_rollsums, GUINT_TO_POINTER (crc), matches);
-          }
-        g_ptr_array_add (matches, val);
-      }
+      val.crc = crc32 (crc32 (0L, NULL, 0), buf + start, offset);
+      val.start = start;
+      val.size = offset;
+      g_array_append_val (ret_chunks, val);
 
       start += offset;
       remaining -= offset;
     }
 
-  return ret_rollsums;
+  g_array_sort (ret_chunks, compare_chunk_crcs);
+
+  return ret_chunks;
 }
 
 static gint
@@ -111,15 +432,14 @@ _ostree_compute_rollsum_matches (GBytes                           *from,
                                  GBytes                           *to)
 {
   OstreeRollsumMatches *ret_rollsum = NULL;
-  g_autoptr(GHashTable) from_rollsum = NULL;
-  g_autoptr(GHashTable) to_rollsum = NULL;
+  g_autoptr(GArray) from_chunks = NULL;
+  g_autoptr(GArray) to_chunks = NULL;
   g_autoptr(GPtrArray) matches = NULL;
   const guint8 *from_buf;
   gsize from_len;
   const guint8 *to_buf;
   gsize to_len;
-  gpointer hkey, hvalue;
-  GHashTableIter hiter;
+  guint i, j;
 
   ret_rollsum = g_new0 (OstreeRollsumMatches, 1);
 
@@ -128,53 +448,59 @@ _ostree_compute_rollsum_matches (GBytes                           *from,
   from_buf = g_bytes_get_data (from, &from_len);
   to_buf = g_bytes_get_data (to, &to_len);
 
-  from_rollsum = rollsum_chunks_crc32 (from);
-  to_rollsum = rollsum_chunks_crc32 (to);
+  from_chunks = rollsum_chunks_crc32 (from_buf, from_len);
+  to_chunks = rollsum_chunks_crc32 (to_buf, to_len);
 
-  g_hash_table_iter_init (&hiter, to_rollsum);
-  while (g_hash_table_iter_next (&hiter, &hkey, &hvalue))
+  /* Both tables are sorted by crc, so walk them in step, looking at
+   * each run of chunks sharing a crc.
+   */
+  i = j = 0;
+  while (i < to_chunks->len)
     {
-      GPtrArray *to_chunks = hvalue;
-      GPtrArray *from_chunks;
-
-      from_chunks = g_hash_table_lookup (from_rollsum, hkey);
-      if (from_chunks != NULL)
+      guint32 crc = g_array_index (to_chunks, RollsumChunkCrc, i).crc;
+      guint to_end = i;
+      guint from_end;
+
+      while (to_end < to_chunks->len &&
+             g_array_index (to_chunks, RollsumChunkCrc, to_end).crc == crc)
+        to_end++;
+
+      while (j < from_chunks->len &&
+             g_array_index (from_chunks, RollsumChunkCrc, j).crc < crc)
+        j++;
+      from_end = j;
+      while (from_end < from_chunks->len &&
+             g_array_index (from_chunks, RollsumChunkCrc, from_end).crc == crc)
+        from_end++;
+
+      if (from_end > j)
         {
-          guint i;
+          guint k;
 
           ret_rollsum->crcmatches++;
 
-          for (i = 0; i < to_chunks->len; i++)
+          for (k = i; k < to_end; k++)
             {
-              GVariant *to_chunk = to_chunks->pdata[i];
-              guint64 to_start, to_offset;
-              guint32 tocrc;
-              guint j;
+              const RollsumChunkCrc *to_chunk = &g_array_index (to_chunks, RollsumChunkCrc, k);
+              guint l;
 
-              g_variant_get (to_chunk, "(utt)", &tocrc, &to_start, &to_offset);
-
-              for (j = 0; j < from_chunks->len; j++)
+              for (l = j; l < from_end; l++)
                 {
-                  GVariant *from_chunk = from_chunks->pdata[j];
-                  guint32 fromcrc;
-                  guint64 from_start, from_offset;
-
-                  g_variant_get (from_chunk, "(utt)", &fromcrc, &from_start, &from_offset);
-
-                  g_assert (fromcrc == tocrc);
+                  const RollsumChunkCrc *from_chunk = &g_array_index (from_chunks, RollsumChunkCrc, l);
 
                   /* Same crc32 but different length, skip it.  */
-                  if (to_offset != from_offset)
+                  if (to_chunk->size != from_chunk->size)
                     continue;
                   
                   /* Rsync uses a cryptographic checksum, but let's be
                    * very conservative here and just memcmp.
                    */
-                  if (memcmp (from_buf + from_start, to_buf + to_start, to_offset) == 0)
+                  if (memcmp (from_buf + from_chunk->start, to_buf + to_chunk->start, to_chunk->size) == 0)
                     {
-                      GVariant *match = g_variant_new ("(uttt)", fromcrc, to_offset, to_start, from_start);
+                      GVariant *match = g_variant_new ("(uttt)", crc, to_chunk->size,
+                                                       to_chunk->start, from_chunk->start);
                       ret_rollsum->bufmatches++;
-                      ret_rollsum->match_size += to_offset;
+                      ret_rollsum->match_size += to_chunk->size;
                       g_ptr_array_add (matches, g_variant_ref_sink (match));
                       break; /* Don't need any more matches */
                     } 
@@ -182,14 +508,13 @@ _ostree_compute_rollsum_matches (GBytes                           *from,
             }
         }
 
-      ret_rollsum->total += to_chunks->len;
+      ret_rollsum->total += to_end - i;
+      i = to_end;
     }
 
   g_ptr_array_sort (matches, compare_matches);
 
-  ret_rollsum->from_rollsums = from_rollsum; from_rollsum = NULL;
-  ret_rollsum->to_rollsums = to_rollsum; to_rollsum = NULL;
-  ret_rollsum->matches = matches; matches = NULL;
+  ret_rollsum->matches = g_steal_pointer (&matches);
 
   return ret_rollsum;
 }
@@ -197,8 +522,422 @@ _ostree_compute_rollsum_matches (GBytes                           *from,
 void
 _ostree_rollsum_matches_free (OstreeRollsumMatches *rollsum)
 {
-  g_hash_table_unref (rollsum->to_rollsums);
-  g_hash_table_unref (rollsum->from_rollsums);
   g_ptr_array_unref (rollsum->matches);
   g_free (rollsum);
 }
+
+/* Block signatures, as in rsync and zsync: one side is split into
+ * fixed-size blocks, each with a weak rolling checksum and a strong
+ * one.  The other side is scanned at every byte offset, rolling the
+ * weak checksum along, and only windows whose weak checksum matches a
+ * block are hashed with the strong one.
+ *
+ * Unlike the content-defined chunks above, which only match when both
+ * sides split identically, this finds any block of one side wherever
+ * it appears in the other, however densely the rest has changed.  And
+ * since the signatures are small, the two sides don't have to be on
+ * the same machine.
+ */
+#define BLOCK_SIZE_MIN 2048
+#define BLOCK_SIZE_MAX (64 * 1024)
+#define BLOCK_FILTER_BITS 16
+
+typedef struct {
+  guint32 weak;
+  guint32 block;
+} BlockIndexEntry;
+
+/*
+ * _ostree_block_signatures_default_block_size:
+ *
+ * Like rsync, use blocks of about the square root of the size, so the
+ * signatures and the expected literal data grow alike.
+ */
+guint32
+_ostree_block_signatures_default_block_size (guint64 size)
+{
+  guint64 block_size = G_GUINT64_CONSTANT (1) << ((g_bit_storage (size) + 1) / 2);
+
+  return (guint32) CLAMP (block_size, BLOCK_SIZE_MIN, BLOCK_SIZE_MAX);
+}
+
+static void
+block_weak_init (const guint8 *buf,
+                 guint32       len,
+                 guint32      *out_s1,
+                 guint32      *out_s2)
+{
+  guint32 s1 = 0, s2 = 0;
+  guint32 i;
+
+  for (i = 0; i < len; i++)
+    {
+      s1 += buf[i];
+      s2 += s1;
+    }
+
+  *out_s1 = s1;
+  *out_s2 = s2;
+}
+
+static inline guint32
+block_weak_value (guint32 s1,
+                  guint32 s2)
+{
+  return (s1 & 0xffff) | (s2 << 16);
+}
+
+static inline guint
+block_filter_key (guint32 weak)
+{
+  return (weak ^ (weak >> BLOCK_FILTER_BITS)) & ((1 << BLOCK_FILTER_BITS) - 1);
+}
+
+static void
+block_strong (OtChecksum   *checksum,
+              const guint8 *buf,
+              gsize         len,
+              guint8        out[OSTREE_BLOCK_SIGNATURE_STRONG_LEN])
+{
+  guint8 digest[OT_SHA256_DIGEST_LEN];
+
+  ot_checksum_reset (checksum);
+  ot_checksum_update (checksum, buf, len);
+  ot_checksum_get_digest (checksum, digest, sizeof (digest));
+  memcpy (out, digest, OSTREE_BLOCK_SIGNATURE_STRONG_LEN);
+}
+
+static gint
+compare_block_index (gconstpointer ap,
+                     gconstpointer bp)
+{
+  const BlockIndexEntry *a = ap;
+  const BlockIndexEntry *b = bp;
+
+  if (a->weak != b->weak)
+    return a->weak < b->weak ? -1 : 1;
+  if (a->block != b->block)
+    return a->block < b->block ? -1 : 1;
+  return 0;
+}
+
+/*
+ * _ostree_block_signature_compute:
+ * @checksum: An initialized checksum context, reset and reused here so
+ *   that callers signing many blocks only set up one
+ * @buf: Data
+ * @buflen: Length of @buf, at most one block
+ * @out_sig: (out): Signature of @buf
+ */
+void
+_ostree_block_signature_compute (OtChecksum           *checksum,
+                                 const guint8         *buf,
+                                 gsize                 buflen,
+                                 OstreeBlockSignature *out_sig)
+{
+  guint32 s1, s2;
+
+  block_weak_init (buf, buflen, &s1, &s2);
+  out_sig->weak = block_weak_value (s1, s2);
+  block_strong (checksum, buf, buflen, out_sig->strong);
+}
+
+/*
+ * _ostree_block_signatures_new_from_blocks:
+ * @block_size: Block size
+ * @size: Size of the data the signatures are of
+ * @blocks: (transfer full) (element-type OstreeBlockSignature): Signature of each block
+ *
+ * Returns: (transfer full): Signatures which can be searched for with
+ * _ostree_block_signatures_find(), e.g. after being received from elsewhere
+ */
+OstreeBlockSignatures *
+_ostree_block_signatures_new_from_blocks (guint32  block_size,
+                                          guint64  size,
+                                          GArray  *blocks)
+{
+  OstreeBlockSignatures *sigs;
+  guint i;
+
+  g_return_val_if_fail (block_size > 0, NULL);
+  g_return_val_if_fail (blocks->len == (size + block_size - 1) / block_size, NULL);
+
+  sigs = g_new0 (OstreeBlockSignatures, 1);
+  sigs->block_size = block_size;
+  sigs->size = size;
+  sigs->blocks = blocks;
+  sigs->index = g_array_sized_new (FALSE, FALSE, sizeof (BlockIndexEntry), blocks->len);
+  sigs->filter = g_malloc0 ((1 << BLOCK_FILTER_BITS) / 8);
+
+  for (i = 0; i < blocks->len; i++)
+    {
+      const OstreeBlockSignature *sig = &g_array_index (blocks, OstreeBlockSignature, i);
+
+      /* Only full blocks can be found by scanning */
+      if ((guint64) (i + 1) * block_size <= size)
+        {
+          BlockIndexEntry entry = { sig->weak, i };
+          guint key = block_filter_key (sig->weak);
+
+          g_array_append_val (sigs->index, entry);
+          sigs->filter[key / 8] |= 1 << (key % 8);
+        }
+    }
+
+  g_array_sort (sigs->index, compare_block_index);
+
+  return sigs;
+}
+
+/*
+ * _ostree_block_signatures_new:
+ * @buf: Data
+ * @buflen: Length of @buf
+ * @block_size: Block size, see _ostree_block_signatures_default_block_size()
+ *
+ * Returns: (transfer full): Signatures of each block of @buf
+ */
+OstreeBlockSignatures *
+_ostree_block_signatures_new (const guint8 *buf,
+                              gsize         buflen,
+                              guint32       block_size)
+{
+  g_auto(OtChecksum) checksum = { 0, };
+  GArray *blocks;
+  guint n_blocks;
+  guint i;
+
+  g_return_val_if_fail (block_size > 0, NULL);
+
+  ot_checksum_init (&checksum);
+  n_blocks = (buflen + block_size - 1) / block_size;
+  blocks = g_array_sized_new (FALSE, FALSE, sizeof (OstreeBlockSignature), n_blocks);
+
+  for (i = 0; i < n_blocks; i++)
+    {
+      gsize start = (gsize) i * block_size;
+      guint32 len = MIN (block_size, buflen - start);
+      OstreeBlockSignature sig;
+      guint32 s1, s2;
+
+      block_weak_init (buf + start, len, &s1, &s2);
+      sig.weak = block_weak_value (s1, s2);
+      block_strong (&checksum, buf + start, len, sig.strong);
+      g_array_append_val (blocks, sig);
+    }
+
+  return _ostree_block_signatures_new_from_blocks (block_size, buflen, blocks);
+}
+
+void
+_ostree_block_signatures_free (OstreeBlockSignatures *sigs)
+{
+  g_array_unref (sigs->blocks);
+  g_array_unref (sigs->index);
+  g_free (sigs->filter);
+  g_free (sigs);
+}
+
+/* Returns the block whose signature matches @window, or -1.  @preferred
+ * (the block after the previous match) is tried first, so unchanged
+ * runs stay contiguous even when they contain repeated blocks.
+ */
+static gint64
+block_signatures_lookup (OstreeBlockSignatures *sigs,
+                         OtChecksum            *checksum,
+                         guint32                weak,
+                         const guint8          *window,
+                         guint32                preferred)
+{
+  guint8 strong[OSTREE_BLOCK_SIGNATURE_STRONG_LEN];
+  gboolean have_strong = FALSE;
+  guint key = block_filter_key (weak);
+  guint lo, hi;
+
+  if ((sigs->filter[key / 8] & (1 << (key % 8))) == 0)
+    return -1;
+
+  if (preferred < sigs->blocks->len &&
+      (guint64) (preferred + 1) * sigs->block_size <= sigs->size)
+    {
+      const OstreeBlockSignature *sig = &g_array_index (sigs->blocks, OstreeBlockSignature, preferred);
+
+      if (sig->weak == weak)
+        {
+          block_strong (checksum, window, sigs->block_size, strong);
+          have_strong = TRUE;
+          if (memcmp (strong, sig->strong, sizeof (strong)) == 0)
+            return preferred;
+        }
+    }
+
+  /* Find the first index entry for @weak */
+  lo = 0;
+  hi = sigs->index->len;
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+
+      if (g_array_index (sigs->index, BlockIndexEntry, mid).weak < weak)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  for (; lo < sigs->index->len; lo++)
+    {
+      const BlockIndexEntry *entry = &g_array_index (sigs->index, BlockIndexEntry, lo);
+      const OstreeBlockSignature *sig;
+
+      if (entry->weak != weak)
+        break;
+
+      if (!have_strong)
+        {
+          block_strong (checksum, window, sigs->block_size, strong);
+          have_strong = TRUE;
+        }
+
+      sig = &g_array_index (sigs->blocks, OstreeBlockSignature, entry->block);
+      if (memcmp (strong, sig->strong, sizeof (strong)) == 0)
+        return entry->block;
+    }
+
+  return -1;
+}
+
+/*
+ * _ostree_block_signatures_find:
+ * @sigs: Signatures
+ * @buf: Data to scan
+ * @buflen: Length of @buf
+ *
+ * Find the full blocks of @sigs which occur in @buf.  Matches don't
+ * overlap, and are in order of offset.
+ *
+ * Returns: (transfer full) (element-type OstreeBlockMatch): Matches
+ */
+GArray *
+_ostree_block_signatures_find (OstreeBlockSignatures *sigs,
+                               const guint8          *buf,
+                               gsize                  buflen)
+{
+  GArray *ret_matches = g_array_new (FALSE, FALSE, sizeof (OstreeBlockMatch));
+  g_auto(OtChecksum) checksum = { 0, };
+  const guint32 block_size = sigs->block_size;
+  guint32 next_block = 0;
+  gboolean have_sum = FALSE;
+  guint32 s1 = 0, s2 = 0;
+  gsize pos = 0;
+
+  if (sigs->index->len == 0)
+    return ret_matches;
+
+  ot_checksum_init (&checksum);
+  while (buflen >= block_size && pos <= buflen - block_size)
+    {
+      gint64 block;
+
+      if (!have_sum)
+        {
+          block_weak_init (buf + pos, block_size, &s1, &s2);
+          have_sum = TRUE;
+        }
+
+      block = block_signatures_lookup (sigs, &checksum, block_weak_value (s1, s2),
+                                       buf + pos, next_block);
+      if (block >= 0)
+        {
+          OstreeBlockMatch match = { pos, (guint32) block };
+
+          g_array_append_val (ret_matches, match);
+          next_block = (guint32) block + 1;
+          pos += block_size;
+          have_sum = FALSE;
+          continue;
+        }
+
+      if (pos + block_size < buflen)
+        {
+          guint8 out = buf[pos];
+
+          s1 += buf[pos + block_size] - out;
+          s2 += s1 - block_size * out;
+        }
+      pos++;
+    }
+
+  return ret_matches;
+}
+
+/*
+ * _ostree_compute_block_matches:
+ *
+ * Like _ostree_compute_rollsum_matches(), using the block signatures
+ * of @from.  Runs of consecutive blocks are merged into one match.
+ */
+OstreeRollsumMatches *
+_ostree_compute_block_matches (GBytes *from,
+                               GBytes *to)
+{
+  OstreeRollsumMatches *ret_rollsum = g_new0 (OstreeRollsumMatches, 1);
+  g_autoptr(GPtrArray) matches = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  g_autoptr(GArray) block_matches = NULL;
+  OstreeBlockSignatures *sigs;
+  const guint8 *from_buf;
+  gsize from_len;
+  const guint8 *to_buf;
+  gsize to_len;
+  guint32 block_size;
+  guint i;
+
+  from_buf = g_bytes_get_data (from, &from_len);
+  to_buf = g_bytes_get_data (to, &to_len);
+
+  block_size = _ostree_block_signatures_default_block_size (MAX (from_len, to_len));
+  sigs = _ostree_block_signatures_new (from_buf, from_len, block_size);
+  block_matches = _ostree_block_signatures_find (sigs, to_buf, to_len);
+
+  ret_rollsum->total = (to_len + block_size - 1) / block_size;
+
+  i = 0;
+  while (i < block_matches->len)
+    {
+      const OstreeBlockMatch *first = &g_array_index (block_matches, OstreeBlockMatch, i);
+      const OstreeBlockSignature *sig = &g_array_index (sigs->blocks, OstreeBlockSignature, first->block);
+      guint64 from_start = (guint64) first->block * block_size;
+      guint64 size = block_size;
+      guint j;
+
+      for (j = i + 1; j < block_matches->len; j++)
+        {
+          const OstreeBlockMatch *next = &g_array_index (block_matches, OstreeBlockMatch, j);
+
+          if (next->offset != first->offset + size ||
+              (guint64) next->block * block_size != from_start + size)
+            break;
+          size += block_size;
+        }
+
+      /* The strong checksum is truncated; we have both sides here, so
+       * be certain.
+       */
+      if (memcmp (from_buf + from_start, to_buf + first->offset, size) == 0)
+        {
+          GVariant *match = g_variant_new ("(uttt)", sig->weak, size,
+                                           first->offset, from_start);
+          ret_rollsum->crcmatches++;
+          ret_rollsum->bufmatches += j - i;
+          ret_rollsum->match_size += size;
+          g_ptr_array_add (matches, g_variant_ref_sink (match));
+        }
+
+      i = j;
+    }
+
+  _ostree_block_signatures_free (sigs);
+
+  ret_rollsum->matches = g_steal_pointer (&matches);
+
+  return ret_rollsum;
+}
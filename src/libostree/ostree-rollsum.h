@@ -21,12 +21,11 @@
 #pragma once
 
 #include <gio/gio.h>
+#include "otutil.h"
 
 G_BEGIN_DECLS
 
 typedef struct {
-  GHashTable *from_rollsums;
-  GHashTable *to_rollsums;
   guint crcmatches;
   guint bufmatches;
   guint total;
@@ -34,10 +33,76 @@ typedef struct {
   GPtrArray *matches;
 } OstreeRollsumMatches;
 
+typedef enum {
+  OSTREE_ROLLSUM_IMPL_SCALAR,
+  OSTREE_ROLLSUM_IMPL_SSE2,
+  OSTREE_ROLLSUM_IMPL_AVX2,
+} OstreeRollsumImpl;
+
+gboolean _ostree_rollsum_impl_supported (OstreeRollsumImpl impl);
+
+int _ostree_rollsum_find_ofs_with_impl (OstreeRollsumImpl  impl,
+                                        const guint8      *buf,
+                                        int                len,
+                                        int               *bits);
+
+int _ostree_rollsum_find_ofs (const guint8 *buf,
+                              int           len,
+                              int          *bits);
+
 OstreeRollsumMatches *
 _ostree_compute_rollsum_matches (GBytes                           *from,
                                  GBytes                           *to);
 
 void _ostree_rollsum_matches_free (OstreeRollsumMatches *rollsum);
 
+/* rsync-style block signatures; see ostree-rollsum.c */
+#define OSTREE_BLOCK_SIGNATURE_STRONG_LEN 16
+
+typedef struct {
+  guint32 weak;
+  guint8 strong[OSTREE_BLOCK_SIGNATURE_STRONG_LEN];
+} OstreeBlockSignature;
+
+typedef struct {
+  guint32 block_size;
+  guint64 size;
+  GArray *blocks; /* OstreeBlockSignature, the last one may be short */
+  GArray *index; /* Full blocks, sorted by weak checksum */
+  guint8 *filter;
+} OstreeBlockSignatures;
+
+typedef struct {
+  guint64 offset;
+  guint32 block;
+} OstreeBlockMatch;
+
+guint32 _ostree_block_signatures_default_block_size (guint64 size);
+
+void _ostree_block_signature_compute (OtChecksum           *checksum,
+                                      const guint8         *buf,
+                                      gsize                 buflen,
+                                      OstreeBlockSignature *out_sig);
+
+OstreeBlockSignatures *
+_ostree_block_signatures_new_from_blocks (guint32  block_size,
+                                          guint64  size,
+                                          GArray  *blocks);
+
+OstreeBlockSignatures *
+_ostree_block_signatures_new (const guint8 *buf,
+                              gsize         buflen,
+                              guint32       block_size);
+
+void _ostree_block_signatures_free (OstreeBlockSignatures *sigs);
+
+GArray *
+_ostree_block_signatures_find (OstreeBlockSignatures *sigs,
+                               const guint8          *buf,
+                               gsize                  buflen);
+
+OstreeRollsumMatches *
+_ostree_compute_block_matches (GBytes *from,
+                               GBytes *to);
+
 G_END_DECLS
@@ -0,0 +1,52 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2017 The OSTree Authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include "ostree-sepolicy.h"
+
+G_BEGIN_DECLS
+
+/*
+ * OstreeSePolicyRelabelFunc:
+ * @subpath: Path of the file relative to the relabeled directory, "" for
+ *   the directory itself
+ * @relpath: Path used for the policy lookup
+ * @new_label: The label which was set
+ * @user_data: User data
+ *
+ * Called (serially) for every file whose label was changed.
+ */
+typedef void (*OstreeSePolicyRelabelFunc) (const char *subpath,
+                                           const char *relpath,
+                                           const char *new_label,
+                                           gpointer    user_data);
+
+gboolean _ostree_sepolicy_relabel_dir_at (OstreeSePolicy                *self,
+                                          int                            dfd,
+                                          const char                    *path,
+                                          const char                    *prefix,
+                                          OstreeSePolicyRestoreconFlags  flags,
+                                          OstreeSePolicyRelabelFunc      func,
+                                          gpointer                       user_data,
+                                          GCancellable                  *cancellable,
+                                          GError                       **error);
+
+G_END_DECLS
@@ -28,6 +28,7 @@
 #include "otutil.h"
 
 #include "ostree-sepolicy.h"
+#include "ostree-sepolicy-private.h"
 #include "ostree-bootloader-uboot.h"
 #include "ostree-bootloader-syslinux.h"
 
@@ -51,6 +52,10 @@ struct OstreeSePolicy {
   struct selabel_handle *selinux_hnd;
   char *selinux_policy_name;
   char *selinux_policy_csum;
+
+  /* Serializes selinux_hnd lookups; libselinux before 2.5 isn't
+   * thread-safe */
+  GMutex lock;
 #endif
 };
 
@@ -84,6 +89,7 @@ ostree_sepolicy_finalize (GObject *object)
       selabel_close (self->selinux_hnd);
       self->selinux_hnd = NULL;
     }
+  g_mutex_clear (&self->lock);
 #endif
 
   G_OBJECT_CLASS (ostree_sepolicy_parent_class)->finalize (object);
@@ -232,7 +238,7 @@ get_policy_checksum (char        **out_csum,
       goto out;
     }
 
-  *out_csum = ot_checksum_file_at (bindir_dfd, best_policy, G_CHECKSUM_SHA256,
+  *out_csum = ot_checksum_file_at (bindir_dfd, best_policy,
                                    cancellable, error);
   if (*out_csum == NULL)
     goto out;
@@ -242,6 +248,12 @@ out:
   return ret;
 }
 
+/* selinux_set_policy_root() sets process-wide state which
+ * selabel_open() then reads, so the two must not interleave with
+ * another policy's, e.g. when deploying several trees in parallel.
+ */
+G_LOCK_DEFINE_STATIC (selinux_policy);
+
 #endif
 
 static gboolean
@@ -313,6 +325,7 @@ initable_init (GInitable     *initable,
     {
       self->runtime_enabled = is_selinux_enabled () == 1;
 
+      G_LOCK (selinux_policy);
       g_setenv ("LIBSELINUX_DISABLE_PCRE_PRECOMPILED", "1", FALSE);
       if (selinux_set_policy_root (gs_file_get_path_cached (policy_root)) != 0)
         {
@@ -320,10 +333,12 @@ initable_init (GInitable     *initable,
                        "selinux_set_policy_root(%s): %s",
                        gs_file_get_path_cached (etc_selinux_dir),
                        strerror (errno));
+          G_UNLOCK (selinux_policy);
           goto out;
         }
 
       self->selinux_hnd = selabel_open (SELABEL_CTX_FILE, NULL, 0);
+      G_UNLOCK (selinux_policy);
       if (!self->selinux_hnd)
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
@@ -367,6 +382,9 @@ initable_init (GInitable     *initable,
 static void
 ostree_sepolicy_init (OstreeSePolicy *self)
 {
+#ifdef HAVE_SELINUX
+  g_mutex_init (&self->lock);
+#endif
 }
 
 static void
@@ -458,28 +476,33 @@ ostree_sepolicy_get_label (OstreeSePolicy    *self,
   gboolean ret = FALSE;
   int res;
   char *con = NULL;
+  g_autofree char *label = NULL;
 
-  if (self->selinux_hnd)
+  if (!self->selinux_hnd)
+    return TRUE;
+
+  g_mutex_lock (&self->lock);
+  res = selabel_lookup_raw (self->selinux_hnd, &con, relpath, unix_mode);
+  if (res != 0)
     {
-      res = selabel_lookup_raw (self->selinux_hnd, &con, relpath, unix_mode);
-      if (res != 0)
+      if (errno != ENOENT)
         {
-          if (errno != ENOENT)
-            {
-              glnx_set_error_from_errno (error);
-              goto out;
-            }
-        }
-      else
-        {
-          /* Ensure we consistently allocate with g_malloc */
-          *out_label = g_strdup (con);
-          freecon (con);
+          glnx_set_error_from_errno (error);
+          goto out;
         }
     }
+  else
+    {
+      /* Ensure we consistently allocate with g_malloc */
+      label = g_strdup (con);
+      freecon (con);
+    }
 
   ret = TRUE;
  out:
+  g_mutex_unlock (&self->lock);
+  if (ret && out_label)
+    *out_label = g_steal_pointer (&label);
   return ret;
 #else
   return TRUE;
@@ -575,6 +598,281 @@ ostree_sepolicy_restorecon (OstreeSePolicy    *self,
 #endif
 }
 
+#ifdef HAVE_SELINUX
+
+/* Upper bound on worker threads used by _ostree_sepolicy_relabel_dir_at() */
+#define RELABEL_MAX_THREADS 8
+
+typedef struct {
+  char *subpath;
+  guint32 mode;
+} RelabelItem;
+
+static void
+relabel_item_clear (gpointer data)
+{
+  RelabelItem *item = data;
+  g_free (item->subpath);
+}
+
+typedef struct {
+  OstreeSePolicy *self;
+  const char *abspath;
+  const char *prefix;
+  OstreeSePolicyRestoreconFlags flags;
+  OstreeSePolicyRelabelFunc func;
+  gpointer user_data;
+  GCancellable *cancellable;
+
+  GArray *items;
+  volatile gint next_item;
+  volatile gint failed;
+
+  GMutex lock;   /* Protects error and calls to func */
+  GError *error;
+} RelabelData;
+
+static gboolean
+relabel_collect_recurse (int            dfd,
+                         const char    *path,
+                         const char    *subpath,
+                         GArray        *items,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+
+  if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      struct stat stbuf;
+      RelabelItem item;
+
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      if (fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      item.subpath = *subpath ? g_strconcat (subpath, "/", dent->d_name, NULL)
+                              : g_strdup (dent->d_name);
+      item.mode = stbuf.st_mode;
+      g_array_append_val (items, item);
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          const char *child_subpath = g_array_index (items, RelabelItem, items->len - 1).subpath;
+          if (!relabel_collect_recurse (dfd_iter.fd, dent->d_name, child_subpath,
+                                        items, cancellable, error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+relabel_one_item (RelabelData  *data,
+                  RelabelItem  *item,
+                  GError      **error)
+{
+  g_autofree char *target = NULL;
+  g_autofree char *relpath = NULL;
+  g_autofree char *label = NULL;
+
+  target = *item->subpath ? g_strconcat (data->abspath, "/", item->subpath, NULL)
+                          : g_strdup (data->abspath);
+
+  /* Note the policy path is always absolute; avoid a doubled '/' when
+   * either component is empty.
+   */
+  if (*data->prefix && *item->subpath)
+    relpath = g_strconcat ("/", data->prefix, "/", item->subpath, NULL);
+  else
+    relpath = g_strconcat ("/", data->prefix, item->subpath, NULL);
+
+  if (data->flags & OSTREE_SEPOLICY_RESTORECON_FLAGS_KEEP_EXISTING)
+    {
+      char *existing_con = NULL;
+      if (lgetfilecon_raw (target, &existing_con) > 0 && existing_con)
+        {
+          freecon (existing_con);
+          return TRUE;
+        }
+    }
+
+  if (!ostree_sepolicy_get_label (data->self, relpath, item->mode, &label,
+                                  data->cancellable, error))
+    return FALSE;
+
+  if (!label)
+    {
+      if (!(data->flags & OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "No label found for '%s'", relpath);
+          return FALSE;
+        }
+      return TRUE;
+    }
+
+  if (lsetfilecon (target, label) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      g_prefix_error (error, "Setting context of %s: ", target);
+      return FALSE;
+    }
+
+  if (data->func)
+    {
+      g_mutex_lock (&data->lock);
+      data->func (item->subpath, relpath, label, data->user_data);
+      g_mutex_unlock (&data->lock);
+    }
+
+  return TRUE;
+}
+
+static gpointer
+relabel_worker (gpointer user_data)
+{
+  RelabelData *data = user_data;
+
+  while (!g_atomic_int_get (&data->failed))
+    {
+      g_autoptr(GError) local_error = NULL;
+      guint i = (guint) g_atomic_int_add (&data->next_item, 1);
+
+      if (i >= data->items->len)
+        break;
+
+      if (g_cancellable_set_error_if_cancelled (data->cancellable, &local_error)
+          || !relabel_one_item (data, &g_array_index (data->items, RelabelItem, i),
+                                &local_error))
+        {
+          g_mutex_lock (&data->lock);
+          if (data->error == NULL)
+            data->error = g_steal_pointer (&local_error);
+          g_mutex_unlock (&data->lock);
+          g_atomic_int_set (&data->failed, TRUE);
+          break;
+        }
+    }
+
+  return NULL;
+}
+
+#endif
+
+/*
+ * _ostree_sepolicy_relabel_dir_at:
+ * @self: Policy
+ * @dfd: Directory fd
+ * @path: Path to directory to relabel, relative to @dfd
+ * @prefix: Path of @path in the policy namespace, without leading '/'
+ * @flags: Flags controlling behavior
+ * @func: (allow-none): Called for every file whose label was set
+ * @user_data: Data for @func
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Recursively reset the security context of @path and everything below
+ * it, equivalent to calling ostree_sepolicy_restorecon() on each file.
+ * The tree is first walked to gather file types, then labels are set
+ * from a small pool of threads.  Policy lookups are serialized since
+ * the selabel handle isn't thread-safe, so only the xattr system calls
+ * run in parallel.
+ */
+gboolean
+_ostree_sepolicy_relabel_dir_at (OstreeSePolicy                *self,
+                                 int                            dfd,
+                                 const char                    *path,
+                                 const char                    *prefix,
+                                 OstreeSePolicyRestoreconFlags  flags,
+                                 OstreeSePolicyRelabelFunc      func,
+                                 gpointer                       user_data,
+                                 GCancellable                  *cancellable,
+                                 GError                       **error)
+{
+#ifdef HAVE_SELINUX
+  gboolean ret = FALSE;
+  g_autoptr(GArray) items = g_array_new (FALSE, FALSE, sizeof (RelabelItem));
+  g_autoptr(GPtrArray) threads = g_ptr_array_new ();
+  g_autofree char *abspath = NULL;
+  RelabelData data = { 0, };
+  RelabelItem root;
+  struct stat stbuf;
+  guint n_threads;
+  guint i;
+
+  g_array_set_clear_func (items, relabel_item_clear);
+
+  if (fstatat (dfd, path, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      goto out;
+    }
+
+  root.subpath = g_strdup ("");
+  root.mode = stbuf.st_mode;
+  g_array_append_val (items, root);
+
+  if (S_ISDIR (stbuf.st_mode))
+    {
+      if (!relabel_collect_recurse (dfd, path, "", items, cancellable, error))
+        goto out;
+    }
+
+  if (dfd == AT_FDCWD || path[0] == '/')
+    abspath = g_strdup (path);
+  else
+    abspath = glnx_fdrel_abspath (dfd, path);
+
+  data.self = self;
+  data.abspath = abspath;
+  data.prefix = prefix;
+  data.flags = flags;
+  data.func = func;
+  data.user_data = user_data;
+  data.cancellable = cancellable;
+  data.items = items;
+  g_mutex_init (&data.lock);
+
+  n_threads = CLAMP (g_get_num_processors (), 1, RELABEL_MAX_THREADS);
+  n_threads = MIN (n_threads, MAX (items->len / 64, 1));
+
+  for (i = 1; i < n_threads; i++)
+    g_ptr_array_add (threads, g_thread_new ("sepolicy-relabel", relabel_worker, &data));
+  relabel_worker (&data);
+  for (i = 0; i < threads->len; i++)
+    g_thread_join (threads->pdata[i]);
+
+  g_mutex_clear (&data.lock);
+
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  if (!ret)
+    g_prefix_error (error, "Relabeling /%s: ", prefix);
+  return ret;
+#else
+  return TRUE;
+#endif
+}
+
 /**
  * ostree_sepolicy_setfscreatecon:
  * @self: Policy
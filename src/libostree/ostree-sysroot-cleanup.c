@@ -24,6 +24,7 @@
 #include "ostree-linuxfsutil.h"
 
 #include "ostree-sysroot-private.h"
+#include "ostree-deployment-private.h"
 
 gboolean
 _ostree_sysroot_list_deployment_dirs_for_os (GFile               *osdir,
@@ -285,6 +286,229 @@ cleanup_other_bootversions (OstreeSysroot       *self,
   return ret;
 }
 
+/* Atomically move @relpath out of the way into the trash directory, so
+ * the actual (potentially very slow) deletion can happen later.
+ */
+static gboolean
+move_to_trash (OstreeSysroot  *self,
+               const char     *relpath,
+               GCancellable   *cancellable,
+               GError        **error)
+{
+  g_autofree char *trash_name = g_strconcat (glnx_basename (relpath), ".XXXXXX", NULL);
+  glnx_fd_close int trash_dfd = -1;
+  guint i;
+  const guint max_attempts = 128;
+
+  if (!glnx_shutil_mkdir_p_at (self->sysroot_fd, _OSTREE_SYSROOT_TRASH_DIR, 0700,
+                               cancellable, error))
+    return FALSE;
+  if (!glnx_opendirat (self->sysroot_fd, _OSTREE_SYSROOT_TRASH_DIR, TRUE, &trash_dfd, error))
+    return FALSE;
+
+  for (i = 0; i < max_attempts; i++)
+    {
+      glnx_gen_temp_name (trash_name);
+      if (renameat (self->sysroot_fd, relpath, trash_dfd, trash_name) == 0)
+        return TRUE;
+      else if (errno == EEXIST || errno == ENOTEMPTY)
+        continue;
+      else if (errno == EXDEV)
+        /* Stateroot on a separate filesystem; delete in place */
+        return glnx_shutil_rm_rf_at (self->sysroot_fd, relpath, cancellable, error);
+      else
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+    }
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+               "Exhausted attempts to find a trash name for %s", relpath);
+  return FALSE;
+}
+
+#define TRASH_MAX_THREADS 4
+
+typedef struct {
+  int trash_dfd;
+  GPtrArray *items;  /* Paths relative to trash_dfd */
+  volatile gint next_item;
+  volatile gint failed;
+  GCancellable *cancellable;
+
+  GMutex lock;
+  GError *error;
+} TrashData;
+
+static gpointer
+empty_trash_worker (gpointer user_data)
+{
+  TrashData *data = user_data;
+
+  while (!g_atomic_int_get (&data->failed))
+    {
+      g_autoptr(GError) local_error = NULL;
+      guint i = (guint) g_atomic_int_add (&data->next_item, 1);
+
+      if (i >= data->items->len)
+        break;
+
+      if (!glnx_shutil_rm_rf_at (data->trash_dfd, data->items->pdata[i],
+                                 data->cancellable, &local_error))
+        {
+          g_mutex_lock (&data->lock);
+          if (data->error == NULL)
+            data->error = g_steal_pointer (&local_error);
+          g_mutex_unlock (&data->lock);
+          g_atomic_int_set (&data->failed, TRUE);
+          break;
+        }
+    }
+
+  return NULL;
+}
+
+/* Append the paths of the entries of @subpath (relative to @dfd) to
+ * @items, descending @depth more levels into directories.
+ */
+static gboolean
+collect_trash_items (int            dfd,
+                     const char    *subpath,
+                     guint          depth,
+                     GPtrArray     *items,
+                     GCancellable  *cancellable,
+                     GError       **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+
+  if (!glnx_dirfd_iterator_init_at (dfd, subpath, FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      g_autofree char *path = NULL;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      path = g_strconcat (subpath, "/", dent->d_name, NULL);
+      if (dent->d_type == DT_DIR && depth > 0)
+        {
+          if (!collect_trash_items (dfd, path, depth - 1, items, cancellable, error))
+            return FALSE;
+        }
+      else
+        g_ptr_array_add (items, g_steal_pointer (&path));
+    }
+
+  return TRUE;
+}
+
+/**
+ * _ostree_sysroot_empty_trash:
+ * @self: Sysroot
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Delete everything in the trash directory.  This does not require
+ * the sysroot lock; if another process is already emptying the trash,
+ * this returns immediately.  Each deployment is split into its
+ * subtrees a few levels down (/usr/lib, /usr/share...), which are
+ * deleted in parallel.
+ */
+gboolean
+_ostree_sysroot_empty_trash (OstreeSysroot  *self,
+                             GCancellable   *cancellable,
+                             GError        **error)
+{
+  gboolean ret = FALSE;
+  glnx_fd_close int trash_dfd = -1;
+  g_auto(GLnxLockFile) trash_lock = GLNX_LOCK_FILE_INIT;
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GPtrArray) entries = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) items = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) threads = g_ptr_array_new ();
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  TrashData data = { 0, };
+  guint n_threads;
+  guint i;
+
+  if (!ot_openat_ignore_enoent (self->sysroot_fd, _OSTREE_SYSROOT_TRASH_DIR, &trash_dfd, error))
+    goto out;
+  if (trash_dfd == -1)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  if (!glnx_make_lock_file (self->sysroot_fd, _OSTREE_SYSROOT_TRASH_LOCKFILE,
+                            LOCK_EX | LOCK_NB, &trash_lock, &local_error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+        {
+          ret = TRUE;
+          goto out;
+        }
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      goto out;
+    }
+
+  if (!glnx_dirfd_iterator_init_at (trash_dfd, ".", FALSE, &dfd_iter, error))
+    goto out;
+  while (TRUE)
+    {
+      struct dirent *dent;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        goto out;
+      if (dent == NULL)
+        break;
+
+      g_ptr_array_add (entries, g_strdup (dent->d_name));
+      if (dent->d_type == DT_DIR)
+        {
+          if (!collect_trash_items (trash_dfd, dent->d_name, 1, items, cancellable, error))
+            goto out;
+        }
+    }
+
+  data.trash_dfd = trash_dfd;
+  data.items = items;
+  data.cancellable = cancellable;
+  g_mutex_init (&data.lock);
+
+  n_threads = CLAMP (g_get_num_processors (), 1, TRASH_MAX_THREADS);
+  n_threads = MIN (n_threads, MAX (items->len, 1));
+  for (i = 0; i < n_threads; i++)
+    g_ptr_array_add (threads, g_thread_new ("ostree-trash", empty_trash_worker, &data));
+  for (i = 0; i < threads->len; i++)
+    g_thread_join (threads->pdata[i]);
+  g_mutex_clear (&data.lock);
+
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      goto out;
+    }
+
+  /* Now just the directory skeletons are left */
+  for (i = 0; i < entries->len; i++)
+    {
+      if (!glnx_shutil_rm_rf_at (trash_dfd, entries->pdata[i], cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  if (!ret)
+    g_prefix_error (error, "Emptying trash: ");
+  return ret;
+}
+
 static gboolean
 cleanup_old_deployments (OstreeSysroot       *self,
                          GCancellable        *cancellable,
@@ -326,6 +550,7 @@ cleanup_old_deployments (OstreeSysroot       *self,
       OstreeDeployment *deployment = all_deployment_dirs->pdata[i];
       g_autofree char *deployment_path = ostree_sysroot_get_deployment_dirpath (self, deployment);
       g_autofree char *origin_relpath = ostree_deployment_get_origin_relpath (deployment);
+      g_autofree char *etc_cache_relpath = _ostree_deployment_get_etc_cache_relpath (deployment);
 
       if (!g_hash_table_lookup (active_deployment_dirs, deployment_path))
         {
@@ -353,10 +578,12 @@ cleanup_old_deployments (OstreeSysroot       *self,
                                                         cancellable, error))
             goto out;
           
-          if (!glnx_shutil_rm_rf_at (self->sysroot_fd, deployment_path, cancellable, error))
+          if (!move_to_trash (self, deployment_path, cancellable, error))
             goto out;
           if (!glnx_shutil_rm_rf_at (self->sysroot_fd, origin_relpath, cancellable, error))
             goto out;
+          if (!glnx_shutil_rm_rf_at (self->sysroot_fd, etc_cache_relpath, cancellable, error))
+            goto out;
         }
     }
 
@@ -585,6 +812,12 @@ _ostree_sysroot_piecemeal_cleanup (OstreeSysroot              *self,
             goto out;
     }
 
+  if (flags & OSTREE_SYSROOT_CLEANUP_TRASH)
+    {
+      if (!_ostree_sysroot_empty_trash (self, cancellable, error))
+        goto out;
+    }
+
   ret = TRUE;
  out:
   return ret;
@@ -32,6 +32,7 @@
 #include "ostree-sysroot-private.h"
 #include "ostree-deployment-private.h"
 #include "ostree-core-private.h"
+#include "ostree-sepolicy-private.h"
 #include "ostree-linuxfsutil.h"
 #include "otutil.h"
 #include "libglnx.h"
@@ -39,6 +40,7 @@
 #define OSTREE_VARRELABEL_ID          "da679b08acd34504b789d96f818ea781"
 #define OSTREE_CONFIGMERGE_ID         "d3863baec13e4449ab0384684a8af3a7"
 #define OSTREE_DEPLOYMENT_COMPLETE_ID "dd440e3e549083b63d0efc7dc15255f1"
+#define OSTREE_DEPLOYMENT_SYNC_ID     "a2b4c8f0e34f4e09b6f2d1c3a8e90b57"
 
 /*
  * Like symlinkat() but overwrites (atomically) an existing
@@ -105,8 +107,8 @@ hardlink_or_copy_at (int         src_dfd,
     {
       if (errno == EMLINK || errno == EXDEV)
         {
-          return glnx_file_copy_at (src_dfd, src_subpath, NULL, dest_dfd, dest_subpath, 0,
-                                    cancellable, error);
+          return ot_file_copy_at (src_dfd, src_subpath, NULL, dest_dfd, dest_subpath, 0,
+                                  cancellable, error);
         }
       else
         {
@@ -216,10 +218,10 @@ copy_dir_recurse (int              src_parent_dfd,
         }
       else
         {
-          if (!glnx_file_copy_at (src_dfd_iter.fd, dent->d_name, &child_stbuf,
-                                  dest_dfd, dent->d_name,
-                                  GLNX_FILE_COPY_OVERWRITE,
-                                  cancellable, error))
+          if (!ot_file_copy_at (src_dfd_iter.fd, dent->d_name, &child_stbuf,
+                                dest_dfd, dent->d_name,
+                                GLNX_FILE_COPY_OVERWRITE,
+                                cancellable, error))
             return FALSE;
         }
     }
@@ -391,10 +393,10 @@ copy_modified_config_file (int                 orig_etc_fd,
     }
   else if (S_ISLNK (modified_stbuf.st_mode) || S_ISREG (modified_stbuf.st_mode))
     {
-      if (!glnx_file_copy_at (modified_etc_fd, path, &modified_stbuf, 
-                              new_etc_fd, path,
-                              GLNX_FILE_COPY_OVERWRITE,
-                              cancellable, error))
+      if (!ot_file_copy_at (modified_etc_fd, path, &modified_stbuf,
+                            new_etc_fd, path,
+                            GLNX_FILE_COPY_OVERWRITE,
+                            cancellable, error))
         goto out;
     }
   else
@@ -410,36 +412,449 @@ copy_modified_config_file (int                 orig_etc_fd,
   return ret;
 }
 
+/* Stat fields of a file in /etc which are recorded in the deployment's
+ * etc-cache when the file is known to have the same content as the
+ * corresponding one in /usr/etc.  Any write, chmod or relabel updates
+ * the ctime, so a match means the file hasn't been touched since.
+ */
+typedef struct {
+  guint64 ino;
+  guint64 size;
+  guint64 mtime_ns;
+  guint64 ctime_ns;
+} EtcCacheEntry;
+
+#define ETC_CACHE_VARIANT_FORMAT "a(stttt)"
+
+static void
+etc_cache_entry_from_stat (EtcCacheEntry     *entry,
+                           const struct stat *stbuf)
+{
+  entry->ino = stbuf->st_ino;
+  entry->size = stbuf->st_size;
+  entry->mtime_ns = (guint64)stbuf->st_mtim.tv_sec * G_GUINT64_CONSTANT(1000000000) + stbuf->st_mtim.tv_nsec;
+  entry->ctime_ns = (guint64)stbuf->st_ctim.tv_sec * G_GUINT64_CONSTANT(1000000000) + stbuf->st_ctim.tv_nsec;
+}
+
+static gboolean
+load_etc_cache (OstreeSysroot     *sysroot,
+                OstreeDeployment  *deployment,
+                GHashTable       **out_cache,
+                GError           **error)
+{
+  g_autofree char *relpath = _ostree_deployment_get_etc_cache_relpath (deployment);
+  g_autoptr(GVariant) cache_variant = NULL;
+  g_autoptr(GHashTable) ret_cache =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  GVariantIter viter;
+  const char *path;
+  EtcCacheEntry entry;
+
+  if (!ot_util_variant_map_at (sysroot->sysroot_fd, relpath,
+                               G_VARIANT_TYPE (ETC_CACHE_VARIANT_FORMAT),
+                               OT_VARIANT_MAP_ALLOW_NOENT,
+                               &cache_variant, error))
+    return FALSE;
+
+  if (cache_variant)
+    {
+      g_variant_iter_init (&viter, cache_variant);
+      while (g_variant_iter_loop (&viter, "(&stttt)", &path, &entry.ino, &entry.size,
+                                  &entry.mtime_ns, &entry.ctime_ns))
+        g_hash_table_replace (ret_cache, g_strdup (path), g_memdup (&entry, sizeof (entry)));
+    }
+
+  *out_cache = g_steal_pointer (&ret_cache);
+  return TRUE;
+}
+
+static gboolean
+build_etc_cache_recurse (int               dfd,
+                         const char       *subpath,
+                         GHashTable       *touched,
+                         GVariantBuilder  *builder,
+                         GCancellable     *cancellable,
+                         GError          **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+
+  if (!glnx_dirfd_iterator_init_at (dfd, subpath ? subpath : ".", FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      struct stat stbuf;
+      g_autofree char *path = NULL;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      path = subpath ? g_strconcat (subpath, "/", dent->d_name, NULL) : g_strdup (dent->d_name);
+      /* Anything copied over by the merge may differ from /usr/etc */
+      if (g_hash_table_contains (touched, path))
+        continue;
+
+      if (dent->d_type == DT_DIR)
+        {
+          if (!build_etc_cache_recurse (dfd, path, touched, builder,
+                                        cancellable, error))
+            return FALSE;
+        }
+      else if (dent->d_type == DT_REG)
+        {
+          EtcCacheEntry entry;
+
+          if (fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+
+          etc_cache_entry_from_stat (&entry, &stbuf);
+          g_variant_builder_add (builder, "(stttt)", path, entry.ino, entry.size,
+                                 entry.mtime_ns, entry.ctime_ns);
+        }
+    }
+
+  return TRUE;
+}
+
+/* Record the regular files of a freshly merged /etc which are plain
+ * copies from /usr/etc, so the next upgrade can skip comparing them.
+ */
+static gboolean
+write_etc_cache (OstreeSysroot     *sysroot,
+                 OstreeDeployment  *deployment,
+                 int                etc_fd,
+                 GHashTable        *touched,
+                 GCancellable      *cancellable,
+                 GError           **error)
+{
+  g_autofree char *relpath = _ostree_deployment_get_etc_cache_relpath (deployment);
+  g_auto(GVariantBuilder) builder = OT_VARIANT_BUILDER_INITIALIZER;
+  g_autoptr(GVariant) cache_variant = NULL;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (ETC_CACHE_VARIANT_FORMAT));
+  if (!build_etc_cache_recurse (etc_fd, NULL, touched, &builder, cancellable, error))
+    return FALSE;
+  cache_variant = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  return glnx_file_replace_contents_at (sysroot->sysroot_fd, relpath,
+                                        g_variant_get_data (cache_variant),
+                                        g_variant_get_size (cache_variant),
+                                        0, cancellable, error);
+}
+
+typedef struct {
+  GHashTable *cache;      /* path -> EtcCacheEntry of unmodified files, may be NULL */
+  GPtrArray *modified;    /* Paths relative to /etc */
+  GPtrArray *removed;
+  GPtrArray *added;
+
+  guint n_unchanged_stat;
+  guint n_unchanged_cache;
+  guint n_compared;
+} EtcDiff;
+
+/* Read up to @len bytes, retrying short reads; returns the number of
+ * bytes read, less than @len only at end of file.
+ */
+static ssize_t
+read_full (int     fd,
+           char   *buf,
+           size_t  len)
+{
+  size_t n_read = 0;
+
+  while (n_read < len)
+    {
+      ssize_t res = read (fd, buf + n_read, len - n_read);
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      else if (res == 0)
+        break;
+      n_read += res;
+    }
+
+  return n_read;
+}
+
+static gboolean
+regfile_contents_equal (int            orig_dfd,
+                        int            modified_dfd,
+                        const char    *name,
+                        gboolean      *out_equal,
+                        GCancellable  *cancellable,
+                        GError       **error)
+{
+  glnx_fd_close int orig_fd = -1;
+  glnx_fd_close int modified_fd = -1;
+  g_autofree char *orig_buf = g_malloc (32768);
+  g_autofree char *modified_buf = g_malloc (32768);
+
+  orig_fd = openat (orig_dfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (orig_fd == -1)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+  modified_fd = openat (modified_dfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (modified_fd == -1)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  while (TRUE)
+    {
+      ssize_t orig_len;
+      ssize_t modified_len;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      orig_len = read_full (orig_fd, orig_buf, 32768);
+      modified_len = read_full (modified_fd, modified_buf, 32768);
+      if (orig_len < 0 || modified_len < 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      if (orig_len != modified_len || memcmp (orig_buf, modified_buf, orig_len) != 0)
+        {
+          *out_equal = FALSE;
+          return TRUE;
+        }
+      if (orig_len < 32768)
+        break;
+    }
+
+  *out_equal = TRUE;
+  return TRUE;
+}
+
+/* Equivalent to comparing the content checksums with xattrs ignored,
+ * but without reading anything for the common unmodified case.
+ */
+static gboolean
+etc_files_equal (EtcDiff            *diff,
+                 int                 orig_dfd,
+                 int                 modified_dfd,
+                 const char         *name,
+                 const char         *path,
+                 const struct stat  *orig_stbuf,
+                 const struct stat  *modified_stbuf,
+                 gboolean           *out_equal,
+                 GCancellable       *cancellable,
+                 GError            **error)
+{
+  EtcCacheEntry *cached;
+
+  *out_equal = FALSE;
+
+  if (orig_stbuf->st_mode != modified_stbuf->st_mode
+      || orig_stbuf->st_uid != modified_stbuf->st_uid
+      || orig_stbuf->st_gid != modified_stbuf->st_gid)
+    return TRUE;
+
+  if (S_ISDIR (orig_stbuf->st_mode))
+    {
+      *out_equal = TRUE;
+      return TRUE;
+    }
+
+  if (orig_stbuf->st_dev == modified_stbuf->st_dev
+      && orig_stbuf->st_ino == modified_stbuf->st_ino)
+    {
+      diff->n_unchanged_stat++;
+      *out_equal = TRUE;
+      return TRUE;
+    }
+
+  if (S_ISLNK (orig_stbuf->st_mode))
+    {
+      g_autofree char *orig_target = NULL;
+      g_autofree char *modified_target = NULL;
+
+      orig_target = glnx_readlinkat_malloc (orig_dfd, name, cancellable, error);
+      if (!orig_target)
+        return FALSE;
+      modified_target = glnx_readlinkat_malloc (modified_dfd, name, cancellable, error);
+      if (!modified_target)
+        return FALSE;
+
+      *out_equal = strcmp (orig_target, modified_target) == 0;
+      return TRUE;
+    }
+  else if (!S_ISREG (orig_stbuf->st_mode))
+    {
+      *out_equal = orig_stbuf->st_rdev == modified_stbuf->st_rdev;
+      return TRUE;
+    }
+
+  if (orig_stbuf->st_size != modified_stbuf->st_size)
+    return TRUE;
+
+  cached = diff->cache ? g_hash_table_lookup (diff->cache, path) : NULL;
+  if (cached)
+    {
+      EtcCacheEntry current;
+
+      etc_cache_entry_from_stat (&current, modified_stbuf);
+      if (memcmp (cached, &current, sizeof (current)) == 0)
+        {
+          diff->n_unchanged_cache++;
+          *out_equal = TRUE;
+          return TRUE;
+        }
+    }
+
+  diff->n_compared++;
+  return regfile_contents_equal (orig_dfd, modified_dfd, name, out_equal,
+                                 cancellable, error);
+}
+
+static gboolean
+diff_etc_recurse (EtcDiff       *diff,
+                  int            orig_dfd,
+                  int            modified_dfd,
+                  const char    *subpath,
+                  GCancellable  *cancellable,
+                  GError       **error)
+{
+  g_auto(GLnxDirFdIterator) orig_iter = { 0, };
+  g_auto(GLnxDirFdIterator) modified_iter = { 0, };
+
+  if (!glnx_dirfd_iterator_init_at (orig_dfd, subpath ? subpath : ".", FALSE, &orig_iter, error))
+    return FALSE;
+  if (!glnx_dirfd_iterator_init_at (modified_dfd, subpath ? subpath : ".", FALSE, &modified_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      struct stat orig_stbuf;
+      struct stat modified_stbuf;
+      g_autofree char *path = NULL;
+      gboolean equal;
+
+      if (!glnx_dirfd_iterator_next_dent (&orig_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      path = subpath ? g_strconcat (subpath, "/", dent->d_name, NULL) : g_strdup (dent->d_name);
+
+      if (fstatat (orig_iter.fd, dent->d_name, &orig_stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+      if (fstatat (modified_iter.fd, dent->d_name, &modified_stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+          if (errno != ENOENT)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+          g_ptr_array_add (diff->removed, g_steal_pointer (&path));
+          continue;
+        }
+
+      if ((orig_stbuf.st_mode & S_IFMT) != (modified_stbuf.st_mode & S_IFMT))
+        {
+          g_ptr_array_add (diff->modified, g_steal_pointer (&path));
+          continue;
+        }
+
+      if (!etc_files_equal (diff, orig_iter.fd, modified_iter.fd, dent->d_name, path,
+                            &orig_stbuf, &modified_stbuf, &equal,
+                            cancellable, error))
+        return FALSE;
+
+      if (S_ISDIR (orig_stbuf.st_mode))
+        {
+          if (!diff_etc_recurse (diff, orig_dfd, modified_dfd, path,
+                                 cancellable, error))
+            return FALSE;
+        }
+
+      if (!equal)
+        g_ptr_array_add (diff->modified, g_steal_pointer (&path));
+    }
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      struct stat orig_stbuf;
+
+      if (!glnx_dirfd_iterator_next_dent (&modified_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      if (fstatat (orig_iter.fd, dent->d_name, &orig_stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+        continue;
+      else if (errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      /* New directories are copied recursively, no need to list
+       * their contents.
+       */
+      g_ptr_array_add (diff->added,
+                       subpath ? g_strconcat (subpath, "/", dent->d_name, NULL)
+                               : g_strdup (dent->d_name));
+    }
+
+  return TRUE;
+}
+
 /**
  * merge_etc_changes:
  *
- * Compute the difference between @orig_etc and @modified_etc,
- * and apply that to @new_etc.
+ * Compute the difference between @orig_etc_fd and @modified_etc_fd,
+ * and apply that to @new_etc_fd.
  *
  * The algorithm for computing the difference is pretty simple; it's
  * approximately equivalent to "diff -unR orig_etc modified_etc",
  * except that rather than attempting a 3-way merge if a file is also
  * changed in @new_etc, the modified version always wins.
+ *
+ * Files are compared by type, ownership, mode and size first, then
+ * looked up in @cache (the etc-cache of the deployment being merged
+ * from, may be %NULL); only the remaining ones have their contents
+ * read.  Every path written to @new_etc_fd is added to @touched.
  */
 static gboolean
-merge_etc_changes (GFile          *orig_etc,
-                   GFile          *modified_etc,
-                   GFile          *new_etc,
+merge_etc_changes (int             orig_etc_fd,
+                   int             modified_etc_fd,
+                   int             new_etc_fd,
+                   GHashTable     *cache,
+                   GHashTable     *touched,
                    GCancellable   *cancellable,
                    GError        **error)
 {
   gboolean ret = FALSE;
-  g_autoptr(GPtrArray) modified = NULL;
-  g_autoptr(GPtrArray) removed = NULL;
-  g_autoptr(GPtrArray) added = NULL;
+  g_autoptr(GPtrArray) modified = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) removed = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) added = g_ptr_array_new_with_free_func (g_free);
+  EtcDiff diff = { cache, modified, removed, added, 0, };
+  gint64 start_time = g_get_monotonic_time ();
+  gint64 scan_time;
+  gint64 remove_time;
+  gint64 end_time;
   guint i;
-  glnx_fd_close int orig_etc_fd = -1;
-  glnx_fd_close int modified_etc_fd = -1;
-  glnx_fd_close int new_etc_fd = -1; 
-
-  modified = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_diff_item_unref);
-  removed = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-  added = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
 
   /* For now, ignore changes to xattrs; the problem is that
    * security.selinux will be different between the /usr/etc labels
@@ -449,13 +864,13 @@ merge_etc_changes (GFile          *orig_etc,
    * file, to have that change persist across upgrades, you must also
    * modify the content of the file.
    */
-  if (!ostree_diff_dirs (OSTREE_DIFF_FLAGS_IGNORE_XATTRS,
-                         orig_etc, modified_etc, modified, removed, added,
+  if (!diff_etc_recurse (&diff, orig_etc_fd, modified_etc_fd, NULL,
                          cancellable, error))
     {
       g_prefix_error (error, "While computing configuration diff: ");
       goto out;
     }
+  scan_time = g_get_monotonic_time ();
 
   ot_log_structured_print_id_v (OSTREE_CONFIGMERGE_ID,
                                 "Copying /etc changes: %u modified, %u removed, %u added", 
@@ -463,52 +878,42 @@ merge_etc_changes (GFile          *orig_etc,
                                 removed->len,
                                 added->len);
 
-  if (!glnx_opendirat (AT_FDCWD, gs_file_get_path_cached (orig_etc), TRUE,
-                       &orig_etc_fd, error))
-    goto out;
-  if (!glnx_opendirat (AT_FDCWD, gs_file_get_path_cached (modified_etc), TRUE,
-                       &modified_etc_fd, error))
-    goto out;
-  if (!glnx_opendirat (AT_FDCWD, gs_file_get_path_cached (new_etc), TRUE,
-                       &new_etc_fd, error))
-    goto out;
-
   for (i = 0; i < removed->len; i++)
     {
-      GFile *file = removed->pdata[i];
-      g_autoptr(GFile) target_file = NULL;
-      g_autofree char *path = NULL;
+      const char *path = removed->pdata[i];
 
-      path = g_file_get_relative_path (orig_etc, file);
-      g_assert (path);
-      target_file = g_file_resolve_relative_path (new_etc, path);
-
-      if (!glnx_shutil_rm_rf_at (AT_FDCWD, gs_file_get_path_cached (target_file), cancellable, error))
+      if (!glnx_shutil_rm_rf_at (new_etc_fd, path, cancellable, error))
         goto out;
+      g_hash_table_add (touched, g_strdup (path));
     }
+  remove_time = g_get_monotonic_time ();
 
   for (i = 0; i < modified->len; i++)
     {
-      OstreeDiffItem *diff = modified->pdata[i];
-      g_autofree char *path = g_file_get_relative_path (modified_etc, diff->target);
-
-      g_assert (path);
+      const char *path = modified->pdata[i];
 
       if (!copy_modified_config_file (orig_etc_fd, modified_etc_fd, new_etc_fd, path,
                                       cancellable, error))
         goto out;
+      g_hash_table_add (touched, g_strdup (path));
     }
   for (i = 0; i < added->len; i++)
     {
-      GFile *file = added->pdata[i];
-      g_autofree char *path = g_file_get_relative_path (modified_etc, file);
-
-      g_assert (path);
+      const char *path = added->pdata[i];
 
       if (!copy_modified_config_file (orig_etc_fd, modified_etc_fd, new_etc_fd, path,
                                       cancellable, error))
         goto out;
+      g_hash_table_add (touched, g_strdup (path));
     }
+  end_time = g_get_monotonic_time ();
+
+  g_debug ("/etc merge: scan %" G_GINT64_FORMAT "ms (%u unchanged by inode, %u by cache, "
+           "%u compared), remove %" G_GINT64_FORMAT "ms, copy %" G_GINT64_FORMAT "ms",
+           (scan_time - start_time) / 1000,
+           diff.n_unchanged_stat, diff.n_unchanged_cache, diff.n_compared,
+           (remove_time - scan_time) / 1000,
+           (end_time - remove_time) / 1000);
 
   ret = TRUE;
  out:
@@ -612,64 +1017,6 @@ relabel_one_path (OstreeSysroot  *sysroot,
   return ret;
 }
 
-static gboolean
-relabel_recursively (OstreeSysroot  *sysroot,
-                     OstreeSePolicy *sepolicy,
-                     GFile          *dir,
-                     GFileInfo      *dir_info,
-                     GPtrArray      *path_parts,
-                     GCancellable   *cancellable,
-                     GError        **error)
-{
-  gboolean ret = FALSE;
-  g_autoptr(GFileEnumerator) direnum = NULL;
-
-  if (!relabel_one_path (sysroot, sepolicy, dir, dir_info, path_parts,
-                         cancellable, error))
-    goto out;
-
-  direnum = g_file_enumerate_children (dir, OSTREE_GIO_FAST_QUERYINFO,
-                                       G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                       cancellable, error);
-  if (!direnum)
-    goto out;
-  
-  while (TRUE)
-    {
-      GFileInfo *file_info;
-      GFile *child;
-      GFileType ftype;
-
-      if (!g_file_enumerator_iterate (direnum, &file_info, &child,
-                                      cancellable, error))
-        goto out;
-      if (file_info == NULL)
-        break;
-
-      g_ptr_array_add (path_parts, (char*)g_file_info_get_name (file_info));
-
-      ftype = g_file_info_get_file_type (file_info);
-      if (ftype == G_FILE_TYPE_DIRECTORY)
-        {
-          if (!relabel_recursively (sysroot, sepolicy, child, file_info, path_parts,
-                                    cancellable, error))
-            goto out;
-        }
-      else
-        {
-          if (!relabel_one_path (sysroot, sepolicy, child, file_info, path_parts,
-                                 cancellable, error))
-            goto out;
-        }
-
-      g_ptr_array_remove_index (path_parts, path_parts->len - 1);
-    }
-
-  ret = TRUE;
- out:
-  return ret;
-}
-
 static gboolean
 selinux_relabel_dir (OstreeSysroot                 *sysroot,
                      OstreeSePolicy                *sepolicy,
@@ -678,27 +1025,10 @@ selinux_relabel_dir (OstreeSysroot                 *sysroot,
                      GCancellable                  *cancellable,
                      GError                       **error)
 {
-  gboolean ret = FALSE;
-  g_autoptr(GPtrArray) path_parts = g_ptr_array_new ();
-  g_autoptr(GFileInfo) root_info = NULL;
-
-  root_info = g_file_query_info (dir, OSTREE_GIO_FAST_QUERYINFO,
-                                 G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                 cancellable, error);
-  if (!root_info)
-    goto out;
-  
-  g_ptr_array_add (path_parts, (char*)prefix);
-  if (!relabel_recursively (sysroot, sepolicy, dir, root_info, path_parts,
-                            cancellable, error))
-    {
-      g_prefix_error (error, "Relabeling /%s: ", prefix);
-      goto out;
-    }
-
-  ret = TRUE;
- out:
-  return ret;
+  return _ostree_sepolicy_relabel_dir_at (sepolicy, AT_FDCWD,
+                                          gs_file_get_path_cached (dir), prefix,
+                                          OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL,
+                                          NULL, NULL, cancellable, error);
 }
 
 static gboolean
@@ -803,6 +1133,8 @@ merge_configuration (OstreeSysroot         *sysroot,
   g_autoptr(GFile) deployment_usretc_path = NULL;
   g_autoptr(GFile) deployment_etc_path = NULL;
   glnx_unref_object OstreeSePolicy *sepolicy = NULL;
+  g_autoptr(GHashTable) touched = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  glnx_fd_close int new_etc_fd = -1;
   gboolean etc_exists;
   gboolean usretc_exists;
 
@@ -881,11 +1213,38 @@ merge_configuration (OstreeSysroot         *sysroot,
 
   if (source_etc_path)
     {
-      if (!merge_etc_changes (source_etc_pristine_path, source_etc_path, deployment_etc_path, 
+      glnx_fd_close int orig_etc_fd = -1;
+      glnx_fd_close int modified_etc_fd = -1;
+      g_autoptr(GHashTable) cache = NULL;
+
+      if (!glnx_opendirat (AT_FDCWD, gs_file_get_path_cached (source_etc_pristine_path), TRUE,
+                           &orig_etc_fd, error))
+        goto out;
+      if (!glnx_opendirat (AT_FDCWD, gs_file_get_path_cached (source_etc_path), TRUE,
+                           &modified_etc_fd, error))
+        goto out;
+      if (!glnx_opendirat (deployment_dfd, "etc", TRUE, &new_etc_fd, error))
+        goto out;
+
+      if (!load_etc_cache (sysroot, previous_deployment, &cache, error))
+        goto out;
+
+      if (!merge_etc_changes (orig_etc_fd, modified_etc_fd, new_etc_fd, cache, touched,
                               cancellable, error))
         goto out;
     }
 
+  if (usretc_exists)
+    {
+      if (new_etc_fd == -1 &&
+          !glnx_opendirat (deployment_dfd, "etc", TRUE, &new_etc_fd, error))
+        goto out;
+
+      if (!write_etc_cache (sysroot, deployment, new_etc_fd, touched,
+                            cancellable, error))
+        goto out;
+    }
+
   ret = TRUE;
   if (out_sepolicy)
     *out_sepolicy = g_steal_pointer (&sepolicy);
@@ -1049,74 +1408,244 @@ get_kernel_from_tree (int             deployment_dfd,
 }
 
 static gboolean
-checksum_from_kernel_src (const char   *name,
-                          char        **out_checksum,
-                          GError     **error)
+checksum_from_kernel_src (const char   *name,
+                          char        **out_checksum,
+                          GError     **error)
+{
+  const char *last_dash = strrchr (name, '-');
+  if (!last_dash)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Malformed kernel/initramfs name '%s', missing '-'", name);
+      return FALSE;
+    }
+  *out_checksum = g_strdup (last_dash + 1);
+  return TRUE;
+}
+
+typedef enum {
+  SYSROOT_SYNC_MODE_FULL,
+  SYSROOT_SYNC_MODE_SYNCFS,
+  SYSROOT_SYNC_MODE_SYNCFS_FREEZE
+} SysrootSyncMode;
+
+/* The sysroot.sync-mode repo config option:
+ *
+ *  - "syncfs" (the default): syncfs() every filesystem touched by the
+ *    deployment: the sysroot, /boot, and the /var of new deployments.
+ *  - "syncfs-freeze": Like syncfs, and additionally freeze and thaw
+ *    /boot after the bootloader swap so its journal is checkpointed.
+ *  - "full": Like syncfs, followed by a global sync().
+ */
+static gboolean
+get_sync_mode (OstreeSysroot    *self,
+               SysrootSyncMode  *out_mode,
+               GCancellable     *cancellable,
+               GError          **error)
+{
+  glnx_unref_object OstreeRepo *repo = NULL;
+  g_autofree char *mode = NULL;
+
+  if (!ostree_sysroot_get_repo (self, &repo, cancellable, error))
+    return FALSE;
+
+  if (!ot_keyfile_get_value_with_default (ostree_repo_get_config (repo), "sysroot", "sync-mode",
+                                          "syncfs", &mode, error))
+    return FALSE;
+
+  if (strcmp (mode, "syncfs") == 0)
+    *out_mode = SYSROOT_SYNC_MODE_SYNCFS;
+  else if (strcmp (mode, "syncfs-freeze") == 0)
+    *out_mode = SYSROOT_SYNC_MODE_SYNCFS_FREEZE;
+  else if (strcmp (mode, "full") == 0)
+    *out_mode = SYSROOT_SYNC_MODE_FULL;
+  else
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid sysroot.sync-mode '%s'", mode);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+typedef struct {
+  char *path;
+  int dfd;
+} SyncTarget;
+
+static void
+sync_target_clear (gpointer data)
+{
+  SyncTarget *target = data;
+  g_free (target->path);
+  if (target->dfd != -1)
+    (void) close (target->dfd);
+}
+
+/* Add @path to @targets unless its filesystem is already there */
+static gboolean
+add_sync_target_at (GArray        *targets,
+                    GHashTable    *seen_devs,
+                    int            dfd,
+                    const char    *path,
+                    GError       **error)
 {
-  const char *last_dash = strrchr (name, '-');
-  if (!last_dash)
+  SyncTarget target = { NULL, -1 };
+  struct stat stbuf;
+
+  if (!glnx_opendirat (dfd, path, TRUE, &target.dfd, error))
+    return FALSE;
+  if (fstat (target.dfd, &stbuf) != 0)
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Malformed kernel/initramfs name '%s', missing '-'", name);
+      glnx_set_error_from_errno (error);
+      (void) close (target.dfd);
       return FALSE;
     }
-  *out_checksum = g_strdup (last_dash + 1);
+
+  if (!g_hash_table_add (seen_devs, g_memdup (&stbuf.st_dev, sizeof (dev_t))))
+    {
+      (void) close (target.dfd);
+      return TRUE;
+    }
+
+  target.path = g_strdup (path);
+  g_array_append_val (targets, target);
   return TRUE;
 }
 
+static guint
+dev_hash (gconstpointer v)
+{
+  guint64 dev = *(const dev_t*)v;
+  return (guint) (dev ^ (dev >> 32));
+}
+
 static gboolean
-syncfs_dir_at (int            dfd,
-               const char    *path,
-               GCancellable  *cancellable,
-               GError       **error)
+dev_equal (gconstpointer a,
+           gconstpointer b)
 {
-  gboolean ret = FALSE;
-  glnx_fd_close int child_dfd = -1;
+  return *(const dev_t*)a == *(const dev_t*)b;
+}
 
-  if (!glnx_opendirat (dfd, path, TRUE, &child_dfd, error))
-    goto out;
-  if (syncfs (child_dfd) != 0)
+/* Sync every filesystem a write of @new_deployments touched: the
+ * sysroot (deployment checkouts and /etc), /boot and the stateroot
+ * /var of deployments which weren't there before, each with
+ * syncfs() and only once.  Unlike a global sync(), this doesn't wait
+ * for unrelated busy filesystems.
+ */
+static gboolean
+full_system_sync (OstreeSysroot     *self,
+                  GPtrArray         *new_deployments,
+                  SysrootSyncMode    mode,
+                  GCancellable      *cancellable,
+                  GError           **error)
+{
+  g_autoptr(GArray) targets = g_array_new (FALSE, FALSE, sizeof (SyncTarget));
+  g_autoptr(GHashTable) seen_devs = g_hash_table_new_full (dev_hash, dev_equal, g_free, NULL);
+  guint i;
+
+  g_array_set_clear_func (targets, sync_target_clear);
+
+  if (!add_sync_target_at (targets, seen_devs, self->sysroot_fd, ".", error))
+    return FALSE;
+  if (!add_sync_target_at (targets, seen_devs, self->sysroot_fd, "boot", error))
+    return FALSE;
+
+  for (i = 0; i < new_deployments->len; i++)
     {
-      glnx_set_error_from_errno (error);
-      goto out;
+      OstreeDeployment *deployment = new_deployments->pdata[i];
+      g_autofree char *varpath = NULL;
+      gboolean is_new = TRUE;
+      guint j;
+
+      for (j = 0; j < self->deployments->len; j++)
+        {
+          if (ostree_deployment_equal (deployment, self->deployments->pdata[j]))
+            {
+              is_new = FALSE;
+              break;
+            }
+        }
+      if (!is_new)
+        continue;
+
+      varpath = g_strdup_printf ("ostree/deploy/%s/var", ostree_deployment_get_osname (deployment));
+      if (!add_sync_target_at (targets, seen_devs, self->sysroot_fd, varpath, error))
+        return FALSE;
     }
 
-  ret = TRUE;
- out:
-  return ret;
+  for (i = 0; i < targets->len; i++)
+    {
+      SyncTarget *target = &g_array_index (targets, SyncTarget, i);
+      gint64 start_time = g_get_monotonic_time ();
+
+      if (syncfs (target->dfd) != 0)
+        {
+          glnx_set_prefix_error_from_errno (error, "syncfs(%s)", target->path);
+          return FALSE;
+        }
+
+      ot_log_structured_print_id_v (OSTREE_DEPLOYMENT_SYNC_ID,
+                                    "Synced filesystem of /%s in %" G_GINT64_FORMAT "ms",
+                                    strcmp (target->path, ".") == 0 ? "" : target->path,
+                                    (g_get_monotonic_time () - start_time) / 1000);
+    }
+
+  if (mode == SYSROOT_SYNC_MODE_FULL)
+    {
+      /* Out of an excess of conservativism, also invoke sync().  The
+       * advantage of still using `syncfs()` above is that we
+       * actually get error codes out of that API.
+       */
+      sync ();
+    }
+
+  return TRUE;
 }
 
-/* First, sync the root directory as well as /var and /boot which may
- * be separate mount points.  Then *in addition*, do a global
- * `sync()`.
+/* For SYSROOT_SYNC_MODE_SYNCFS_FREEZE, after the bootloader
+ * configuration has been swapped.  Only a separate /boot is frozen;
+ * freezing the root filesystem would stall the whole system.
  */
 static gboolean
-full_system_sync (OstreeSysroot     *self,
+freeze_thaw_boot (OstreeSysroot     *self,
+                  SysrootSyncMode    mode,
                   GCancellable      *cancellable,
                   GError           **error)
 {
-  gboolean ret = FALSE;
+  glnx_fd_close int boot_dfd = -1;
+  struct stat boot_stbuf;
+  struct stat root_stbuf;
+  gint64 start_time;
+
+  if (mode != SYSROOT_SYNC_MODE_SYNCFS_FREEZE)
+    return TRUE;
 
-  if (syncfs (self->sysroot_fd) != 0)
+  if (!glnx_opendirat (self->sysroot_fd, "boot", TRUE, &boot_dfd, error))
+    return FALSE;
+
+  if (fstat (boot_dfd, &boot_stbuf) != 0 ||
+      fstat (self->sysroot_fd, &root_stbuf) != 0)
     {
       glnx_set_error_from_errno (error);
-      goto out;
+      return FALSE;
     }
 
-  if (!syncfs_dir_at (self->sysroot_fd, "boot", cancellable, error))
-    goto out;
+  if (boot_stbuf.st_dev == root_stbuf.st_dev)
+    return TRUE;
 
-  /* And now out of an excess of conservativism, we still invoke
-   * sync().  The advantage of still using `syncfs()` above is that we
-   * actually get error codes out of that API, and we more clearly
-   * delineate what we actually want to sync in the future when this
-   * global sync call is removed.
-   */
-  sync ();
+  start_time = g_get_monotonic_time ();
+  if (!_ostree_linuxfs_filesystem_freeze_thaw (boot_dfd, cancellable, error))
+    {
+      g_prefix_error (error, "Freezing /boot: ");
+      return FALSE;
+    }
 
-  ret = TRUE;
- out:
-  return ret;
+  ot_log_structured_print_id_v (OSTREE_DEPLOYMENT_SYNC_ID,
+                                "Froze and thawed /boot in %" G_GINT64_FORMAT "ms",
+                                (g_get_monotonic_time () - start_time) / 1000);
+  return TRUE;
 }
 
 static gboolean
@@ -1742,9 +2271,13 @@ _ostree_sysroot_write_deployments_internal (OstreeSysroot     *self,
   gboolean found_booted_deployment = FALSE;
   gboolean bootloader_is_atomic = FALSE;
   gboolean boot_was_ro_mount = FALSE;
+  SysrootSyncMode sync_mode;
 
   g_assert (self->loaded);
 
+  if (!get_sync_mode (self, &sync_mode, cancellable, error))
+    goto out;
+
   /* Assign a bootserial to each new deployment.
    */
   g_hash_table_unref (assign_bootserials (new_deployments));
@@ -1805,7 +2338,7 @@ _ostree_sysroot_write_deployments_internal (OstreeSysroot     *self,
           goto out;
         }
       
-      if (!full_system_sync (self, cancellable, error))
+      if (!full_system_sync (self, new_deployments, sync_mode, cancellable, error))
         {
           g_prefix_error (error, "Full sync: ");
           goto out;
@@ -1818,6 +2351,9 @@ _ostree_sysroot_write_deployments_internal (OstreeSysroot     *self,
           g_prefix_error (error, "Swapping current bootlinks: ");
           goto out;
         }
+
+      if (!freeze_thaw_boot (self, sync_mode, cancellable, error))
+        goto out;
       
       bootloader_is_atomic = TRUE;
     }
@@ -1925,7 +2461,7 @@ _ostree_sysroot_write_deployments_internal (OstreeSysroot     *self,
           goto out;
         }
 
-      if (!full_system_sync (self, cancellable, error))
+      if (!full_system_sync (self, new_deployments, sync_mode, cancellable, error))
         {
           g_prefix_error (error, "Full sync: ");
           goto out;
@@ -1937,6 +2473,9 @@ _ostree_sysroot_write_deployments_internal (OstreeSysroot     *self,
           g_prefix_error (error, "Final bootloader swap: ");
           goto out;
         }
+
+      if (!freeze_thaw_boot (self, sync_mode, cancellable, error))
+        goto out;
     }
 
   ot_log_structured_print_id_v (OSTREE_DEPLOYMENT_COMPLETE_ID,
@@ -2021,34 +2560,26 @@ allocate_deployserial (OstreeSysroot           *self,
   return ret;
 }
                             
-/**
- * ostree_sysroot_deploy_tree:
- * @self: Sysroot
- * @osname: (allow-none): osname to use for merge deployment
- * @revision: Checksum to add
- * @origin: (allow-none): Origin to use for upgrades
- * @provided_merge_deployment: (allow-none): Use this deployment for merge path
- * @override_kernel_argv: (allow-none) (array zero-terminated=1) (element-type utf8): Use these as kernel arguments; if %NULL, inherit options from provided_merge_deployment
- * @out_new_deployment: (out): The new deployment path
- * @cancellable: Cancellable
- * @error: Error
- *
- * Check out deployment tree with revision @revision, performing a 3
- * way merge with @provided_merge_deployment for configuration.
+/* Does all of the work of ostree_sysroot_deploy_tree() except
+ * allocating @new_deployserial, and doesn't modify @self, so that several
+ * of these can run in parallel.  @var_lock (if non-%NULL) serializes
+ * the one-time relabeling of the stateroot /var.
  */
-gboolean
-ostree_sysroot_deploy_tree (OstreeSysroot     *self,
-                            const char        *osname,
-                            const char        *revision,
-                            GKeyFile          *origin,
-                            OstreeDeployment  *provided_merge_deployment,
-                            char             **override_kernel_argv,
-                            OstreeDeployment **out_new_deployment,
-                            GCancellable      *cancellable,
-                            GError           **error)
+static gboolean
+deploy_tree_internal (OstreeSysroot     *self,
+                      const char        *osname,
+                      const char        *revision,
+                      int                new_deployserial,
+                      GKeyFile          *origin,
+                      OstreeDeployment  *provided_merge_deployment,
+                      char             **override_kernel_argv,
+                      GMutex            *var_lock,
+                      OstreeDeployment **out_new_deployment,
+                      OstreeSePolicy   **out_sepolicy,
+                      GCancellable      *cancellable,
+                      GError           **error)
 {
   gboolean ret = FALSE;
-  gint new_deployserial;
   glnx_unref_object OstreeDeployment *new_deployment = NULL;
   glnx_unref_object OstreeDeployment *merge_deployment = NULL;
   glnx_unref_object OstreeRepo *repo = NULL;
@@ -2062,20 +2593,11 @@ ostree_sysroot_deploy_tree (OstreeSysroot     *self,
   glnx_unref_object OstreeSePolicy *sepolicy = NULL;
   g_autofree char *new_bootcsum = NULL;
   glnx_unref_object OstreeBootconfigParser *bootconfig = NULL;
+  OtCopyStats stats_before, stats_after;
 
-  g_return_val_if_fail (osname != NULL || self->booted_deployment != NULL, FALSE);
-
-  if (osname == NULL)
-    osname = ostree_deployment_get_osname (self->booted_deployment);
+  ot_get_copy_stats (&stats_before);
 
   osdeploydir = ot_gfile_get_child_build_path (self->path, "ostree", "deploy", osname, NULL);
-  if (!g_file_query_exists (osdeploydir, NULL))
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
-                   "No OS named \"%s\" known", osname);
-      goto out;
-    }
-
   deployment_var = g_file_get_child (osdeploydir, "var");
 
   if (!ostree_sysroot_get_repo (self, &repo, cancellable, error))
@@ -2084,10 +2606,6 @@ ostree_sysroot_deploy_tree (OstreeSysroot     *self,
   if (provided_merge_deployment != NULL)
     merge_deployment = g_object_ref (provided_merge_deployment);
 
-  if (!allocate_deployserial (self, osname, revision, &new_deployserial,
-                              cancellable, error))
-    goto out;
-
   new_deployment = ostree_deployment_new (0, osname, revision, new_deployserial,
                                           new_bootcsum, -1);
   ostree_deployment_set_origin (new_deployment, origin);
@@ -2145,12 +2663,17 @@ ostree_sysroot_deploy_tree (OstreeSysroot     *self,
   if (!ot_ensure_unlinked_at (deployment_var_dfd, ".updated", error))
     goto out;
 
-  g_clear_object (&self->sepolicy);
-  self->sepolicy = g_object_ref (sepolicy);
-
+  if (var_lock)
+    g_mutex_lock (var_lock);
   if (!selinux_relabel_var_if_needed (self, sepolicy, deployment_var,
                                       cancellable, error))
-    goto out;
+    {
+      if (var_lock)
+        g_mutex_unlock (var_lock);
+      goto out;
+    }
+  if (var_lock)
+    g_mutex_unlock (var_lock);
 
   if (!(self->debug_flags & OSTREE_SYSROOT_DEBUG_MUTABLE_DEPLOYMENTS))
     {
@@ -2167,10 +2690,10 @@ ostree_sysroot_deploy_tree (OstreeSysroot     *self,
     /* Explicitly override the label for the origin file to ensure
      * it's system_conf_t.
      */
-    if (self->sepolicy != NULL
-        && ostree_sepolicy_get_name (self->sepolicy) != NULL)
+    if (sepolicy != NULL
+        && ostree_sepolicy_get_name (sepolicy) != NULL)
       {
-        if (!ostree_sepolicy_setfscreatecon (self->sepolicy,
+        if (!ostree_sepolicy_setfscreatecon (sepolicy,
                                              "/etc/ostree/remotes.d/dummy.conf",
                                              0644,
                                              error))
@@ -2203,9 +2726,268 @@ ostree_sysroot_deploy_tree (OstreeSysroot     *self,
       ostree_bootconfig_parser_set (bootconfig, "options", new_options);
     }
 
+  /* These are process-wide, so include any concurrent deployments */
+  ot_get_copy_stats (&stats_after);
+  g_debug ("Deployed %s.%d: %" G_GUINT64_FORMAT " bytes reflinked, %" G_GUINT64_FORMAT
+           " copied in kernel, %" G_GUINT64_FORMAT " copied",
+           revision, new_deployserial,
+           stats_after.bytes_reflinked - stats_before.bytes_reflinked,
+           stats_after.bytes_copied_in_kernel - stats_before.bytes_copied_in_kernel,
+           stats_after.bytes_copied - stats_before.bytes_copied);
+
   ret = TRUE;
   ot_transfer_out_value (out_new_deployment, &new_deployment);
+  ot_transfer_out_value (out_sepolicy, &sepolicy);
+ out:
+  return ret;
+}
+
+
+static gboolean
+ensure_osname_exists (OstreeSysroot  *self,
+                      const char     *osname,
+                      GError        **error)
+{
+  g_autoptr(GFile) osdeploydir =
+    ot_gfile_get_child_build_path (self->path, "ostree", "deploy", osname, NULL);
+
+  if (!g_file_query_exists (osdeploydir, NULL))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "No OS named \"%s\" known", osname);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * ostree_sysroot_deploy_tree:
+ * @self: Sysroot
+ * @osname: (allow-none): osname to use for merge deployment
+ * @revision: Checksum to add
+ * @origin: (allow-none): Origin to use for upgrades
+ * @provided_merge_deployment: (allow-none): Use this deployment for merge path
+ * @override_kernel_argv: (allow-none) (array zero-terminated=1) (element-type utf8): Use these as kernel arguments; if %NULL, inherit options from provided_merge_deployment
+ * @out_new_deployment: (out): The new deployment path
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Check out deployment tree with revision @revision, performing a 3
+ * way merge with @provided_merge_deployment for configuration.
+ */
+gboolean
+ostree_sysroot_deploy_tree (OstreeSysroot     *self,
+                            const char        *osname,
+                            const char        *revision,
+                            GKeyFile          *origin,
+                            OstreeDeployment  *provided_merge_deployment,
+                            char             **override_kernel_argv,
+                            OstreeDeployment **out_new_deployment,
+                            GCancellable      *cancellable,
+                            GError           **error)
+{
+  gint new_deployserial;
+  glnx_unref_object OstreeSePolicy *sepolicy = NULL;
+
+  g_return_val_if_fail (osname != NULL || self->booted_deployment != NULL, FALSE);
+
+  if (osname == NULL)
+    osname = ostree_deployment_get_osname (self->booted_deployment);
+
+  if (!ensure_osname_exists (self, osname, error))
+    return FALSE;
+
+  if (!allocate_deployserial (self, osname, revision, &new_deployserial,
+                              cancellable, error))
+    return FALSE;
+
+  if (!deploy_tree_internal (self, osname, revision, new_deployserial, origin,
+                             provided_merge_deployment, override_kernel_argv,
+                             NULL, out_new_deployment, &sepolicy,
+                             cancellable, error))
+    return FALSE;
+
+  g_clear_object (&self->sepolicy);
+  self->sepolicy = g_steal_pointer (&sepolicy);
+
+  return TRUE;
+}
+
+#define DEPLOY_TREES_MAX_THREADS 4
+
+typedef struct {
+  OstreeSysroot *sysroot;
+  const OstreeSysrootDeployTreeOpts *opts;
+  guint n_opts;
+  const char **osnames;
+  int *deployserials;
+  OstreeDeployment **new_deployments;
+  OstreeSePolicy **sepolicies;
+  volatile gint next_item;
+  volatile gint failed;
+  GCancellable *cancellable;
+
+  GMutex var_lock;
+  GMutex lock;
+  GError *error;
+} DeployTreesData;
+
+static gpointer
+deploy_trees_worker (gpointer user_data)
+{
+  DeployTreesData *data = user_data;
+
+  while (!g_atomic_int_get (&data->failed))
+    {
+      g_autoptr(GError) local_error = NULL;
+      guint i = (guint) g_atomic_int_add (&data->next_item, 1);
+      const OstreeSysrootDeployTreeOpts *opts;
+
+      if (i >= data->n_opts)
+        break;
+
+      opts = &data->opts[i];
+      if (!deploy_tree_internal (data->sysroot, data->osnames[i], opts->revision,
+                                 data->deployserials[i], opts->origin,
+                                 opts->provided_merge_deployment,
+                                 opts->override_kernel_argv, &data->var_lock,
+                                 &data->new_deployments[i], &data->sepolicies[i],
+                                 data->cancellable, &local_error))
+        {
+          g_prefix_error (&local_error, "Deploying %s: ", opts->revision);
+          g_mutex_lock (&data->lock);
+          if (data->error == NULL)
+            data->error = g_steal_pointer (&local_error);
+          g_mutex_unlock (&data->lock);
+          g_atomic_int_set (&data->failed, TRUE);
+          break;
+        }
+    }
+
+  return NULL;
+}
+
+/**
+ * ostree_sysroot_deploy_trees:
+ * @self: Sysroot
+ * @opts: (array length=n_opts): Trees to deploy
+ * @n_opts: Length of @opts
+ * @out_new_deployments: (out) (element-type OstreeDeployment): The new deployments, in the same order as @opts
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like calling ostree_sysroot_deploy_tree() once for each element of
+ * @opts, but the checkouts, configuration merges and relabeling are
+ * performed in parallel.  Nothing is synced to disk and the bootloader
+ * configuration is untouched; pass the new deployments to a single
+ * call of ostree_sysroot_write_deployments(), which does that once for
+ * all of them.
+ *
+ * If any tree fails to deploy, an error is returned; the checkouts
+ * already made are left for ostree_sysroot_cleanup() to remove.
+ */
+gboolean
+ostree_sysroot_deploy_trees (OstreeSysroot                      *self,
+                             const OstreeSysrootDeployTreeOpts  *opts,
+                             guint                               n_opts,
+                             GPtrArray                         **out_new_deployments,
+                             GCancellable                       *cancellable,
+                             GError                            **error)
+{
+  gboolean ret = FALSE;
+  DeployTreesData data = { 0, };
+  g_autoptr(GPtrArray) threads = g_ptr_array_new ();
+  g_autoptr(GPtrArray) ret_deployments = NULL;
+  g_autofree const char **osnames = g_new0 (const char *, n_opts);
+  g_autofree int *deployserials = g_new0 (int, n_opts);
+  g_autofree OstreeDeployment **new_deployments = g_new0 (OstreeDeployment *, n_opts);
+  g_autofree OstreeSePolicy **sepolicies = g_new0 (OstreeSePolicy *, n_opts);
+  guint n_threads;
+  guint i, j;
+
+  g_return_val_if_fail (n_opts == 0 || opts != NULL, FALSE);
+
+  /* Open the repo now rather than racing to do so in the workers */
+  if (!ostree_sysroot_get_repo (self, NULL, cancellable, error))
+    goto out;
+
+  /* Deployserials are allocated up front, as several entries may deploy
+   * the same revision of the same OS.
+   */
+  for (i = 0; i < n_opts; i++)
+    {
+      const char *osname = opts[i].osname;
+
+      if (osname == NULL)
+        {
+          g_return_val_if_fail (self->booted_deployment != NULL, FALSE);
+          osname = ostree_deployment_get_osname (self->booted_deployment);
+        }
+      osnames[i] = osname;
+
+      if (!ensure_osname_exists (self, osname, error))
+        goto out;
+
+      if (!allocate_deployserial (self, osname, opts[i].revision, &deployserials[i],
+                                  cancellable, error))
+        goto out;
+
+      for (j = 0; j < i; j++)
+        {
+          if (strcmp (osnames[j], osname) == 0 &&
+              strcmp (opts[j].revision, opts[i].revision) == 0)
+            deployserials[i] = MAX (deployserials[i], deployserials[j] + 1);
+        }
+    }
+
+  data.sysroot = self;
+  data.opts = opts;
+  data.n_opts = n_opts;
+  data.osnames = osnames;
+  data.deployserials = deployserials;
+  data.new_deployments = new_deployments;
+  data.sepolicies = sepolicies;
+  data.cancellable = cancellable;
+  g_mutex_init (&data.var_lock);
+  g_mutex_init (&data.lock);
+
+  n_threads = CLAMP (g_get_num_processors (), 1, DEPLOY_TREES_MAX_THREADS);
+  n_threads = MIN (n_threads, MAX (n_opts, 1));
+  for (i = 0; i < n_threads; i++)
+    g_ptr_array_add (threads, g_thread_new ("ostree-deploy", deploy_trees_worker, &data));
+  for (i = 0; i < threads->len; i++)
+    g_thread_join (threads->pdata[i]);
+  g_mutex_clear (&data.var_lock);
+  g_mutex_clear (&data.lock);
+
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      goto out;
+    }
+
+  ret_deployments = g_ptr_array_new_with_free_func (g_object_unref);
+  for (i = 0; i < n_opts; i++)
+    g_ptr_array_add (ret_deployments, g_steal_pointer (&new_deployments[i]));
+
+  /* Match ostree_sysroot_deploy_tree(), which leaves the policy of the
+   * last deployed tree.
+   */
+  if (n_opts > 0)
+    {
+      g_clear_object (&self->sepolicy);
+      self->sepolicy = g_steal_pointer (&sepolicies[n_opts - 1]);
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_new_deployments, &ret_deployments);
  out:
+  for (i = 0; i < n_opts; i++)
+    {
+      g_clear_object (&new_deployments[i]);
+      g_clear_object (&sepolicies[i]);
+    }
   return ret;
 }
 
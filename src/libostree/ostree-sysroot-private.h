@@ -113,9 +113,20 @@ typedef enum {
   OSTREE_SYSROOT_CLEANUP_BOOTVERSIONS = 1 << 0,
   OSTREE_SYSROOT_CLEANUP_DEPLOYMENTS  = 1 << 1,
   OSTREE_SYSROOT_CLEANUP_PRUNE_REPO   = 1 << 2,
+  OSTREE_SYSROOT_CLEANUP_TRASH        = 1 << 3,
   OSTREE_SYSROOT_CLEANUP_ALL          = 0xffff
 } OstreeSysrootCleanupFlags;
 
+/* Old deployments are renamed here, and deleted later, potentially
+ * without holding the sysroot lock.
+ */
+#define _OSTREE_SYSROOT_TRASH_DIR "ostree/trash"
+#define _OSTREE_SYSROOT_TRASH_LOCKFILE "ostree/trash.lock"
+
+gboolean _ostree_sysroot_empty_trash (OstreeSysroot *self,
+                                      GCancellable  *cancellable,
+                                      GError       **error);
+
 gboolean _ostree_sysroot_piecemeal_cleanup (OstreeSysroot *sysroot,
                                             OstreeSysrootCleanupFlags flags,
                                             GCancellable *cancellable,
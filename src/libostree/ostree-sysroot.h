@@ -156,6 +156,38 @@ gboolean ostree_sysroot_deploy_tree (OstreeSysroot     *self,
                                      GCancellable      *cancellable,
                                      GError           **error);
 
+/**
+ * OstreeSysrootDeployTreeOpts: (skip)
+ * @osname: (allow-none): osname to use for merge deployment
+ * @revision: Checksum to add
+ * @origin: (allow-none): Origin to use for upgrades
+ * @provided_merge_deployment: (allow-none): Use this deployment for merge path
+ * @override_kernel_argv: (allow-none): Use these as kernel arguments
+ *
+ * One tree to deploy with ostree_sysroot_deploy_trees(); the members
+ * have the same meaning as the arguments of
+ * ostree_sysroot_deploy_tree().  Ensure that you have entirely zeroed
+ * the structure, then set just the desired options.
+ */
+typedef struct {
+  const char *osname;
+  const char *revision;
+  GKeyFile *origin;
+  OstreeDeployment *provided_merge_deployment;
+  char **override_kernel_argv;
+
+  guint unused_uints[8];
+  gpointer unused_ptrs[7];
+} OstreeSysrootDeployTreeOpts;
+
+_OSTREE_PUBLIC
+gboolean ostree_sysroot_deploy_trees (OstreeSysroot                      *self,
+                                      const OstreeSysrootDeployTreeOpts  *opts,
+                                      guint                               n_opts,
+                                      GPtrArray                         **out_new_deployments,
+                                      GCancellable                       *cancellable,
+                                      GError                            **error);
+
 _OSTREE_PUBLIC
 gboolean ostree_sysroot_deployment_set_mutable (OstreeSysroot     *self,
                                                 OstreeDeployment  *deployment,
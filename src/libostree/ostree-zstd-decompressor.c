@@ -0,0 +1,166 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2017 The OSTree Authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "ostree-zstd-decompressor.h"
+
+#include <zstd.h>
+#include <string.h>
+
+/**
+ * SECTION:ostree-zstd-decompressor
+ * @title: Zstandard decompressor
+ *
+ * An implementation of #GConverter that decompresses data using
+ * Zstandard.
+ */
+
+static void _ostree_zstd_decompressor_iface_init          (GConverterIface *iface);
+
+struct _OstreeZstdDecompressor
+{
+  GObject parent_instance;
+
+  ZSTD_DStream *dstream;
+  gboolean frame_done;
+};
+
+G_DEFINE_TYPE_WITH_CODE (OstreeZstdDecompressor, _ostree_zstd_decompressor,
+                         G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_CONVERTER,
+                                                _ostree_zstd_decompressor_iface_init))
+
+static void
+_ostree_zstd_decompressor_finalize (GObject *object)
+{
+  OstreeZstdDecompressor *self = OSTREE_ZSTD_DECOMPRESSOR (object);
+
+  g_clear_pointer (&self->dstream, ZSTD_freeDStream);
+
+  G_OBJECT_CLASS (_ostree_zstd_decompressor_parent_class)->finalize (object);
+}
+
+static void
+_ostree_zstd_decompressor_init (OstreeZstdDecompressor *self)
+{
+}
+
+static void
+_ostree_zstd_decompressor_class_init (OstreeZstdDecompressorClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = _ostree_zstd_decompressor_finalize;
+}
+
+OstreeZstdDecompressor *
+_ostree_zstd_decompressor_new (void)
+{
+  return g_object_new (OSTREE_TYPE_ZSTD_DECOMPRESSOR, NULL);
+}
+
+static void
+_ostree_zstd_decompressor_reset (GConverter *converter)
+{
+  OstreeZstdDecompressor *self = OSTREE_ZSTD_DECOMPRESSOR (converter);
+
+  if (self->dstream)
+    (void) ZSTD_DCtx_reset (self->dstream, ZSTD_reset_session_only);
+  self->frame_done = FALSE;
+}
+
+static GConverterResult
+_ostree_zstd_decompressor_convert (GConverter *converter,
+                                   const void *inbuf,
+                                   gsize       inbuf_size,
+                                   void       *outbuf,
+                                   gsize       outbuf_size,
+                                   GConverterFlags flags,
+                                   gsize      *bytes_read,
+                                   gsize      *bytes_written,
+                                   GError    **error)
+{
+  OstreeZstdDecompressor *self = OSTREE_ZSTD_DECOMPRESSOR (converter);
+  ZSTD_inBuffer input = { inbuf, inbuf_size, 0 };
+  ZSTD_outBuffer output = { outbuf, outbuf_size, 0 };
+  size_t res;
+
+  if (outbuf_size == 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                           "Output buffer too small");
+      return G_CONVERTER_ERROR;
+    }
+
+  if (self->frame_done)
+    {
+      *bytes_read = 0;
+      *bytes_written = 0;
+      return G_CONVERTER_FINISHED;
+    }
+
+  if (!self->dstream)
+    {
+      self->dstream = ZSTD_createDStream ();
+      if (!self->dstream)
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                               "Out of memory");
+          return G_CONVERTER_ERROR;
+        }
+    }
+
+  res = ZSTD_decompressStream (self->dstream, &output, &input);
+  if (ZSTD_isError (res))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Data is corrupt: %s", ZSTD_getErrorName (res));
+      return G_CONVERTER_ERROR;
+    }
+
+  *bytes_read = input.pos;
+  *bytes_written = output.pos;
+
+  /* A return value of 0 means the frame is fully decoded and flushed */
+  if (res == 0)
+    {
+      self->frame_done = TRUE;
+      return G_CONVERTER_FINISHED;
+    }
+
+  if (input.pos == 0 && output.pos == 0)
+    {
+      if (flags & G_CONVERTER_INPUT_AT_END)
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Unexpected end of zstd stream");
+      else
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                             "Input buffer too small");
+      return G_CONVERTER_ERROR;
+    }
+
+  return G_CONVERTER_CONVERTED;
+}
+
+static void
+_ostree_zstd_decompressor_iface_init (GConverterIface *iface)
+{
+  iface->convert = _ostree_zstd_decompressor_convert;
+  iface->reset = _ostree_zstd_decompressor_reset;
+}
@@ -0,0 +1,96 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2017 The OSTree Authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include "ot-checksum-instream.h"
+
+struct _OtChecksumInstreamPrivate {
+  OtChecksum *checksum;
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE (OtChecksumInstream, ot_checksum_instream, G_TYPE_FILTER_INPUT_STREAM)
+
+static gssize   ot_checksum_instream_read         (GInputStream         *stream,
+                                                   void                 *buffer,
+                                                   gsize                 count,
+                                                   GCancellable         *cancellable,
+                                                   GError              **error);
+
+static void
+ot_checksum_instream_class_init (OtChecksumInstreamClass *klass)
+{
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  stream_class->read_fn = ot_checksum_instream_read;
+}
+
+static void
+ot_checksum_instream_init (OtChecksumInstream *self)
+{
+  self->priv = ot_checksum_instream_get_instance_private (self);
+}
+
+/*
+ * ot_checksum_instream_new:
+ * @base: Input stream
+ * @checksum: An initialized checksum, must outlive the stream
+ *
+ * Returns: A stream which passes through the contents of @base,
+ * updating @checksum as it is read.
+ */
+OtChecksumInstream *
+ot_checksum_instream_new (GInputStream    *base,
+                          OtChecksum      *checksum)
+{
+  OtChecksumInstream *stream;
+
+  g_return_val_if_fail (G_IS_INPUT_STREAM (base), NULL);
+
+  stream = g_object_new (OT_TYPE_CHECKSUM_INSTREAM,
+                         "base-stream", base,
+                         NULL);
+
+  stream->priv->checksum = checksum;
+
+  return (OtChecksumInstream*) (stream);
+}
+
+static gssize
+ot_checksum_instream_read (GInputStream  *stream,
+                           void          *buffer,
+                           gsize          count,
+                           GCancellable  *cancellable,
+                           GError       **error)
+{
+  OtChecksumInstream *self = (OtChecksumInstream*) stream;
+  GFilterInputStream *fself = (GFilterInputStream*) self;
+  gssize res = -1;
+
+  res = g_input_stream_read (fself->base_stream,
+                             buffer,
+                             count,
+                             cancellable,
+                             error);
+  if (res > 0)
+    ot_checksum_update (self->priv->checksum, buffer, res);
+
+  return res;
+}
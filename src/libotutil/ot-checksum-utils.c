@@ -23,26 +23,163 @@
 #include "config.h"
 
 #include "otutil.h"
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#endif
 
 #include <string.h>
 
+/* With the OpenSSL backend, the EVP calls below can only fail when
+ * allocating the context, or with an engine substituted for the
+ * builtin SHA-256, which we never ask for.  Like GChecksum, the API
+ * has no error reporting; allocation failure is fatal as with
+ * g_malloc(), and anything else is asserted impossible.
+ */
+
+void
+ot_checksum_init (OtChecksum *checksum)
+{
+#ifdef HAVE_OPENSSL
+  EVP_MD_CTX *ctx = EVP_MD_CTX_create ();
+  int r;
+
+  if (!ctx)
+    g_error ("Failed to allocate SHA-256 context");
+  r = EVP_DigestInit_ex (ctx, EVP_sha256 (), NULL);
+  g_assert (r == 1);
+  checksum->data = ctx;
+#else
+  checksum->data = g_checksum_new (G_CHECKSUM_SHA256);
+#endif
+  checksum->closed = FALSE;
+  checksum->initialized = TRUE;
+}
+
+/* Start over with an empty input, reusing the context; cheaper than
+ * clearing and initializing it again when hashing many small buffers.
+ */
+void
+ot_checksum_reset (OtChecksum *checksum)
+{
+  g_return_if_fail (checksum->initialized);
+#ifdef HAVE_OPENSSL
+  {
+    int r = EVP_DigestInit_ex (checksum->data, EVP_sha256 (), NULL);
+    g_assert (r == 1);
+  }
+#else
+  g_checksum_reset (checksum->data);
+#endif
+  checksum->closed = FALSE;
+}
+
+void
+ot_checksum_update (OtChecksum   *checksum,
+                    const guint8 *buf,
+                    size_t        len)
+{
+  g_return_if_fail (checksum->initialized);
+  g_return_if_fail (!checksum->closed);
+#ifdef HAVE_OPENSSL
+  {
+    int r = EVP_DigestUpdate (checksum->data, buf, len);
+    g_assert (r == 1);
+  }
+#else
+  g_checksum_update (checksum->data, buf, len);
+#endif
+}
+
+/* Finalize the hash state on first use; the digest is cached so that
+ * both the binary and hex forms can be retrieved, like GChecksum.
+ */
+static void
+ot_checksum_close (OtChecksum *checksum)
+{
+  g_assert (checksum->initialized);
+  if (checksum->closed)
+    return;
+#ifdef HAVE_OPENSSL
+  {
+    guint digest_len = 0;
+    int r = EVP_DigestFinal_ex (checksum->data, checksum->digest, &digest_len);
+    g_assert (r == 1);
+    g_assert_cmpint (digest_len, ==, OT_SHA256_DIGEST_LEN);
+  }
+#else
+  {
+    gsize digest_len = OT_SHA256_DIGEST_LEN;
+    g_checksum_get_digest (checksum->data, checksum->digest, &digest_len);
+    g_assert_cmpint (digest_len, ==, OT_SHA256_DIGEST_LEN);
+  }
+#endif
+  checksum->closed = TRUE;
+}
+
+void
+ot_checksum_get_digest (OtChecksum *checksum,
+                        guint8     *buf,
+                        size_t      buflen)
+{
+  g_return_if_fail (buflen == OT_SHA256_DIGEST_LEN);
+  ot_checksum_close (checksum);
+  memcpy (buf, checksum->digest, buflen);
+}
+
+void
+ot_checksum_get_hexdigest (OtChecksum *checksum,
+                           char       *buf,
+                           size_t      buflen)
+{
+  static const char hexchars[] = "0123456789abcdef";
+  guint i;
+
+  g_return_if_fail (buflen == OT_SHA256_STRING_LEN + 1);
+  ot_checksum_close (checksum);
+  for (i = 0; i < OT_SHA256_DIGEST_LEN; i++)
+    {
+      buf[i * 2] = hexchars[checksum->digest[i] >> 4];
+      buf[i * 2 + 1] = hexchars[checksum->digest[i] & 0xf];
+    }
+  buf[OT_SHA256_STRING_LEN] = '\0';
+}
+
 guchar *
-ot_csum_from_gchecksum (GChecksum  *checksum)
+ot_checksum_dup_digest (OtChecksum *checksum)
 {
-  guchar *ret = g_malloc (32);
-  gsize len = 32;
-  
-  g_checksum_get_digest (checksum, ret, &len);
-  g_assert (len == 32);
+  guchar *ret = g_malloc (OT_SHA256_DIGEST_LEN);
+  ot_checksum_get_digest (checksum, ret, OT_SHA256_DIGEST_LEN);
+  return ret;
+}
+
+char *
+ot_checksum_dup_hexdigest (OtChecksum *checksum)
+{
+  char *ret = g_malloc (OT_SHA256_STRING_LEN + 1);
+  ot_checksum_get_hexdigest (checksum, ret, OT_SHA256_STRING_LEN + 1);
   return ret;
 }
 
+void
+ot_checksum_clear (OtChecksum *checksum)
+{
+  if (!checksum->initialized)
+    return;
+#ifdef HAVE_OPENSSL
+  EVP_MD_CTX_destroy (checksum->data);
+#else
+  g_checksum_free (checksum->data);
+#endif
+  checksum->data = NULL;
+  checksum->initialized = FALSE;
+}
+
 gboolean
 ot_gio_write_update_checksum (GOutputStream  *out,
                               gconstpointer   data,
                               gsize           len,
                               gsize          *out_bytes_written,
-                              GChecksum      *checksum,
+                              OtChecksum     *checksum,
                               GCancellable   *cancellable,
                               GError        **error)
 {
@@ -60,7 +197,7 @@ ot_gio_write_update_checksum (GOutputStream  *out,
     }
 
   if (checksum)
-    g_checksum_update (checksum, data, len);
+    ot_checksum_update (checksum, data, len);
   
   ret = TRUE;
  out:
@@ -70,7 +207,7 @@ ot_gio_write_update_checksum (GOutputStream  *out,
 gboolean
 ot_gio_splice_update_checksum (GOutputStream  *out,
                                GInputStream   *in,
-                               GChecksum      *checksum,
+                               OtChecksum     *checksum,
                                GCancellable   *cancellable,
                                GError        **error)
 {
@@ -81,7 +218,8 @@ ot_gio_splice_update_checksum (GOutputStream  *out,
   if (checksum != NULL)
     {
       gsize bytes_read, bytes_written;
-      char buf[4096];
+      /* Large enough that accelerated hashing isn't dominated by read() */
+      char buf[32768];
       do
         {
           if (!g_input_stream_read_all (in, buf, sizeof(buf), &bytes_read, cancellable, error))
@@ -111,20 +249,19 @@ ot_gio_splice_get_checksum (GOutputStream  *out,
                             GError        **error)
 {
   gboolean ret = FALSE;
-  GChecksum *checksum = NULL;
+  g_auto(OtChecksum) checksum = { 0, };
   g_autofree guchar *ret_csum = NULL;
 
-  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  ot_checksum_init (&checksum);
 
-  if (!ot_gio_splice_update_checksum (out, in, checksum, cancellable, error))
+  if (!ot_gio_splice_update_checksum (out, in, &checksum, cancellable, error))
     goto out;
 
-  ret_csum = ot_csum_from_gchecksum (checksum);
+  ret_csum = ot_checksum_dup_digest (&checksum);
 
   ret = TRUE;
   ot_transfer_out_value (out_csum, &ret_csum);
  out:
-  g_clear_pointer (&checksum, (GDestroyNotify) g_checksum_free);
   return ret;
 }
 
@@ -142,25 +279,23 @@ ot_gio_checksum_stream (GInputStream   *in,
 char *
 ot_checksum_file_at (int             dfd,
                      const char     *path,
-                     GChecksumType   checksum_type,
                      GCancellable   *cancellable,
                      GError        **error)
 {
-  GChecksum *checksum = NULL;
+  g_auto(OtChecksum) checksum = { 0, };
   char *ret = NULL;
   g_autoptr(GInputStream) in = NULL;
 
   if (!ot_openat_read_stream (dfd, path, TRUE, &in, cancellable, error))
     goto out;
 
-  checksum = g_checksum_new (checksum_type);
+  ot_checksum_init (&checksum);
 
-  if (!ot_gio_splice_update_checksum (NULL, in, checksum, cancellable, error))
+  if (!ot_gio_splice_update_checksum (NULL, in, &checksum, cancellable, error))
     goto out;
 
-  ret = g_strdup (g_checksum_get_string (checksum));
+  ret = ot_checksum_dup_hexdigest (&checksum);
  out:
-  g_clear_pointer (&checksum, (GDestroyNotify) g_checksum_free);
   return ret;
 
 }
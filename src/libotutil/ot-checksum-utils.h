@@ -23,16 +23,46 @@
 #pragma once
 
 #include <gio/gio.h>
+#include "libglnx.h"
 
 G_BEGIN_DECLS
 
-guchar *ot_csum_from_gchecksum (GChecksum *checksum);
+#define OT_SHA256_DIGEST_LEN 32
+#define OT_SHA256_STRING_LEN 64
+
+/* An incremental SHA-256 state; when built with OpenSSL this uses
+ * libcrypto, which selects SHA-NI/ARMv8 crypto extensions at runtime,
+ * otherwise it wraps GChecksum.  Allocate on the stack with
+ * g_auto(OtChecksum) and call ot_checksum_init() before use.
+ */
+typedef struct {
+  gboolean initialized;
+  gboolean closed;
+  gpointer data;
+  guint8 digest[OT_SHA256_DIGEST_LEN];
+} OtChecksum;
+
+void ot_checksum_init (OtChecksum *checksum);
+void ot_checksum_reset (OtChecksum *checksum);
+void ot_checksum_update (OtChecksum   *checksum,
+                         const guint8 *buf,
+                         size_t        len);
+void ot_checksum_get_digest (OtChecksum *checksum,
+                             guint8     *buf,
+                             size_t      buflen);
+void ot_checksum_get_hexdigest (OtChecksum *checksum,
+                                char       *buf,
+                                size_t      buflen);
+guchar *ot_checksum_dup_digest (OtChecksum *checksum);
+char *ot_checksum_dup_hexdigest (OtChecksum *checksum);
+void ot_checksum_clear (OtChecksum *checksum);
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(OtChecksum, ot_checksum_clear)
 
 gboolean ot_gio_write_update_checksum (GOutputStream  *out,
                                        gconstpointer   data,
                                        gsize           len,
                                        gsize          *out_bytes_written,
-                                       GChecksum      *checksum,
+                                       OtChecksum     *checksum,
                                        GCancellable   *cancellable,
                                        GError        **error);
 
@@ -44,7 +74,7 @@ gboolean ot_gio_splice_get_checksum (GOutputStream  *out,
 
 gboolean ot_gio_splice_update_checksum (GOutputStream  *out,
                                         GInputStream   *in,
-                                        GChecksum      *checksum,
+                                        OtChecksum     *checksum,
                                         GCancellable   *cancellable,
                                         GError        **error);
 
@@ -55,7 +85,6 @@ gboolean ot_gio_checksum_stream (GInputStream   *in,
 
 char * ot_checksum_file_at (int             dfd,
                             const char     *path,
-                            GChecksumType   checksum_type,
                             GCancellable   *cancellable,
                             GError        **error);
 
@@ -23,7 +23,15 @@
 #include "ot-fs-utils.h"
 #include "libglnx.h"
 #include <sys/xattr.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
 #include <gio/gunixinputstream.h>
+#include <string.h>
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
 
 int
 ot_opendirat (int dfd, const char *path, gboolean follow)
@@ -250,3 +258,355 @@ ot_file_mapat_bytes (int dfd,
 
   return g_mapped_file_get_bytes (mfile);
 }
+
+/* Returns TRUE if @errsv from a reflink or copy_file_range() means we
+ * should fall back to the next method for this copy.
+ */
+static gboolean
+errno_is_copy_unsupported (int errsv)
+{
+  return errsv == EOPNOTSUPP || errsv == ENOTTY || errsv == ENOSYS
+    || errsv == EXDEV || errsv == EINVAL || errsv == EBADF;
+}
+
+/* Returns TRUE if @errsv means the method can never work for this
+ * filesystem pair, so it is worth remembering.  Others, like EINVAL
+ * for unaligned ranges or special files, only say something about one
+ * particular copy.
+ */
+static gboolean
+errno_is_copy_unsupported_by_fs (int errsv)
+{
+  return errsv == EOPNOTSUPP || errsv == ENOTTY || errsv == ENOSYS
+    || errsv == EXDEV;
+}
+
+/* What we've learned about copying between a pair of filesystems */
+typedef struct {
+  dev_t src_dev;
+  dev_t dest_dev;
+  gboolean no_reflink;
+  gboolean no_copy_range;
+} CopyCapabilities;
+
+#define COPY_CAPABILITIES_MAX 16
+
+G_LOCK_DEFINE_STATIC (copy_state);
+static CopyCapabilities copy_capabilities[COPY_CAPABILITIES_MAX];
+static guint n_copy_capabilities;
+static OtCopyStats copy_stats;
+
+/* Must be called with the copy_state lock held */
+static CopyCapabilities *
+lookup_copy_capabilities (dev_t src_dev,
+                          dev_t dest_dev)
+{
+  CopyCapabilities *caps;
+  guint i;
+
+  for (i = 0; i < n_copy_capabilities; i++)
+    {
+      caps = &copy_capabilities[i];
+      if (caps->src_dev == src_dev && caps->dest_dev == dest_dev)
+        return caps;
+    }
+
+  /* Rather than growing, recycle the oldest entry; all that costs is
+   * one more failed ioctl.
+   */
+  if (n_copy_capabilities < COPY_CAPABILITIES_MAX)
+    caps = &copy_capabilities[n_copy_capabilities++];
+  else
+    {
+      memmove (&copy_capabilities[0], &copy_capabilities[1],
+               sizeof (CopyCapabilities) * (COPY_CAPABILITIES_MAX - 1));
+      caps = &copy_capabilities[COPY_CAPABILITIES_MAX - 1];
+    }
+  caps->src_dev = src_dev;
+  caps->dest_dev = dest_dev;
+  caps->no_reflink = FALSE;
+  caps->no_copy_range = FALSE;
+  return caps;
+}
+
+static void
+get_copy_capabilities (int        src_fd,
+                       int        dest_fd,
+                       dev_t     *out_src_dev,
+                       dev_t     *out_dest_dev,
+                       gboolean  *out_no_reflink,
+                       gboolean  *out_no_copy_range)
+{
+  struct stat src_stbuf;
+  struct stat dest_stbuf;
+  CopyCapabilities *caps;
+
+  /* If we can't tell, just try everything */
+  if (fstat (src_fd, &src_stbuf) != 0 || fstat (dest_fd, &dest_stbuf) != 0)
+    {
+      *out_src_dev = *out_dest_dev = 0;
+      *out_no_reflink = *out_no_copy_range = FALSE;
+      return;
+    }
+
+  G_LOCK (copy_state);
+  caps = lookup_copy_capabilities (src_stbuf.st_dev, dest_stbuf.st_dev);
+  *out_no_reflink = caps->no_reflink;
+  *out_no_copy_range = caps->no_copy_range;
+  G_UNLOCK (copy_state);
+
+  *out_src_dev = src_stbuf.st_dev;
+  *out_dest_dev = dest_stbuf.st_dev;
+}
+
+static void
+set_copy_unsupported (dev_t    src_dev,
+                      dev_t    dest_dev,
+                      gboolean reflink)
+{
+  CopyCapabilities *caps;
+
+  G_LOCK (copy_state);
+  caps = lookup_copy_capabilities (src_dev, dest_dev);
+  if (reflink)
+    caps->no_reflink = TRUE;
+  else
+    caps->no_copy_range = TRUE;
+  G_UNLOCK (copy_state);
+}
+
+static void
+add_copy_stats (guint64 reflinked,
+                guint64 copied_in_kernel,
+                guint64 copied)
+{
+  G_LOCK (copy_state);
+  copy_stats.bytes_reflinked += reflinked;
+  copy_stats.bytes_copied_in_kernel += copied_in_kernel;
+  copy_stats.bytes_copied += copied;
+  G_UNLOCK (copy_state);
+}
+
+/**
+ * ot_get_copy_stats:
+ * @out_stats: (out): Counters
+ *
+ * Return the number of bytes ot_regfile_copy_bytes() has handled in
+ * this process so far, by method.  Callers interested in a single
+ * operation should subtract the values from before it.
+ */
+void
+ot_get_copy_stats (OtCopyStats *out_stats)
+{
+  G_LOCK (copy_state);
+  *out_stats = copy_stats;
+  G_UNLOCK (copy_state);
+}
+
+/**
+ * ot_regfile_copy_bytes:
+ * @src_fd: Source file, positioned at the start
+ * @dest_fd: Empty destination file
+ * @size: Number of bytes to copy
+ *
+ * Copy the data of @src_fd into @dest_fd.  A reflink (FICLONE) is
+ * tried first so filesystems like btrfs and XFS can share extents;
+ * otherwise copy_file_range() keeps the copy in the kernel, with a
+ * plain read()/write() loop as last resort.  Which of these fail for a
+ * given pair of filesystems is remembered, so later copies go straight
+ * to the method that works.
+ */
+gboolean
+ot_regfile_copy_bytes (int            src_fd,
+                       int            dest_fd,
+                       goffset        size,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  goffset remaining = size;
+  guint64 copied = 0;
+  dev_t src_dev, dest_dev;
+  gboolean no_reflink, no_copy_range;
+
+  get_copy_capabilities (src_fd, dest_fd, &src_dev, &dest_dev,
+                         &no_reflink, &no_copy_range);
+
+  if (!no_reflink)
+    {
+      if (ioctl (dest_fd, FICLONE, src_fd) == 0)
+        {
+          add_copy_stats (size, 0, 0);
+          return TRUE;
+        }
+      else
+        {
+          int errsv = errno;
+
+          if (!errno_is_copy_unsupported (errsv))
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+          if (errno_is_copy_unsupported_by_fs (errsv))
+            set_copy_unsupported (src_dev, dest_dev, TRUE);
+        }
+    }
+
+#ifdef __NR_copy_file_range
+  while (!no_copy_range && remaining > 0)
+    {
+      ssize_t n = syscall (__NR_copy_file_range, src_fd, NULL, dest_fd, NULL,
+                           (size_t) MIN (remaining, G_MAXSSIZE), 0);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          /* The offsets are unchanged on failure, so we can continue
+           * with the fallback from wherever we got to. */
+          if (errno_is_copy_unsupported (errno))
+            {
+              if (errno_is_copy_unsupported_by_fs (errno))
+                set_copy_unsupported (src_dev, dest_dev, FALSE);
+              break;
+            }
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+      else if (n == 0)
+        break;
+      remaining -= n;
+    }
+#endif
+  add_copy_stats (0, size - remaining, 0);
+
+  while (remaining > 0)
+    {
+      char buf[16384];
+      ssize_t bytes_read;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      bytes_read = read (src_fd, buf, MIN (remaining, sizeof (buf)));
+      if (bytes_read < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+      else if (bytes_read == 0)
+        break;
+
+      if (glnx_loop_write (dest_fd, buf, bytes_read) < 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+      remaining -= bytes_read;
+      copied += bytes_read;
+    }
+  add_copy_stats (0, 0, copied);
+
+  return TRUE;
+}
+
+/**
+ * ot_file_copy_at:
+ * @src_dfd: Source directory fd
+ * @src_subpath: Path to source file
+ * @src_stbuf: (allow-none): Stat of the source, if already known
+ * @dest_dfd: Target directory fd
+ * @dest_subpath: Destination path
+ * @copyflags: Flags
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like glnx_file_copy_at(), but the data of regular files is copied
+ * with ot_regfile_copy_bytes(), so it is reflinked where possible.
+ * Ownership, mode, timestamps and (unless %GLNX_FILE_COPY_NOXATTRS)
+ * extended attributes are copied too.  Other file types are delegated
+ * to glnx_file_copy_at().
+ */
+gboolean
+ot_file_copy_at (int                 src_dfd,
+                 const char         *src_subpath,
+                 struct stat        *src_stbuf,
+                 int                 dest_dfd,
+                 const char         *dest_subpath,
+                 GLnxFileCopyFlags   copyflags,
+                 GCancellable       *cancellable,
+                 GError            **error)
+{
+  struct stat local_stbuf;
+  glnx_fd_close int src_fd = -1;
+  glnx_fd_close int dest_fd = -1;
+  struct timespec ts[2];
+
+  if (!src_stbuf)
+    {
+      if (fstatat (src_dfd, src_subpath, &local_stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+      src_stbuf = &local_stbuf;
+    }
+
+  if (!S_ISREG (src_stbuf->st_mode))
+    return glnx_file_copy_at (src_dfd, src_subpath, src_stbuf,
+                              dest_dfd, dest_subpath, copyflags,
+                              cancellable, error);
+
+  src_fd = openat (src_dfd, src_subpath, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NOFOLLOW);
+  if (src_fd == -1)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  if ((copyflags & GLNX_FILE_COPY_OVERWRITE) != 0)
+    {
+      if (!ot_ensure_unlinked_at (dest_dfd, dest_subpath, error))
+        return FALSE;
+    }
+
+  dest_fd = openat (dest_dfd, dest_subpath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOCTTY,
+                    0600);
+  if (dest_fd == -1)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  if (!ot_regfile_copy_bytes (src_fd, dest_fd, src_stbuf->st_size, cancellable, error))
+    goto err;
+
+  if (fchown (dest_fd, src_stbuf->st_uid, src_stbuf->st_gid) != 0)
+    goto err_errno;
+
+  if (fchmod (dest_fd, src_stbuf->st_mode & 07777) != 0)
+    goto err_errno;
+
+  if ((copyflags & GLNX_FILE_COPY_NOXATTRS) == 0)
+    {
+      g_autoptr(GVariant) xattrs = NULL;
+
+      if (!glnx_fd_get_all_xattrs (src_fd, &xattrs, cancellable, error))
+        goto err;
+      if (!glnx_fd_set_all_xattrs (dest_fd, xattrs, cancellable, error))
+        goto err;
+    }
+
+  ts[0] = src_stbuf->st_atim;
+  ts[1] = src_stbuf->st_mtim;
+  (void) futimens (dest_fd, ts);
+
+  return TRUE;
+
+ err_errno:
+  glnx_set_error_from_errno (error);
+ err:
+  (void) unlinkat (dest_dfd, dest_subpath, 0);
+  return FALSE;
+}
@@ -21,6 +21,7 @@
 #pragma once
 
 #include "ot-unix-utils.h"
+#include "libglnx.h"
 
 G_BEGIN_DECLS
 
@@ -70,4 +71,27 @@ GBytes *ot_file_mapat_bytes (int dfd,
                              const char *path,
                              GError **error);
 
+typedef struct {
+  guint64 bytes_reflinked;
+  guint64 bytes_copied_in_kernel;  /* By copy_file_range() */
+  guint64 bytes_copied;
+} OtCopyStats;
+
+void ot_get_copy_stats (OtCopyStats *out_stats);
+
+gboolean ot_regfile_copy_bytes (int            src_fd,
+                                int            dest_fd,
+                                goffset        size,
+                                GCancellable  *cancellable,
+                                GError       **error);
+
+gboolean ot_file_copy_at (int                 src_dfd,
+                          const char         *src_subpath,
+                          struct stat        *src_stbuf,
+                          int                 dest_dfd,
+                          const char         *dest_subpath,
+                          GLnxFileCopyFlags   copyflags,
+                          GCancellable       *cancellable,
+                          GError            **error);
+
 G_END_DECLS
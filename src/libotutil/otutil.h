@@ -51,6 +51,7 @@
 #include <ot-variant-utils.h>
 #include <ot-spawn-utils.h>
 #include <ot-checksum-utils.h>
+#include <ot-checksum-instream.h>
 #include <ot-gpg-utils.h>
 #include <ot-log-utils.h>
 
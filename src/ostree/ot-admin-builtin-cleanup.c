@@ -26,13 +26,51 @@
 #include "ot-admin-builtins.h"
 #include "ot-admin-functions.h"
 #include "ostree.h"
+#include "ostree-cmdprivate.h"
+#include "otutil.h"
 
 #include <glib/gi18n.h>
+#include <sys/syscall.h>
+
+#ifndef IOPRIO_CLASS_IDLE
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+#endif
+
+static gboolean opt_background;
+static gboolean opt_empty_trash;
 
 static GOptionEntry options[] = {
+  { "background", 0, 0, G_OPTION_ARG_NONE, &opt_background, "Release the lock and delete old deployments in a background process", NULL },
+  { "empty-trash", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &opt_empty_trash, "Only delete deployments already in the trash, without the sysroot lock", NULL },
   { NULL }
 };
 
+static void
+detach_child_setup (gpointer user_data)
+{
+  (void) setsid ();
+}
+
+/* Re-exec ourself with --empty-trash as a detached process in its own
+ * session, with stdio on /dev/null.  GLib spawns it through an
+ * intermediate child, so it is reparented away from us.
+ */
+static gboolean
+spawn_empty_trash (OstreeSysroot  *sysroot,
+                   GError        **error)
+{
+  g_autofree char *sysroot_arg =
+    g_strconcat ("--sysroot=", gs_file_get_path_cached (ostree_sysroot_get_path (sysroot)), NULL);
+  const char *child_argv[] = { "/proc/self/exe", "admin", "cleanup", "--empty-trash",
+                               sysroot_arg, NULL };
+
+  return g_spawn_async (NULL, (char**) child_argv, NULL,
+                        G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                        detach_child_setup, NULL, NULL, error);
+}
+
 gboolean
 ot_admin_builtin_cleanup (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
@@ -43,16 +81,51 @@ ot_admin_builtin_cleanup (int argc, char **argv, GCancellable *cancellable, GErr
   context = g_option_context_new ("Delete untagged deployments and repository objects");
 
   if (!ostree_admin_option_context_parse (context, options, &argc, &argv,
-                                          OSTREE_ADMIN_BUILTIN_FLAG_SUPERUSER,
+                                          OSTREE_ADMIN_BUILTIN_FLAG_SUPERUSER | OSTREE_ADMIN_BUILTIN_FLAG_UNLOCKED,
                                           &sysroot, cancellable, error))
     goto out;
 
-  if (!ostree_sysroot_load (sysroot, cancellable, error))
+  /* The trash has its own lock */
+  if (opt_empty_trash)
+    {
+#ifdef SYS_ioprio_set
+      /* Nobody waits for this helper; get out of the way of everything
+       * else.  Set before the deletion threads exist, which inherit it.
+       */
+      (void) syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                      IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#endif
+      if (!ostree_cmd__private__ ()->ostree_sysroot_empty_trash (sysroot, cancellable, error))
+        goto out;
+      ret = TRUE;
+      goto out;
+    }
+
+  if (!ot_admin_sysroot_lock (sysroot, error))
     goto out;
 
-  if (!ostree_sysroot_cleanup (sysroot, cancellable, error))
+  if (!ostree_sysroot_load (sysroot, cancellable, error))
     goto out;
 
+  if (opt_background)
+    {
+      /* Only the rename of old deployments into the trash happens
+       * under the sysroot lock; the slow part is done by a detached
+       * helper which doesn't need it.
+       */
+      if (!ostree_cmd__private__ ()->ostree_sysroot_cleanup_without_trash (sysroot, cancellable, error))
+        goto out;
+      ostree_sysroot_unlock (sysroot);
+
+      if (!spawn_empty_trash (sysroot, error))
+        goto out;
+    }
+  else
+    {
+      if (!ostree_sysroot_cleanup (sysroot, cancellable, error))
+        goto out;
+    }
+
   ret = TRUE;
  out:
   return ret;
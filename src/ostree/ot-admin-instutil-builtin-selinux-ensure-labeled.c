@@ -26,122 +26,20 @@
 #include "ot-main.h"
 #include "ot-admin-instutil-builtins.h"
 
+#include "ostree-cmdprivate.h"
 #include "otutil.h"
 
-static char *
-ptrarray_path_join (GPtrArray  *path)
+static void
+on_relabeled (const char *subpath,
+              const char *relpath,
+              const char *new_label,
+              gpointer    user_data)
 {
-  GString *path_buf;
+  const char *root = user_data;
 
-  path_buf = g_string_new ("");
-
-  if (path->len == 0)
-    g_string_append_c (path_buf, '/');
-  else
-    {
-      guint i;
-      for (i = 0; i < path->len; i++)
-        {
-          const char *elt = path->pdata[i];
-
-          g_string_append_c (path_buf, '/');
-          g_string_append (path_buf, elt);
-        }
-    }
-
-  return g_string_free (path_buf, FALSE);
-}
-
-static gboolean
-relabel_one_path (OstreeSePolicy *sepolicy,
-                  GFile          *path,
-                  GFileInfo      *info,
-                  GPtrArray      *path_parts,
-                  GCancellable   *cancellable,
-                  GError        **error)
-{
-  gboolean ret = FALSE;
-  g_autofree char *relpath = NULL;
-  g_autofree char *new_label = NULL;
-
-  relpath = ptrarray_path_join (path_parts);
-  if (!ostree_sepolicy_restorecon (sepolicy, relpath,
-                                   info, path,
-                                   OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL |
-                                   OSTREE_SEPOLICY_RESTORECON_FLAGS_KEEP_EXISTING,
-                                   &new_label,
-                                   cancellable, error))
-    {
-      g_prefix_error (error, "Setting context of %s: ", gs_file_get_path_cached (path));
-      goto out;
-    }
-
-  if (new_label)
-    g_print ("Set label of '%s' (as '%s') to '%s'\n",
-             gs_file_get_path_cached (path),
-             relpath,
-             new_label);
-
-  ret = TRUE;
- out:
-  return ret;
-}
-
-static gboolean
-relabel_recursively (OstreeSePolicy *sepolicy,
-                     GFile          *dir,
-                     GFileInfo      *dir_info,
-                     GPtrArray      *path_parts,
-                     GCancellable   *cancellable,
-                     GError        **error)
-{
-  gboolean ret = FALSE;
-  g_autoptr(GFileEnumerator) direnum = NULL;
-
-  if (!relabel_one_path (sepolicy, dir, dir_info, path_parts,
-                         cancellable, error))
-    goto out;
-
-  direnum = g_file_enumerate_children (dir, OSTREE_GIO_FAST_QUERYINFO,
-                                       G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                       cancellable, error);
-  if (!direnum)
-    goto out;
-  
-  while (TRUE)
-    {
-      GFileInfo *file_info;
-      GFile *child;
-      GFileType ftype;
-
-      if (!g_file_enumerator_iterate (direnum, &file_info, &child,
-                                      cancellable, error))
-        goto out;
-      if (file_info == NULL)
-        break;
-
-      g_ptr_array_add (path_parts, (char*)g_file_info_get_name (file_info));
-
-      ftype = g_file_info_get_file_type (file_info);
-      if (ftype == G_FILE_TYPE_DIRECTORY)
-        {
-          if (!relabel_recursively (sepolicy, child, file_info, path_parts,
-                                    cancellable, error))
-            goto out;
-        }
-      else
-        {
-          if (!relabel_one_path (sepolicy, child, file_info, path_parts,
-                                 cancellable, error))
-            goto out;
-        }
-
-      g_ptr_array_remove_index (path_parts, path_parts->len - 1);
-    }
-
-  ret = TRUE;
- out:
-  return ret;
+  g_print ("Set label of '%s%s%s' (as '%s') to '%s'\n",
+           root, *subpath ? "/" : "", subpath,
+           relpath, new_label);
 }
 
 static gboolean
@@ -151,27 +49,13 @@ selinux_relabel_dir (OstreeSePolicy                *sepolicy,
                      GCancellable                  *cancellable,
                      GError                       **error)
 {
-  gboolean ret = FALSE;
-  g_autoptr(GPtrArray) path_parts = g_ptr_array_new ();
-  g_autoptr(GFileInfo) root_info = NULL;
+  const char *root = gs_file_get_path_cached (dir);
 
-  root_info = g_file_query_info (dir, OSTREE_GIO_FAST_QUERYINFO,
-                                 G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                 cancellable, error);
-  if (!root_info)
-    goto out;
-  
-  g_ptr_array_add (path_parts, (char*)prefix);
-  if (!relabel_recursively (sepolicy, dir, root_info, path_parts,
-                            cancellable, error))
-    {
-      g_prefix_error (error, "Relabeling /%s: ", prefix);
-      goto out;
-    }
-
-  ret = TRUE;
- out:
-  return ret;
+  return ostree_cmd__private__ ()->ostree_sepolicy_relabel_dir_at (sepolicy, AT_FDCWD, root, prefix,
+                                                                   OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL |
+                                                                   OSTREE_SEPOLICY_RESTORECON_FLAGS_KEEP_EXISTING,
+                                                                   on_relabeled, (gpointer) root,
+                                                                   cancellable, error);
 }
 
 static GOptionEntry options[] = {
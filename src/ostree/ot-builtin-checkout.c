@@ -41,6 +41,7 @@ static gboolean opt_from_stdin;
 static char *opt_from_file;
 static gboolean opt_disable_fsync;
 static gboolean opt_require_hardlinks;
+static gboolean opt_reflink;
 
 static gboolean
 parse_fsync_cb (const char  *option_name,
@@ -69,6 +70,7 @@ static GOptionEntry options[] = {
   { "from-file", 0, 0, G_OPTION_ARG_STRING, &opt_from_file, "Process many checkouts from input file", "FILE" },
   { "fsync", 0, 0, G_OPTION_ARG_CALLBACK, parse_fsync_cb, "Specify how to invoke fsync()", "POLICY" },
   { "require-hardlinks", 'H', 0, G_OPTION_ARG_NONE, &opt_require_hardlinks, "Do not fall back to full copies if hardlinking fails", NULL },
+  { "reflink", 0, 0, G_OPTION_ARG_NONE, &opt_reflink, "Copy files (using reflinks if supported) instead of hardlinking them", NULL },
   { NULL }
 };
 
@@ -87,7 +89,7 @@ process_one_checkout (OstreeRepo           *repo,
    * `ostree_repo_checkout_at` until such time as we have a more
    * convenient infrastructure for testing C APIs with data.
    */
-  if (opt_disable_cache || opt_whiteouts || opt_require_hardlinks)
+  if (opt_disable_cache || opt_whiteouts || opt_require_hardlinks || opt_reflink)
     {
       OstreeRepoCheckoutAtOptions options = { 0, };
       
@@ -100,6 +102,7 @@ process_one_checkout (OstreeRepo           *repo,
       if (subpath)
         options.subpath = subpath;
       options.no_copy_fallback = opt_require_hardlinks;
+      options.prefer_reflinks = opt_reflink;
 
       if (!ostree_repo_checkout_at (repo, &options,
                                     AT_FDCWD, destination,
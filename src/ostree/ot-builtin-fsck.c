@@ -236,17 +236,72 @@ fsck_reachable_objects_from_commits (OstreeRepo            *repo,
   return ret;
 }
 
+typedef struct {
+  GHashTable *commits;
+  GPtrArray *tombstones;
+  guint n_partial;
+} FsckCommitsData;
+
+static gboolean
+collect_commit_cb (OstreeRepo        *repo,
+                   const guchar      *csum,
+                   OstreeObjectType   objtype,
+                   gpointer           user_data,
+                   GError           **error)
+{
+  FsckCommitsData *data = user_data;
+  char checksum[OSTREE_SHA256_STRING_LEN+1];
+  OstreeRepoCommitState commitstate = 0;
+  g_autoptr(GVariant) commit = NULL;
+
+  if (objtype != OSTREE_OBJECT_TYPE_COMMIT)
+    return TRUE;
+
+  ostree_checksum_inplace_from_bytes (csum, checksum);
+
+  if (!ostree_repo_load_commit (repo, checksum, &commit, &commitstate, error))
+    return FALSE;
+
+  if (opt_add_tombstones)
+    {
+      GError *local_error = NULL;
+      g_autofree char *parent = ostree_commit_get_parent (commit);
+      if (parent)
+        {
+          g_autoptr(GVariant) parent_commit = NULL;
+          if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, parent,
+                                         &parent_commit, &local_error))
+            {
+              if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+                {
+                  g_ptr_array_add (data->tombstones, g_strdup (checksum));
+                  g_clear_error (&local_error);
+                }
+              else
+                {
+                  g_propagate_error (error, local_error);
+                  return FALSE;
+                }
+            }
+        }
+    }
+
+  if (commitstate & OSTREE_REPO_COMMIT_STATE_PARTIAL)
+    data->n_partial++;
+  else
+    g_hash_table_add (data->commits, g_variant_ref_sink (ostree_object_name_serialize (checksum, objtype)));
+
+  return TRUE;
+}
+
 gboolean
 ostree_builtin_fsck (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
   gboolean ret = FALSE;
   g_autoptr(GOptionContext) context = NULL;
   glnx_unref_object OstreeRepo *repo = NULL;
-  GHashTableIter hash_iter;
-  gpointer key, value;
   gboolean found_corruption = FALSE;
-  guint n_partial = 0;
-  g_autoptr(GHashTable) objects = NULL;
+  FsckCommitsData data = { 0, };
   g_autoptr(GHashTable) commits = NULL;
   g_autoptr(GPtrArray) tombstones = NULL;
   context = g_option_context_new ("- Check the repository for consistency");
@@ -257,65 +312,18 @@ ostree_builtin_fsck (int argc, char **argv, GCancellable *cancellable, GError **
   if (!opt_quiet)
     g_print ("Enumerating objects...\n");
 
-  if (!ostree_repo_list_objects (repo, OSTREE_REPO_LIST_OBJECTS_ALL,
-                                 &objects, cancellable, error))
-    goto out;
-
   commits = g_hash_table_new_full (ostree_hash_object_name, g_variant_equal,
                                    (GDestroyNotify)g_variant_unref, NULL);
-  
-  g_hash_table_iter_init (&hash_iter, objects);
 
   if (opt_add_tombstones)
     tombstones = g_ptr_array_new_with_free_func (g_free);
 
-  while (g_hash_table_iter_next (&hash_iter, &key, &value))
-    {
-      GVariant *serialized_key = key;
-      const char *checksum;
-      OstreeObjectType objtype;
-      OstreeRepoCommitState commitstate = 0;
-      g_autoptr(GVariant) commit = NULL;
-
-      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
-
-      if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
-        {
-          if (!ostree_repo_load_commit (repo, checksum, &commit, &commitstate, error))
-            goto out;
-
-          if (opt_add_tombstones)
-            {
-              GError *local_error = NULL;
-              g_autofree char *parent = ostree_commit_get_parent (commit);
-              if (parent)
-                {
-                  g_autoptr(GVariant) parent_commit = NULL;
-                  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, parent,
-                                                 &parent_commit, &local_error))
-                    {
-                      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
-                        {
-                          g_ptr_array_add (tombstones, g_strdup (checksum));
-                          g_clear_error (&local_error);
-                        }
-                      else
-                        {
-                          g_propagate_error (error, local_error);
-                          goto out;
-                        }
-                    }
-                }
-            }
-
-          if (commitstate & OSTREE_REPO_COMMIT_STATE_PARTIAL)
-            n_partial++;
-          else
-            g_hash_table_add (commits, g_variant_ref (serialized_key));
-        }
-    }
-
-  g_clear_pointer (&objects, (GDestroyNotify) g_hash_table_unref);
+  data.commits = commits;
+  data.tombstones = tombstones;
+  if (!ostree_repo_foreach_object (repo, OSTREE_REPO_LIST_OBJECTS_ALL, 0, 1,
+                                   collect_commit_cb, &data,
+                                   cancellable, error))
+    goto out;
 
   if (!opt_quiet)
     g_print ("Verifying content integrity of %u commit objects...\n",
@@ -341,9 +349,9 @@ ostree_builtin_fsck (int argc, char **argv, GCancellable *cancellable, GError **
             goto out;
         }
     }
-  else if (n_partial > 0)
+  else if (data.n_partial > 0)
     {
-      g_print ("%u partial commits not verified\n", n_partial);
+      g_print ("%u partial commits not verified\n", data.n_partial);
     }
 
   if (found_corruption)
@@ -25,6 +25,7 @@
 #include "ot-main.h"
 #include "ot-builtins.h"
 #include "ostree.h"
+#include "ostree-cmdprivate.h"
 #include "otutil.h"
 #include "parse-datetime.h"
 
@@ -86,7 +87,8 @@ prune_commits_keep_younger_than_date (OstreeRepo *repo, const char *date, GCance
 {
   g_autoptr(GHashTable) refs = NULL;
   g_autoptr(GHashTable) ref_heads = g_hash_table_new (g_str_hash, g_str_equal);
-  g_autoptr(GHashTable) objects = NULL;
+  g_autoptr(GHashTable) seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  OstreeRepo *r;
   GHashTableIter hash_iter;
   gpointer key, value;
   struct timespec ts;
@@ -117,44 +119,42 @@ prune_commits_keep_younger_than_date (OstreeRepo *repo, const char *date, GCance
       g_hash_table_add (ref_heads, (char*)value);
     }
 
-  if (!ostree_repo_list_objects (repo, OSTREE_REPO_LIST_OBJECTS_ALL, &objects,
-                                 cancellable, error))
-    goto out;
-
-  g_hash_table_iter_init (&hash_iter, objects);
-
-  while (g_hash_table_iter_next (&hash_iter, &key, &value))
+  /* The commit index has each commit's timestamp, so we don't need to
+   * load every commit object.  Like listing all objects, this covers
+   * parent repos too; a commit in several is only considered once.
+   */
+  for (r = repo; r != NULL; r = ostree_repo_get_parent (r))
     {
-      GVariant *serialized_key = key;
+      g_autoptr(GVariant) commit_index = NULL;
+      GVariantIter viter;
       const char *checksum;
-      OstreeObjectType objtype;
       guint64 commit_timestamp;
-      g_autoptr(GVariant) commit = NULL;
-
-      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
 
-      if (objtype != OSTREE_OBJECT_TYPE_COMMIT)
-        continue;
-
-      if (g_hash_table_contains (ref_heads, checksum))
-        continue;
-
-      if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, checksum,
-                                     &commit, error))
+      if (!ostree_cmd__private__ ()->ostree_repo_get_commit_index (r, &commit_index,
+                                                                   cancellable, error))
         goto out;
 
-      commit_timestamp = ostree_commit_get_timestamp (commit);
-      if (commit_timestamp < ts.tv_sec)
+      g_variant_iter_init (&viter, commit_index);
+      while (g_variant_iter_next (&viter, "(&s&s&st)", &checksum, NULL, NULL, &commit_timestamp))
         {
-          if (opt_static_deltas_only)
-            {
-              if(!ostree_repo_prune_static_deltas (repo, checksum, cancellable, error))
-                goto out;
-            }
-          else
+          if (g_hash_table_contains (ref_heads, checksum))
+            continue;
+          if (!g_hash_table_add (seen, g_strdup (checksum)))
+            continue;
+
+          if (commit_timestamp < ts.tv_sec)
             {
-              if (!ostree_repo_delete_object (repo, OSTREE_OBJECT_TYPE_COMMIT, checksum, cancellable, error))
-                goto out;
+              if (opt_static_deltas_only)
+                {
+                  if (!ostree_repo_prune_static_deltas (repo, checksum, cancellable, error))
+                    goto out;
+                }
+              else
+                {
+                  if (!ostree_repo_delete_object (repo, OSTREE_OBJECT_TYPE_COMMIT, checksum,
+                                                  cancellable, error))
+                    goto out;
+                }
             }
         }
     }
@@ -25,8 +25,144 @@
 #include "ot-main.h"
 #include "ot-builtins.h"
 #include "ostree.h"
+#include "ostree-cmdprivate.h"
 #include "otutil.h"
 
+static gboolean opt_commits;
+
+static GOptionEntry options[] = {
+  { "commits", 0, 0, G_OPTION_ARG_NONE, &opt_commits, "Summarize a set of commits, including bytes shared between them and unique to each", NULL },
+  { NULL }
+};
+
+typedef struct {
+  guint8 objtype;
+  guint64 archived;
+  guint64 unpacked;
+  guint refcount;
+} SizeSummaryEntry;
+
+typedef struct {
+  gsize files;
+  guint64 archived;
+  guint64 unpacked;
+} SizeSummaryTotals;
+
+static void
+totals_add (SizeSummaryTotals *totals,
+            SizeSummaryEntry  *entry)
+{
+  if (entry->objtype == OSTREE_OBJECT_TYPE_FILE)
+    totals->files++;
+  totals->archived += entry->archived;
+  totals->unpacked += entry->unpacked;
+}
+
+static gboolean
+summarize_commits (OstreeRepo    *repo,
+                   int            n_revs,
+                   char         **revs,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  g_autoptr(GPtrArray) commits = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) commit_sizes = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+  g_autoptr(GHashTable) objects = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+  SizeSummaryTotals all_totals = { 0, };
+  SizeSummaryTotals shared_totals = { 0, };
+  GHashTableIter hashiter;
+  gpointer key, value;
+  int i;
+
+  /* Collect the sizes of each commit, counting how many of the commits
+   * reference each object.
+   */
+  for (i = 0; i < n_revs; i++)
+    {
+      g_autofree char *commit = NULL;
+      GVariant *sizes = NULL;
+      GVariantIter iter;
+      const char *checksum;
+      guint8 objtype;
+      guint64 archived, unpacked;
+
+      if (!ostree_repo_resolve_rev (repo, revs[i], FALSE, &commit, error))
+        return FALSE;
+
+      if (!ostree_cmd__private__ ()->ostree_repo_get_commit_object_sizes (repo, commit, &sizes,
+                                                                          cancellable, error))
+        return FALSE;
+
+      g_variant_iter_init (&iter, sizes);
+      while (g_variant_iter_next (&iter, "{&s(ytt)}", &checksum, &objtype, &archived, &unpacked))
+        {
+          SizeSummaryEntry *entry = g_hash_table_lookup (objects, checksum);
+
+          if (!entry)
+            {
+              entry = g_new0 (SizeSummaryEntry, 1);
+              entry->objtype = objtype;
+              entry->archived = archived;
+              entry->unpacked = unpacked;
+              /* Keys point into the variants, which outlive the table */
+              g_hash_table_insert (objects, (char*)checksum, entry);
+            }
+          entry->refcount++;
+        }
+
+      g_ptr_array_add (commits, g_steal_pointer (&commit));
+      g_ptr_array_add (commit_sizes, sizes);
+    }
+
+  for (i = 0; i < n_revs; i++)
+    {
+      SizeSummaryTotals totals = { 0, };
+      SizeSummaryTotals unique_totals = { 0, };
+      GVariantIter iter;
+      const char *checksum;
+
+      g_variant_iter_init (&iter, commit_sizes->pdata[i]);
+      while (g_variant_iter_next (&iter, "{&s(ytt)}", &checksum, NULL, NULL, NULL))
+        {
+          SizeSummaryEntry *entry = g_hash_table_lookup (objects, checksum);
+
+          totals_add (&totals, entry);
+          if (entry->refcount == 1)
+            totals_add (&unique_totals, entry);
+        }
+
+      g_print ("Summary for commit %s (%s):\n"
+               "  files: %" G_GSIZE_FORMAT " entries, %" G_GSIZE_FORMAT " unique\n"
+               "  archived: %" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT " unique\n"
+               "  unpacked: %" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT " unique\n",
+               (char*)commits->pdata[i], revs[i],
+               totals.files, unique_totals.files,
+               totals.archived, unique_totals.archived,
+               totals.unpacked, unique_totals.unpacked);
+    }
+
+  g_hash_table_iter_init (&hashiter, objects);
+  while (g_hash_table_iter_next (&hashiter, &key, &value))
+    {
+      SizeSummaryEntry *entry = value;
+
+      totals_add (&all_totals, entry);
+      if (entry->refcount > 1)
+        totals_add (&shared_totals, entry);
+    }
+
+  g_print ("Summary for %d commits:\n"
+           "  files: %" G_GSIZE_FORMAT " entries, %" G_GSIZE_FORMAT " shared\n"
+           "  archived: %" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT " shared\n"
+           "  unpacked: %" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT " shared\n",
+           n_revs,
+           all_totals.files, shared_totals.files,
+           all_totals.archived, shared_totals.archived,
+           all_totals.unpacked, shared_totals.unpacked);
+
+  return TRUE;
+}
+
 gboolean
 ostree_builtin_size_summary (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
@@ -45,14 +181,29 @@ ostree_builtin_size_summary (int argc, char **argv, GCancellable *cancellable, G
   gint64 new_archived = 0;
   gint64 new_unpacked = 0;
 
-  context = g_option_context_new ("[REMOTE] BRANCH - Display the summary for branch");
+  context = g_option_context_new ("[REMOTE] BRANCH | --commits REV... - Display the summary for branch");
 
-  if (!ostree_option_context_parse (context, NULL, &argc, &argv, OSTREE_BUILTIN_FLAG_NONE, &repo, cancellable, error))
+  if (!ostree_option_context_parse (context, options, &argc, &argv, OSTREE_BUILTIN_FLAG_NONE, &repo, cancellable, error))
     goto out;
 
   if (!ostree_repo_open (repo, cancellable, error))
     goto out;
 
+  if (opt_commits)
+    {
+      if (argc < 2)
+        {
+          ot_util_usage_error (context, "At least one REV must be specified", error);
+          goto out;
+        }
+
+      if (!summarize_commits (repo, argc - 1, argv + 1, cancellable, error))
+        goto out;
+
+      ret = TRUE;
+      goto out;
+    }
+
   switch (argc)
     {
     case 3:
@@ -33,11 +33,17 @@ static char *opt_min_fallback_size;
 static char *opt_max_bsdiff_size;
 static char *opt_max_chunk_size;
 static char *opt_endianness;
+static char *opt_compression;
 static gboolean opt_empty;
 static gboolean opt_swap_endianness;
 static gboolean opt_inline;
 static gboolean opt_disable_bsdiff;
+static gboolean opt_disable_similarity_by_content;
 static gboolean opt_if_not_exists;
+static char **opt_from_revs;
+static int opt_from_last;
+static int opt_jobs;
+static gboolean opt_no_update_summary;
 
 #define BUILTINPROTO(name) static gboolean ot_static_delta_builtin_ ## name (int argc, char **argv, GCancellable *cancellable, GError **error)
 
@@ -45,6 +51,7 @@ BUILTINPROTO(list);
 BUILTINPROTO(show);
 BUILTINPROTO(delete);
 BUILTINPROTO(generate);
+BUILTINPROTO(generate_many);
 BUILTINPROTO(apply_offline);
 
 #undef BUILTINPROTO
@@ -54,6 +61,7 @@ static OstreeCommand static_delta_subcommands[] = {
   { "show", ot_static_delta_builtin_show },
   { "delete", ot_static_delta_builtin_delete },
   { "generate", ot_static_delta_builtin_generate },
+  { "generate-many", ot_static_delta_builtin_generate_many },
   { "apply-offline", ot_static_delta_builtin_apply_offline },
   { NULL, NULL }
 };
@@ -62,15 +70,31 @@ static OstreeCommand static_delta_subcommands[] = {
 static GOptionEntry generate_options[] = {
   { "from", 0, 0, G_OPTION_ARG_STRING, &opt_from_rev, "Create delta from revision REV", "REV" },
   { "empty", 0, 0, G_OPTION_ARG_NONE, &opt_empty, "Create delta from scratch", NULL },
-  { "inline", 0, 0, G_OPTION_ARG_NONE, &opt_inline, "Inline delta parts into main delta", NULL },
   { "to", 0, 0, G_OPTION_ARG_STRING, &opt_to_rev, "Create delta to revision REV", "REV" },
+  { NULL }
+};
+
+static GOptionEntry generate_many_options[] = {
+  { "from", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_from_revs, "Create a delta from revision REV (may be given multiple times)", "REV" },
+  { "from-last", 0, 0, G_OPTION_ARG_INT, &opt_from_last, "Create deltas from the N parents of the target", "N" },
+  { "to", 0, 0, G_OPTION_ARG_STRING, &opt_to_rev, "Create deltas to revision REV", "REV" },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Number of deltas to generate at once (default: number of CPUs)", "N" },
+  { "no-update-summary", 0, 0, G_OPTION_ARG_NONE, &opt_no_update_summary, "Don't regenerate the summary file afterwards", NULL },
+  { NULL }
+};
+
+/* Shared between generate and generate-many */
+static GOptionEntry delta_params_options[] = {
+  { "inline", 0, 0, G_OPTION_ARG_NONE, &opt_inline, "Inline delta parts into main delta", NULL },
   { "disable-bsdiff", 0, 0, G_OPTION_ARG_NONE, &opt_disable_bsdiff, "Disable use of bsdiff", NULL },
+  { "disable-similarity-by-content", 0, 0, G_OPTION_ARG_NONE, &opt_disable_similarity_by_content, "Only match modified files by name and size, not content", NULL },
   { "if-not-exists", 'n', 0, G_OPTION_ARG_NONE, &opt_if_not_exists, "Only generate if a delta does not already exist", NULL },
   { "set-endianness", 0, 0, G_OPTION_ARG_STRING, &opt_endianness, "Choose metadata endianness ('l' or 'B')", "ENDIAN" },
   { "swap-endianness", 0, 0, G_OPTION_ARG_NONE, &opt_swap_endianness, "Swap metadata endianness from host order", NULL },
   { "min-fallback-size", 0, 0, G_OPTION_ARG_STRING, &opt_min_fallback_size, "Minimum uncompressed size in megabytes for individual HTTP request", NULL},
   { "max-bsdiff-size", 0, 0, G_OPTION_ARG_STRING, &opt_max_bsdiff_size, "Maximum size in megabytes to consider bsdiff compression for input files", NULL},
   { "max-chunk-size", 0, 0, G_OPTION_ARG_STRING, &opt_max_chunk_size, "Maximum size of delta chunks in megabytes", NULL},
+  { "compression", 0, 0, G_OPTION_ARG_STRING, &opt_compression, "Compression for delta parts: none, xz, or zstd[:LEVEL] (default xz)", "TYPE"},
   { NULL }
 };
 
@@ -199,6 +223,150 @@ ot_static_delta_builtin_delete (int argc, char **argv, GCancellable *cancellable
 }
 
 
+static gboolean
+parse_compression (const char  *spec,
+                   guint8      *out_type,
+                   gboolean    *out_have_level,
+                   gint32      *out_level,
+                   GError     **error)
+{
+  g_autofree char *name = g_strdup (spec);
+  char *level_str = strchr (name, ':');
+  gint32 level = 0;
+
+  if (level_str)
+    {
+      char *endp;
+      *level_str = '\0';
+      level_str++;
+      level = (gint32) g_ascii_strtoll (level_str, &endp, 10);
+      if (*level_str == '\0' || *endp != '\0')
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Invalid compression level '%s'", level_str);
+          return FALSE;
+        }
+    }
+
+  if (strcmp (name, "none") == 0)
+    *out_type = 0;
+  else if (strcmp (name, "xz") == 0 || strcmp (name, "lzma") == 0)
+    *out_type = 'x';
+  else if (strcmp (name, "zstd") == 0)
+    *out_type = 'z';
+  else
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Unknown compression type '%s'", name);
+      return FALSE;
+    }
+
+  if (level_str && *out_type != 'z')
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Compression type '%s' does not take a level", name);
+      return FALSE;
+    }
+
+  *out_have_level = level_str != NULL;
+  *out_level = level;
+  return TRUE;
+}
+
+/* Reset our peak resident set size, so the one the library reports
+ * with --verbose covers only generating deltas.  Best effort; requires
+ * Linux 4.0.
+ */
+static void
+reset_peak_rss (void)
+{
+  glnx_fd_close int fd = open ("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+
+  if (fd != -1)
+    (void) write (fd, "5", 1);
+}
+
+/* Add the parameters from delta_params_options to @parambuilder */
+static gboolean
+build_delta_params (GVariantBuilder  *parambuilder,
+                    gboolean          verbose,
+                    GError          **error)
+{
+  int endianness;
+
+  if (opt_endianness)
+    {
+      if (strcmp (opt_endianness, "l") == 0)
+        endianness = G_LITTLE_ENDIAN;
+      else if (strcmp (opt_endianness, "B") == 0)
+        endianness = G_BIG_ENDIAN;
+      else
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Invalid endianness '%s'", opt_endianness);
+          return FALSE;
+        }
+    }
+  else
+    endianness = G_BYTE_ORDER;
+
+  if (opt_swap_endianness)
+    {
+      switch (endianness)
+        {
+        case G_LITTLE_ENDIAN:
+          endianness = G_BIG_ENDIAN;
+          break;
+        case G_BIG_ENDIAN:
+          endianness = G_LITTLE_ENDIAN;
+          break;
+        default:
+          g_assert_not_reached ();
+        }
+    }
+
+  if (opt_min_fallback_size)
+    g_variant_builder_add (parambuilder, "{sv}",
+                           "min-fallback-size", g_variant_new_uint32 (g_ascii_strtoull (opt_min_fallback_size, NULL, 10)));
+  if (opt_max_bsdiff_size)
+    g_variant_builder_add (parambuilder, "{sv}",
+                           "max-bsdiff-size", g_variant_new_uint32 (g_ascii_strtoull (opt_max_bsdiff_size, NULL, 10)));
+  if (opt_max_chunk_size)
+    g_variant_builder_add (parambuilder, "{sv}",
+                           "max-chunk-size", g_variant_new_uint32 (g_ascii_strtoull (opt_max_chunk_size, NULL, 10)));
+  if (opt_disable_bsdiff)
+    g_variant_builder_add (parambuilder, "{sv}",
+                           "bsdiff-enabled", g_variant_new_boolean (FALSE));
+  if (opt_disable_similarity_by_content)
+    g_variant_builder_add (parambuilder, "{sv}",
+                           "similarity-by-content", g_variant_new_boolean (FALSE));
+  if (opt_inline)
+    g_variant_builder_add (parambuilder, "{sv}",
+                           "inline-parts", g_variant_new_boolean (TRUE));
+  if (opt_compression)
+    {
+      guint8 compression_type;
+      gboolean have_level;
+      gint32 compression_level;
+
+      if (!parse_compression (opt_compression, &compression_type,
+                              &have_level, &compression_level, error))
+        return FALSE;
+      g_variant_builder_add (parambuilder, "{sv}",
+                             "compression", g_variant_new_byte (compression_type));
+      if (have_level)
+        g_variant_builder_add (parambuilder, "{sv}",
+                               "compression-level", g_variant_new_int32 (compression_level));
+    }
+
+  if (verbose)
+    g_variant_builder_add (parambuilder, "{sv}", "verbose", g_variant_new_boolean (TRUE));
+  if (opt_endianness || opt_swap_endianness)
+    g_variant_builder_add (parambuilder, "{sv}", "endianness", g_variant_new_uint32 (endianness));
+
+  return TRUE;
+}
+
 static gboolean
 ot_static_delta_builtin_generate (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
@@ -207,6 +375,7 @@ ot_static_delta_builtin_generate (int argc, char **argv, GCancellable *cancellab
   glnx_unref_object OstreeRepo *repo = NULL;
 
   context = g_option_context_new ("GENERATE [TO] - Generate static delta files");
+  g_option_context_add_main_entries (context, delta_params_options, NULL);
   if (!ostree_option_context_parse (context, generate_options, &argc, &argv, OSTREE_BUILTIN_FLAG_NONE, &repo, cancellable, error))
     goto out;
 
@@ -229,7 +398,7 @@ ot_static_delta_builtin_generate (int argc, char **argv, GCancellable *cancellab
       g_autofree char *to_resolved = NULL;
       g_autofree char *from_parent_str = NULL;
       g_autoptr(GVariantBuilder) parambuilder = NULL;
-      int endianness;
+      g_autoptr(GVariant) params = NULL;
 
       g_assert (opt_to_rev);
 
@@ -275,69 +444,161 @@ ot_static_delta_builtin_generate (int argc, char **argv, GCancellable *cancellab
             }
         }
       
-      if (opt_endianness)
-        {
-          if (strcmp (opt_endianness, "l") == 0)
-            endianness = G_LITTLE_ENDIAN;
-          else if (strcmp (opt_endianness, "B") == 0)
-            endianness = G_BIG_ENDIAN;
-          else
-            {
-              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                           "Invalid endianness '%s'", opt_endianness);
-              goto out;
-            }
-        }
-      else
-        endianness = G_BYTE_ORDER;
-          
-      if (opt_swap_endianness)
-        {
-          switch (endianness)
-            {
-            case G_LITTLE_ENDIAN:
-              endianness = G_BIG_ENDIAN;
-              break;
-            case G_BIG_ENDIAN:
-              endianness = G_LITTLE_ENDIAN;
-              break;
-            default:
-              g_assert_not_reached ();
-            }
-        }
-
       parambuilder = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
-      if (opt_min_fallback_size)
-        g_variant_builder_add (parambuilder, "{sv}",
-                               "min-fallback-size", g_variant_new_uint32 (g_ascii_strtoull (opt_min_fallback_size, NULL, 10)));
-      if (opt_max_bsdiff_size)
-        g_variant_builder_add (parambuilder, "{sv}",
-                               "max-bsdiff-size", g_variant_new_uint32 (g_ascii_strtoull (opt_max_bsdiff_size, NULL, 10)));
-      if (opt_max_chunk_size)
-        g_variant_builder_add (parambuilder, "{sv}",
-                               "max-chunk-size", g_variant_new_uint32 (g_ascii_strtoull (opt_max_chunk_size, NULL, 10)));
-      if (opt_disable_bsdiff)
-        g_variant_builder_add (parambuilder, "{sv}",
-                               "bsdiff-enabled", g_variant_new_boolean (FALSE));
-      if (opt_inline)
-        g_variant_builder_add (parambuilder, "{sv}",
-                               "inline-parts", g_variant_new_boolean (TRUE));
-
-      g_variant_builder_add (parambuilder, "{sv}", "verbose", g_variant_new_boolean (TRUE));
-      if (opt_endianness || opt_swap_endianness)
-        g_variant_builder_add (parambuilder, "{sv}", "endianness", g_variant_new_uint32 (endianness));
+      if (!build_delta_params (parambuilder, TRUE, error))
+        goto out;
+      params = g_variant_ref_sink (g_variant_builder_end (parambuilder));
 
       g_print ("Generating static delta:\n");
       g_print ("  From: %s\n", from_resolved ? from_resolved : "empty");
       g_print ("  To:   %s\n", to_resolved);
-      { g_autoptr(GVariant) params = g_variant_ref_sink (g_variant_builder_end (parambuilder));
-        if (!ostree_repo_static_delta_generate (repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
-                                                from_resolved, to_resolved, NULL,
-                                                params,
-                                                cancellable, error))
-          goto out;
+      reset_peak_rss ();
+      if (!ostree_repo_static_delta_generate (repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
+                                              from_resolved, to_resolved, NULL,
+                                              params,
+                                              cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+ot_static_delta_builtin_generate_many (int argc, char **argv, GCancellable *cancellable, GError **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GOptionContext) context = NULL;
+  glnx_unref_object OstreeRepo *repo = NULL;
+  g_autofree char *to_resolved = NULL;
+  g_autoptr(GPtrArray) from_resolved = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GVariantBuilder) parambuilder = NULL;
+  g_autoptr(GVariant) params = NULL;
+  char **iter;
+  guint i;
+
+  context = g_option_context_new ("GENERATE-MANY [TO] - Generate static delta files from several revisions");
+  g_option_context_add_main_entries (context, delta_params_options, NULL);
+  if (!ostree_option_context_parse (context, generate_many_options, &argc, &argv, OSTREE_BUILTIN_FLAG_NONE, &repo, cancellable, error))
+    goto out;
+
+  if (!ostree_ensure_repo_writable (repo, error))
+    goto out;
+
+  if (argc >= 3 && opt_to_rev == NULL)
+    opt_to_rev = argv[2];
+
+  if (opt_to_rev == NULL)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "TO revision must be specified");
+      goto out;
+    }
+
+  if (opt_from_last < 0 || (opt_from_revs == NULL && opt_from_last == 0))
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "--from=REV or --from-last=N must be specified");
+      goto out;
+    }
+
+  if (!ostree_repo_resolve_rev (repo, opt_to_rev, FALSE, &to_resolved, error))
+    goto out;
+
+  for (iter = opt_from_revs; iter && *iter; iter++)
+    {
+      char *resolved;
+
+      if (!ostree_repo_resolve_rev (repo, *iter, FALSE, &resolved, error))
+        goto out;
+      g_ptr_array_add (from_resolved, resolved);
+    }
+
+  if (opt_from_last > 0)
+    {
+      g_autoptr(GVariant) commit = NULL;
+
+      if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, to_resolved,
+                                     &commit, error))
+        goto out;
+
+      for (i = 0; i < (guint) opt_from_last; i++)
+        {
+          g_autofree char *parent = ostree_commit_get_parent (commit);
+          g_autoptr(GVariant) parent_commit = NULL;
+
+          if (!parent)
+            break;
+          if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_COMMIT, parent,
+                                                   &parent_commit, error))
+            goto out;
+          /* Stop where the local history does */
+          if (!parent_commit)
+            break;
+
+          g_ptr_array_add (from_resolved, g_steal_pointer (&parent));
+          g_variant_unref (commit);
+          commit = g_steal_pointer (&parent_commit);
+        }
+    }
+
+  /* Drop duplicates, and existing deltas if asked to */
+  { g_autoptr(GHashTable) seen = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (i = 0; i < from_resolved->len; )
+      {
+        const char *from = from_resolved->pdata[i];
+        gboolean skip = strcmp (from, to_resolved) == 0 || g_hash_table_contains (seen, from);
+
+        if (!skip && opt_if_not_exists)
+          {
+            g_autofree char *delta_id = g_strconcat (from, "-", to_resolved, NULL);
+
+            if (!ostree_cmd__private__ ()->ostree_static_delta_query_exists (repo, delta_id, &skip, cancellable, error))
+              goto out;
+            if (skip)
+              g_print ("Delta %s already exists.\n", delta_id);
+          }
+
+        if (skip)
+          g_ptr_array_remove_index (from_resolved, i);
+        else
+          {
+            g_hash_table_add (seen, (char*) from);
+            i++;
+          }
       }
+  }
 
+  if (from_resolved->len > 0)
+    {
+      parambuilder = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
+      /* Output of deltas generated in parallel would be interleaved */
+      if (!build_delta_params (parambuilder, FALSE, error))
+        goto out;
+      if (opt_jobs > 0)
+        g_variant_builder_add (parambuilder, "{sv}", "n-jobs", g_variant_new_uint32 (opt_jobs));
+      params = g_variant_ref_sink (g_variant_builder_end (parambuilder));
+
+      g_print ("Generating static deltas:\n");
+      for (i = 0; i < from_resolved->len; i++)
+        g_print ("  From: %s\n", (char*)from_resolved->pdata[i]);
+      g_print ("  To:   %s\n", to_resolved);
+
+      g_ptr_array_add (from_resolved, NULL);
+      reset_peak_rss ();
+      if (!ostree_repo_static_delta_generate_many (repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
+                                                   (const char * const *) from_resolved->pdata,
+                                                   to_resolved, NULL, params,
+                                                   cancellable, error))
+        goto out;
+    }
+
+  if (!opt_no_update_summary)
+    {
+      if (!ostree_repo_regenerate_summary (repo, NULL, cancellable, error))
+        goto out;
     }
 
   ret = TRUE;
@@ -398,6 +398,9 @@ do_get (OtTrivialHttpd    *self,
                   soup_message_headers_free_ranges (msg->request_headers, ranges);
                   goto out;
                 }
+              if (ranges_length > 0)
+                httpd_log (self, "  range: %" G_GINT64_FORMAT "-%" G_GINT64_FORMAT "\n",
+                           (gint64) ranges[0].start, (gint64) ranges[0].end);
               soup_message_headers_free_ranges (msg->request_headers, ranges);
             }
           if (buffer_length > 0)
@@ -26,7 +26,9 @@ function validate_bootloader() {
     elif test -f sysroot/boot/grub2/grub.cfg; then
 	    bootloader="grub2"
     fi
-    if test -n "${bootloader}"; then
+    if test "${bootloader}" = "grub2" && grep -q '^### BEGIN ostree ###' sysroot/boot/grub2/grub.cfg; then
+        $(dirname $0)/grub2-entries-crosscheck.py sysroot/boot/loader/entries sysroot/boot/grub2/grub.cfg "${OSTREE_BOOT_PARTITION:-}"
+    elif test -n "${bootloader}"; then
         $(dirname $0)/bootloader-entries-crosscheck.py sysroot ${bootloader}
     fi
     cd -
@@ -19,7 +19,7 @@
 
 set -euo pipefail
 
-echo "1..60"
+echo "1..62"
 
 $OSTREE checkout test2 checkout-test2
 echo "ok checkout"
@@ -38,6 +38,28 @@ $OSTREE rev-parse $partial > partial-results
 assert_file_has_content checksum $(cat partial-results)
 echo "ok shortened checksum"
 
+$OSTREE commit -b test2-index -s 'index test' --tree=ref=test2
+indexed=$($OSTREE rev-parse test2-index)
+$OSTREE rev-parse ${indexed:0:8} > partial-results
+assert_file_has_content partial-results ${indexed}
+assert_has_file repo/state/commit-index
+# A query saves what it rescanned, so repeating it doesn't write again;
+# age the directory so it isn't within the racy window
+touch -d '2000-01-01' repo/objects/${indexed:0:2}
+$OSTREE rev-parse ${indexed:0:8} > /dev/null
+cp repo/state/commit-index commit-index.orig
+$OSTREE rev-parse ${indexed:0:8} > /dev/null
+cmp repo/state/commit-index commit-index.orig
+rm -f commit-index.orig
+# Objects removed behind the index's back must not be resolved
+$OSTREE refs --delete test2-index
+rm repo/objects/${indexed:0:2}/${indexed:2}.commit
+if $OSTREE rev-parse ${indexed:0:8} 2>/dev/null; then
+    assert_not_reached "rev-parse resolved a deleted commit"
+fi
+rm -f partial-results
+echo "ok commit index"
+
 (cd repo && ${CMD_PREFIX} ostree rev-parse test2)
 echo "ok repo-in-cwd"
 
@@ -259,6 +281,16 @@ cd checkout-test2-union
 assert_file_has_content ./yet/another/tree/green "leaf"
 echo "ok checkout union 1"
 
+cd ${test_tmpdir}
+rm -rf checkout-test2-reflink
+$OSTREE checkout --reflink test2 checkout-test2-reflink
+assert_file_has_content checkout-test2-reflink/yet/another/tree/green "leaf"
+assert_streq "$(stat -c %h checkout-test2-reflink/yet/another/tree/green)" 1
+chmod u+w checkout-test2-reflink/yet/another/tree/green
+echo "not a leaf" > checkout-test2-reflink/yet/another/tree/green
+$OSTREE fsck
+echo "ok checkout reflink"
+
 cd ${test_tmpdir}
 rm -rf shadow-repo
 mkdir shadow-repo
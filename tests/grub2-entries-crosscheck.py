@@ -27,6 +27,17 @@ else:
     loaderpath = sys.argv[1]
     grub2path = sys.argv[2]
 
+# Prefix on kernel paths, as with OSTREE_BOOT_PARTITION
+if len(sys.argv) > 3:
+    boot_prefix = sys.argv[3]
+else:
+    boot_prefix = ''
+
+def strip_boot_prefix(path):
+    if boot_prefix != '' and path.startswith(boot_prefix):
+        return path[len(boot_prefix):]
+    return path
+
 def fatal(msg):
     sys.stderr.write(msg)
     sys.stderr.write('\n')
@@ -66,9 +77,12 @@ with open(grub2path) as f:
     in_ostree_config = False
     grub2_entry = None
     for line in f:
-        if line.startswith('### BEGIN /etc/grub.d/15_ostree ###'):
+        # The native generator in libostree uses its own markers
+        if (line.startswith('### BEGIN /etc/grub.d/15_ostree ###') or
+            line.startswith('### BEGIN ostree ###')):
             in_ostree_config = True
-        elif line.startswith('### END /etc/grub.d/15_ostree ###'): 
+        elif (line.startswith('### END /etc/grub.d/15_ostree ###') or
+              line.startswith('### END ostree ###')):
             in_ostree_config = False
             if grub2_entry is not None:
                 grub2_entries.append(grub2_entry)
@@ -79,10 +93,10 @@ with open(grub2path) as f:
                 grub2_entry = {}
             elif line.startswith('linux'):
                 parts = line.split()
-                grub2_entry['linux'] = parts[1]
+                grub2_entry['linux'] = strip_boot_prefix(parts[1])
                 grub2_entry['options'] = ' '.join(parts[2:])
             elif line.startswith('initrd'):
-                grub2_entry['initrd'] = line.split()[1]
+                grub2_entry['initrd'] = strip_boot_prefix(line.split()[1])
 
 if len(entries) != len(grub2_entries):
     fatal("Found {0} loader entries, but {1} GRUB2 entries\n".format(len(entries), len(grub2_entries)))
@@ -295,6 +295,9 @@ setup_os_boot_grub2() {
             chmod +x ${test_tmpdir}/ostree-grub-generator
             export OSTREE_GRUB2_EXEC=${test_tmpdir}/ostree-grub-generator
             ;;
+        *native*)
+            ${CMD_PREFIX} ostree --repo=sysroot/ostree/repo config set sysroot.grub2-generator native
+            ;;
     esac
 }
 
@@ -35,7 +35,7 @@ function verify_initial_contents() {
     assert_file_has_content baz/cow '^moo$'
 }
 
-echo "1..14"
+echo "1..16"
 
 # Try both syntaxes
 repo_init
@@ -48,6 +48,30 @@ cd ${test_tmpdir}
 verify_initial_contents
 echo "ok pull contents"
 
+cd ${test_tmpdir}
+repo_init
+${CMD_PREFIX} ostree --repo=repo config set core.write-threads 1
+${CMD_PREFIX} ostree --repo=repo pull origin main
+${CMD_PREFIX} ostree --repo=repo fsck
+verify_initial_contents
+echo "ok pull with one write thread"
+
+cd ${test_tmpdir}
+rm commit-sync-tree -rf
+mkdir commit-sync-tree
+echo "local content" > commit-sync-tree/localfile
+for policy in syncfs fdatasync batched; do
+    repo_init
+    ${CMD_PREFIX} ostree --repo=repo config set core.commit-sync ${policy}
+    ${CMD_PREFIX} ostree --repo=repo config set core.commit-sync-batch-mb 1
+    ${CMD_PREFIX} ostree --repo=repo pull origin main
+    ${CMD_PREFIX} ostree --repo=repo commit -b local-${policy} --tree=ref=origin/main --tree=dir=${test_tmpdir}/commit-sync-tree
+    ${CMD_PREFIX} ostree --repo=repo fsck
+    verify_initial_contents
+    cd ${test_tmpdir}
+done
+echo "ok pull and commit with each commit-sync policy"
+
 cd ${test_tmpdir}
 mkdir mirrorrepo
 ${CMD_PREFIX} ostree --repo=mirrorrepo init --mode=archive-z2
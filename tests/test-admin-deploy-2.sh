@@ -24,7 +24,7 @@ set -euo pipefail
 # Exports OSTREE_SYSROOT so --sysroot not needed.
 setup_os_repository "archive-z2" "syslinux"
 
-echo "1..3"
+echo "1..4"
 
 ${CMD_PREFIX} ostree --repo=sysroot/ostree/repo pull-local --remote=testos testos-repo testos/buildmaster/x86_64-runtime
 rev=$(${CMD_PREFIX} ostree --repo=sysroot/ostree/repo rev-parse testos/buildmaster/x86_64-runtime)
@@ -61,3 +61,17 @@ assert_has_dir sysroot/boot/ostree/testos-${bootcsum}
 assert_file_has_content sysroot/ostree/deploy/testos/deploy/${newrev}.0/etc/os-release 'NAME=TestOS'
 
 echo "ok manual cleanup"
+
+${CMD_PREFIX} ostree --repo=sysroot/ostree/repo config set sysroot.sync-mode bogus
+if ${CMD_PREFIX} ostree admin deploy --os=testos testos:testos/buildmaster/x86_64-runtime 2>err.txt; then
+    assert_not_reached "deploy with invalid sync-mode should have failed"
+fi
+assert_file_has_content err.txt "Invalid sysroot.sync-mode"
+for mode in full syncfs-freeze syncfs; do
+    ${CMD_PREFIX} ostree --repo=sysroot/ostree/repo config set sysroot.sync-mode ${mode}
+    ${CMD_PREFIX} ostree admin deploy --os=testos testos:testos/buildmaster/x86_64-runtime
+    ${CMD_PREFIX} ostree admin undeploy 0
+done
+assert_file_has_content sysroot/ostree/deploy/testos/deploy/${newrev}.0/etc/os-release 'NAME=TestOS'
+
+echo "ok sync modes"
@@ -24,7 +24,7 @@ set -euo pipefail
 # Exports OSTREE_SYSROOT so --sysroot not needed.
 setup_os_repository "archive-z2" "syslinux"
 
-echo "1..1"
+echo "1..2"
 
 ${CMD_PREFIX} ostree --repo=sysroot/ostree/repo pull-local --remote=testos testos-repo testos/buildmaster/x86_64-runtime
 rev=$(${CMD_PREFIX} ostree --repo=sysroot/ostree/repo rev-parse testos/buildmaster/x86_64-runtime)
@@ -35,3 +35,26 @@ ${CMD_PREFIX} ostree --repo=sysroot/ostree/repo refs > refs.txt
 assert_not_file_has_content refs.txt '^ostree/'
 
 echo "ok deploy + undeploy repo prune"
+
+# Undeploying goes through the trash, which is emptied synchronously
+${CMD_PREFIX} ostree admin deploy --os=testos testos:testos/buildmaster/x86_64-runtime
+${CMD_PREFIX} ostree admin undeploy 0
+assert_not_has_dir sysroot/ostree/deploy/testos/deploy/${rev}.0
+assert_not_has_dir sysroot/ostree/deploy/testos/deploy/${rev}.1
+if test -d sysroot/ostree/trash; then
+    test -z "$(ls sysroot/ostree/trash)" || assert_not_reached "trash not empty"
+fi
+
+# Leftover trash is reclaimed by a background cleanup
+mkdir -p sysroot/ostree/trash/leftover.XXXXXX/usr/lib
+touch sysroot/ostree/trash/leftover.XXXXXX/usr/lib/somelib.so
+${CMD_PREFIX} ostree admin cleanup --background
+for i in $(seq 50); do
+    if ! test -d sysroot/ostree/trash/leftover.XXXXXX; then
+        break
+    fi
+    sleep 0.1
+done
+assert_not_has_dir sysroot/ostree/trash/leftover.XXXXXX
+
+echo "ok cleanup via trash"
@@ -24,7 +24,7 @@ set -euo pipefail
 # Exports OSTREE_SYSROOT so --sysroot not needed.
 setup_os_repository "archive-z2" "syslinux"
 
-echo "1..2"
+echo "1..3"
 
 ${CMD_PREFIX} ostree --repo=sysroot/ostree/repo pull-local --remote=testos testos-repo testos/buildmaster/x86_64-runtime
 rev=$(${CMD_PREFIX} ostree --repo=sysroot/ostree/repo rev-parse testos/buildmaster/x86_64-runtime)
@@ -140,3 +140,22 @@ assert_has_file sysroot/ostree/deploy/testos/deploy/${rev}.0/etc/initially-empty
 rm ${newconfpath}
 
 echo "ok"
+
+# A deployment records which of its /etc files are pristine copies
+etc=sysroot/ostree/deploy/testos/deploy/${rev}.0/etc
+assert_has_file sysroot/ostree/deploy/testos/deploy/${rev}.0.etc-cache
+# Same size and mtime, different content; must still be detected
+tr 'a-z' 'A-Z' < ${etc}/a-new-default-config-file > conf.new
+touch -r ${etc}/a-new-default-config-file conf.new
+cat conf.new > ${etc}/a-new-default-config-file
+touch -r conf.new ${etc}/a-new-default-config-file
+os_repository_new_commit 0 3
+${CMD_PREFIX} ostree admin upgrade --os=testos
+oldrev=${rev}
+rev=$(${CMD_PREFIX} ostree --repo=sysroot/ostree/repo rev-parse testos/buildmaster/x86_64-runtime)
+assert_file_has_content sysroot/ostree/deploy/testos/deploy/${rev}.0/etc/a-new-default-config-file "A NEW DEFAULT CONFIG FILE"
+assert_has_file sysroot/ostree/deploy/testos/deploy/${rev}.0.etc-cache
+${CMD_PREFIX} ostree admin undeploy 1
+assert_not_has_file sysroot/ostree/deploy/testos/deploy/${oldrev}.0.etc-cache
+
+echo "ok"
@@ -0,0 +1,53 @@
+#!/bin/bash
+#
+# Copyright (C) 2017 The OSTree Authors
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+echo "1..17"
+
+. $(dirname $0)/libtest.sh
+
+# Exports OSTREE_SYSROOT so --sysroot not needed.
+setup_os_repository "archive-z2" "grub2 native"
+
+. $(dirname $0)/admin-test.sh
+
+cd ${test_tmpdir}
+assert_file_has_content sysroot/boot/grub2/grub.cfg '^# This file was generated by ostree'
+assert_file_has_content sysroot/boot/grub2/grub.cfg '^linux /boot/ostree/testos-'
+
+cat > sysroot/boot/grub2/ostree-header.cfg <<EOH
+set default=0
+set timeout=1
+EOH
+cat > sysroot/boot/grub2/ostree-entry.cfg <<EOH
+menuentry @TITLE@ --id 'custom-@INDEX@' {
+linux @LINUX@ @OPTIONS@ custom
+initrd @INITRD@
+}
+EOH
+${CMD_PREFIX} ostree admin deploy --os=testos testos:testos/buildmaster/x86_64-runtime
+assert_file_has_content sysroot/boot/grub2/grub.cfg '^set timeout=1'
+assert_not_file_has_content sysroot/boot/grub2/grub.cfg 'set timeout=5'
+assert_file_has_content sysroot/boot/grub2/grub.cfg "^menuentry .* --id 'custom-0'"
+assert_file_has_content sysroot/boot/grub2/grub.cfg '^linux /boot/ostree/testos-.* custom$'
+assert_file_has_content sysroot/boot/grub2/grub.cfg '^initrd /boot/ostree/testos-'
+$(dirname $0)/grub2-entries-crosscheck.py sysroot/boot/loader/entries sysroot/boot/grub2/grub.cfg /boot
+
+echo "ok native grub2 templates"
@@ -170,6 +170,132 @@ test_raw_file_to_archive_z2_stream (gconstpointer data)
   g_assert_cmpint (checks, >, 0);
 }
 
+static gboolean
+add_object_cb (OstreeRepo        *repo,
+               const guchar      *csum,
+               OstreeObjectType   objtype,
+               gpointer           user_data,
+               GError           **error)
+{
+  GHashTable *seen = user_data;
+  char checksum[OSTREE_SHA256_STRING_LEN+1];
+  GVariant *key;
+
+  ostree_checksum_inplace_from_bytes (csum, checksum);
+  key = g_variant_ref_sink (ostree_object_name_serialize (checksum, objtype));
+  /* Each object must be seen exactly once across all shards */
+  g_assert (!g_hash_table_contains (seen, key));
+  g_hash_table_add (seen, key);
+  return TRUE;
+}
+
+static void
+test_foreach_object (gconstpointer data)
+{
+  OstreeRepo *repo = OSTREE_REPO (data);
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GHashTable) objects = NULL;
+  g_autoptr(GHashTable) seen = NULL;
+  GHashTableIter iter;
+  gpointer key;
+  guint shard;
+
+  ostree_repo_list_objects (repo, OSTREE_REPO_LIST_OBJECTS_ALL, &objects, NULL, &error);
+  g_assert_no_error (error);
+
+  seen = g_hash_table_new_full (ostree_hash_object_name, g_variant_equal,
+                                (GDestroyNotify) g_variant_unref, NULL);
+  for (shard = 0; shard < 3; shard++)
+    {
+      ostree_repo_foreach_object (repo, OSTREE_REPO_LIST_OBJECTS_ALL, shard, 3,
+                                  add_object_cb, seen, NULL, &error);
+      g_assert_no_error (error);
+    }
+
+  g_assert_cmpuint (g_hash_table_size (seen), ==, g_hash_table_size (objects));
+  g_hash_table_iter_init (&iter, objects);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_assert (g_hash_table_contains (seen, key));
+}
+
+/* Time static delta generation, and report the delta size.  By default
+ * the trees are synthetic: the "to" commit renames and moves every
+ * file of the "from" commit and changes a byte in each, so no basename
+ * matches.  Set OSTREE_DELTA_BENCH_REPO, OSTREE_DELTA_BENCH_FROM and
+ * OSTREE_DELTA_BENCH_TO to benchmark a real pair of commits instead;
+ * note the delta is written into that repository.
+ */
+static void
+test_delta_similarity_benchmark (gconstpointer data)
+{
+  OstreeRepo *repo = OSTREE_REPO (data);
+  GError *local_error = NULL;
+  GError **error = &local_error;
+  const char *bench_repo_path = g_getenv ("OSTREE_DELTA_BENCH_REPO");
+  glnx_unref_object OstreeRepo *bench_repo = NULL;
+  g_autofree char *from = NULL;
+  g_autofree char *to = NULL;
+  g_autofree char *show_cmd = NULL;
+  g_autofree char *show_out = NULL;
+  const char *total_size;
+  double elapsed;
+
+  if (!g_test_perf ())
+    return;
+
+  if (bench_repo_path)
+    {
+      g_autoptr(GFile) path = g_file_new_for_path (bench_repo_path);
+
+      bench_repo = ostree_repo_new (path);
+      if (!ostree_repo_open (bench_repo, NULL, error))
+        goto out;
+      if (!ostree_repo_resolve_rev (bench_repo, g_getenv ("OSTREE_DELTA_BENCH_FROM"), FALSE, &from, error))
+        goto out;
+      if (!ostree_repo_resolve_rev (bench_repo, g_getenv ("OSTREE_DELTA_BENCH_TO"), FALSE, &to, error))
+        goto out;
+    }
+  else
+    {
+      if (!ot_test_run_libtest ("rm -rf delta-bench-from delta-bench-to && "
+                                "mkdir -p delta-bench-from/usr/lib delta-bench-to/usr/lib64 && "
+                                "for i in $(seq 200); do "
+                                "head -c 262144 /dev/urandom > delta-bench-from/usr/lib/libbench$i.so.1.0; "
+                                "cp delta-bench-from/usr/lib/libbench$i.so.1.0 delta-bench-to/usr/lib64/bench-$i-renamed; "
+                                "printf x | dd of=delta-bench-to/usr/lib64/bench-$i-renamed bs=1 seek=4096 conv=notrunc status=none; "
+                                "done && "
+                                "ostree --repo=repo commit -b delta-bench --tree=dir=delta-bench-from && "
+                                "ostree --repo=repo commit -b delta-bench --tree=dir=delta-bench-to", error))
+        goto out;
+
+      bench_repo = g_object_ref (repo);
+      bench_repo_path = "repo";
+      if (!ostree_repo_resolve_rev (bench_repo, "delta-bench^", FALSE, &from, error))
+        goto out;
+      if (!ostree_repo_resolve_rev (bench_repo, "delta-bench", FALSE, &to, error))
+        goto out;
+    }
+
+  g_test_timer_start ();
+  if (!ostree_repo_static_delta_generate (bench_repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
+                                          from, to, NULL, NULL, NULL, error))
+    goto out;
+  elapsed = g_test_timer_elapsed ();
+
+  show_cmd = g_strdup_printf ("ostree --repo=%s static-delta show %s-%s", bench_repo_path, from, to);
+  if (!g_spawn_command_line_sync (show_cmd, &show_out, NULL, NULL, error))
+    goto out;
+  total_size = strstr (show_out, "Total Size: ");
+  g_assert (total_size);
+
+  g_test_minimized_result (elapsed, "delta %.10s-%.10s: generated in %.3f s, %" G_GUINT64_FORMAT " bytes",
+                           from, to, elapsed,
+                           g_ascii_strtoull (total_size + strlen ("Total Size: "), NULL, 10));
+
+ out:
+  g_assert_no_error (local_error);
+}
+
 int main (int argc, char **argv)
 {
   g_autoptr(GError) error = NULL;
@@ -183,6 +309,8 @@ int main (int argc, char **argv)
   
   g_test_add_data_func ("/repo-not-system", repo, test_repo_is_not_system);
   g_test_add_data_func ("/raw-file-to-archive-z2-stream", repo, test_raw_file_to_archive_z2_stream);
+  g_test_add_data_func ("/foreach-object", repo, test_foreach_object);
+  g_test_add_data_func ("/delta-similarity-benchmark", repo, test_delta_similarity_benchmark);
 
   return g_test_run();
  out:
@@ -79,9 +79,111 @@ test_ostree_parse_delta_name (void)
   }
 }
 
+static void
+test_ot_checksum (void)
+{
+  const char *abc_sha256 = "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad";
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  gsize buflen = 1024 * 1024 + 7;
+  g_autofree guint8 *buf = g_malloc (buflen);
+  char hexdigest[OT_SHA256_STRING_LEN + 1];
+  guint8 digest[OT_SHA256_DIGEST_LEN];
+  gsize i;
+
+  {
+    g_auto(OtChecksum) checksum = { 0, };
+    ot_checksum_init (&checksum);
+    ot_checksum_update (&checksum, (guint8*)"abc", 3);
+    ot_checksum_get_hexdigest (&checksum, hexdigest, sizeof (hexdigest));
+    g_assert_cmpstr (hexdigest, ==, abc_sha256);
+    /* Retrieving the digest twice must be stable */
+    ot_checksum_get_hexdigest (&checksum, hexdigest, sizeof (hexdigest));
+    g_assert_cmpstr (hexdigest, ==, abc_sha256);
+  }
+
+  for (i = 0; i < buflen; i++)
+    buf[i] = g_rand_int_range (rand, 0, 256);
+
+  /* Compare against GChecksum, feeding the data in odd-sized pieces */
+  {
+    g_auto(OtChecksum) checksum = { 0, };
+    g_autoptr(GChecksum) gchecksum = g_checksum_new (G_CHECKSUM_SHA256);
+    g_autofree guchar *dup_digest = NULL;
+    gsize gdigest_len = sizeof (digest);
+    gsize offset = 0;
+
+    ot_checksum_init (&checksum);
+    while (offset < buflen)
+      {
+        gsize len = MIN (buflen - offset, (gsize)g_rand_int_range (rand, 1, 100000));
+        ot_checksum_update (&checksum, buf + offset, len);
+        offset += len;
+      }
+    g_checksum_update (gchecksum, buf, buflen);
+
+    ot_checksum_get_hexdigest (&checksum, hexdigest, sizeof (hexdigest));
+    g_assert_cmpstr (hexdigest, ==, g_checksum_get_string (gchecksum));
+
+    g_checksum_get_digest (gchecksum, digest, &gdigest_len);
+    dup_digest = ot_checksum_dup_digest (&checksum);
+    g_assert (memcmp (dup_digest, digest, sizeof (digest)) == 0);
+  }
+}
+
+/* Outside of perf mode, this hashes only a few objects of each size
+ * and checks that both implementations agree.
+ */
+static void
+test_ot_checksum_benchmark (void)
+{
+  const gsize object_sizes[] = { 256, 4096, 1024 * 1024 };
+  const gsize total = g_test_perf () ? 256 * 1024 * 1024 : 1024 * 1024;
+  g_autofree guint8 *buf = g_malloc0 (object_sizes[G_N_ELEMENTS (object_sizes) - 1]);
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (object_sizes); i++)
+    {
+      const gsize size = object_sizes[i];
+      const gsize n_objects = total / size;
+      guint8 digest[OT_SHA256_DIGEST_LEN];
+      guint8 ot_digest[OT_SHA256_DIGEST_LEN];
+      gdouble gchecksum_time, ot_checksum_time;
+      gsize j;
+
+      g_test_timer_start ();
+      for (j = 0; j < n_objects; j++)
+        {
+          g_autoptr(GChecksum) gchecksum = g_checksum_new (G_CHECKSUM_SHA256);
+          gsize digest_len = sizeof (digest);
+          g_checksum_update (gchecksum, buf, size);
+          g_checksum_get_digest (gchecksum, digest, &digest_len);
+        }
+      gchecksum_time = g_test_timer_elapsed ();
+
+      g_test_timer_start ();
+      for (j = 0; j < n_objects; j++)
+        {
+          g_auto(OtChecksum) checksum = { 0, };
+          ot_checksum_init (&checksum);
+          ot_checksum_update (&checksum, buf, size);
+          ot_checksum_get_digest (&checksum, ot_digest, sizeof (ot_digest));
+        }
+      ot_checksum_time = g_test_timer_elapsed ();
+      g_assert (memcmp (digest, ot_digest, sizeof (digest)) == 0);
+
+      g_test_message ("%" G_GSIZE_FORMAT " byte objects: GChecksum %.1f MiB/s, OtChecksum %.1f MiB/s",
+                      size, total / gchecksum_time / (1024 * 1024),
+                      total / ot_checksum_time / (1024 * 1024));
+      g_test_minimized_result (ot_checksum_time, "OtChecksum %" G_GSIZE_FORMAT " byte objects: %.3fs",
+                               size, ot_checksum_time);
+    }
+}
+
 int main (int argc, char **argv)
 {
   g_test_init (&argc, &argv, NULL);
   g_test_add_func ("/ostree_parse_delta_name", test_ostree_parse_delta_name);
+  g_test_add_func ("/ot-checksum", test_ot_checksum);
+  g_test_add_func ("/ot-checksum-benchmark", test_ot_checksum_benchmark);
   return g_test_run();
 }
@@ -26,7 +26,7 @@ skip_without_user_xattrs
 bindatafiles="bash true ostree"
 morebindatafiles="false ls"
 
-echo '1..11'
+echo '1..15'
 
 mkdir repo
 ${CMD_PREFIX} ostree --repo=repo init --mode=archive-z2
@@ -196,6 +196,43 @@ ${CMD_PREFIX} ostree --repo=repo2 ls ${newrev} >/dev/null
 
 echo 'ok apply offline inline'
 
+if ${CMD_PREFIX} ostree --version | grep -q -e '\+zstd'; then
+    rm -rf repo/deltas/${deltaprefix}/${deltadir}/*
+    ${CMD_PREFIX} ostree --repo=repo static-delta generate --compression=zstd:5 --from=${origrev} --to=${newrev}
+    assert_has_file repo/deltas/${deltaprefix}/${deltadir}/0
+
+    rm repo2 -rf
+    mkdir repo2 && ${CMD_PREFIX} ostree --repo=repo2 init --mode=bare-user
+    ${CMD_PREFIX} ostree --repo=repo2 pull-local repo ${origrev}
+    ${CMD_PREFIX} ostree --repo=repo2 static-delta apply-offline repo/deltas/${deltaprefix}/${deltadir}
+    ${CMD_PREFIX} ostree --repo=repo2 fsck
+    ${CMD_PREFIX} ostree --repo=repo2 ls ${newrev} >/dev/null
+
+    echo 'ok apply offline zstd'
+else
+    echo 'ok # SKIP no zstd support'
+fi
+
+# With bsdiff ruled out by size, modified objects are either rollsums
+# against their previous version or shipped whole
+rm -rf repo/deltas/${deltaprefix}/${deltadir}/*
+${CMD_PREFIX} ostree --repo=repo static-delta generate --max-bsdiff-size=0 --from=${origrev} --to=${newrev} > out.txt 2>&1
+assert_file_has_content out.txt "bsdiff=0 objects"
+
+rm repo2 -rf
+mkdir repo2 && ${CMD_PREFIX} ostree --repo=repo2 init --mode=bare-user
+${CMD_PREFIX} ostree --repo=repo2 pull-local repo ${origrev}
+${CMD_PREFIX} ostree --repo=repo2 static-delta apply-offline repo/deltas/${deltaprefix}/${deltadir}
+${CMD_PREFIX} ostree --repo=repo2 fsck
+${CMD_PREFIX} ostree --repo=repo2 ls ${newrev} >/dev/null
+
+echo 'ok apply offline without bsdiff'
+
+if ${CMD_PREFIX} ostree --repo=repo static-delta generate --compression=bogus --from=${origrev} --to=${newrev} 2>err.txt; then
+    assert_not_reached "static-delta generate --compression=bogus unexpectedly succeeded"
+fi
+assert_file_has_content err.txt "Unknown compression type"
+
 ${CMD_PREFIX} ostree --repo=repo static-delta list | grep ^${origrev}-${newrev}$ || exit 1
 ${CMD_PREFIX} ostree --repo=repo static-delta list | grep ^${origrev}$ || exit 1
 
@@ -242,3 +279,59 @@ fi
 assert_file_has_content err.txt "Invalid rev 'GARBAGE'"
 
 echo 'ok handle bad delta name'
+
+rm -f repo/summary
+${CMD_PREFIX} ostree --repo=repo static-delta delete ${newrev}-${samerev}
+${CMD_PREFIX} ostree --repo=repo static-delta generate-many --from-last=5 --to=${samerev} > out.txt
+assert_file_has_content out.txt "From: ${newrev}"
+assert_file_has_content out.txt "From: ${origrev}"
+${CMD_PREFIX} ostree --repo=repo static-delta list | grep ^${newrev}-${samerev}$ || exit 1
+${CMD_PREFIX} ostree --repo=repo static-delta list | grep ^${origrev}-${samerev}$ || exit 1
+assert_has_file repo/summary
+${CMD_PREFIX} ostree --repo=repo static-delta generate-many --if-not-exists --from=${origrev} --to=${samerev} > out.txt
+assert_file_has_content out.txt "Delta ${origrev}-${samerev} already exists"
+
+rm -rf repo2
+mkdir repo2 && ${CMD_PREFIX} ostree --repo=repo2 init --mode=bare-user
+${CMD_PREFIX} ostree --repo=repo2 pull-local repo ${origrev}
+${CMD_PREFIX} ostree --repo=repo2 refs --create=test ${origrev}
+${CMD_PREFIX} ostree --repo=repo2 pull-local --require-static-deltas repo test
+assert_streq "$(${CMD_PREFIX} ostree --repo=repo2 rev-parse test)" "${samerev}"
+${CMD_PREFIX} ostree --repo=repo2 fsck
+
+echo 'ok generate-many'
+
+# A file that is both renamed and modified can't be paired by name, only
+# by content
+rm -rf renamerepo renamefiles
+mkdir renamerepo && ${CMD_PREFIX} ostree --repo=renamerepo init --mode=archive-z2
+mkdir renamefiles
+cp $(which bash) renamefiles/oldname
+${CMD_PREFIX} ostree --repo=renamerepo commit -b test -s test --tree=dir=renamefiles
+renamefrom=$(${CMD_PREFIX} ostree --repo=renamerepo rev-parse test)
+mv renamefiles/oldname renamefiles/newname
+permuteFile 1 renamefiles/newname
+${CMD_PREFIX} ostree --repo=renamerepo commit -b test -s test --tree=dir=renamefiles
+renameto=$(${CMD_PREFIX} ostree --repo=renamerepo rev-parse test)
+
+${CMD_PREFIX} ostree --repo=renamerepo static-delta generate --from=${renamefrom} --to=${renameto} > out.txt 2>&1
+assert_file_has_content out.txt "^modified: 1$"
+if grep -q "^rollsum=0 objects" out.txt && grep -q "^bsdiff=0 objects" out.txt; then
+    assert_not_reached "renamed file was not diffed against its old version"
+fi
+
+rm repo2 -rf
+mkdir repo2 && ${CMD_PREFIX} ostree --repo=repo2 init --mode=bare-user
+${CMD_PREFIX} ostree --repo=repo2 pull-local renamerepo ${renamefrom}
+deltaprefix=$(get_assert_one_direntry_matching renamerepo/deltas '.')
+deltadir=$(get_assert_one_direntry_matching renamerepo/deltas/${deltaprefix} '-')
+${CMD_PREFIX} ostree --repo=repo2 static-delta apply-offline renamerepo/deltas/${deltaprefix}/${deltadir}
+${CMD_PREFIX} ostree --repo=repo2 fsck
+${CMD_PREFIX} ostree --repo=repo2 ls ${renameto} >/dev/null
+
+${CMD_PREFIX} ostree --repo=renamerepo static-delta generate --disable-similarity-by-content --from=${renamefrom} --to=${renameto} > out.txt 2>&1
+assert_file_has_content out.txt "^modified: 0$"
+assert_file_has_content out.txt "^rollsum=0 objects"
+assert_file_has_content out.txt "^bsdiff=0 objects"
+
+echo 'ok generate renamed and modified file'
@@ -26,7 +26,7 @@ unset OSTREE_GPG_HOME
 
 skip_without_user_xattrs
 
-echo "1..8"
+echo "1..9"
 
 setup_test_repository "archive-z2"
 echo "ok setup"
@@ -61,6 +61,15 @@ cmp checkout1.files checkout2.files
 cmp checkout1.files checkout3.files
 echo "ok checkouts same"
 
+# Metadata is stored the same way in every mode, so it's hardlinked
+# between repos of different modes
+rev=$(${CMD_PREFIX} ostree --repo=repo3 rev-parse test2)
+nlink=$(stat -c '%h' repo3/objects/${rev:0:2}/${rev:2}.commit)
+if test "${nlink}" -lt 2; then
+    assert_not_reached "commit object not hardlinked"
+fi
+echo "ok pull-local links metadata across modes"
+
 mkdir repo4
 ${CMD_PREFIX} ostree --repo=repo4 init --mode="archive-z2"
 ${CMD_PREFIX} ostree --repo=repo4 remote add --gpg-import ${test_tmpdir}/gpghome/key1.asc origin repo
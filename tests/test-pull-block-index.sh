@@ -0,0 +1,75 @@
+#!/bin/bash
+#
+# Copyright (C) 2017 The OSTree Authors
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+setup_fake_remote_repo1 "archive-z2" "" "--log-file=${test_tmpdir}/httpd-log"
+
+echo '1..3'
+
+cd ${test_tmpdir}
+srv=${test_tmpdir}/ostree-srv/gnomerepo
+${CMD_PREFIX} ostree --repo=${srv} config set core.block-index-min-size 65536
+
+mkdir files
+head -c 1048576 /dev/urandom > files/big
+echo small > files/small
+${CMD_PREFIX} ostree --repo=${srv} commit -b big -s "big 1" --tree=dir=files
+${CMD_PREFIX} ostree --repo=${srv} summary -u
+find ${srv}/block-index -type f > block-indexes
+assert_streq "$(wc -l < block-indexes)" 1
+
+mkdir repo
+${CMD_PREFIX} ostree --repo=repo init
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo pull --reuse-blocks origin big
+${CMD_PREFIX} ostree --repo=repo fsck
+echo "ok block index"
+
+printf 'changed' | dd of=files/big bs=1 seek=500000 conv=notrunc 2>/dev/null
+${CMD_PREFIX} ostree --repo=${srv} commit -b big -s "big 2" --tree=dir=files
+${CMD_PREFIX} ostree --repo=${srv} summary -u
+find ${srv}/block-index -type f > block-indexes
+assert_streq "$(wc -l < block-indexes)" 1
+
+> httpd-log
+${CMD_PREFIX} ostree --repo=repo pull --reuse-blocks origin big
+assert_file_has_content httpd-log 'serving.*/block-index/'
+assert_file_has_content httpd-log 'range: '
+${CMD_PREFIX} ostree --repo=repo fsck
+${CMD_PREFIX} ostree --repo=repo checkout -U origin:big checkout-big
+cmp files/big checkout-big/big
+echo "ok pull reusing blocks"
+
+# Without an index, the changed file is fetched whole
+printf 'again' | dd of=files/big bs=1 seek=800000 conv=notrunc 2>/dev/null
+${CMD_PREFIX} ostree --repo=${srv} commit -b big -s "big 3" --tree=dir=files
+${CMD_PREFIX} ostree --repo=${srv} summary -u
+rm -rf ${srv}/block-index
+> httpd-log
+${CMD_PREFIX} ostree --repo=repo pull --reuse-blocks origin big
+assert_not_file_has_content httpd-log 'range: '
+${CMD_PREFIX} ostree --repo=repo fsck
+rm -rf checkout-big
+${CMD_PREFIX} ostree --repo=repo checkout -U origin:big checkout-big
+cmp files/big checkout-big/big
+echo "ok pull reusing blocks fallback"
@@ -114,6 +114,89 @@ test_pull_multi_error_then_ok (gconstpointer data)
   g_assert_no_error (local_error);
 }
 
+/* Outside of perf mode, this pulls only a few files with each policy
+ * and checks that the commit arrived.
+ */
+static void
+test_pull_commit_sync_benchmark (gconstpointer data)
+{
+  GError *local_error = NULL;
+  GError **error = &local_error;
+  const char *policies[] = { "syncfs", "fdatasync", "batched" };
+  char *refs[] = { "bench", NULL };
+  const guint n_files = g_test_perf () ? 4000 : 20;
+  g_autofree char *setup_cmd = NULL;
+  g_autoptr(GFile) srv_repo_path = g_file_new_for_path ("ostree-srv/gnomerepo");
+  glnx_unref_object OstreeRepo *srv_repo = ostree_repo_new (srv_repo_path);
+  g_autofree char *srv_rev = NULL;
+  guint i;
+
+  /* Files of 16k, all distinct */
+  setup_cmd = g_strdup_printf ("rm -rf bench-tree && mkdir bench-tree && "
+                               "for i in $(seq %u); do "
+                               "(echo $i; head -c 16384 /dev/urandom) > bench-tree/f$i; done && "
+                               "ostree --repo=ostree-srv/gnomerepo commit -b bench --tree=dir=bench-tree",
+                               n_files);
+  if (!ot_test_run_libtest (setup_cmd, error))
+    goto out;
+
+  if (!ostree_repo_open (srv_repo, NULL, error))
+    goto out;
+  if (!ostree_repo_resolve_rev (srv_repo, "bench", FALSE, &srv_rev, error))
+    goto out;
+
+  for (i = 0; i < G_N_ELEMENTS (policies); i++)
+    {
+      g_autofree char *path = g_strconcat ("bench-repo-", policies[i], NULL);
+      g_autoptr(GFile) repo_path = g_file_new_for_path (path);
+      glnx_unref_object OstreeRepo *repo = ostree_repo_new (repo_path);
+      glnx_unref_object OstreeRepo *setup_repo = ostree_repo_new (repo_path);
+      g_autoptr(GKeyFile) config = NULL;
+      g_autofree char *http_address = NULL;
+      g_autofree char *repo_url = NULL;
+      g_autofree char *rev = NULL;
+      double elapsed;
+
+      if (!ostree_repo_create (setup_repo, OSTREE_REPO_MODE_BARE_USER, NULL, error))
+        goto out;
+      config = ostree_repo_copy_config (setup_repo);
+      g_key_file_set_string (config, "core", "commit-sync", policies[i]);
+      if (!ostree_repo_write_config (setup_repo, config, error))
+        goto out;
+
+      if (!ostree_repo_open (repo, NULL, error))
+        goto out;
+      if (!g_file_get_contents ("httpd-address", &http_address, NULL, error))
+        goto out;
+      repo_url = g_strconcat (http_address, "/ostree/gnomerepo", NULL);
+      { g_autoptr(GVariantBuilder) builder = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
+        g_autoptr(GVariant) opts = NULL;
+
+        g_variant_builder_add (builder, "{s@v}", "gpg-verify", g_variant_new_variant (g_variant_new_boolean (FALSE)));
+        opts = g_variant_ref_sink (g_variant_builder_end (builder));
+
+        if (!ostree_repo_remote_change (repo, NULL, OSTREE_REPO_REMOTE_CHANGE_ADD,
+                                        "origin", repo_url, opts, NULL, error))
+          goto out;
+      }
+
+      g_test_timer_start ();
+      if (!ostree_repo_pull (repo, "origin", refs, 0, NULL, NULL, error))
+        goto out;
+      elapsed = g_test_timer_elapsed ();
+
+      if (!ostree_repo_resolve_rev (repo, "origin:bench", FALSE, &rev, error))
+        goto out;
+      g_assert_cmpstr (rev, ==, srv_rev);
+
+      g_test_minimized_result (elapsed, "commit-sync=%s: pulled %u files in %.3f s",
+                               policies[i], n_files, elapsed);
+    }
+
+ out:
+  g_assert_no_error (local_error);
+}
+
 int main (int argc, char **argv)
 {
   TestData td = {NULL,};
@@ -125,6 +208,7 @@ int main (int argc, char **argv)
 
   g_test_add_data_func ("/test-pull-c/multi-nochange", &td, test_pull_multi_nochange);
   g_test_add_data_func ("/test-pull-c/multi-ok-error-repeat", &td, test_pull_multi_error_then_ok);
+  g_test_add_data_func ("/test-pull-c/commit-sync-benchmark", &td, test_pull_commit_sync_benchmark);
 
   r = g_test_run();
   g_clear_object (&td.repo);
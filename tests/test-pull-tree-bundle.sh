@@ -0,0 +1,76 @@
+#!/bin/bash
+#
+# Copyright (C) 2017 The OSTree Authors
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+setup_fake_remote_repo1 "archive-z2" "" "--log-file=${test_tmpdir}/httpd-log"
+
+echo '1..3'
+
+cd ${test_tmpdir}
+srv=${test_tmpdir}/ostree-srv/gnomerepo
+${CMD_PREFIX} ostree --repo=${srv} config set core.tree-bundles true
+${CMD_PREFIX} ostree --repo=${srv} summary -u
+rev=$(${CMD_PREFIX} ostree --repo=${srv} rev-parse main)
+assert_has_file ${srv}/tree-bundles/${rev:0:2}/${rev:2}
+
+mkdir repo
+${CMD_PREFIX} ostree --repo=repo init
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+> httpd-log
+${CMD_PREFIX} ostree --repo=repo pull origin main
+assert_file_has_content httpd-log 'serving.*/tree-bundles/'
+assert_not_file_has_content httpd-log 'serving.*\.dirtree'
+${CMD_PREFIX} ostree --repo=repo fsck
+${CMD_PREFIX} ostree --repo=repo checkout -U origin:main checkout-main
+assert_file_has_content checkout-main/baz/deeper/ohyeah hi
+echo "ok pull with tree bundle"
+
+# Updating the ref, the unchanged metadata is already stored
+${CMD_PREFIX} ostree --repo=${srv} checkout -U main srv-main
+echo "an update" > srv-main/baz/updated
+${CMD_PREFIX} ostree --repo=${srv} commit -b main --tree=dir=srv-main
+${CMD_PREFIX} ostree --repo=${srv} summary -u
+newrev=$(${CMD_PREFIX} ostree --repo=${srv} rev-parse main)
+assert_has_file ${srv}/tree-bundles/${newrev:0:2}/${newrev:2}
+> httpd-log
+${CMD_PREFIX} ostree --repo=repo pull origin main
+assert_not_file_has_content httpd-log 'serving.*/tree-bundles/'
+assert_file_has_content httpd-log 'serving.*\.dirtree'
+assert_streq "$(${CMD_PREFIX} ostree --repo=repo rev-parse origin:main)" "${newrev}"
+${CMD_PREFIX} ostree --repo=repo fsck
+echo "ok incremental pull without tree bundle"
+
+${CMD_PREFIX} ostree --repo=${srv} config set core.tree-bundles false
+${CMD_PREFIX} ostree --repo=${srv} summary -u
+assert_not_has_file ${srv}/tree-bundles/${rev:0:2}/${rev:2}
+assert_not_has_file ${srv}/tree-bundles/${newrev:0:2}/${newrev:2}
+
+rm -rf repo
+mkdir repo
+${CMD_PREFIX} ostree --repo=repo init
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+> httpd-log
+${CMD_PREFIX} ostree --repo=repo pull origin main
+assert_file_has_content httpd-log 'serving.*\.dirtree'
+${CMD_PREFIX} ostree --repo=repo fsck
+echo "ok pull without tree bundle"
@@ -137,9 +137,233 @@ test_rollsum (void)
   test_rollsum_helper (a, MAX_BUFFER_SIZE, b, MAX_BUFFER_SIZE, FALSE);
 }
 
+static const char *rollsum_impl_names[] = { "scalar", "sse2", "avx2" };
+
+static void
+fill_rollsum_test_data (GRand *rand, guint8 *buf, gsize len, gboolean sparse)
+{
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    {
+      if (sparse)
+        buf[i] = (i % 7 == 0) ? g_rand_int (rand) : 0;
+      else
+        buf[i] = g_rand_int (rand);
+    }
+}
+
+static guint64
+check_block_matches (const guint8 *a, gsize size_a, const guint8 *b, gsize size_b)
+{
+  g_autoptr(GBytes) bytes_a = g_bytes_new_static (a, size_a);
+  g_autoptr(GBytes) bytes_b = g_bytes_new_static (b, size_b);
+  OstreeRollsumMatches *matches = _ostree_compute_block_matches (bytes_a, bytes_b);
+  guint64 sum_matched = 0;
+  guint64 prev_end = 0;
+  guint64 ret;
+  guint i;
+
+  for (i = 0; i < matches->matches->len; i++)
+    {
+      guint32 crc;
+      guint64 size, to_start, from_start;
+
+      g_variant_get (matches->matches->pdata[i], "(uttt)", &crc, &size, &to_start, &from_start);
+
+      /* In order, and not overlapping */
+      g_assert_cmpint (to_start, >=, prev_end);
+      g_assert_cmpint (from_start + size, <=, size_a);
+      g_assert_cmpint (to_start + size, <=, size_b);
+      g_assert_cmpint (memcmp (a + from_start, b + to_start, size), ==, 0);
+      prev_end = to_start + size;
+      sum_matched += size;
+    }
+
+  g_assert_cmpint (sum_matched, ==, matches->match_size);
+  ret = matches->match_size;
+  _ostree_rollsum_matches_free (matches);
+  return ret;
+}
+
+static void
+test_block_signatures (void)
+{
+#define BLOCKS_BUFFER_SIZE 1000000
+#define BLOCKS_INSERT_SIZE 100
+  g_autofree guint8 *a = g_malloc (BLOCKS_BUFFER_SIZE);
+  g_autofree guint8 *b = g_malloc (BLOCKS_BUFFER_SIZE + BLOCKS_INSERT_SIZE);
+  g_autoptr(GRand) rand = g_rand_new_with_seed (7);
+  guint32 block_size = _ostree_block_signatures_default_block_size (BLOCKS_BUFFER_SIZE);
+  guint64 matched;
+  gsize i;
+
+  g_assert_cmpint (block_size, >=, 2048);
+  g_assert_cmpint (block_size & (block_size - 1), ==, 0);
+
+  fill_rollsum_test_data (rand, a, BLOCKS_BUFFER_SIZE, FALSE);
+
+  /* Identical, except for the short last block */
+  matched = check_block_matches (a, BLOCKS_BUFFER_SIZE, a, BLOCKS_BUFFER_SIZE);
+  g_assert_cmpint (matched, >, BLOCKS_BUFFER_SIZE - block_size);
+
+  /* An insertion, and a changed byte every 16KiB: most blocks are
+   * still found, at shifted offsets.
+   */
+  memcpy (b, a, BLOCKS_BUFFER_SIZE / 2);
+  for (i = 0; i < BLOCKS_INSERT_SIZE; i++)
+    b[BLOCKS_BUFFER_SIZE / 2 + i] = g_rand_int (rand);
+  memcpy (b + BLOCKS_BUFFER_SIZE / 2 + BLOCKS_INSERT_SIZE, a + BLOCKS_BUFFER_SIZE / 2,
+          BLOCKS_BUFFER_SIZE / 2);
+  for (i = 0; i < BLOCKS_BUFFER_SIZE + BLOCKS_INSERT_SIZE; i += 16 * 1024)
+    b[i] = ~b[i];
+  matched = check_block_matches (a, BLOCKS_BUFFER_SIZE, b, BLOCKS_BUFFER_SIZE + BLOCKS_INSERT_SIZE);
+  g_assert_cmpint (matched * 10, >=, (guint64) BLOCKS_BUFFER_SIZE * 8);
+
+  /* Found directly against the signatures, too */
+  { OstreeBlockSignatures *sigs = _ostree_block_signatures_new (a, BLOCKS_BUFFER_SIZE, block_size);
+    g_autoptr(GArray) found = _ostree_block_signatures_find (sigs, b + BLOCKS_BUFFER_SIZE / 2 + BLOCKS_INSERT_SIZE,
+                                                             BLOCKS_BUFFER_SIZE / 2);
+    g_assert_cmpint (found->len, >, 0);
+    for (i = 0; i < found->len; i++)
+      {
+        OstreeBlockMatch *match = &g_array_index (found, OstreeBlockMatch, i);
+        g_assert_cmpint (memcmp (a + (gsize) match->block * block_size,
+                                 b + BLOCKS_BUFFER_SIZE / 2 + BLOCKS_INSERT_SIZE + match->offset,
+                                 block_size), ==, 0);
+      }
+    _ostree_block_signatures_free (sigs);
+  }
+
+  /* Unrelated */
+  fill_rollsum_test_data (rand, b, BLOCKS_BUFFER_SIZE, FALSE);
+  matched = check_block_matches (a, BLOCKS_BUFFER_SIZE, b, BLOCKS_BUFFER_SIZE);
+  g_assert_cmpint (matched, ==, 0);
+
+  /* Smaller than a block */
+  matched = check_block_matches (a, 100, a, 100);
+  g_assert_cmpint (matched, ==, 0);
+}
+
+static void
+test_rollsum_find_ofs (void)
+{
+#define FIND_OFS_BUFFER_SIZE (4*1024*1024)
+  g_autofree guint8 *buf = g_malloc (FIND_OFS_BUFFER_SIZE);
+  g_autoptr(GRand) rand = g_rand_new_with_seed (1);
+  guint pass, trial, impl;
+
+  /* Every implementation must split exactly like bup */
+  for (pass = 0; pass < 2; pass++)
+    {
+      fill_rollsum_test_data (rand, buf, FIND_OFS_BUFFER_SIZE, pass == 1);
+
+      for (trial = 0; trial < 2000; trial++)
+        {
+          int len = (trial % 5 == 0) ? g_rand_int_range (rand, 0, 100) : g_rand_int_range (rand, 0, 200000);
+          gsize off = g_rand_int_range (rand, 0, FIND_OFS_BUFFER_SIZE - 200000);
+          int expected_bits = -1;
+          int expected = bupsplit_find_ofs (buf + off, len, &expected_bits);
+
+          for (impl = OSTREE_ROLLSUM_IMPL_SCALAR; impl <= OSTREE_ROLLSUM_IMPL_AVX2; impl++)
+            {
+              int bits = -1;
+              int ofs;
+
+              if (!_ostree_rollsum_impl_supported (impl))
+                continue;
+
+              ofs = _ostree_rollsum_find_ofs_with_impl (impl, buf + off, len, &bits);
+              g_assert_cmpint (ofs, ==, expected);
+              if (ofs > 0)
+                g_assert_cmpint (bits, ==, expected_bits);
+            }
+        }
+    }
+}
+
+/* Outside of perf mode, this runs on a small buffer and only checks
+ * that every implementation agrees with bupsplit.
+ */
+static void
+test_rollsum_benchmark (void)
+{
+  const gsize buffer_size = g_test_perf () ? 64*1024*1024 : 1024*1024;
+  g_autofree guint8 *buf = g_malloc (buffer_size);
+  g_autoptr(GRand) rand = g_rand_new_with_seed (1);
+  guint bup_n_chunks = 0;
+  int impl;
+
+  fill_rollsum_test_data (rand, buf, buffer_size, FALSE);
+
+  /* -1 is bup itself */
+  for (impl = -1; impl <= OSTREE_ROLLSUM_IMPL_AVX2; impl++)
+    {
+      gsize pos = 0;
+      guint n_chunks = 0;
+      double elapsed;
+
+      if (impl >= 0 && !_ostree_rollsum_impl_supported (impl))
+        continue;
+
+      g_test_timer_start ();
+      while (pos < buffer_size)
+        {
+          int len = buffer_size - pos;
+          int ofs;
+
+          if (impl < 0)
+            ofs = bupsplit_find_ofs (buf + pos, len, NULL);
+          else
+            ofs = _ostree_rollsum_find_ofs_with_impl (impl, buf + pos, len, NULL);
+          if (ofs == 0)
+            break;
+          pos += ofs;
+          n_chunks++;
+        }
+      elapsed = g_test_timer_elapsed ();
+
+      if (impl < 0)
+        bup_n_chunks = n_chunks;
+      else
+        g_assert_cmpuint (n_chunks, ==, bup_n_chunks);
+
+      g_test_minimized_result (elapsed, "%s: %u chunks in %.3f s, %.1f MB/s",
+                               impl < 0 ? "bupsplit" : rollsum_impl_names[impl],
+                               n_chunks, elapsed,
+                               (pos / (1024.0 * 1024.0)) / elapsed);
+    }
+
+  /* And the full matcher on two similar buffers */
+  { g_autofree guint8 *other = g_memdup (buf, buffer_size);
+    g_autoptr(GBytes) from_bytes = g_bytes_new_static (buf, buffer_size);
+    g_autoptr(GBytes) to_bytes = NULL;
+    OstreeRollsumMatches *matches;
+    gsize i;
+    double elapsed;
+
+    for (i = 0; i < buffer_size; i += 1024*1024)
+      other[i] = ~other[i];
+    to_bytes = g_bytes_new_static (other, buffer_size);
+
+    g_test_timer_start ();
+    matches = _ostree_compute_rollsum_matches (from_bytes, to_bytes);
+    elapsed = g_test_timer_elapsed ();
+    /* Only the chunks containing a flipped byte differ */
+    g_assert_cmpuint (matches->bufmatches, >, 0);
+    g_assert_cmpuint (matches->bufmatches, <, matches->total);
+    g_test_minimized_result (elapsed, "matches: %u/%u chunks in %.3f s",
+                             matches->bufmatches, matches->total, elapsed);
+    _ostree_rollsum_matches_free (matches);
+  }
+}
+
 int main (int argc, char **argv)
 {
   g_test_init (&argc, &argv, NULL);
   g_test_add_func ("/rollsum", test_rollsum);
+  g_test_add_func ("/rollsum-find-ofs", test_rollsum_find_ofs);
+  g_test_add_func ("/block-signatures", test_block_signatures);
+  g_test_add_func ("/rollsum-benchmark", test_rollsum_benchmark);
   return g_test_run();
 }
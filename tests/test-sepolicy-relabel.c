@@ -0,0 +1,250 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2017 The OSTree Authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <gio/gio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "libglnx.h"
+#include "libostreetest.h"
+#include "ostree-cmdprivate.h"
+
+#define N_DIRS 64
+#define N_FILES_PER_DIR 64
+
+static gboolean
+make_tree (int dfd, const char *path, GError **error)
+{
+  guint i, j;
+
+  if (!glnx_shutil_mkdir_p_at (dfd, path, 0755, NULL, error))
+    return FALSE;
+
+  for (i = 0; i < N_DIRS; i++)
+    {
+      g_autofree char *dirpath = g_strdup_printf ("%s/d%u", path, i);
+
+      if (!glnx_shutil_mkdir_p_at (dfd, dirpath, 0755, NULL, error))
+        return FALSE;
+
+      for (j = 0; j < N_FILES_PER_DIR; j++)
+        {
+          g_autofree char *filepath = g_strdup_printf ("%s/f%u.conf", dirpath, j);
+
+          if (!glnx_file_replace_contents_at (dfd, filepath, (guint8*)"x", 1,
+                                              0, NULL, error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static void
+on_relabeled (const char *subpath,
+              const char *relpath,
+              const char *new_label,
+              gpointer    user_data)
+{
+  GHashTable *labels = user_data;
+  g_hash_table_replace (labels, g_strdup (relpath), g_strdup (new_label));
+}
+
+static gboolean
+check_labels (OstreeSePolicy *sepolicy,
+              GHashTable     *labels,
+              GError        **error)
+{
+  GHashTableIter iter;
+  gpointer k, v;
+
+  g_hash_table_iter_init (&iter, labels);
+  while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+      const char *relpath = k;
+      g_autofree char *expected = NULL;
+      /* Only the file type matters to the lookup */
+      guint32 mode = g_str_has_suffix (relpath, ".conf") ? S_IFREG : S_IFDIR;
+
+      if (!ostree_sepolicy_get_label (sepolicy, relpath, mode, &expected, NULL, error))
+        return FALSE;
+      g_assert_cmpstr (expected, ==, v);
+    }
+
+  return TRUE;
+}
+
+/* Without a policy nothing has a label, which relabeling must only
+ * accept with ALLOW_NOLABEL.
+ */
+static gboolean
+check_relabel_without_policy (OstreeSePolicy *sepolicy,
+                              GError        **error)
+{
+  g_autoptr(GHashTable) labels =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_autoptr(GError) local_error = NULL;
+
+  if (!make_tree (AT_FDCWD, "nopolicy", error))
+    return FALSE;
+
+  if (!ostree_cmd__private__ ()->ostree_sepolicy_relabel_dir_at (sepolicy, AT_FDCWD, "nopolicy", "etc",
+                                                                 OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL,
+                                                                 on_relabeled, labels, NULL, error))
+    return FALSE;
+  g_assert_cmpuint (g_hash_table_size (labels), ==, 0);
+
+#ifdef HAVE_SELINUX
+  g_assert (!ostree_cmd__private__ ()->ostree_sepolicy_relabel_dir_at (sepolicy, AT_FDCWD, "nopolicy", "etc",
+                                                                       OSTREE_SEPOLICY_RESTORECON_FLAGS_NONE,
+                                                                       on_relabeled, labels, NULL, &local_error));
+  g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_assert (strstr (local_error->message, "No label found") != NULL);
+  g_assert_cmpuint (g_hash_table_size (labels), ==, 0);
+#endif
+
+  return TRUE;
+}
+
+static void
+test_sepolicy_relabel (void)
+{
+  g_autoptr(GError) error = NULL;
+  glnx_unref_object OstreeSePolicy *sepolicy = NULL;
+  g_autoptr(GFile) root = g_file_new_for_path ("/");
+  g_autoptr(GHashTable) labels =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_autoptr(GTimer) timer = NULL;
+  g_autoptr(GFile) serial_dir = NULL;
+  g_autoptr(GFileEnumerator) direnum = NULL;
+  double elapsed_parallel;
+  double elapsed_serial;
+
+  sepolicy = ostree_sepolicy_new (root, NULL, &error);
+  if (!sepolicy)
+    goto out;
+
+  if (ostree_sepolicy_get_name (sepolicy) == NULL)
+    {
+      if (!check_relabel_without_policy (sepolicy, &error))
+        goto out;
+      return;
+    }
+
+  if (!make_tree (AT_FDCWD, "parallel", &error))
+    goto out;
+
+  timer = g_timer_new ();
+  if (!ostree_cmd__private__ ()->ostree_sepolicy_relabel_dir_at (sepolicy, AT_FDCWD, "parallel", "etc",
+                                                                 OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL,
+                                                                 on_relabeled, labels, NULL, &error))
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED)
+          || g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+        {
+          g_test_skip ("Unable to set SELinux labels");
+          return;
+        }
+      goto out;
+    }
+  elapsed_parallel = g_timer_elapsed (timer, NULL);
+
+  if (!check_labels (sepolicy, labels, &error))
+    goto out;
+
+  if (!g_test_perf ())
+    return;
+
+  /* Compare against labeling one file at a time via the public API */
+  if (!make_tree (AT_FDCWD, "serial", &error))
+    goto out;
+  serial_dir = g_file_new_for_path ("serial");
+
+  g_timer_start (timer);
+  if (!ostree_sepolicy_restorecon (sepolicy, "/etc", NULL, serial_dir,
+                                   OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL,
+                                   NULL, NULL, &error))
+    goto out;
+  direnum = g_file_enumerate_children (serial_dir, "standard::name,unix::mode",
+                                       G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL, &error);
+  if (!direnum)
+    goto out;
+  while (TRUE)
+    {
+      GFileInfo *dir_info;
+      GFile *child;
+      g_autoptr(GFileEnumerator) child_direnum = NULL;
+      g_autofree char *dir_relpath = NULL;
+
+      if (!g_file_enumerator_iterate (direnum, &dir_info, &child, NULL, &error))
+        goto out;
+      if (dir_info == NULL)
+        break;
+
+      dir_relpath = g_strconcat ("/etc/", g_file_info_get_name (dir_info), NULL);
+      if (!ostree_sepolicy_restorecon (sepolicy, dir_relpath, dir_info, child,
+                                       OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL,
+                                       NULL, NULL, &error))
+        goto out;
+
+      child_direnum = g_file_enumerate_children (child, "standard::name,unix::mode",
+                                                 G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL, &error);
+      if (!child_direnum)
+        goto out;
+      while (TRUE)
+        {
+          GFileInfo *file_info;
+          GFile *file;
+          g_autofree char *relpath = NULL;
+
+          if (!g_file_enumerator_iterate (child_direnum, &file_info, &file, NULL, &error))
+            goto out;
+          if (file_info == NULL)
+            break;
+
+          relpath = g_strconcat (dir_relpath, "/", g_file_info_get_name (file_info), NULL);
+          if (!ostree_sepolicy_restorecon (sepolicy, relpath, file_info, file,
+                                           OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL,
+                                           NULL, NULL, &error))
+            goto out;
+        }
+    }
+  elapsed_serial = g_timer_elapsed (timer, NULL);
+
+  g_test_message ("serial: %.3fs parallel: %.3fs (%u files)",
+                  elapsed_serial, elapsed_parallel, N_DIRS * (N_FILES_PER_DIR + 1) + 1);
+  g_test_minimized_result (elapsed_parallel, "parallel relabel: %.3fs", elapsed_parallel);
+
+ out:
+  if (error)
+    g_error ("%s", error->message);
+}
+
+int main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/sepolicy-relabel", test_sepolicy_relabel);
+
+  return g_test_run();
+}
@@ -25,7 +25,7 @@ set -e
 
 setup_fake_remote_repo1 "archive-z2" "--generate-sizes"
 
-echo '1..3'
+echo '1..7'
 
 cd ${test_tmpdir}
 rm repo -rf
@@ -45,3 +45,41 @@ assert_file_has_content sizes.txt "files: 5/5 entries"
 assert_file_has_content sizes.txt "archived: \([0-9]*\)/\1"
 assert_file_has_content sizes.txt "unpacked: \([0-9]*\)/\1"
 echo "ok size summary correct after pull"
+
+cd ${test_tmpdir}
+mkdir extra-files
+echo extra > extra-files/extra
+${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo commit --generate-sizes -b main2 -s "Extra" --tree=ref=main --tree=dir=extra-files
+assert_has_file ostree-srv/gnomerepo/state/object-sizes
+${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo size-summary main2 | tee sizes.txt
+assert_file_has_content sizes.txt "files: 6/6 entries"
+echo "ok size summary includes reused objects"
+
+${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo size-summary --commits main main2 | tee sizes.txt
+assert_file_has_content sizes.txt "files: 5 entries, 0 unique"
+assert_file_has_content sizes.txt "files: 6 entries, 1 unique"
+assert_file_has_content sizes.txt "Summary for 2 commits"
+assert_file_has_content sizes.txt "files: 6 entries, 5 shared"
+echo "ok size summary for commit set"
+
+# Without ostree.sizes metadata, sizes come from the object size index
+${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo commit -b main3 -s "No sizes" --tree=ref=main2
+${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo size-summary --commits main2 main3 | tee sizes.txt
+assert_file_has_content sizes.txt "files: 6 entries, 0 unique"
+assert_file_has_content sizes.txt "files: 6 entries, 6 shared"
+assert_not_file_has_content sizes.txt "archived: 0,"
+echo "ok size summary without size metadata"
+
+# Prune drops the index records of deleted objects
+cd ${test_tmpdir}
+echo unique-to-tmp > extra-files/tmp-only
+${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo commit --generate-sizes -b tmp -s "Temporary" --tree=ref=main --tree=dir=extra-files
+size_before=$(stat -c %s ostree-srv/gnomerepo/state/object-sizes)
+${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo refs --delete tmp
+${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo prune --refs-only
+size_after=$(stat -c %s ostree-srv/gnomerepo/state/object-sizes)
+test ${size_after} -lt ${size_before}
+test $((size_after % 56)) = 0
+${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo size-summary main2 | tee sizes.txt
+assert_file_has_content sizes.txt "files: 6/6 entries"
+echo "ok prune compacts the object size index"
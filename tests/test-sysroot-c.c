@@ -71,6 +71,76 @@ test_sysroot_reload (gconstpointer data)
     g_error ("%s", error->message);
 }
 
+static void
+test_sysroot_deploy_trees (gconstpointer data)
+{
+  OstreeSysroot *sysroot = (void*)data;
+  g_autoptr(GError) error = NULL;
+  glnx_unref_object OstreeRepo *repo = NULL;
+  g_autoptr(GPtrArray) old_deployments = NULL;
+  g_autoptr(GPtrArray) new_deployments = NULL;
+  g_autoptr(GPtrArray) all_deployments = NULL;
+  g_autoptr(GPtrArray) deployments = NULL;
+  g_autofree char *runtime_rev = NULL;
+  g_autofree char *devel_rev = NULL;
+  OstreeSysrootDeployTreeOpts opts[3] = { { 0, }, };
+  guint i;
+
+  if (!run_sync ("ostree --repo=sysroot/ostree/repo pull-local --remote=testos testos-repo testos/buildmaster/x86_64-runtime testos/buildmaster/x86_64-devel", &error))
+    goto out;
+
+  if (!ostree_sysroot_load (sysroot, NULL, &error))
+    goto out;
+  if (!ostree_sysroot_get_repo (sysroot, &repo, NULL, &error))
+    goto out;
+  if (!ostree_repo_resolve_rev (repo, "testos:testos/buildmaster/x86_64-runtime", FALSE, &runtime_rev, &error))
+    goto out;
+  if (!ostree_repo_resolve_rev (repo, "testos:testos/buildmaster/x86_64-devel", FALSE, &devel_rev, &error))
+    goto out;
+
+  /* The same revision twice must get distinct deployserials */
+  opts[0].osname = "testos";
+  opts[0].revision = runtime_rev;
+  opts[1].osname = "testos";
+  opts[1].revision = devel_rev;
+  opts[2].osname = "testos";
+  opts[2].revision = runtime_rev;
+
+  if (!ostree_sysroot_deploy_trees (sysroot, opts, G_N_ELEMENTS (opts), &new_deployments,
+                                    NULL, &error))
+    goto out;
+  g_assert_cmpuint (new_deployments->len, ==, 3);
+  g_assert_cmpint (ostree_deployment_get_deployserial (new_deployments->pdata[2]), ==,
+                   ostree_deployment_get_deployserial (new_deployments->pdata[0]) + 1);
+
+  old_deployments = ostree_sysroot_get_deployments (sysroot);
+  all_deployments = g_ptr_array_new_with_free_func (g_object_unref);
+  for (i = 0; i < new_deployments->len; i++)
+    g_ptr_array_add (all_deployments, g_object_ref (new_deployments->pdata[i]));
+  for (i = 0; i < old_deployments->len; i++)
+    g_ptr_array_add (all_deployments, g_object_ref (old_deployments->pdata[i]));
+
+  if (!ostree_sysroot_write_deployments (sysroot, all_deployments, NULL, &error))
+    goto out;
+
+  if (!ostree_sysroot_load (sysroot, NULL, &error))
+    goto out;
+  deployments = ostree_sysroot_get_deployments (sysroot);
+  g_assert_cmpuint (deployments->len, ==, all_deployments->len);
+  for (i = 0; i < new_deployments->len; i++)
+    {
+      OstreeDeployment *expected = new_deployments->pdata[i];
+      OstreeDeployment *found = deployments->pdata[i];
+
+      g_assert_cmpstr (ostree_deployment_get_csum (found), ==, ostree_deployment_get_csum (expected));
+      g_assert_cmpint (ostree_deployment_get_deployserial (found), ==, ostree_deployment_get_deployserial (expected));
+    }
+
+ out:
+  if (error)
+    g_error ("%s", error->message);
+}
+
 int main (int argc, char **argv)
 {
   g_autoptr(GError) error = NULL;
@@ -83,6 +153,7 @@ int main (int argc, char **argv)
     goto out;
   
   g_test_add_data_func ("/sysroot-reload", sysroot, test_sysroot_reload);
+  g_test_add_data_func ("/sysroot-deploy-trees", sysroot, test_sysroot_deploy_trees);
 
   return g_test_run();
  out: